@@ -1,8 +1,13 @@
 #include "JsonPwmSequencer.h"
+#include "ScheduleImage.h"
+#include "freertos/task.h"
 #include <ArduinoJson.h>
 #include <FS.h>
 #include <SPIFFS.h>
+#include <ctype.h>
 #include <math.h>
+#include <stdio.h>   // snprintf
+#include <stdlib.h>  // bsearch
 #include <strings.h> // strcasecmp
 
 namespace {
@@ -10,18 +15,896 @@ namespace {
 // coil order is A,B,C,D.
 const float PHASES_CW[4] = {270.0f, 90.0f, 180.0f, 0.0f};
 const float PHASES_CCW[4] = {90.0f, 270.0f, 180.0f, 0.0f};
+
+// loadNext()'s task: a JSON load holds a parse buffer per include level on
+// the stack.
+const uint32_t NEXT_LOAD_STACK = 8192;
+const UBaseType_t NEXT_LOAD_PRIORITY = 1;
+
+// Schedule methods. One table lookup per entry replaces the old chain of
+// String compares; the handler switches on Op.
+enum class Op : uint8_t {
+  DUTY,
+  PHASE,
+  CARRIER_DUTY,
+  WAIT,
+  FREQ_RAMP,
+  CARRIER_RAMP,
+  PHASE_RAMP,
+  DIRECTION,
+  ACTIVATE,
+  LABEL,
+  REPEAT,
+  SUB,
+  END,
+  CALL,
+  INCLUDE,
+  SWEEP,
+};
+
+struct Method {
+  const char *name;
+  Op op;
+  TaskMode mode;      // ramps only
+  bool needsChannels; // per-channel: no valid "channels" => unknown, as before
+};
+
+// Sorted by name (strcmp) for bsearch.
+const Method METHODS[] = {
+    {"activateChannels", Op::ACTIVATE, TaskMode::POLYNOMIAL, false},
+    {"addCarrierDutyCycleTask", Op::CARRIER_DUTY, TaskMode::POLYNOMIAL, true},
+    {"addCarrierEaseRampTask", Op::CARRIER_RAMP, TaskMode::EASE, false},
+    {"addCarrierExponentialRampTask", Op::CARRIER_RAMP, TaskMode::EXPONENTIAL, false},
+    {"addCarrierRampTask", Op::CARRIER_RAMP, TaskMode::POLYNOMIAL, false},
+    {"addDutyCycleTask", Op::DUTY, TaskMode::POLYNOMIAL, true},
+    {"addEaseRampTask", Op::FREQ_RAMP, TaskMode::EASE, false},
+    {"addExponentialRampTask", Op::FREQ_RAMP, TaskMode::EXPONENTIAL, false},
+    {"addLinearRampTask", Op::FREQ_RAMP, TaskMode::POLYNOMIAL, false},
+    {"addPhaseRampTask", Op::PHASE_RAMP, TaskMode::EASE, true},
+    {"addPhaseTask", Op::PHASE, TaskMode::POLYNOMIAL, true},
+    {"addWaitTask", Op::WAIT, TaskMode::POLYNOMIAL, false},
+    {"call", Op::CALL, TaskMode::POLYNOMIAL, false},
+    {"end", Op::END, TaskMode::POLYNOMIAL, false},
+    {"include", Op::INCLUDE, TaskMode::POLYNOMIAL, false},
+    {"label", Op::LABEL, TaskMode::POLYNOMIAL, false},
+    {"repeat", Op::REPEAT, TaskMode::POLYNOMIAL, false},
+    {"setDirection", Op::DIRECTION, TaskMode::POLYNOMIAL, false},
+    {"sub", Op::SUB, TaskMode::POLYNOMIAL, false},
+    {"sweep", Op::SWEEP, TaskMode::POLYNOMIAL, false},
+};
+
+int compareMethod(const void *key, const void *entry) {
+  return strcmp((const char *)key, ((const Method *)entry)->name);
+}
+
+const Method *findMethod(const char *name) {
+  return (const Method *)bsearch(name, METHODS,
+                                 sizeof(METHODS) / sizeof(METHODS[0]),
+                                 sizeof(Method), compareMethod);
+}
+
+// Forward-only, chunk-buffered view of the schedule file. Tracks the byte
+// offset so the loader can seek back to the schedule array.
+class ScheduleReader {
+public:
+  explicit ScheduleReader(File &file) : _file(file) {}
+
+  int peek() {
+    if (_pos == _len && !fill())
+      return -1;
+    return (uint8_t)_buf[_pos];
+  }
+  int get() {
+    int c = peek();
+    if (c >= 0)
+      _pos++;
+    return c;
+  }
+  size_t offset() const { return _base + _pos; }
+  bool seek(size_t off) {
+    _base = off;
+    _pos = _len = 0;
+    return _file.seek(off);
+  }
+
+  // Whitespace and // or /* */ comments (ARDUINOJSON_ENABLE_COMMENTS).
+  void skipSpace() {
+    for (;;) {
+      int c = peek();
+      if (c == '/') {
+        get();
+        skipComment();
+      } else if (c >= 0 && isspace(c)) {
+        get();
+      } else {
+        return;
+      }
+    }
+  }
+
+  // Copy the next JSON value (object, array, string or scalar) into out,
+  // NUL-terminated, without comments or whitespace outside strings. A scalar
+  // ends at the next delimiter, which is left unread. out == nullptr skips
+  // the value instead. False if the input ends first or the value needs more
+  // than cap - 1 bytes.
+  bool readValue(char *out, size_t cap, size_t &len) {
+    skipSpace();
+    len = 0;
+    int first = -1;
+    int depth = 0;
+    bool inString = false;
+    bool escaped = false;
+    for (;;) {
+      int c = peek();
+      if (c < 0)
+        return false;
+      if (!inString && depth == 0 && first >= 0 && first != '"' &&
+          (c == ',' || c == '}' || c == ']' || c == '/' || isspace(c)))
+        break; // end of a top-level scalar
+      get();
+      if (inString) {
+        if (escaped)
+          escaped = false;
+        else if (c == '\\')
+          escaped = true;
+        else if (c == '"')
+          inString = false;
+      } else if (c == '/') {
+        skipComment();
+        continue;
+      } else if (isspace(c)) {
+        continue;
+      } else if (c == '"') {
+        inString = true;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if (c == '}' || c == ']') {
+        depth--;
+      }
+      if (out) {
+        if (len + 1 >= cap)
+          return false;
+        out[len] = (char)c;
+      }
+      len++;
+      if (first < 0)
+        first = c;
+      else if (!inString && depth == 0 && (c == '}' || c == ']' || c == '"'))
+        break; // end of a container or a string
+    }
+    if (out)
+      out[len] = '\0';
+    return len > 0;
+  }
+
+private:
+  static const size_t CHUNK = 256;
+
+  bool fill() {
+    _base += _len;
+    _len = _file.read((uint8_t *)_buf, CHUNK);
+    _pos = 0;
+    return _len > 0;
+  }
+
+  // After a '/': skip the rest of a // or /* */ comment.
+  void skipComment() {
+    int c = get();
+    if (c == '/') {
+      while ((c = get()) >= 0 && c != '\n') {
+      }
+    } else if (c == '*') {
+      int prev = 0;
+      while ((c = get()) >= 0 && !(prev == '*' && c == '/'))
+        prev = c;
+    }
+  }
+
+  File &_file;
+  char _buf[CHUNK];
+  size_t _base = 0; // file offset of _buf[0]
+  size_t _pos = 0;
+  size_t _len = 0;
+};
+
+// CRC-32 as zlib.crc32() computes it (what the image compiler stores), a
+// nibble at a time: a 64-byte table instead of 1 KB, still only a couple of
+// ms for the largest schedule. `crc` continues a previous call's result, as
+// zlib.crc32(data, value) does.
+uint32_t crc32(const uint8_t *p, size_t n, uint32_t crc = 0) {
+  static const uint32_t T[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+      0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+      0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  while (n--) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ T[crc & 0x0F];
+    crc = (crc >> 4) ^ T[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+// True if the SPIFFS file at `path` is missing (nothing to compare against)
+// or its CRC-32 is `expected`. Streamed through a stack buffer: no parse, no
+// heap.
+bool sourceMatches(const char *path, uint32_t expected) {
+  if (!SPIFFS.exists(path)) return true;
+  File src = SPIFFS.open(path, "r");
+  if (!src) return true;
+  uint8_t buf[128];
+  uint32_t crc = 0;
+  size_t n;
+  while ((n = src.read(buf, sizeof(buf))) > 0) crc = crc32(buf, n, crc);
+  src.close();
+  return crc == expected;
+}
+
+// LoadState::error of a failure inside an included file, already reported.
+const char *const IN_INCLUDED_FILE = "in an included file";
+
+// Stream the schedule array at the reader's position one entry at a time
+// through `buf`, handing each to apply(entry); apply() returns false to stop
+// (its error is the caller's to report). False with `error` set on a syntax
+// error.
+template <typename Apply>
+bool streamEntries(ScheduleReader &in, char *buf, size_t cap, JsonDocument &doc,
+                   const char *&error, Apply apply) {
+  size_t len;
+  in.skipSpace();
+  if (in.get() != '[') {
+    error = "schedule is not an array";
+    return false;
+  }
+  in.skipSpace();
+  if (in.peek() == ']') {
+    in.get();
+    return true;
+  }
+  for (;;) {
+    in.skipSpace();
+    if (in.peek() != '{') {
+      error = "schedule entry is not an object";
+      return false;
+    }
+    if (!in.readValue(buf, cap, len)) {
+      error = "entry too long for the parse buffer (or file truncated)";
+      return false;
+    }
+    auto err = deserializeJson(doc, buf, len);
+    if (err) {
+      error = err.c_str();
+      return false;
+    }
+    if (!apply(doc.as<JsonObjectConst>()))
+      return false;
+    in.skipSpace();
+    int c = in.get();
+    if (c == ']')
+      return true;
+    if (c != ',') {
+      error = "expected ',' or ']' after a schedule entry";
+      return false;
+    }
+  }
+}
 } // namespace
 
+// Running full state while streaming: TRAJECTORY_POINT tasks need every
+// channel, so each per-channel command updates one entry here and pushes the
+// whole snapshot.
+struct JsonPwmSequencer::LoadState {
+  float curFreq;
+  float curDuty[4];
+  float curPhase[4];
+  float curCarrier[4]; // NAN = untouched; flushState() skips those channels
+  // Label ID active for whatever step gets pushed next; "label" entries
+  // update this without pushing a queue entry of their own.
+  uint16_t currentLabel = NO_LABEL;
+  bool unknownSeen = false;
+  bool quiet = false; // replaying: unknown methods were already reported
+
+  // Control flow. The snapshot above only says what state an entry runs
+  // from until the first block or call: a block may run many times, from
+  // different states. So from then on (`deferred`) every setter is queued
+  // as a ParamTask that touches only its own fields.
+  struct SubDef {
+    char name[32]; // "sub" name, or the included file's path
+    Subroutine sub;
+    bool closed; // callable once its "end" is read
+    uint8_t nParams;
+    char params[PwmSequencer::MAX_PARAMS][16];
+  };
+  std::vector<SubDef> subs;
+  int blocks[PwmSequencer::MAX_DEPTH]; // open: SubDef index, -1 = repeat
+  int depth = 0;
+  int includes = 0;     // included files being read
+  int includeDepth = 0; // blocks an "end" can't close: the include's own
+  bool deferred = false;
+  size_t stepOffset = 0; // queueSize() - _labelSteps
+  const char *error = nullptr; // set: the load fails
+
+  void seed(float freq, const float *duty, const float *phase) {
+    curFreq = freq;
+    for (int i = 0; i < 4; i++) {
+      curDuty[i] = duty[i];
+      curPhase[i] = phase[i];
+      curCarrier[i] = NAN;
+    }
+    currentLabel = NO_LABEL;
+    subs.clear();
+    depth = 0;
+    includeDepth = 0;
+    deferred = false;
+    error = nullptr;
+  }
+
+  // Argument slot of `name` in the innermost sub being defined, or -1.
+  int findParam(const char *name) const {
+    for (int d = depth - 1; d >= 0; d--) {
+      if (blocks[d] < 0)
+        continue;
+      const SubDef &def = subs[blocks[d]];
+      for (int k = 0; k < def.nParams; k++)
+        if (strcmp(def.params[k], name) == 0)
+          return k;
+      return -1;
+    }
+    return -1;
+  }
+
+  // Closed sub (or included file) called `name`, latest first; -1 if none.
+  int findSub(const char *name) const {
+    for (size_t i = subs.size(); i-- > 0;)
+      if (subs[i].closed && strcmp(subs[i].name, name) == 0)
+        return (int)i;
+    return -1;
+  }
+};
+
 JsonPwmSequencer::JsonPwmSequencer(PwmController *phaseCtrl)
     : PwmSequencer(phaseCtrl) {}
 
+JsonPwmSequencer::~JsonPwmSequencer() {
+  while (nextState() == NextState::LOADING)
+    vTaskDelay(1); // the loader writes into _next
+  delete _next;
+  if (_image)
+    spi_flash_munmap(_imageMap);
+}
+
+bool JsonPwmSequencer::loadNext(const char *filename, SwapAt when) {
+  if (nextState() == NextState::LOADING) {
+    Serial.printf("[JsonPwmSequencer] %s: still loading %s\n", filename,
+                  _nextPath);
+    return false;
+  }
+  if (strlen(filename) >= sizeof(_nextPath)) {
+    Serial.printf("[JsonPwmSequencer] %s: path longer than %u characters\n",
+                  filename, (unsigned)sizeof(_nextPath) - 1);
+    return false;
+  }
+  cancelNext();
+  _next = new JsonPwmSequencer(nullptr); // compiled only, never drives
+  strcpy(_nextPath, filename);
+  _nextWhen = when;
+  _nextState = (uint8_t)NextState::LOADING;
+
+  // The other core from the caller (normally core 0, away from loop()), low
+  // priority: it only has to finish before the hand-over is wanted.
+  const BaseType_t core = xPortGetCoreID() ? 0 : 1;
+  if (xTaskCreatePinnedToCore(nextLoaderMain, "seq_load", NEXT_LOAD_STACK, this,
+                              NEXT_LOAD_PRIORITY, nullptr, core) != pdPASS) {
+    Serial.printf("[JsonPwmSequencer] load task create failed\n");
+    delete _next;
+    _next = nullptr;
+    _nextState = (uint8_t)NextState::NONE;
+    return false;
+  }
+  return true;
+}
+
+void JsonPwmSequencer::nextLoaderMain(void *arg) {
+  JsonPwmSequencer *self = (JsonPwmSequencer *)arg;
+  JsonPwmSequencer *next = self->_next;
+  bool ok = next->loadFromPartition(self->_nextPath) ||
+            next->loadFromJsonFile(self->_nextPath);
+  // Publishes the finished standby to run() (sequentially consistent store).
+  self->_nextState = (uint8_t)(ok ? NextState::READY : NextState::FAILED);
+  vTaskDelete(nullptr);
+}
+
+bool JsonPwmSequencer::cancelNext() {
+  if (nextState() == NextState::LOADING)
+    return false;
+  delete _next;
+  _next = nullptr;
+  _nextState = (uint8_t)NextState::NONE;
+  return true;
+}
+
+void JsonPwmSequencer::run() {
+  if (nextState() != NextState::READY || isPaused()) {
+    PwmSequencer::run();
+    return;
+  }
+  if (!isDone()) {
+    const bool atStep = _nextWhen == SwapAt::STEP;
+    stopAtTaskBoundary(atStep);
+    PwmSequencer::run();
+    stopAtTaskBoundary(false);
+    if (!isDone() && !(atStep && atTaskBoundary()))
+      return;
+  }
+  swapToNext();
+  PwmSequencer::run();
+}
+
+void JsonPwmSequencer::swapToNext() {
+  // Its "direction"/"initial_phase" are what it was loaded for (e.g.
+  // coupling_ccw -> coupling_cw): those phases apply, the rest carries over.
+  const bool turned = handOver(*_next, esp_timer_get_time(), true);
+  std::swap(_labelText, _next->_labelText);
+  std::swap(_labelOffsets, _next->_labelOffsets);
+  std::swap(_labelRuns, _next->_labelRuns);
+  std::swap(_labelFirstStep, _next->_labelFirstStep);
+  std::swap(_labelSteps, _next->_labelSteps);
+  _labelHint = 0;
+  std::swap(_sweepLabels, _next->_sweepLabels);
+  std::swap(_sweepText, _next->_sweepText);
+  std::swap(_lastLoad, _next->_lastLoad);
+  std::swap(_imagePart, _next->_imagePart);
+  std::swap(_image, _next->_image);
+  std::swap(_imageMap, _next->_imageMap);
+  std::swap(_flashSchedule, _next->_flashSchedule);
+  // A schedule without "gain_schedule" keeps the running table.
+  if (_next->_hasGainSchedule) {
+    _gainSchedule = _next->_gainSchedule;
+    _hasGainSchedule = true;
+    applyGainSchedule();
+  }
+
+  delete _next; // now the schedule that just finished
+  _next = nullptr;
+  _swaps++;
+  _nextState = (uint8_t)NextState::NONE;
+  Serial.printf("[JsonPwmSequencer] now running %s (%s, swap %u%s)\n",
+                _nextPath, _lastLoad.fromFlash ? "flash" : "JSON",
+                (unsigned)_swaps, turned ? ", its initial phases applied" : "");
+}
+
+void JsonPwmSequencer::start() {
+  PwmSequencer::start();
+  applyGainSchedule();
+}
+
+bool JsonPwmSequencer::gainSchedule(BalanceGainSchedule &out) const {
+  if (_hasGainSchedule)
+    out = _gainSchedule;
+  return _hasGainSchedule;
+}
+
+void JsonPwmSequencer::applyGainSchedule() {
+  if (!_hasGainSchedule)
+    return;
+  if (!controller()->setBalanceGainSchedule(_gainSchedule.points(),
+                                            _gainSchedule.size()))
+    Serial.printf("[JsonPwmSequencer] gain_schedule ignored (balance off)\n");
+}
+
 const char *JsonPwmSequencer::labelForStep(size_t i) const {
-  if (i >= _stepLabels.size())
+  return labelName(labelIdForStep(i));
+}
+
+uint16_t JsonPwmSequencer::labelIdForStep(size_t i) const {
+  if (_flashSchedule) {
+    // Offsets were bounds-checked by loadFromPartition().
+    if (i >= _flashSchedule->taskCount)
+      return NO_LABEL;
+    uint16_t l = ((const uint16_t *)(_image + _flashSchedule->labelIdxOffset))[i];
+    return l < _flashSchedule->labelCount ? l : NO_LABEL;
+  }
+  if (i >= _labelSteps || _labelRuns.empty() || i < _labelRuns[0].firstStep)
+    return NO_LABEL;
+
+  // Callers walk the steps in order, so try the last run and the next one
+  // before searching.
+  size_t r = _labelHint < _labelRuns.size() ? _labelHint : 0;
+  auto holds = [&](size_t run) {
+    return _labelRuns[run].firstStep <= i &&
+           (run + 1 == _labelRuns.size() || i < _labelRuns[run + 1].firstStep);
+  };
+  if (!holds(r)) {
+    if (r + 1 < _labelRuns.size() && holds(r + 1)) {
+      r++;
+    } else {
+      size_t lo = 0, hi = _labelRuns.size(); // last run starting <= i
+      while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (_labelRuns[mid].firstStep <= i)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      r = lo;
+    }
+  }
+  _labelHint = r;
+  return _labelRuns[r].id;
+}
+
+uint16_t JsonPwmSequencer::currentLabelId() const {
+  const int32_t s = sweepStep();
+  size_t n;
+  const ScheduleSweepLabel *sw = sweepLabels(n);
+  size_t id = namedLabels();
+  for (size_t k = 0; s >= 0 && k < n; k++) {
+    if (sw[k].step == currentIndex()) {
+      id += (uint32_t)s / SWEEP_STEPS;
+      return id < NO_LABEL ? (uint16_t)id : NO_LABEL;
+    }
+    id += sweepAt(sw[k].word, 0, nullptr, nullptr);
+  }
+  return labelIdForStep(currentIndex());
+}
+
+size_t JsonPwmSequencer::namedLabels() const {
+  return _flashSchedule ? _flashSchedule->labelCount : _labelOffsets.size();
+}
+
+const ScheduleSweepLabel *JsonPwmSequencer::sweepLabels(size_t &n) const {
+  if (_flashSchedule) {
+    n = _flashSchedule->sweepLabelCount;
+    return (const ScheduleSweepLabel *)(_image + _flashSchedule->sweepLabelsOffset);
+  }
+  n = _sweepLabels.size();
+  return _sweepLabels.data();
+}
+
+const ScheduleSweepLabel *JsonPwmSequencer::sweepLabelFor(uint16_t id,
+                                                         uint32_t &point) const {
+  size_t n;
+  const ScheduleSweepLabel *sw = sweepLabels(n);
+  size_t first = namedLabels();
+  for (size_t k = 0; id != NO_LABEL && id >= first && k < n; k++) {
+    const uint32_t points = sweepAt(sw[k].word, 0, nullptr, nullptr);
+    if (id < first + points) {
+      point = (uint32_t)(id - first);
+      return &sw[k];
+    }
+    first += points;
+  }
+  return nullptr;
+}
+
+size_t JsonPwmSequencer::labelCount() const {
+  size_t n;
+  const ScheduleSweepLabel *sw = sweepLabels(n);
+  size_t count = namedLabels();
+  for (size_t k = 0; k < n; k++)
+    count += sweepAt(sw[k].word, 0, nullptr, nullptr);
+  return count < NO_LABEL ? count : NO_LABEL;
+}
+
+const char *JsonPwmSequencer::labelName(uint16_t id) const {
+  if (id >= labelCount())
     return "";
-  return _stepLabels[i].c_str();
+  uint32_t point;
+  if (const ScheduleSweepLabel *sl = sweepLabelFor(id, point)) {
+    // The template with {level} -> the point's carrier level and {mask} ->
+    // OFF, SOLO_A, PAIR_AB, TRIO_ABC or ALL.
+    const char *t = _flashSchedule ? (const char *)_image + sl->text
+                                   : &_sweepText[sl->text];
+    float level = 0.0f;
+    uint8_t mask = 0;
+    sweepAt(sl->word, point, &level, &mask);
+    char *out = _sweepLabelBuf;
+    const size_t cap = sizeof(_sweepLabelBuf);
+    size_t n = 0;
+    while (*t && n + 1 < cap) {
+      if (strncmp(t, "{level}", 7) == 0) {
+        n += snprintf(out + n, cap - n, "%g", level);
+        t += 7;
+      } else if (strncmp(t, "{mask}", 6) == 0) {
+        static const char *const GROUP[] = {"OFF", "SOLO_", "PAIR_", "TRIO_", "ALL"};
+        const int bits = __builtin_popcount(mask);
+        n += snprintf(out + n, cap - n, "%s", GROUP[bits]);
+        for (int i = 0; i < 4 && bits > 0 && bits < 4 && n + 1 < cap; i++)
+          if ((mask >> i) & 1)
+            out[n++] = (char)('A' + i);
+        t += 6;
+      } else {
+        out[n++] = *t++;
+      }
+      if (n >= cap)
+        n = cap - 1; // snprintf() truncated
+    }
+    out[n] = '\0';
+    return out;
+  }
+  if (_flashSchedule)
+    return (const char *)_image +
+           ((const uint32_t *)(_image + _flashSchedule->labelsOffset))[id];
+  return &_labelText[_labelOffsets[id]];
+}
+
+uint16_t JsonPwmSequencer::findLabel(const char *name) const {
+  for (size_t id = 0; name && *name && id < labelCount(); id++)
+    if (strcasecmp(labelName((uint16_t)id), name) == 0)
+      return (uint16_t)id;
+  return NO_LABEL;
+}
+
+bool JsonPwmSequencer::seekToLabel(const char *name) {
+  uint16_t id = findLabel(name);
+  uint32_t point;
+  if (const ScheduleSweepLabel *sl = sweepLabelFor(id, point)) {
+    seekToStep(sl->step, point);
+    return true;
+  }
+  if (id == NO_LABEL || id >= _labelFirstStep.size() ||
+      _labelFirstStep[id] == UINT32_MAX) {
+    Serial.printf("[JsonPwmSequencer] no step labelled '%s'\n", name);
+    return false;
+  }
+  seekToStep(_labelFirstStep[id]);
+  return true;
+}
+
+uint16_t JsonPwmSequencer::internLabel(const char *name) {
+  if (!name || !*name)
+    return NO_LABEL;
+  for (size_t id = 0; id < _labelOffsets.size(); id++)
+    if (strcmp(&_labelText[_labelOffsets[id]], name) == 0)
+      return (uint16_t)id;
+  if (_labelOffsets.size() >= NO_LABEL)
+    return NO_LABEL;
+  _labelOffsets.push_back((uint32_t)_labelText.size());
+  _labelText.insert(_labelText.end(), name, name + strlen(name) + 1);
+  _labelFirstStep.push_back(UINT32_MAX); // until a step uses it
+  return (uint16_t)(_labelOffsets.size() - 1);
+}
+
+void JsonPwmSequencer::pushStepLabel(uint16_t id) {
+  // A step before any run is implicitly NO_LABEL, so only start a run on a
+  // change.
+  uint16_t prev = _labelRuns.empty() ? NO_LABEL : _labelRuns.back().id;
+  if (id != prev) {
+    _labelRuns.push_back(LabelRun{(uint32_t)_labelSteps, id});
+    if (id < _labelFirstStep.size() && _labelFirstStep[id] == UINT32_MAX)
+      _labelFirstStep[id] = (uint32_t)_labelSteps;
+  }
+  _labelSteps++;
+}
+
+void JsonPwmSequencer::truncateLabels(size_t steps, size_t names) {
+  while (!_labelRuns.empty() && _labelRuns.back().firstStep >= steps)
+    _labelRuns.pop_back();
+  if (steps < _labelSteps)
+    _labelSteps = steps;
+  if (names < _labelOffsets.size()) {
+    _labelText.resize(_labelOffsets[names]);
+    _labelOffsets.resize(names);
+    _labelFirstStep.resize(names);
+  }
+  for (uint32_t &first : _labelFirstStep)
+    if (first != UINT32_MAX && first >= steps)
+      first = UINT32_MAX;
+  while (!_sweepLabels.empty() && _sweepLabels.back().step >= steps) {
+    _sweepText.resize(_sweepLabels.back().text);
+    _sweepLabels.pop_back();
+  }
+}
+
+void JsonPwmSequencer::clearLabels() {
+  std::vector<char>().swap(_labelText);
+  std::vector<uint32_t>().swap(_labelOffsets);
+  std::vector<LabelRun>().swap(_labelRuns);
+  std::vector<uint32_t>().swap(_labelFirstStep);
+  std::vector<ScheduleSweepLabel>().swap(_sweepLabels);
+  std::vector<char>().swap(_sweepText);
+  _labelSteps = 0;
+  _labelHint = 0;
+}
+
+void JsonPwmSequencer::dropFlashSchedule() {
+  if (!_flashSchedule)
+    return;
+  _flashSchedule = nullptr;
+  useExternalTasks(nullptr, 0, 0); // back to the (empty) queue
+}
+
+const uint8_t *JsonPwmSequencer::mapImage(const char *partitionLabel) {
+  const esp_partition_t *part = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)SCHEDULE_PARTITION_SUBTYPE,
+      partitionLabel);
+  if (!part) {
+    Serial.printf("[JsonPwmSequencer] no '%s' schedule partition -- flash a "
+                  "table that has one (partitions.csv)\n",
+                  partitionLabel);
+    return nullptr;
+  }
+  if (part != _imagePart) {
+    dropFlashSchedule(); // its tasks live in the old mapping
+    if (_image)
+      spi_flash_munmap(_imageMap);
+    _image = nullptr;
+    _imagePart = nullptr;
+    const void *p = nullptr;
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA,
+                                       &p, &_imageMap);
+    if (err != ESP_OK) {
+      Serial.printf("[JsonPwmSequencer] mmap of '%s' failed (err=0x%x)\n",
+                    partitionLabel, (unsigned)err);
+      return nullptr;
+    }
+    _image = (const uint8_t *)p;
+    _imagePart = part;
+  }
+
+  const ScheduleImageHeader *ih = (const ScheduleImageHeader *)_image;
+  if (ih->magic != SCHEDULE_IMAGE_MAGIC) {
+    Serial.printf("[JsonPwmSequencer] '%s' holds no schedule image -- run "
+                  "tools/compile_schedules.py --flash\n",
+                  partitionLabel);
+    return nullptr;
+  }
+  if (ih->version != SCHEDULE_IMAGE_VERSION ||
+      ih->taskEncoding != PwmSequencer::TASK_ENCODING ||
+      ih->imageBytes > part->size ||
+      sizeof(*ih) + (uint64_t)ih->scheduleCount * sizeof(ScheduleDirEntry) >
+          ih->imageBytes) {
+    Serial.printf("[JsonPwmSequencer] schedule image v%u (task encoding %u) "
+                  "does not match this firmware (v%u, encoding %u) -- "
+                  "recompile it\n",
+                  (unsigned)ih->version, (unsigned)ih->taskEncoding,
+                  (unsigned)SCHEDULE_IMAGE_VERSION,
+                  (unsigned)PwmSequencer::TASK_ENCODING);
+    return nullptr;
+  }
+  return _image;
+}
+
+bool JsonPwmSequencer::loadFromPartition(const char *filename,
+                                         const char *partitionLabel) {
+  int64_t t0 = esp_timer_get_time();
+  uint32_t freeAtStart = ESP.getFreeHeap();
+  _lastLoad = JsonLoadReport();
+
+  const uint8_t *image = mapImage(partitionLabel);
+  if (!image)
+    return false;
+  const ScheduleImageHeader *ih = (const ScheduleImageHeader *)image;
+  const ScheduleDirEntry *dir = (const ScheduleDirEntry *)(ih + 1);
+  const ScheduleHeader *sh = nullptr;
+  for (uint32_t i = 0; i < ih->scheduleCount && !sh; i++) {
+    if (strncmp(dir[i].name, filename, sizeof(dir[i].name)) == 0 &&
+        dir[i].offset % 4 == 0 &&
+        dir[i].offset + (uint64_t)sizeof(ScheduleHeader) <= ih->imageBytes)
+      sh = (const ScheduleHeader *)(image + dir[i].offset);
+  }
+  if (!sh) {
+    Serial.printf("[JsonPwmSequencer] %s is not in the schedule image\n",
+                  filename);
+    return false;
+  }
+
+  // Everything the sequencer will dereference must sit inside the CRC'd data
+  // block, which must sit inside the image.
+  const uint64_t dataEnd = (uint64_t)sh->tasksOffset + sh->dataBytes;
+  auto inData = [&](uint32_t off, uint64_t bytes) {
+    return off >= sh->tasksOffset && off + bytes <= dataEnd;
+  };
+  auto isString = [&](uint32_t off) {
+    return inData(off, 1) && memchr(image + off, '\0', dataEnd - off) != nullptr;
+  };
+  bool ok = sh->tasksOffset % 4 == 0 && dataEnd <= ih->imageBytes &&
+            inData(sh->tasksOffset, (uint64_t)sh->taskWords * sizeof(uint32_t)) &&
+            sh->labelIdxOffset % 2 == 0 &&
+            inData(sh->labelIdxOffset, (uint64_t)sh->taskCount * sizeof(uint16_t)) &&
+            sh->labelsOffset % 4 == 0 &&
+            inData(sh->labelsOffset, (uint64_t)sh->labelCount * sizeof(uint32_t)) &&
+            sh->sweepLabelsOffset % 4 == 0 &&
+            inData(sh->sweepLabelsOffset,
+                   (uint64_t)sh->sweepLabelCount * sizeof(ScheduleSweepLabel)) &&
+            sh->includesOffset % 4 == 0 &&
+            inData(sh->includesOffset,
+                   (uint64_t)sh->includeCount * sizeof(ScheduleInclude)) &&
+            crc32(image + sh->tasksOffset, sh->dataBytes) == sh->dataCrc32;
+  const uint32_t *labels = (const uint32_t *)(image + sh->labelsOffset);
+  for (uint32_t l = 0; ok && l < sh->labelCount; l++)
+    ok = isString(labels[l]);
+  const ScheduleSweepLabel *sweeps =
+      (const ScheduleSweepLabel *)(image + sh->sweepLabelsOffset);
+  for (uint32_t k = 0; ok && k < sh->sweepLabelCount; k++)
+    ok = sweeps[k].step < sh->taskCount && isString(sweeps[k].text);
+  const ScheduleInclude *includes =
+      (const ScheduleInclude *)(image + sh->includesOffset);
+  for (uint32_t k = 0; ok && k < sh->includeCount; k++)
+    ok = isString(includes[k].path);
+  BalanceGainSchedule gains;
+  const bool hasGains = sh->gainPointCount != ScheduleHeader::NO_GAIN_SCHEDULE;
+  if (ok && hasGains)
+    ok = sh->gainPointsOffset % 4 == 0 &&
+         sh->gainPointCount <= (uint32_t)BalanceGainSchedule::MAX_POINTS &&
+         inData(sh->gainPointsOffset,
+                (uint64_t)sh->gainPointCount * sizeof(BalanceGainPoint)) &&
+         gains.set((const BalanceGainPoint *)(image + sh->gainPointsOffset),
+                   (int)sh->gainPointCount);
+  if (!ok) {
+    Serial.printf("[JsonPwmSequencer] %s: schedule image is corrupt -- "
+                  "recompile and reflash it\n",
+                  filename);
+    return false;
+  }
+
+  // An edited JSON (uploadfs) without a recompiled image would silently run
+  // the old schedule; so would an edited include. Each file is only checked
+  // if it is there to compare against.
+  const char *stale = sourceMatches(filename, sh->sourceCrc32) ? nullptr : filename;
+  for (uint32_t k = 0; !stale && k < sh->includeCount; k++) {
+    const char *path = (const char *)(image + includes[k].path);
+    if (!sourceMatches(path, includes[k].crc32)) stale = path;
+  }
+  if (stale) {
+    Serial.printf("[JsonPwmSequencer] %s: schedule image is stale (%s changed "
+                  "since it was compiled) -- rerun "
+                  "tools/compile_schedules.py --flash\n",
+                  filename, stale);
+    return false;
+  }
+
+  if (!useExternalTasks((const uint32_t *)(image + sh->tasksOffset),
+                        sh->taskWords, sh->taskCount)) {
+    Serial.printf("[JsonPwmSequencer] %s: schedule image has malformed task "
+                  "records -- recompile and reflash it\n",
+                  filename);
+    return false;
+  }
+  for (uint32_t k = 0; k < sh->sweepLabelCount; k++) {
+    if (!sweepAt(sweeps[k].word, 0, nullptr, nullptr)) {
+      Serial.printf("[JsonPwmSequencer] %s: schedule image labels a sweep "
+                    "it does not have -- recompile and reflash it\n",
+                    filename);
+      useExternalTasks(nullptr, 0, 0);
+      return false;
+    }
+  }
+  clearLabels();
+  _flashSchedule = sh;
+  _labelFirstStep.assign(sh->labelCount, UINT32_MAX);
+  const uint16_t *stepLabel = (const uint16_t *)(image + sh->labelIdxOffset);
+  for (uint32_t i = sh->taskCount; i-- > 0;)
+    if (stepLabel[i] < sh->labelCount)
+      _labelFirstStep[stepLabel[i]] = i;
+  compile(sh->resolutionMs, sh->initialFreq, sh->initialDuty,
+          sh->initialPhase);
+  if (hasGains) {
+    _gainSchedule = gains;
+    _hasGainSchedule = true;
+  }
+
+  uint32_t freeNow = ESP.getFreeHeap();
+  _lastLoad.ok = true;
+  _lastLoad.fromFlash = true;
+  _lastLoad.fileBytes = sh->dataBytes;
+  _lastLoad.entries = sh->taskCount;
+  _lastLoad.loadUs = (uint32_t)(esp_timer_get_time() - t0);
+  _lastLoad.peakHeapBytes = freeNow < freeAtStart ? freeAtStart - freeNow : 0;
+  Serial.printf("[JsonPwmSequencer] %s (flash): %u tasks, %u bytes, %.1f ms, "
+                "heap %u bytes\n",
+                filename, (unsigned)sh->taskCount, (unsigned)sh->dataBytes,
+                _lastLoad.loadUs / 1000.0f, (unsigned)_lastLoad.peakHeapBytes);
+  return true;
 }
 
 bool JsonPwmSequencer::loadFromJsonFile(const char *filename) {
+  int64_t t0 = esp_timer_get_time();
+  uint32_t freeAtStart = ESP.getFreeHeap();
+  uint32_t freeFloor = freeAtStart;
+  _lastLoad = JsonLoadReport();
+  dropFlashSchedule(); // JSON tasks go to the queue
+
   File file = SPIFFS.open(filename, "r");
   if (!file) {
     Serial.printf("[JsonPwmSequencer] cannot open %s -- is SPIFFS mounted "
@@ -29,22 +912,7 @@ bool JsonPwmSequencer::loadFromJsonFile(const char *filename) {
                   filename);
     return false;
   }
-  size_t size = file.size();
-  std::unique_ptr<char[]> buf(new char[size + 1]);
-  file.readBytes(buf.get(), size);
-  buf[size] = '\0';
-  file.close();
-
-  // Elastic document (ArduinoJson v7): grows its internal pool as needed, so
-  // there's no fixed byte-capacity to guess for a large generated experiment.
-  JsonDocument doc;
-  auto err = deserializeJson(doc, buf.get());
-  if (err) {
-    Serial.printf("[JsonPwmSequencer] parse failed: %s (file=%u bytes, "
-                  "free heap=%u bytes)\n",
-                  err.c_str(), (unsigned)size, (unsigned)ESP.getFreeHeap());
-    return false;
-  }
+  _lastLoad.fileBytes = (uint32_t)file.size();
 
   // Initial state from the file; project defaults fill any absent key. A bare
   // top-level array is the schedule with all defaults.
@@ -53,193 +921,683 @@ bool JsonPwmSequencer::loadFromJsonFile(const char *filename) {
   float initialDuty[4] = {50, 50, 50, 50};
   float initialPhase[4] = {PHASES_CCW[0], PHASES_CCW[1], PHASES_CCW[2],
                            PHASES_CCW[3]};
+  bool cw = false;
+  float phaseOverride[4] = {NAN, NAN, NAN, NAN};
+  BalanceGainSchedule gains; // "gain_schedule", kept only if the load succeeds
+  bool hasGains = false;
 
-  JsonArray arr;
-  if (doc.is<JsonArray>()) {
-    arr = doc.as<JsonArray>();
-  } else {
-    JsonObject cfg = doc.as<JsonObject>();
-    resolutionMs = cfg["resolution_ms"] | resolutionMs;
-    initialFreq = cfg["initial_freq"] | initialFreq;
-
-    JsonArray dutyArr = cfg["initial_duty"].as<JsonArray>();
-    for (int i = 0; i < 4 && i < (int)dutyArr.size(); i++)
-      initialDuty[i] = dutyArr[i] | initialDuty[i];
+  const size_t queueStart = queueSize();
+  const size_t labelStepsStart = _labelSteps;
+  const size_t labelNamesStart = _labelOffsets.size();
+  LoadState st;
+  ScheduleReader in(file);
+  char buf[PARSE_BUFFER_BYTES];
+  size_t len;
+  JsonDocument doc; // one entry at a time
+  uint32_t entry = 0;
+  const char *error = nullptr;
 
+  auto resolvePhases = [&]() {
     // "direction" seeds all four phases from the project CW/CCW convention;
     // an explicit "initial_phase" array (if present) overrides per-channel.
-    const char *dir = cfg["direction"] | "";
-    if (strcasecmp(dir, "cw") == 0) {
-      for (int i = 0; i < 4; i++)
-        initialPhase[i] = PHASES_CW[i];
+    for (int i = 0; i < 4; i++) {
+      initialPhase[i] = cw ? PHASES_CW[i] : PHASES_CCW[i];
+      if (!isnan(phaseOverride[i]))
+        initialPhase[i] = phaseOverride[i];
+    }
+  };
+
+  // Stream the schedule array at the reader's position into the queue.
+  auto streamSchedule = [&]() -> bool {
+    resolvePhases();
+    st.seed(initialFreq, initialDuty, initialPhase);
+    st.stepOffset = queueSize() - _labelSteps;
+    bool ok = streamEntries(in, buf, sizeof(buf), doc, error,
+                            [&](JsonObjectConst obj) {
+                              uint32_t freeNow = ESP.getFreeHeap();
+                              if (freeNow < freeFloor)
+                                freeFloor = freeNow;
+                              applyEntry(obj, st);
+                              entry++;
+                              error = st.error;
+                              return st.error == nullptr;
+                            });
+    if (ok && st.depth > 0) {
+      error = "block not closed by 'end'";
+      ok = false;
+    }
+    return ok;
+  };
+
+  // Top level: a bare schedule array, or the config object around one.
+  auto parseFile = [&]() -> bool {
+    in.skipSpace();
+    int first = in.peek();
+    if (first == '[')
+      return streamSchedule();
+    if (first != '{') {
+      error = "expected '{' or '['";
+      return false;
+    }
+    in.get();
+    size_t scheduleAt = 0;
+    bool streamed = false;
+    bool reseed = false; // a seeding key came after "schedule"
+    in.skipSpace();
+    bool more = in.peek() != '}';
+    if (!more)
+      in.get();
+    while (more) {
+      char key[48];
+      size_t keyLen;
+      if (!in.readValue(key, sizeof(key), keyLen) || keyLen < 2 ||
+          key[0] != '"' || key[keyLen - 1] != '"') {
+        error = "expected a key";
+        return false;
+      }
+      key[keyLen - 1] = '\0';
+      const char *name = key + 1;
+      in.skipSpace();
+      if (in.get() != ':') {
+        error = "expected ':'";
+        return false;
+      }
+
+      bool seeds = strcmp(name, "initial_freq") == 0 ||
+                   strcmp(name, "initial_duty") == 0 ||
+                   strcmp(name, "direction") == 0 ||
+                   strcmp(name, "initial_phase") == 0;
+      if (strcmp(name, "schedule") == 0) {
+        in.skipSpace();
+        scheduleAt = in.offset();
+        if (!streamSchedule())
+          return false;
+        streamed = true;
+      } else if (seeds || strcmp(name, "resolution_ms") == 0) {
+        if (!in.readValue(buf, sizeof(buf), len) ||
+            deserializeJson(doc, buf, len)) {
+          error = "bad config value";
+          return false;
+        }
+        JsonVariantConst v = doc.as<JsonVariantConst>();
+        if (strcmp(name, "resolution_ms") == 0) {
+          resolutionMs = v | resolutionMs;
+        } else if (strcmp(name, "initial_freq") == 0) {
+          initialFreq = v | initialFreq;
+        } else if (strcmp(name, "initial_duty") == 0) {
+          JsonArrayConst dutyArr = v.as<JsonArrayConst>();
+          for (int i = 0; i < 4 && i < (int)dutyArr.size(); i++)
+            initialDuty[i] = dutyArr[i] | initialDuty[i];
+        } else if (strcmp(name, "direction") == 0) {
+          cw = strcasecmp(v | "", "cw") == 0;
+        } else {
+          JsonArrayConst phaseArr = v.as<JsonArrayConst>();
+          for (int i = 0; i < 4 && i < (int)phaseArr.size(); i++)
+            phaseOverride[i] = phaseArr[i] | phaseOverride[i];
+        }
+        reseed = reseed || (streamed && seeds);
+      } else if (strcmp(name, "gain_schedule") == 0) {
+        // Streamed a point at a time, like the schedule: a table of
+        // MAX_POINTS pretty-printed points needn't fit one parse buffer.
+        BalanceGainPoint points[BalanceGainSchedule::MAX_POINTS];
+        int n = 0;
+        if (!streamEntries(in, buf, sizeof(buf), doc, error,
+                           [&](JsonObjectConst p) {
+                             if (n == BalanceGainSchedule::MAX_POINTS)
+                               return false;
+                             points[n].freqHz = p["freq"] | NAN;
+                             points[n].kp = p["kp"] | NAN;
+                             points[n].ki = p["ki"] | NAN;
+                             points[n].kd = p["kd"] | NAN;
+                             n++;
+                             return true;
+                           }) ||
+            !gains.set(points, n)) {
+          error = "bad gain_schedule (an array of at most 8 {freq, kp, ki, "
+                  "kd}, freq ascending, gains >= 0)";
+          return false;
+        }
+        hasGains = true;
+      } else if (!in.readValue(nullptr, 0, len)) { // unknown key: ignored
+        error = "bad value";
+        return false;
+      }
+
+      in.skipSpace();
+      int c = in.get();
+      if (c == '}')
+        break;
+      if (c != ',') {
+        error = "expected ',' or '}'";
+        return false;
+      }
+      in.skipSpace();
+    }
+
+    // Rare: initial state given after the schedule. The tasks above were
+    // built from the wrong running state, so replay the array.
+    if (reseed) {
+      truncateQueue(queueStart);
+      truncateLabels(labelStepsStart, labelNamesStart);
+      entry = 0;
+      st.quiet = true;
+      if (!in.seek(scheduleAt)) {
+        error = "seek failed";
+        return false;
+      }
+      return streamSchedule();
     }
-    JsonArray phaseArr = cfg["initial_phase"].as<JsonArray>();
-    for (int i = 0; i < 4 && i < (int)phaseArr.size(); i++)
-      initialPhase[i] = phaseArr[i] | initialPhase[i];
+    return true;
+  };
 
-    arr = cfg["schedule"].as<JsonArray>();
+  if (!parseFile()) {
+    Serial.printf("[JsonPwmSequencer] parse failed: %s at byte %u of %s "
+                  "(entry %u, free heap=%u bytes)\n",
+                  error ? error : "?", (unsigned)in.offset(), filename,
+                  (unsigned)entry, (unsigned)ESP.getFreeHeap());
+    file.close();
+    truncateQueue(queueStart);
+    truncateLabels(labelStepsStart, labelNamesStart);
+    return false;
   }
+  file.close();
+  resolvePhases();
 
-  reserve(arr.size());
-  _stepLabels.reserve(arr.size());
+  compile(resolutionMs, initialFreq, initialDuty, initialPhase);
+  if (hasGains) {
+    _gainSchedule = gains;
+    _hasGainSchedule = true;
+  }
+  {
+    uint32_t freeNow = ESP.getFreeHeap();
+    if (freeNow < freeFloor)
+      freeFloor = freeNow;
+  }
+  _lastLoad.ok = true;
+  _lastLoad.entries = entry;
+  _lastLoad.loadUs = (uint32_t)(esp_timer_get_time() - t0);
+  _lastLoad.peakHeapBytes = freeAtStart - freeFloor;
+  Serial.printf("[JsonPwmSequencer] %s: %u entries, %u bytes, %.1f ms, "
+                "peak heap %u bytes\n",
+                filename, (unsigned)entry, (unsigned)_lastLoad.fileBytes,
+                _lastLoad.loadUs / 1000.0f, (unsigned)_lastLoad.peakHeapBytes);
+  return true;
+}
 
-  // Running full state: TRAJECTORY_POINT tasks need every channel, so each
-  // per-channel command updates one entry here and pushes the whole snapshot.
-  float curFreq = initialFreq;
-  float curDuty[4];
-  float curPhase[4];
-  float curCarrier[4]; // NAN = untouched; applyCurrentState() skips those channels
-  for (int i = 0; i < 4; i++) {
-    curDuty[i] = initialDuty[i];
-    curPhase[i] = initialPhase[i];
-    curCarrier[i] = NAN;
-  }
-
-  // Label active for whatever step gets pushed next; "label" entries update
-  // this without pushing a queue entry of their own.
-  String currentLabel;
-
-  std::vector<String> unknownMethods;
-  for (JsonObject obj : arr) {
-    const char *methodCStr = obj["method"] | "";
-    String method(methodCStr);
-    int mask = obj["mask"] | 0;
-    float value = obj["value"] | 0.0f;
-    float from = obj["from"] | 0.0f;
-    float to = obj["to"] | 0.0f;
-    float shape = obj["shape"] | NAN; // curve param for any ramp; NAN = default
-    uint32_t durationMs = obj["duration_ms"] | 0;
-    bool called = false;
-    bool pushedTask = false;
-
-    // Target channel(s): "channels" is an int (one) or an array (many, applied in
-    // one simultaneous snapshot). In-range (0-3) only; other entries dropped.
-    int channels[4];
-    int nChannels = 0;
-    if (obj["channels"].is<JsonArray>()) {
-      for (auto c : obj["channels"].as<JsonArray>()) {
-        int ci = c.as<int>();
-        if (ci >= 0 && ci < 4 && nChannels < 4)
-          channels[nChannels++] = ci;
-      }
-    } else if (obj["channels"].is<int>()) {
-      int ci = obj["channels"].as<int>();
-      if (ci >= 0 && ci < 4)
+bool JsonPwmSequencer::includeFile(const char *path, LoadState &st) {
+  LoadState::SubDef def = {};
+  if (strlen(path) >= sizeof(def.name)) {
+    st.error = "include path too long";
+    return false;
+  }
+  strcpy(def.name, path);
+  File file = SPIFFS.open(path, "r");
+  if (!file) {
+    Serial.printf("[JsonPwmSequencer] cannot open included %s\n", path);
+    st.error = "included file not found";
+    return false;
+  }
+  ScheduleReader in(file);
+  char buf[PARSE_BUFFER_BYTES];
+  size_t len;
+  JsonDocument doc;
+  const char *error = nullptr;
+
+  const uint16_t outerLabel = st.currentLabel;
+  bool done = false;
+
+  // The file's schedule becomes the body of a subroutine named after it.
+  auto streamBody = [&]() -> bool {
+    if (!beginSubroutine(def.sub)) {
+      error = "blocks nested too deep";
+      return false;
+    }
+    const int self = (int)st.subs.size();
+    const int depth = st.depth;
+    st.subs.push_back(def);
+    st.blocks[st.depth++] = self;
+    while (_labelSteps + st.stepOffset < queueSize())
+      pushStepLabel(st.currentLabel); // the opener
+    bool ok = streamEntries(in, buf, sizeof(buf), doc, error,
+                            [&](JsonObjectConst entry) {
+                              applyEntry(entry, st);
+                              return st.error == nullptr;
+                            });
+    if (!ok)
+      return false;
+    if (st.depth != depth + 1) {
+      error = "block not closed by 'end'";
+      return false;
+    }
+    st.depth--;
+    if (!endBlock()) {
+      error = "schedule has no tasks";
+      return false;
+    }
+    st.subs[self].closed = true;
+    while (_labelSteps + st.stepOffset < queueSize())
+      pushStepLabel(st.currentLabel);
+    done = true;
+    return true;
+  };
+
+  // A bare array, or {"params": [...], "schedule": [...]} in that order.
+  auto parseFile = [&]() -> bool {
+    in.skipSpace();
+    int first = in.peek();
+    if (first == '[')
+      return streamBody();
+    if (in.get() != '{') {
+      error = "expected '{' or '['";
+      return false;
+    }
+    for (;;) {
+      char key[16];
+      size_t keyLen;
+      if (!in.readValue(key, sizeof(key), keyLen) || keyLen < 2 ||
+          key[0] != '"' || key[keyLen - 1] != '"') {
+        error = "expected a key";
+        return false;
+      }
+      key[keyLen - 1] = '\0';
+      in.skipSpace();
+      if (in.get() != ':') {
+        error = "expected ':'";
+        return false;
+      }
+      if (strcmp(key + 1, "schedule") == 0) {
+        if (done) {
+          error = "more than one \"schedule\"";
+          return false;
+        }
+        in.skipSpace();
+        if (!streamBody())
+          return false;
+      } else if (strcmp(key + 1, "params") == 0 && !done) {
+        if (!in.readValue(buf, sizeof(buf), len) ||
+            deserializeJson(doc, buf, len) || !doc.is<JsonArrayConst>()) {
+          error = "\"params\" is not an array";
+          return false;
+        }
+        for (JsonVariantConst p : doc.as<JsonArrayConst>()) {
+          const char *name = p | "";
+          if (def.nParams == PwmSequencer::MAX_PARAMS || !*name ||
+              strlen(name) >= sizeof(def.params[0])) {
+            error = "too many \"params\", or a bad name";
+            return false;
+          }
+          strcpy(def.params[def.nParams++], name);
+        }
+      } else if (!in.readValue(nullptr, 0, len)) { // other keys: ignored
+        error = "bad value";
+        return false;
+      }
+      in.skipSpace();
+      int c = in.get();
+      if (c == '}')
+        break;
+      if (c != ',') {
+        error = "expected ',' or '}'";
+        return false;
+      }
+      in.skipSpace();
+    }
+    if (!done)
+      error = "no \"schedule\"";
+    return done;
+  };
+
+  st.includes++;
+  bool ok = parseFile();
+  st.includes--;
+  file.close();
+  st.currentLabel = outerLabel; // labels set in the file stay in it
+  if (!ok) {
+    if (st.error != IN_INCLUDED_FILE) { // else printed by the nested include
+      Serial.printf("[JsonPwmSequencer] parse failed: %s at byte %u of "
+                    "included %s\n",
+                    st.error ? st.error : error ? error : "?",
+                    (unsigned)in.offset(), path);
+      st.error = IN_INCLUDED_FILE;
+    }
+    return false;
+  }
+  return true;
+}
+
+void JsonPwmSequencer::applyEntry(const JsonObjectConst &obj, LoadState &st) {
+  const char *methodName = obj["method"] | "";
+  const float shape = obj["shape"] | NAN; // curve param for any ramp; NAN = default
+
+  // Target channel(s): "channels" is an int (one) or an array (many, applied in
+  // one simultaneous snapshot). In-range (0-3) only; other entries dropped.
+  int channels[4];
+  int nChannels = 0;
+  uint8_t channelMask = 0;
+  if (obj["channels"].is<JsonArrayConst>()) {
+    for (JsonVariantConst c : obj["channels"].as<JsonArrayConst>()) {
+      int ci = c.as<int>();
+      if (ci >= 0 && ci < 4 && nChannels < 4)
         channels[nChannels++] = ci;
     }
+  } else if (obj["channels"].is<int>()) {
+    int ci = obj["channels"].as<int>();
+    if (ci >= 0 && ci < 4)
+      channels[nChannels++] = ci;
+  }
+  for (int i = 0; i < nChannels; i++)
+    channelMask |= (uint8_t)(1 << channels[i]);
 
-    if (method == "addDutyCycleTask" && nChannels > 0) {
-      for (int i = 0; i < nChannels; i++)
-        curDuty[channels[i]] = constrain(value, 0.0f, 100.0f);
-      addSequenceTask(makeTrajectoryTask(curFreq, curDuty, curPhase, curCarrier));
-      called = true;
-      pushedTask = true;
-    } else if (method == "addPhaseTask" && nChannels > 0) {
-      for (int i = 0; i < nChannels; i++)
-        curPhase[channels[i]] = value;
-      addSequenceTask(makeTrajectoryTask(curFreq, curDuty, curPhase, curCarrier));
-      called = true;
-      pushedTask = true;
-    } else if (method == "addWaitTask") {
-      addWaitTask(durationMs);
-      called = true;
-      pushedTask = true;
-    } else if (method == "addLinearRampTask") {
-      addRampTask(from, to, durationMs, TaskType::PWM_FREQ,
-                  TaskMode::POLYNOMIAL, shape);
-      curFreq = to;
-      called = true;
-      pushedTask = true;
-    } else if (method == "addEaseRampTask") {
-      addRampTask(from, to, durationMs, TaskType::PWM_FREQ, TaskMode::EASE,
-                  shape);
-      curFreq = to;
-      called = true;
-      pushedTask = true;
-    } else if (method == "addExponentialRampTask") {
-      addRampTask(from, to, durationMs, TaskType::PWM_FREQ,
-                  TaskMode::EXPONENTIAL, shape);
-      curFreq = to;
-      called = true;
-      pushedTask = true;
-    } else if (method == "addCarrierRampTask") {
-      addRampTask(from, to, durationMs, TaskType::CARRIER_DUTY,
-                  TaskMode::POLYNOMIAL, shape);
-      for (int i = 0; i < 4; i++)
-        curCarrier[i] = to;
-      called = true;
-      pushedTask = true;
-    } else if (method == "addCarrierEaseRampTask") {
-      addRampTask(from, to, durationMs, TaskType::CARRIER_DUTY,
-                  TaskMode::EASE, shape);
+  const Method *m = findMethod(methodName);
+  if (!m || (m->needsChannels && nChannels == 0)) {
+    if (st.quiet)
+      return;
+    if (!st.unknownSeen)
+      Serial.println("[JsonPwmSequencer] Unknown methods found in schedule:");
+    st.unknownSeen = true;
+    Serial.println(methodName);
+    return;
+  }
+  if (m->op == Op::LABEL) {
+    st.currentLabel = internLabel(obj["value"] | "");
+    return; // recognized, but pushes nothing; doesn't advance the queue
+  }
+
+  // Operand `key` of `from`: a number, or "$name", a parameter of the sub
+  // being defined.
+  auto operand = [&](JsonObjectConst from, const char *key,
+                     float def) -> Operand {
+    JsonVariantConst v = from[key];
+    const char *ref = v | "";
+    if (ref[0] != '$')
+      return Operand(v | def);
+    int slot = st.findParam(ref + 1);
+    if (slot < 0) {
+      Serial.printf("[JsonPwmSequencer] '%s' is not a parameter of the "
+                    "enclosing sub\n",
+                    ref);
+      st.error = "unknown parameter";
+      return Operand(def);
+    }
+    return Operand::arg(slot);
+  };
+  const Operand value = operand(obj, "value", 0.0f);
+  const Operand from = operand(obj, "from", 0.0f);
+  const Operand to = operand(obj, "to", 0.0f);
+  const Operand mask = operand(obj, "mask", 0.0f);
+  const Operand duration = operand(obj, "duration_ms", 0.0f);
+  const uint32_t durationMs = obj["duration_ms"] | 0;
+  const bool literal = value.param < 0 && from.param < 0 && to.param < 0 &&
+                       mask.param < 0 && duration.param < 0;
+  if (st.error)
+    return;
+
+  // Arguments for a call of subs[def] from an "args" object keyed by
+  // parameter name.
+  auto call = [&](int def) {
+    const LoadState::SubDef &sub = st.subs[def];
+    Operand args[PwmSequencer::MAX_PARAMS];
+    JsonObjectConst given = obj["args"].as<JsonObjectConst>();
+    for (int k = 0; k < sub.nParams && !st.error; k++) {
+      if (given[sub.params[k]].isNull()) {
+        Serial.printf("[JsonPwmSequencer] %s: no value for '%s'\n", sub.name,
+                      sub.params[k]);
+        st.error = "missing argument";
+      }
+      args[k] = operand(given, sub.params[k], 0.0f);
+    }
+    if (!st.error)
+      addCall(sub.sub, args, sub.nParams);
+  };
+
+  ParamTask task;
+  task.mode = m->mode;
+  task.shape = shape;
+  switch (m->op) {
+  case Op::DUTY:
+  case Op::PHASE:
+  case Op::CARRIER_DUTY: {
+    float *cur = m->op == Op::DUTY    ? st.curDuty
+                 : m->op == Op::PHASE ? st.curPhase
+                                      : st.curCarrier;
+    if (st.deferred) {
+      task.op = ParamOp::SET;
+      task.type = m->op == Op::DUTY    ? TaskType::PWM_DUTY
+                  : m->op == Op::PHASE ? TaskType::PWM_PHASE
+                                       : TaskType::CARRIER_DUTY;
+      task.channels = channelMask;
       for (int i = 0; i < 4; i++)
-        curCarrier[i] = to;
-      called = true;
-      pushedTask = true;
-    } else if (method == "addCarrierExponentialRampTask") {
-      addRampTask(from, to, durationMs, TaskType::CARRIER_DUTY,
-                  TaskMode::EXPONENTIAL, shape);
+        task.a[i] = value;
+      addParamTask(task);
+      break;
+    }
+    for (int i = 0; i < nChannels; i++)
+      cur[channels[i]] = m->op == Op::PHASE
+                             ? value.value
+                             : constrain(value.value, 0.0f, 100.0f);
+    addSequenceTask(makeTrajectoryTask(st.curFreq, st.curDuty, st.curPhase,
+                                       st.curCarrier));
+    break;
+  }
+  case Op::WAIT:
+    if (!literal) {
+      task.op = ParamOp::WAIT;
+      task.a[0] = duration;
+      addParamTask(task);
+      break;
+    }
+    addWaitTask(durationMs);
+    break;
+  case Op::FREQ_RAMP:
+  case Op::CARRIER_RAMP:
+  case Op::PHASE_RAMP:
+    if (!literal) {
+      task.op = ParamOp::RAMP;
+      task.type = m->op == Op::FREQ_RAMP      ? TaskType::PWM_FREQ
+                  : m->op == Op::CARRIER_RAMP ? TaskType::CARRIER_DUTY
+                                              : TaskType::PWM_PHASE;
+      task.channels = m->op == Op::PHASE_RAMP ? channelMask : 0x0F;
+      task.a[0] = from;
+      task.a[1] = to;
+      task.a[2] = duration;
+      addParamTask(task);
+      break;
+    }
+    if (m->op == Op::FREQ_RAMP) {
+      addRampTask(from.value, to.value, durationMs,
+                  TaskType::PWM_FREQ, m->mode, shape);
+      st.curFreq = to.value;
+    } else if (m->op == Op::CARRIER_RAMP) {
+      addRampTask(from.value, to.value, durationMs,
+                  TaskType::CARRIER_DUTY, m->mode, shape);
       for (int i = 0; i < 4; i++)
-        curCarrier[i] = to;
-      called = true;
-      pushedTask = true;
-    } else if (method == "addPhaseRampTask" && nChannels > 0) {
+        st.curCarrier[i] = to.value;
+    } else {
       // Ramp only the named channel(s); NAN leaves the others alone. Same
       // "channels" int-or-array form as the instant per-channel setters.
       float starts[4] = {NAN, NAN, NAN, NAN};
       float ends[4] = {NAN, NAN, NAN, NAN};
       for (int i = 0; i < nChannels; i++) {
-        starts[channels[i]] = from;
-        ends[channels[i]] = to;
-        curPhase[channels[i]] = to;
-      }
-      addRampTask(starts, ends, 4, durationMs, TaskType::PWM_PHASE,
-                  TaskMode::EASE, shape);
-      called = true;
-      pushedTask = true;
-    } else if (method == "addCarrierDutyCycleTask" && nChannels > 0) {
-      for (int i = 0; i < nChannels; i++)
-        curCarrier[channels[i]] = constrain(value, 0.0f, 100.0f);
-      addSequenceTask(makeTrajectoryTask(curFreq, curDuty, curPhase, curCarrier));
-      called = true;
-      pushedTask = true;
-    } else if (method == "setDirection") {
-      // value != 0 => CCW, else CW (see PHASES_CW/PHASES_CCW above).
-      const float *phases = (value != 0.0f) ? PHASES_CCW : PHASES_CW;
-      for (int i = 0; i < 4; i++)
-        curPhase[i] = phases[i];
-      addSequenceTask(makeTrajectoryTask(curFreq, curDuty, curPhase, curCarrier));
-      called = true;
-      pushedTask = true;
-    } else if (method == "activateChannels") {
-      // "mask" bit i set => channel i carrier duty = value (clamped); else 0.
-      float onDuty = constrain(value, 0.0f, 100.0f);
+        starts[channels[i]] = from.value;
+        ends[channels[i]] = to.value;
+        st.curPhase[channels[i]] = to.value;
+      }
+      addRampTask(starts, ends, 4, durationMs,
+                  TaskType::PWM_PHASE, m->mode, shape);
+    }
+    break;
+  case Op::DIRECTION: {
+    if (value.param >= 0) {
+      st.error = "setDirection takes no parameter";
+      return;
+    }
+    // value != 0 => CCW, else CW (see PHASES_CW/PHASES_CCW above).
+    const float *phases = (value.value != 0.0f) ? PHASES_CCW : PHASES_CW;
+    if (st.deferred) {
+      task.op = ParamOp::SET;
+      task.type = TaskType::PWM_PHASE;
+      task.channels = 0x0F;
       for (int i = 0; i < 4; i++)
-        curCarrier[i] = ((mask >> i) & 1) ? onDuty : 0.0f;
-      addSequenceTask(makeTrajectoryTask(curFreq, curDuty, curPhase, curCarrier));
-      called = true;
-      pushedTask = true;
-    } else if (method == "label") {
-      const char *labelCStr = obj["value"] | "";
-      currentLabel = String(labelCStr);
-      called = true; // recognized, but pushes nothing; doesn't advance the queue
+        task.a[i] = phases[i];
+      addParamTask(task);
+      break;
     }
-
-    if (pushedTask) {
-      _stepLabels.push_back(currentLabel);
+    for (int i = 0; i < 4; i++)
+      st.curPhase[i] = phases[i];
+    addSequenceTask(makeTrajectoryTask(st.curFreq, st.curDuty, st.curPhase,
+                                       st.curCarrier));
+    break;
+  }
+  case Op::ACTIVATE: {
+    if (st.deferred) {
+      task.op = ParamOp::ACTIVATE;
+      task.a[0] = mask;
+      task.a[1] = value;
+      addParamTask(task);
+      break;
+    }
+    // "mask" bit i set => channel i carrier duty = value (clamped); else 0.
+    float onDuty = constrain(value.value, 0.0f, 100.0f);
+    for (int i = 0; i < 4; i++)
+      st.curCarrier[i] = (((obj["mask"] | 0) >> i) & 1) ? onDuty : 0.0f;
+    addSequenceTask(makeTrajectoryTask(st.curFreq, st.curDuty, st.curPhase,
+                                       st.curCarrier));
+    break;
+  }
+  case Op::LABEL:
+    break; // handled above
+  case Op::REPEAT:
+    st.deferred = true;
+    if (!obj["count"].is<uint32_t>()) {
+      st.error = "repeat needs a literal \"count\"";
+      return;
+    }
+    if (!beginRepeat(obj["count"].as<uint32_t>())) {
+      st.error = "blocks nested too deep";
+      return;
     }
-    if (!called) {
-      unknownMethods.push_back(method);
+    st.blocks[st.depth++] = -1;
+    break;
+  case Op::SUB: {
+    st.deferred = true;
+    LoadState::SubDef def = {};
+    const char *name = obj["name"] | "";
+    if (!*name || strlen(name) >= sizeof(def.name)) {
+      st.error = "sub needs a \"name\" of at most 31 characters";
+      return;
     }
+    strcpy(def.name, name);
+    for (JsonVariantConst p : obj["params"].as<JsonArrayConst>()) {
+      const char *param = p | "";
+      if (def.nParams == PwmSequencer::MAX_PARAMS || !*param ||
+          strlen(param) >= sizeof(def.params[0])) {
+        st.error = "too many \"params\", or a bad name";
+        return;
+      }
+      strcpy(def.params[def.nParams++], param);
+    }
+    if (!beginSubroutine(def.sub)) {
+      st.error = "blocks nested too deep";
+      return;
+    }
+    st.blocks[st.depth++] = (int)st.subs.size();
+    st.subs.push_back(def);
+    break;
   }
-
-  if (!unknownMethods.empty()) {
-    Serial.println("[JsonPwmSequencer] Unknown methods found in schedule:");
-    for (const auto &m : unknownMethods) {
-      Serial.println(m);
+  case Op::END:
+    if (st.depth == 0 || st.depth <= st.includeDepth) {
+      st.error = "\"end\" without an open block";
+      return;
     }
+    if (!endBlock()) {
+      st.error = "block has no tasks";
+      return;
+    }
+    if (st.blocks[--st.depth] >= 0)
+      st.subs[st.blocks[st.depth]].closed = true;
+    break;
+  case Op::CALL: {
+    st.deferred = true;
+    int def = st.findSub(obj["name"] | "");
+    if (def < 0) {
+      Serial.printf("[JsonPwmSequencer] no sub '%s' defined before this "
+                    "call\n",
+                    obj["name"] | "");
+      st.error = "call of an undefined sub";
+      return;
+    }
+    call(def);
+    break;
   }
-
-  compile(resolutionMs, initialFreq, initialDuty, initialPhase);
-  return true;
+  case Op::SWEEP: {
+    // "levels" (carrier %) the outer loop, "masks" the inner; every point
+    // leaves all carriers at 0.
+    const char *tmpl = obj["label"] | "";
+    if (strlen(tmpl) >= 32) {
+      st.error = "sweep \"label\" longer than 31 characters";
+      return;
+    }
+    std::vector<float> levels;
+    std::vector<uint8_t> masks;
+    for (JsonVariantConst v : obj["levels"].as<JsonArrayConst>()) {
+      if (!v.is<float>()) {
+        st.error = "sweep \"levels\" are numbers";
+        return;
+      }
+      levels.push_back(v.as<float>());
+    }
+    for (JsonVariantConst v : obj["masks"].as<JsonArrayConst>()) {
+      if (!v.is<int>() || v.as<int>() < 0 || v.as<int>() > 15) {
+        st.error = "sweep \"masks\" are 0-15";
+        return;
+      }
+      masks.push_back((uint8_t)v.as<int>());
+    }
+    const size_t word = queueWords();
+    const uint32_t dwellMs = obj["dwell_ms"] | 0;
+    const uint32_t restMs = obj["rest_ms"] | 0;
+    if (!addSweep(levels.data(), (int)levels.size(), masks.data(),
+                  (int)masks.size(), dwellMs, restMs)) {
+      st.error = "sweep needs 1-255 \"levels\" and \"masks\"";
+      return;
+    }
+    for (int i = 0; i < 4; i++)
+      st.curCarrier[i] = 0.0f;
+    if (*tmpl) {
+      _sweepLabels.push_back(ScheduleSweepLabel{(uint32_t)(queueSize() - 1),
+                                                (uint32_t)word,
+                                                (uint32_t)_sweepText.size()});
+      _sweepText.insert(_sweepText.end(), tmpl, tmpl + strlen(tmpl) + 1);
+    }
+    break;
+  }
+  case Op::INCLUDE: {
+    st.deferred = true;
+    const char *path = obj["file"] | "";
+    int def = st.findSub(path);
+    if (def < 0) {
+      for (const LoadState::SubDef &sub : st.subs)
+        if (!sub.closed && strcmp(sub.name, path) == 0) {
+          st.error = "include loop";
+          return;
+        }
+      if (st.includes >= MAX_INCLUDE_DEPTH) {
+        st.error = "includes nested too deep";
+        return;
+      }
+      const int includeDepth = st.includeDepth;
+      st.includeDepth = st.depth + 1; // its "end"s can't close our blocks
+      bool ok = includeFile(path, st);
+      st.includeDepth = includeDepth;
+      if (!ok)
+        return;
+      def = st.findSub(path);
+    }
+    call(def);
+    break;
+  }
+  }
+  // One label per record queued (an include's body labelled itself).
+  while (_labelSteps + st.stepOffset < queueSize())
+    pushStepLabel(st.currentLabel);
 }
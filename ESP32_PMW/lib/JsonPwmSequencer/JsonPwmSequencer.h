@@ -1,29 +1,203 @@
 #pragma once
 #include "PwmSequencer.h"
+#include "ScheduleImage.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
 #include <Arduino.h>
+#include <atomic>
 #include <vector>
 
-// Forward declaration for ArduinoJson
+// Forward declarations for ArduinoJson
 class JsonVariant;
+class JsonObjectConst;
+
+// What the last load cost (also printed on every load).
+struct JsonLoadReport {
+  bool ok = false;
+  bool fromFlash = false;     // loadFromPartition(): tasks run from mapped flash
+  uint32_t fileBytes = 0;     // JSON file, or the schedule's block in the image
+  uint32_t entries = 0;       // schedule entries parsed (labels included); flash: tasks
+  uint32_t loadUs = 0;        // open/map .. compile() done
+  uint32_t peakHeapBytes = 0; // largest free-heap drop seen during the load
+};
 
 class JsonPwmSequencer : public PwmSequencer {
 public:
+  // One schedule entry (comments stripped) must fit in this many bytes.
+  static const size_t PARSE_BUFFER_BYTES = 512;
+  // Includes nest this deep; each level holds its own parse buffer on the
+  // stack.
+  static const int MAX_INCLUDE_DEPTH = 3;
+
   JsonPwmSequencer(PwmController *phaseCtrl);
+  ~JsonPwmSequencer();
 
   /**
    * @brief Load and compile a JSON schedule from SPIFFS. Full schema: README.md.
    *        Object {resolution_ms, initial_freq, initial_duty, direction,
-   *        schedule:[...]}; a bare array is the schedule with defaults
+   *        gain_schedule:[...], schedule:[...]}; a bare array is the schedule with defaults
    *        (resolution_ms 25, initial_freq 0 = DC, initial_duty {50,50,50,50},
-   *        direction CCW).
-   * @return False if the file can't be opened or parsed.
+   *        direction CCW). The file is streamed: schedule entries are parsed
+   *        one at a time through a PARSE_BUFFER_BYTES buffer straight into
+   *        queue tasks, so memory does not grow with file size beyond the
+   *        queue itself. "repeat", "sub"/"call" and "include" entries become
+   *        control records that run() follows, and a "sweep" one record
+   *        that run() expands as it goes; nothing is unrolled.
+   * @return False if the file can't be opened or parsed, or its blocks and
+   *         calls don't add up (nothing is queued).
    */
   bool loadFromJsonFile(const char *filename);
 
+  /**
+   * @brief Load `filename`'s precompiled form from the schedule image in data
+   *        partition `partitionLabel` (see tools/compile_schedules.py). The
+   *        partition is memory-mapped and the tasks run straight from flash:
+   *        no JSON parse and no heap copy of the queue (compile() still builds
+   *        its ramp tables in RAM). Refused, so the caller can fall back to
+   *        loadFromJsonFile(), if the image is missing, corrupt, lacks this
+   *        schedule, or was compiled from a JSON file of a different size
+   *        than the one on SPIFFS.
+   * @param filename SPIFFS path the image was compiled from, e.g. "/tilt.json".
+   */
+  bool loadFromPartition(const char *filename,
+                         const char *partitionLabel = "schedules");
+
+  const JsonLoadReport &lastLoad() const { return _lastLoad; }
+
+  /** @brief PwmSequencer::start(), then hand the schedule's "gain_schedule"
+   *  (if it had one) to PwmController::setBalanceGainSchedule. Without it the
+   *  controller's table is left as it is. */
+  void start();
+  /** @brief The last loaded "gain_schedule"; false if no load had one. */
+  bool gainSchedule(BalanceGainSchedule &out) const;
+
+  // When a loadNext() schedule takes over.
+  enum class SwapAt : uint8_t {
+    STEP, // as soon as a task ends (a sweep's on/dwell/off/rest steps count)
+    END   // once the running schedule is done
+  };
+  // Where loadNext() is.
+  enum class NextState : uint8_t { NONE, LOADING, READY, FAILED };
+
+  /**
+   * @brief Load and compile `filename` into a standby sequencer while this
+   *        one keeps running: flash image first, else the JSON, on a
+   *        background task on the other core. Once it is READY, run() hands
+   *        over to it at `when`, between two of its own tasks. The new
+   *        schedule starts from the frequency, duty and carriers the old
+   *        one left, not from its own initial_* keys, so the coils stay
+   *        energized. Its phases ("direction", "initial_phase") do apply:
+   *        the ones that differ are pushed at the swap. From then on
+   *        labels, lastLoad() and seeks are the new schedule's. Both
+   *        schedules are in RAM until the swap.
+   * @return False if a load is still in progress, the path is longer than
+   *         31 characters, or the task can't start.
+   */
+  bool loadNext(const char *filename, SwapAt when = SwapAt::END);
+  NextState nextState() const { return (NextState)_nextState.load(); }
+  /** @brief Drop a READY or FAILED standby schedule.
+   *  @return False while it is still LOADING (it can't be stopped). */
+  bool cancelNext();
+  /** @brief Schedules run() has swapped in so far. */
+  uint32_t swapCount() const { return _swaps; }
+
+  /** @brief PwmSequencer::run(), plus the loadNext() hand-over when it is
+   *  due: the new schedule's first steps run in the same call. */
+  void run();
+
+  // labelIdForStep() for a step without a label (or out of range).
+  static const uint16_t NO_LABEL = 0xFFFF;
+
   /** @brief Telemetry label for queue step `i`, or "" if none / out of range.
-   *  Callers poll labelForStep(currentIndex()) each loop() and print on change. */
+   *  Same as labelName(labelIdForStep(i)); allocates nothing. */
   const char *labelForStep(size_t i) const;
+  /** @brief Interned label ID of queue step `i` (0..labelCount()-1), or
+   *  NO_LABEL. Callers poll labelIdForStep(currentIndex()) each loop() and
+   *  compare IDs to spot a change; O(1) while the step only moves forward. */
+  uint16_t labelIdForStep(size_t i) const;
+  /** @brief Label ID of what runs now: labelIdForStep(currentIndex()), or
+   *  inside a sweep with a "label" template, its current point's. What
+   *  telemetry reports. */
+  uint16_t currentLabelId() const;
+  /** @brief Distinct labels in the loaded schedule(s), in first-use order,
+   *  then one per point of each labelled sweep, sweep by sweep. */
+  size_t labelCount() const;
+  /** @brief Name of label `id`, or "" for NO_LABEL / out of range. Telemetry
+   *  can print this table once and the IDs after that. A sweep point's name
+   *  is generated into a buffer the next call reuses. */
+  const char *labelName(uint16_t id) const;
+  /** @brief Label ID named `name` (case-insensitive, so it survives the
+   *  lowercased serial commands), or NO_LABEL. */
+  uint16_t findLabel(const char *name) const;
+
+  /** @brief seekToStep() to the first step tagged `name` (findLabel()), or
+   *  to the sweep point it names.
+   *  @return False (nothing changes) if no step has that label. */
+  bool seekToLabel(const char *name);
 
 private:
-  std::vector<String> _stepLabels;
+  struct LoadState; // running per-load state, JsonPwmSequencer.cpp
+
+  void applyEntry(const JsonObjectConst &obj, LoadState &st);
+  // Stream schedule file `path` into a subroutine named after it.
+  bool includeFile(const char *path, LoadState &st);
+  // Map the image partition (once) and check its header; null on failure.
+  const uint8_t *mapImage(const char *partitionLabel);
+  void dropFlashSchedule();
+  // Intern `name` into the label table; NO_LABEL for "" (or a full table).
+  uint16_t internLabel(const char *name);
+  // Tag the next queue step with label `id`.
+  void pushStepLabel(uint16_t id);
+  // Forget the step labels from step `steps` on, and labels from `names` on.
+  void truncateLabels(size_t steps, size_t names);
+  void clearLabels();
+  // Labels before the sweep points' (interned, or the image's table).
+  size_t namedLabels() const;
+  const ScheduleSweepLabel *sweepLabels(size_t &n) const;
+  // The labelled sweep label `id` names, and which of its points; null if
+  // `id` is not a sweep point's.
+  const ScheduleSweepLabel *sweepLabelFor(uint16_t id, uint32_t &point) const;
+  // loadNext()'s background task: loads _nextPath into _next.
+  static void nextLoaderMain(void *arg);
+  // Hand over to the READY _next, then free the old schedule.
+  void swapToNext();
+  // Push _gainSchedule to the controller, if a load had one.
+  void applyGainSchedule();
+
+  // Labels of queued steps. Names are interned once, NUL-terminated, into
+  // one contiguous block (_labelText at _labelOffsets[id]). Steps are stored
+  // as runs: _labelRuns[r] labels steps firstStep up to the next run's
+  // firstStep (the last one up to _labelSteps).
+  struct LabelRun {
+    uint32_t firstStep;
+    uint16_t id;
+  };
+  std::vector<char> _labelText;
+  std::vector<uint32_t> _labelOffsets;
+  std::vector<LabelRun> _labelRuns;
+  std::vector<uint32_t> _labelFirstStep; // per ID, for seekToLabel()
+  size_t _labelSteps = 0;
+  mutable size_t _labelHint = 0; // run of the last lookup
+  // Sweeps with a "label" template, in queue order (templates in
+  // _sweepText). Nothing per point: names are made up when asked for.
+  std::vector<ScheduleSweepLabel> _sweepLabels;
+  std::vector<char> _sweepText;
+  mutable char _sweepLabelBuf[48];
+  JsonLoadReport _lastLoad;
+  BalanceGainSchedule _gainSchedule;
+  bool _hasGainSchedule = false;
+
+  // Mapped schedule image; labels come from here while a flash schedule runs.
+  const esp_partition_t *_imagePart = nullptr;
+  const uint8_t *_image = nullptr;
+  spi_flash_mmap_handle_t _imageMap = 0;
+  const ScheduleHeader *_flashSchedule = nullptr;
+
+  // Standby schedule (loadNext()). Only the loader task touches _next until
+  // _nextState says READY or FAILED; from then on only this one does.
+  JsonPwmSequencer *_next = nullptr;
+  char _nextPath[32] = "";
+  SwapAt _nextWhen = SwapAt::END;
+  std::atomic<uint8_t> _nextState{(uint8_t)NextState::NONE};
+  uint32_t _swaps = 0;
 };
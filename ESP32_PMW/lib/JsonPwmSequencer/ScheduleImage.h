@@ -0,0 +1,90 @@
+#pragma once
+#include "PwmSequencer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Compiled schedule image, as written by tools/compile_schedules.py and
+// flashed to the "schedules" data partition (partitions.csv).
+// JsonPwmSequencer::loadFromPartition() maps it and runs the tasks in place,
+// so every struct below is the exact on-flash layout: little-endian, offsets
+// from the start of the image, task records 4-byte aligned. The compiler packs
+// the same layout by hand; the static_asserts catch drift between the two.
+//
+//   ScheduleImageHeader
+//   ScheduleDirEntry[scheduleCount]
+//   per schedule: ScheduleHeader, then its data block:
+//     uint32_t[taskWords]          (tasksOffset; the queue's task records,
+//                                   PwmSequencer::TASK_ENCODING)
+//     uint16_t[taskCount]          (labelIdxOffset; label per task, NO_LABEL = none)
+//     uint32_t[labelCount]         (labelsOffset; image offset of each label)
+//     ScheduleSweepLabel[sweepLabelCount] (sweepLabelsOffset)
+//     BalanceGainPoint[gainPointCount]    (gainPointsOffset; "gain_schedule")
+//     ScheduleInclude[includeCount]       (includesOffset; files it includes)
+//     NUL-terminated label strings, the sweep label templates, then the
+//     include paths
+
+static const uint32_t SCHEDULE_IMAGE_MAGIC = 0x31515350UL; // "PSQ1"
+static const uint16_t SCHEDULE_IMAGE_VERSION = 5;
+// Data partition subtype for the image (custom range 0x40-0xFE).
+static const uint8_t SCHEDULE_PARTITION_SUBTYPE = 0x40;
+
+struct ScheduleImageHeader {
+  uint32_t magic;         // SCHEDULE_IMAGE_MAGIC
+  uint16_t version;       // SCHEDULE_IMAGE_VERSION
+  uint16_t taskEncoding;  // PwmSequencer::TASK_ENCODING of the records
+  uint32_t scheduleCount; // directory entries after this header
+  uint32_t imageBytes;    // whole image, this header included
+};
+
+struct ScheduleDirEntry {
+  char name[32];   // SPIFFS path of the source, e.g. "/tilt.json"
+  uint32_t offset; // of its ScheduleHeader
+  uint32_t reserved;
+};
+
+struct ScheduleHeader {
+  uint32_t taskCount;
+  uint32_t taskWords; // record words at tasksOffset
+  uint32_t resolutionMs;
+  float initialFreq;
+  float initialDuty[4];
+  float initialPhase[4];
+  uint32_t tasksOffset;
+  uint32_t labelIdxOffset;
+  uint32_t labelsOffset;
+  uint32_t labelCount;
+  uint32_t sweepLabelsOffset;
+  uint32_t sweepLabelCount;
+  uint32_t gainPointsOffset;
+  uint32_t gainPointCount; // NO_GAIN_SCHEDULE: the JSON has no "gain_schedule"
+  uint32_t includesOffset;
+  uint32_t includeCount;
+  uint32_t dataBytes;   // tasks through the last string
+  uint32_t dataCrc32;   // CRC-32 (zlib) of those dataBytes
+  uint32_t sourceCrc32; // CRC-32 of the JSON it was compiled from (staleness check)
+
+  static const uint16_t NO_LABEL = 0xFFFF;
+  static const uint32_t NO_GAIN_SCHEDULE = 0xFFFFFFFFUL;
+};
+
+// A sweep (PwmSequencer::addSweep()) whose points get generated labels; see
+// JsonPwmSequencer::labelName(). The JSON loader keeps the same records.
+struct ScheduleSweepLabel {
+  uint32_t step; // queue index of the sweep's record
+  uint32_t word; // where that record starts
+  uint32_t text; // its label template (JSON loader: offset into its own text)
+};
+
+// A file the schedule includes, at any depth, each once: what it was
+// compiled from, for the same staleness check as ScheduleHeader::sourceCrc32.
+struct ScheduleInclude {
+  uint32_t path;  // image offset of its SPIFFS path, e.g. "/coil_pulse.json"
+  uint32_t crc32; // CRC-32 (zlib) of the file's bytes
+};
+
+static_assert(sizeof(ScheduleImageHeader) == 16, "schedule image layout");
+static_assert(sizeof(ScheduleDirEntry) == 40, "schedule image layout");
+static_assert(sizeof(ScheduleHeader) == 100, "schedule image layout");
+static_assert(sizeof(BalanceGainPoint) == 16, "schedule image layout");
+static_assert(sizeof(ScheduleSweepLabel) == 12, "schedule image layout");
+static_assert(sizeof(ScheduleInclude) == 8, "schedule image layout");
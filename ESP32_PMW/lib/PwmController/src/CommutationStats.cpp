@@ -0,0 +1,51 @@
+#include "CommutationStats.h"
+
+void CycleHistogram::reset() {
+  for (int i = 0; i < BINS; i++)
+    _bins[i] = 0;
+  _count = 0;
+  _min = 0xFFFFFFFFUL;
+  _max = 0;
+}
+
+void IRAM_ATTR CycleHistogram::add(uint32_t cycles) {
+  int bin;
+  if (cycles < 4) {
+    bin = (int)cycles;
+  } else {
+    // msb >= 2; the two bits below it pick the sub-bin. __builtin_clz is one
+    // NSAU instruction on Xtensa, so this stays IRAM-safe.
+    int msb = 31 - __builtin_clz(cycles);
+    bin = 4 * (msb - 1) + (int)((cycles >> (msb - 2)) & 3UL);
+  }
+  _bins[bin]++;
+  _count++;
+  if (cycles < _min)
+    _min = cycles;
+  if (cycles > _max)
+    _max = cycles;
+}
+
+uint32_t CycleHistogram::binLower(int bin) {
+  if (bin < 4)
+    return (uint32_t)bin;
+  int msb = bin / 4 + 1;
+  return (uint32_t)(4 + bin % 4) << (msb - 2);
+}
+
+uint32_t CycleHistogram::percentile(float p) const {
+  if (_count == 0)
+    return 0;
+  uint32_t rank = (uint32_t)ceilf(p * (float)_count);
+  if (rank < 1)
+    rank = 1;
+  uint32_t seen = 0;
+  for (int i = 0; i < BINS; i++) {
+    seen += _bins[i];
+    if (seen >= rank) {
+      uint32_t upper = (i + 1 < BINS) ? binLower(i + 1) - 1 : 0xFFFFFFFFUL;
+      return upper < _max ? upper : _max;
+    }
+  }
+  return _max;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Always-on commutation timing instrumentation (see PwmController::
+// commutationStats). Everything is recorded in CPU cycles (CCOUNT) on the core
+// the commutation callback runs on, so recording is a few dozen cycles: no
+// floats, no division, no locks beyond the one the tick already holds.
+
+// Log-linear histogram over the full uint32 range: exact below 8 cycles, then
+// 4 sub-bins per power of two (<= 12.5% relative bin width), 124 bins total.
+class CycleHistogram {
+public:
+  static const int BINS = 124;
+
+  CycleHistogram() { reset(); }
+  void reset();
+  void IRAM_ATTR add(uint32_t cycles);
+
+  uint32_t count() const { return _count; }
+  uint32_t min() const { return _count ? _min : 0; }
+  uint32_t max() const { return _max; }
+  // Upper edge of the bin holding the p-quantile (0..1), clamped to max(); a
+  // conservative estimate, never below the true quantile.
+  uint32_t percentile(float p) const;
+
+  uint32_t binCount(int bin) const { return _bins[bin]; }
+  static uint32_t binLower(int bin);
+
+private:
+  uint32_t _bins[BINS];
+  uint32_t _count;
+  uint32_t _min;
+  uint32_t _max;
+};
+
+struct CommutationStats {
+  static const int MAX_CHANNELS = 4;
+
+  // How late each tick fired against its scheduled time.
+  CycleHistogram dispatchLatency;
+  // Tick entry to exit (lookup + GPIO writes + the recording itself).
+  CycleHistogram callbackDuration;
+  // Per channel: how far after its ideal PhaseParams startUs/endUs each real
+  // coil edge was written. Bounded below by the tick quantization.
+  CycleHistogram edgeError[MAX_CHANNELS];
+
+  void reset() {
+    dispatchLatency.reset();
+    callbackDuration.reset();
+    for (int i = 0; i < MAX_CHANNELS; i++)
+      edgeError[i].reset();
+  }
+};
+
+// Fixed-rate control task (PwmController::enableCurrentBalance with a rate):
+// same histograms, CPU cycles on the control core.
+struct ControlLoopStats {
+  // Entry-to-entry interval; a steady loop sits in one or two bins at the
+  // configured period.
+  CycleHistogram interval;
+  // One iteration: ADC sampling + overcurrent latch + PI step + LEDC writes.
+  CycleHistogram busy;
+  uint32_t overruns = 0; // iterations that took longer than one period
+  uint32_t missed = 0;   // timer ticks dropped while an iteration was still running
+
+  void reset() {
+    interval.reset();
+    busy.reset();
+    overruns = 0;
+    missed = 0;
+  }
+};
@@ -5,12 +5,12 @@ static inline float clampf(float v, float lo, float hi) {
   return v < lo ? lo : (v > hi ? hi : v);
 }
 
-CurrentBalanceController::CurrentBalanceController(const BalanceConfig &cfg)
+CurrentBalanceFloat::CurrentBalanceFloat(const BalanceConfig &cfg)
     : _cfg(cfg) {
   reset(cfg.dutyMin);
 }
 
-void CurrentBalanceController::reset(float startDuty) {
+void CurrentBalanceFloat::reset(float startDuty) {
   _idxMin = 0;
   _holdFrozen = false;
   _holdTarget = 0.0f;
@@ -18,10 +18,17 @@ void CurrentBalanceController::reset(float startDuty) {
     _integrator[i] = startDuty;
     _dutyOut[i] = startDuty;
     _lastErr[i] = 0.0f;
+    _lastDeriv[i] = 0.0f;
   }
 }
 
-void CurrentBalanceController::step(const float *iMeas, float dtMs,
+void CurrentBalanceFloat::retuneGains(float kp, float ki, float kd) {
+  for (int i = 0; i < N; i++)
+    _integrator[i] += (_cfg.kp - kp) * _lastErr[i] + (_cfg.kd - kd) * _lastDeriv[i];
+  setGains(kp, ki, kd);
+}
+
+void CurrentBalanceFloat::step(const float *iMeas, float dtMs,
                                     const float *ceiling, float *dutyOut) {
   const float rateScale = dtMs / _cfg.nominalTickMs;
 
@@ -135,6 +142,7 @@ void CurrentBalanceController::step(const float *iMeas, float dtMs,
       duty = clampf(_dutyOut[i] + _cfg.minRampPctPerMs * dtMs, lo, hi);
       _integrator[i] = duty; // continuity for when it later falls back to PI
       _lastErr[i] = 0.0f;    // keep the derivative fresh for the handoff
+      _lastDeriv[i] = 0.0f;
     } else {
       // PI(+D) toward this channel's ratio-scaled share of the hold level, with
       // directional anti-windup: freeze the integrator only when the error
@@ -145,6 +153,7 @@ void CurrentBalanceController::step(const float *iMeas, float dtMs,
       const float derivative =
           (rateScale > 0.0f) ? (err - _lastErr[i]) / rateScale : 0.0f;
       _lastErr[i] = err;
+      _lastDeriv[i] = derivative;
       const float candidate = _integrator[i] + _cfg.kp * err + _cfg.kd * derivative;
       duty = clampf(candidate, lo, hi);
       const bool pushingIntoHighSat = (candidate > hi) && (err > 0.0f);
@@ -157,3 +166,40 @@ void CurrentBalanceController::step(const float *iMeas, float dtMs,
     _dutyOut[i] = duty;
   }
 }
+
+bool BalanceGainSchedule::set(const BalanceGainPoint *points, int n) {
+  if (n < 0 || n > MAX_POINTS || (n > 0 && !points))
+    return false;
+  for (int k = 0; k < n; k++) {
+    const BalanceGainPoint &p = points[k];
+    if (!isfinite(p.freqHz) || !isfinite(p.kp) || !isfinite(p.ki) ||
+        !isfinite(p.kd) || p.freqHz < 0.0f || p.kp < 0.0f || p.ki < 0.0f ||
+        p.kd < 0.0f || (k > 0 && p.freqHz <= points[k - 1].freqHz))
+      return false;
+  }
+  for (int k = 0; k < n; k++)
+    _points[k] = points[k];
+  _n = n;
+  return true;
+}
+
+void BalanceGainSchedule::at(float freqHz, float &kp, float &ki,
+                             float &kd) const {
+  if (_n == 0)
+    return;
+  int k = 1;
+  while (k < _n && _points[k].freqHz < freqHz)
+    k++;
+  if (k == _n || freqHz <= _points[0].freqHz) {
+    const BalanceGainPoint &p = _points[k == _n ? _n - 1 : 0];
+    kp = p.kp;
+    ki = p.ki;
+    kd = p.kd;
+    return;
+  }
+  const BalanceGainPoint &a = _points[k - 1], &b = _points[k];
+  const float t = (freqHz - a.freqHz) / (b.freqHz - a.freqHz);
+  kp = a.kp + t * (b.kp - a.kp);
+  ki = a.ki + t * (b.ki - a.ki);
+  kd = a.kd + t * (b.kd - a.kd);
+}
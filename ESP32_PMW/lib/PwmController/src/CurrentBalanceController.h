@@ -1,6 +1,7 @@
 #pragma once
 
-#include <Arduino.h>
+#include <math.h>
+#include <stdint.h>
 
 // Onboard current-balance PI controller; every experiment firmware shares this
 // one tuned loop.
@@ -18,6 +19,10 @@
 //     regulated, no per-channel hand trims.
 // NAN ceiling => channel parked off (duty 0), excluded from the argmin (matches
 // how the JSON sequencer leaves untouched channels NAN).
+//
+// Two implementations of the same law: CurrentBalanceFloat (the original) and
+// CurrentBalanceFixed (Q16 integer, see below). CurrentBalanceController is
+// the float one unless the build sets -D BALANCE_FIXED_POINT=1.
 
 struct BalanceConfig {
   // Converged tuning (KP=2.2, KI=0.10, KD=0.15); runtime-tunable via setters.
@@ -53,11 +58,38 @@ struct BalanceConfig {
   float refBandPct = 0.5f;
 };
 
-class CurrentBalanceController {
+// Gains at one drive frequency; see BalanceGainSchedule.
+struct BalanceGainPoint {
+  float freqHz;
+  float kp, ki, kd;
+};
+
+// Gains keyed by drive frequency (PwmController::setBalanceGainSchedule). The
+// coil impedance changes a lot between a few Hz, resonance and 500 Hz, and a
+// single triple has to be tuned for the worst of them. at() interpolates
+// linearly between the points and holds the end points' gains outside them;
+// DC (0 Hz) gets the first point's.
+class BalanceGainSchedule {
+public:
+  static const int MAX_POINTS = 8;
+
+  // Frequencies strictly ascending, gains finite and >= 0, n <= MAX_POINTS;
+  // n = 0 empties it. False (unchanged) otherwise.
+  bool set(const BalanceGainPoint *points, int n);
+  int size() const { return _n; }
+  const BalanceGainPoint *points() const { return _points; }
+  void at(float freqHz, float &kp, float &ki, float &kd) const;
+
+private:
+  BalanceGainPoint _points[MAX_POINTS];
+  int _n = 0;
+};
+
+class CurrentBalanceFloat {
 public:
   static const int N = 4;
 
-  explicit CurrentBalanceController(const BalanceConfig &cfg = BalanceConfig());
+  explicit CurrentBalanceFloat(const BalanceConfig &cfg = BalanceConfig());
 
   // Reset integrator/duty/error state; call before a run with the duty every
   // channel starts equal at (e.g. 50%).
@@ -77,6 +109,10 @@ public:
     _cfg.ki = ki;
     _cfg.kd = kd;
   }
+  // setGains, bumpless: the change in the P and D terms at the last step's
+  // error is moved into each PI channel's integrator, so the duty doesn't
+  // step (gain scheduling calls this every step while the frequency moves).
+  void retuneGains(float kp, float ki, float kd);
   void setRamp(float pctPerMs) { _cfg.minRampPctPerMs = pctPerMs; }
   const BalanceConfig &config() const { return _cfg; }
   int latchedMinIndex() const { return _idxMin; }
@@ -88,6 +124,7 @@ private:
   float _integrator[N];
   float _dutyOut[N];
   float _lastErr[N];
+  float _lastDeriv[N]; // derivative the last PI step used (0 after a ramp)
   int _idxMin; // latched; persists across ticks, see minSwitchMarginA
   // Freeze-at-end-of-spin-up: latched true the first tick a follower (ratio < 1,
   // a tilt step) appears. _holdTarget = balanced current captured then, held
@@ -95,3 +132,81 @@ private:
   bool _holdFrozen;
   float _holdTarget;
 };
+
+// The same law in Q16 fixed point (currents in 1/65536 A, duties in 1/65536 %,
+// gains Q24), with no data-dependent control flow in the source: every channel
+// evaluates the overcurrent, ramp and PI branches and selects one, the argmin
+// runs over all four channels whatever their state, the kd divide runs even on
+// a zero dt, and there is no early return. That narrows the spread across
+// branch mixes but doesn't make the cost constant (the compiler still emits
+// branches for the clamps and selects, and divide latency depends on the
+// operands), and it is slower than the float law in the worst case: on the
+// host its worst mix is about 2.5x the float one's. Only the spread is
+// narrower; main_balance_bench prints both worst cases for the target. The
+// float API is kept; floats are converted once at entry and exit, and the
+// only divisions are one float divide per step (kd / rateScale) and two
+// 32-bit integer divides per channel (the ratio and its inverse).
+//
+// Differences from CurrentBalanceFloat, all outside the rig's operating range:
+// ceilings are resolved to 1/256 % for the ratios and saturate at 128 %;
+// currents saturate at +-32767 A; the integrator saturates at
+// +-INTEGRATOR_LIMIT % (the float one winds down without bound under a long
+// overcurrent); kd / rateScale saturates at 128 (a dt under ~0.002 ms);
+// a negative ceiling counts as 0. Otherwise the duties stay within
+// DUTY_TOLERANCE (one 10-bit LEDC step) of the float version's, and almost
+// always within 0.01 %: the larger deviations are single steps where the PI
+// candidate lands on a clamp and the two disagree on the anti-windup freeze.
+// Checked by tools/balance_bench_host.cpp on the recorded PicoScope traces
+// and by main_balance_bench on target.
+class CurrentBalanceFixed {
+public:
+  static const int N = 4;
+  static constexpr float INTEGRATOR_LIMIT = 16384.0f;      // duty %
+  static constexpr float DUTY_TOLERANCE = 100.0f / 1024.0f; // duty %, vs float
+
+  explicit CurrentBalanceFixed(const BalanceConfig &cfg = BalanceConfig());
+
+  void reset(float startDuty);
+  void step(const float *iMeas, float dtMs, const float *ceiling,
+            float *dutyOut);
+
+  void setGains(float kp, float ki, float kd) {
+    _cfg.kp = kp;
+    _cfg.ki = ki;
+    _cfg.kd = kd;
+    _quantize();
+  }
+  void retuneGains(float kp, float ki, float kd);
+  void setRamp(float pctPerMs) { _cfg.minRampPctPerMs = pctPerMs; }
+  const BalanceConfig &config() const { return _cfg; }
+  int latchedMinIndex() const { return _idxMin; }
+  bool holdFrozen() const { return _holdFrozen; }
+  float holdTarget() const { return (float)_holdTarget * (1.0f / 65536.0f); }
+
+private:
+  // Config fields in Q form; redone by the constructor and setGains.
+  void _quantize();
+
+  BalanceConfig _cfg;
+  int32_t _kp;                      // Q24 (ki and kd are scaled by dt per step)
+  int32_t _dutyMin, _dutyMax;       // Q16 %
+  int32_t _iMax, _backoff;          // Q16 A / %
+  int32_t _margin, _minSignal;      // Q16 A
+  int32_t _refBand;                 // Q8 %, same scale as the ratio ceilings
+  float _invNominalTickMs;
+
+  int32_t _integrator[N];           // Q16 %
+  int32_t _dutyOut[N];              // Q16 %
+  int32_t _lastErr[N];              // Q16 A
+  int32_t _lastDErr[N];             // Q16 A, error change the last PI step saw
+  float _lastRateScale;             // that step's dt / nominalTickMs
+  int _idxMin;
+  bool _holdFrozen;
+  int32_t _holdTarget;              // Q16 A
+};
+
+#if BALANCE_FIXED_POINT
+using CurrentBalanceController = CurrentBalanceFixed;
+#else
+using CurrentBalanceController = CurrentBalanceFloat;
+#endif
@@ -0,0 +1,184 @@
+#include "CurrentBalanceController.h"
+
+namespace {
+const float Q8 = 256.0f;
+const float Q16 = 65536.0f;
+const float Q24 = 16777216.0f;
+const int32_t NRM_INF = INT32_MAX; // a channel with no ratio (float: INFINITY)
+const float NO_CEILING[CurrentBalanceFixed::N] = {NAN, NAN, NAN, NAN};
+
+// Saturating, rounding float -> Q conversion (NAN -> 0). limit is in the
+// float's own units.
+inline int32_t toQ(float v, float scale, float limit) {
+  v = v == v ? v : 0.0f;
+  v = v > limit ? limit : (v < -limit ? -limit : v);
+  v *= scale;
+  return (int32_t)(v + (v < 0.0f ? -0.5f : 0.5f));
+}
+
+inline int32_t sat32(int64_t v) {
+  return v > INT32_MAX ? INT32_MAX : (v < INT32_MIN ? INT32_MIN : (int32_t)v);
+}
+
+inline int32_t clampq(int64_t v, int32_t lo, int32_t hi) {
+  return v < lo ? lo : (v > hi ? hi : (int32_t)v);
+}
+
+// a * b in Q(s), rounded.
+inline int64_t mulq(int32_t a, int32_t b, int s) {
+  return ((int64_t)a * b + (1LL << (s - 1))) >> s;
+}
+
+// Rounded unsigned divide; both operands fit in 31 bits.
+inline uint32_t divq(uint32_t num, uint32_t den) {
+  return (num + den / 2) / den;
+}
+} // namespace
+
+CurrentBalanceFixed::CurrentBalanceFixed(const BalanceConfig &cfg) : _cfg(cfg) {
+  _quantize();
+  reset(cfg.dutyMin);
+}
+
+void CurrentBalanceFixed::_quantize() {
+  _kp = toQ(_cfg.kp, Q24, 127.0f);
+  _dutyMin = toQ(_cfg.dutyMin, Q16, 32767.0f);
+  _dutyMax = toQ(_cfg.dutyMax, Q16, 32767.0f);
+  _iMax = toQ(_cfg.iMax, Q16, 32767.0f);
+  _backoff = toQ(_cfg.overcurrentBackoffPct, Q16, 32767.0f);
+  _margin = toQ(_cfg.minSwitchMarginA, Q16, 32767.0f);
+  _minSignal = toQ(_cfg.minSignalA, Q16, 32767.0f);
+  _refBand = toQ(_cfg.refBandPct, Q8, 127.0f);
+  _invNominalTickMs = _cfg.nominalTickMs > 0.0f ? 1.0f / _cfg.nominalTickMs : 0.0f;
+}
+
+void CurrentBalanceFixed::reset(float startDuty) {
+  _idxMin = 0;
+  _holdFrozen = false;
+  _holdTarget = 0;
+  const int32_t d = toQ(startDuty, Q16, 32767.0f);
+  for (int i = 0; i < N; i++) {
+    _integrator[i] = d;
+    _dutyOut[i] = d;
+    _lastErr[i] = 0;
+    _lastDErr[i] = 0;
+  }
+  _lastRateScale = 1.0f;
+}
+
+// Same compensation as CurrentBalanceFloat::retuneGains, worked in float (it
+// runs only when the gains move) and saturated back into the integrator.
+void CurrentBalanceFixed::retuneGains(float kp, float ki, float kd) {
+  const float dkd = _lastRateScale > 0.0f ? (_cfg.kd - kd) / _lastRateScale : 0.0f;
+  for (int i = 0; i < N; i++) {
+    const float shift = (_cfg.kp - kp) * (float)_lastErr[i] + dkd * (float)_lastDErr[i];
+    const float integ = (float)_integrator[i] * (1.0f / Q16) + shift * (1.0f / Q16);
+    _integrator[i] = toQ(integ, Q16, INTEGRATOR_LIMIT);
+  }
+  setGains(kp, ki, kd);
+}
+
+// CurrentBalanceFloat::step's law, step for step (see the comments there);
+// only the evaluation order differs.
+void CurrentBalanceFixed::step(const float *iMeas, float dtMs,
+                               const float *ceiling, float *dutyOut) {
+  const int32_t integratorLimit = toQ(INTEGRATOR_LIMIT, Q16, INTEGRATOR_LIMIT);
+  const float rateScale = dtMs * _invNominalTickMs;
+  const int32_t kiRate = toQ(_cfg.ki * rateScale, Q24, 127.0f);
+  // Divides even on a zero dt (by 1, result dropped): same work every step.
+  const bool rated = rateScale > 0.0f;
+  const int32_t kdQ = toQ(_cfg.kd / (rated ? rateScale : 1.0f), Q24, 127.0f);
+  const int32_t kdRate = rated ? kdQ : 0;
+  const int32_t rampStep = toQ(_cfg.minRampPctPerMs * dtMs, Q16, 32767.0f);
+  const float *c = ceiling ? ceiling : NO_CEILING;
+
+  // Inputs, active set and the largest commanded carrier.
+  bool active[N];
+  int32_t ceil8[N], ceil16[N], iq[N];
+  int32_t maxCeil8 = 0;
+  for (int i = 0; i < N; i++) {
+    active[i] = c[i] == c[i];
+    const float ce = active[i] && c[i] > 0.0f ? c[i] : 0.0f;
+    ceil8[i] = toQ(ce, Q8, 127.99f);
+    ceil16[i] = toQ(ce, Q16, 32767.0f);
+    iq[i] = toQ(iMeas[i], Q16, 32767.0f);
+    maxCeil8 = ceil8[i] > maxCeil8 ? ceil8[i] : maxCeil8;
+  }
+  const bool anyActive = maxCeil8 > 0;
+
+  // Ratios (Q16) and ratio-normalized currents.
+  int32_t ratio[N], nrm[N];
+  bool isRef[N];
+  bool hasFollower = false;
+  for (int i = 0; i < N; i++) {
+    ratio[i] = (int32_t)divq((uint32_t)ceil8[i] << 16, anyActive ? maxCeil8 : 1);
+    const uint32_t inv = divq((uint32_t)maxCeil8 << 16, ceil8[i] ? ceil8[i] : 1);
+    nrm[i] = active[i] && ceil8[i] > 0 ? sat32(mulq(iq[i], (int32_t)inv, 16)) : NRM_INF;
+    isRef[i] = active[i] && ceil8[i] >= maxCeil8 - _refBand;
+    hasFollower = hasFollower || (active[i] && !isRef[i]);
+  }
+
+  // Anchor: argmin over the reference channels, else over the active ones,
+  // latched with the switch margin.
+  int64_t refVal = INT64_MAX, actVal = INT64_MAX;
+  int refMin = 0, actMin = 0;
+  for (int i = 0; i < N; i++) {
+    const bool r = isRef[i] && nrm[i] < refVal;
+    refMin = r ? i : refMin;
+    refVal = r ? nrm[i] : refVal;
+    const bool a = active[i] && nrm[i] < actVal;
+    actMin = a ? i : actMin;
+    actVal = a ? nrm[i] : actVal;
+  }
+  const int trueIdxMin = refVal != INT64_MAX ? refMin : actMin;
+  int idxMin = active[_idxMin] && isRef[_idxMin] ? _idxMin : trueIdxMin;
+  idxMin = nrm[trueIdxMin] < (int64_t)nrm[idxMin] - _margin ? trueIdxMin : idxMin;
+  const int32_t magnitude = nrm[idxMin];
+
+  const bool holdFrozen = _holdFrozen || hasFollower;
+  const int32_t holdTarget = _holdFrozen || !hasFollower ? _holdTarget : magnitude;
+  const int32_t mag = holdFrozen ? holdTarget : magnitude;
+  const bool coRamp = !holdFrozen && magnitude < _minSignal;
+
+  for (int i = 0; i < N; i++) {
+    const int32_t hi = clampq(ceil16[i], 0, _dutyMax);
+    const int32_t lo = hi < _dutyMin ? hi : _dutyMin;
+    const int32_t integ = _integrator[i];
+
+    // Overcurrent backoff.
+    const int32_t intOver = clampq((int64_t)integ - _backoff, -integratorLimit, integratorLimit);
+    const int32_t dutyOver = clampq(intOver, lo, hi);
+
+    // Anchor / co-ramp toward the ceiling.
+    const int32_t dutyRamp = clampq((int64_t)_dutyOut[i] + rampStep, lo, hi);
+
+    // PI(+D) toward the ratio-scaled hold level, directional anti-windup.
+    const int32_t target = sat32(mulq(mag, ratio[i], 16));
+    const int32_t err = sat32((int64_t)target - iq[i]);
+    const int32_t dErr = sat32((int64_t)err - _lastErr[i]);
+    const int64_t candidate = (int64_t)integ + mulq(_kp, err, 24) + mulq(kdRate, dErr, 24);
+    const int32_t dutyPi = clampq(candidate, lo, hi);
+    const bool windup = (candidate > hi && err > 0) || (candidate < lo && err < 0);
+    const int32_t intPi = windup ? integ
+        : clampq((int64_t)integ + mulq(kiRate, err, 24), -integratorLimit, integratorLimit);
+
+    const bool over = iq[i] > _iMax;
+    const bool ramp = !holdFrozen && (coRamp || i == idxMin);
+    const bool on = anyActive && active[i];
+    const int32_t duty = on ? (over ? dutyOver : (ramp ? dutyRamp : dutyPi)) : 0;
+    const int32_t nextInt = over ? intOver : (ramp ? dutyRamp : intPi);
+    const int32_t nextErr = over ? _lastErr[i] : (ramp ? 0 : err);
+    const int32_t nextDErr = over ? _lastDErr[i] : (ramp ? 0 : dErr);
+    _integrator[i] = on ? nextInt : integ;
+    _lastErr[i] = on ? nextErr : _lastErr[i];
+    _lastDErr[i] = on ? nextDErr : _lastDErr[i];
+    _dutyOut[i] = duty;
+    dutyOut[i] = (float)duty * (1.0f / Q16);
+  }
+
+  // An all-off tick leaves the anchor and the hold as they were.
+  _lastRateScale = anyActive ? rateScale : _lastRateScale;
+  _idxMin = anyActive ? idxMin : _idxMin;
+  _holdFrozen = anyActive ? holdFrozen : _holdFrozen;
+  _holdTarget = anyActive ? holdTarget : _holdTarget;
+}
@@ -0,0 +1,133 @@
+#include "CurrentFilter.h"
+#include <math.h>
+
+namespace {
+const int COEF_BITS = 28;
+const double COEF_ONE = (double)(1L << COEF_BITS);
+
+bool moved(float now, float was) {
+  if (was == 0.0f || now == 0.0f) return now != was;
+  return fabsf(now - was) > CurrentFilter::RETUNE_TOLERANCE * was;
+}
+} // namespace
+
+void CurrentFilter::configure(const Config &cfg, float fixedTauMs) {
+  _cfg = cfg;
+  if (_cfg.notchHarmonics > MAX_NOTCHES) _cfg.notchHarmonics = MAX_NOTCHES;
+  _fixedTauMs = fixedTauMs;
+  _medianGateQ8 = (int32_t)lroundf(_cfg.medianGateA * 256000.0f);
+  _tunedDriveHz = -1.0f;
+}
+
+// RBJ cookbook biquads, designed in double: near DC a float cos(w0) is off by
+// ~1% of a 0.5 Hz notch's frequency, and Q28 has more bits than a float
+// mantissa anyway (soft-float, but only per retune). The a's are quantized
+// first and the b's derived from them, so the DC gain is exactly 1 in Q28
+// however close the poles sit to the unit circle.
+CurrentFilter::Biquad CurrentFilter::_notch(double w0, double q) {
+  const double alpha = sin(w0) / (2.0 * q);
+  const double a0 = 1.0 + alpha;
+  Biquad b;
+  b.on = true;
+  b.a1 = (int32_t)llround(-2.0 * cos(w0) / a0 * COEF_ONE);
+  b.a2 = (int32_t)llround((1.0 - alpha) / a0 * COEF_ONE);
+  // b0 = b2 = (1 + a2) / 2, b1 = a1.
+  b.b0 = (int32_t)(((int64_t)(1L << COEF_BITS) + b.a2) / 2);
+  b.b2 = b.b0;
+  b.b1 = b.a1;
+  return b;
+}
+
+CurrentFilter::Biquad CurrentFilter::_lowPass(double w0) {
+  const double alpha = sin(w0) * M_SQRT1_2; // Q = 1/sqrt(2)
+  const double a0 = 1.0 + alpha;
+  Biquad b;
+  b.on = true;
+  b.a1 = (int32_t)llround(-2.0 * cos(w0) / a0 * COEF_ONE);
+  b.a2 = (int32_t)llround((1.0 - alpha) / a0 * COEF_ONE);
+  // b0 : b1 : b2 = 1 : 2 : 1, summing to 1 + a1 + a2.
+  const int64_t sum = (int64_t)(1L << COEF_BITS) + b.a1 + b.a2;
+  b.b0 = (int32_t)(sum / 4);
+  b.b1 = (int32_t)(sum / 2);
+  b.b2 = (int32_t)(sum - b.b0 - b.b1);
+  return b;
+}
+
+bool CurrentFilter::retune(float driveHz, float updateHz) {
+  if (driveHz < 0.0f) driveHz = 0.0f;
+  if (updateHz <= 0.0f) return false;
+  if (_tunedDriveHz >= 0.0f && !moved(driveHz, _tunedDriveHz) &&
+      !moved(updateHz, _tunedUpdateHz))
+    return false;
+  _tunedDriveHz = driveHz;
+  _tunedUpdateHz = updateHz;
+
+  const double norm = (double)driveHz / updateHz; // cycles per update
+  for (int k = 0; k < MAX_NOTCHES; k++) {
+    const double raw = norm * (k + 1);
+    double f = raw - floor(raw); // fold into 0 .. 0.5 cycles per update
+    if (f > 0.5) f = 1.0 - f;
+    _bq[k].on = false;
+    if (k < _cfg.notchHarmonics && f > 0.0 && (raw < 0.5 || f >= MIN_ALIAS_HZ))
+      _bq[k] = _notch(2.0 * M_PI * f, _cfg.notchQ);
+  }
+  const double lp = norm * _cfg.lowPassFieldRatio;
+  _bq[MAX_NOTCHES].on = false;
+  if (lp > 0.0 && lp < MAX_LOWPASS_HZ)
+    _bq[MAX_NOTCHES] = _lowPass(2.0 * M_PI * lp);
+
+  float tau = _fixedTauMs;
+  if (_cfg.emaFieldPeriods > 0.0f && driveHz > 0.0f) {
+    tau = 1000.0f * _cfg.emaFieldPeriods / driveHz;
+    if (tau < _cfg.tauMinMs) tau = _cfg.tauMinMs;
+    if (tau > _cfg.tauMaxMs) tau = _cfg.tauMaxMs;
+  }
+  _tauMs = tau;
+  const float alpha = tau > 0.0f ? 1.0f - expf(-1000.0f / (updateHz * tau)) : 1.0f;
+  _alphaQ20 = (int32_t)lroundf(alpha * (float)(1L << 20));
+  if (_alphaQ20 < 1) _alphaQ20 = 1;
+  return true;
+}
+
+void CurrentFilter::reset(State &s, int32_t xQ8) const {
+  for (int k = 0; k < 3; k++) s.med[k] = xQ8;
+  for (int k = 0; k <= MAX_NOTCHES; k++)
+    for (int j = 0; j < 6; j++) s.bq[k][j] = j < 4 ? xQ8 : 0;
+  s.ema = (int64_t)xQ8 << 16;
+}
+
+int32_t CurrentFilter::step(State &s, int32_t x) const {
+  if (_cfg.median3) {
+    s.med[0] = s.med[1];
+    s.med[1] = s.med[2];
+    s.med[2] = x;
+    const int32_t a = s.med[0], b = s.med[1], c = s.med[2];
+    const int32_t m = a > b ? (b > c ? b : (a > c ? c : a)) : (a > c ? a : (b > c ? c : b));
+    x = b - m > _medianGateQ8 || m - b > _medianGateQ8 ? m : b;
+  }
+  for (int k = 0; k <= MAX_NOTCHES; k++) {
+    const Biquad &q = _bq[k];
+    int32_t *z = s.bq[k];
+    if (!q.on) { // keep it in steady state for when retune() turns it on
+      z[0] = z[1] = z[2] = z[3] = x;
+      z[4] = z[5] = 0;
+      continue;
+    }
+    // Second-order error feedback: the rounding remainders go back in through
+    // (1 - z^-1)^2, cancelling the ~1 / (1 + a1 + a2) gain the poles near DC
+    // would otherwise give them (tens of mA at a 1 Hz notch / 0.5 Hz cutoff).
+    int64_t acc = (int64_t)q.b0 * x + (int64_t)q.b1 * z[0] + (int64_t)q.b2 * z[1] -
+                  (int64_t)q.a1 * z[2] - (int64_t)q.a2 * z[3] +
+                  2 * (int64_t)z[4] - z[5];
+    const int32_t y = (int32_t)((acc + (1LL << (COEF_BITS - 1))) >> COEF_BITS);
+    z[1] = z[0];
+    z[0] = x;
+    z[3] = z[2];
+    z[2] = y;
+    z[5] = z[4];
+    z[4] = (int32_t)(acc - ((int64_t)y << COEF_BITS));
+    x = y;
+  }
+  s.ema += ((((int64_t)x << 16) - s.ema) * _alphaQ20) >> 20;
+  return (int32_t)((s.ema + (1 << 15)) >> 16);
+}
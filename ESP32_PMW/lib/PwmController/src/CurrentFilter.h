@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+
+// Fixed-point filter chain for one CurrentSense update stream (see
+// CurrentSense::setFilter). Per channel, in order, each stage optional:
+//   median-of-3  -> drops single-update spikes (one update of delay); with
+//                   medianGateA set, only a sample that far from the median
+//                   is replaced, so ripple swinging less than that per update
+//                   isn't distorted into tones the notches don't remove
+//   notches      -> biquad notch at k * drive frequency, k = 1..notchHarmonics,
+//                   or where it aliases to at the update rate
+//   low-pass     -> biquad (Butterworth) at lowPassFieldRatio * drive frequency
+//   EMA          -> time constant emaFieldPeriods field periods, clamped to
+//                   [tauMinMs, tauMaxMs]; the fixed tau when that's 0 or in DC
+// Coefficients are shared by every channel and recomputed by retune() only
+// when the drive or update rate has moved by more than RETUNE_TOLERANCE; a
+// step is integer-only. Samples are Q8 mA (1/256 mA) in an int32.
+//
+// The notch and low-pass stages follow the drive frequency, so in DC mode
+// (driveHz 0) they pass through. Sampled once per update, ripple at k * f
+// shows up at its alias (350 Hz's 3rd harmonic lands at 50 Hz at 1 kHz
+// updates), so that's where the notch goes. One that aliases to within
+// MIN_ALIAS_HZ of DC is left to the EMA: it can't be told from the mean, and
+// a notch that low would take longer to settle than the EMA. The low-pass
+// passes through at or above MAX_LOWPASS_HZ.
+class CurrentFilter {
+public:
+  static const int MAX_NOTCHES = 3;
+  static constexpr float RETUNE_TOLERANCE = 0.005f; // relative
+  static constexpr float MIN_ALIAS_HZ = 0.02f;      // of the update rate
+  static constexpr float MAX_LOWPASS_HZ = 0.45f;    // of the update rate
+
+  struct Config {
+    bool median3 = false;
+    float medianGateA = 0.0f;       // 0 = plain median
+    uint8_t notchHarmonics = 0;     // 0..MAX_NOTCHES
+    float notchQ = 2.0f;            // centre / -3 dB width
+    float lowPassFieldRatio = 0.0f; // cutoff = this * drive Hz; 0 = off
+    float emaFieldPeriods = 0.0f;   // 0 = fixed tau
+    float tauMinMs = 1.0f;
+    float tauMaxMs = 1000.0f;
+  };
+
+  // Per channel: the stage history. Seed with reset() before the first step().
+  struct State {
+    int32_t med[3];
+    int32_t bq[MAX_NOTCHES + 1][6]; // x1, x2, y1, y2, rounding e1, e2
+    int64_t ema;                    // Q24 mA
+  };
+
+  // fixedTauMs: the EMA time constant when the config doesn't follow the
+  // drive (CurrentSense's tauFilterMs). Forces the next retune().
+  void configure(const Config &cfg, float fixedTauMs);
+  const Config &config() const { return _cfg; }
+
+  // driveHz: field frequency (0: DC / unknown). updateHz: step() calls per
+  // second. True if the coefficients were recomputed.
+  bool retune(float driveHz, float updateHz);
+
+  // Steady state at xQ8 (every stage has unity DC gain).
+  void reset(State &s, int32_t xQ8) const;
+  int32_t step(State &s, int32_t xQ8) const;
+
+  float emaTauMs() const { return _tauMs; }
+
+private:
+  struct Biquad {
+    bool on;
+    int32_t b0, b1, b2, a1, a2; // Q28, a0 normalized to 1
+  };
+  static Biquad _notch(double w0, double q);
+  static Biquad _lowPass(double w0);
+
+  Config _cfg;
+  float _fixedTauMs = 50.0f;
+  int32_t _medianGateQ8 = 0;
+  Biquad _bq[MAX_NOTCHES + 1] = {};
+  int32_t _alphaQ20 = 1 << 20;
+  float _tauMs = 0.0f;
+  float _tunedDriveHz = -1.0f; // < 0: not tuned yet
+  float _tunedUpdateHz = 0.0f;
+};
@@ -0,0 +1,62 @@
+#include "FundamentalFit.h"
+#include <math.h>
+
+namespace {
+// sin over one period in 256 steps (1.4 deg); cos is a quarter turn on.
+struct SineTable {
+  float v[256];
+  SineTable() {
+    for (int i = 0; i < 256; i++)
+      v[i] = sinf(2.0f * (float)M_PI * (float)i / 256.0f);
+  }
+};
+const SineTable SINE;
+} // namespace
+
+void FundamentalFit::reset() {
+  _n = 0;
+  _x0 = 0.0f;
+  _sx = _sc = _ss = _scc = _sss = _scs = _sxc = _sxs = 0.0f;
+}
+
+void FundamentalFit::add(uint32_t phaseQ32, float x) {
+  const uint32_t i = (phaseQ32 + (1u << 23)) >> 24 & 255; // nearest entry
+  const float s = SINE.v[i];
+  const float c = SINE.v[(i + 64) & 255];
+  if (_n == 0) _x0 = x;
+  x -= _x0;
+  _n++;
+  _sx += x;
+  _sc += c;
+  _ss += s;
+  _scc += c * c;
+  _sss += s * s;
+  _scs += c * s;
+  _sxc += x * c;
+  _sxs += x * s;
+}
+
+bool FundamentalFit::solve(float &mean, float &amplitude, float &phaseDeg) const {
+  if (_n < 4) return false;
+  // Normal equations M * [a b c] = v, M symmetric; Cramer's rule.
+  const float n = (float)_n;
+  const float m00 = n, m01 = _sc, m02 = _ss;
+  const float m11 = _scc, m12 = _scs, m22 = _sss;
+  const float c00 = m11 * m22 - m12 * m12;
+  const float c01 = m02 * m12 - m01 * m22;
+  const float c02 = m01 * m12 - m02 * m11;
+  const float det = m00 * c00 + m01 * c01 + m02 * c02;
+  // Evenly spread samples give det ~ n^3/4; a sliver of the period gives ~0.
+  if (!(det > 1e-3f * n * n * n)) return false;
+  const float c11 = m00 * m22 - m02 * m02;
+  const float c12 = m01 * m02 - m00 * m12;
+  const float c22 = m00 * m11 - m01 * m01;
+  const float a = (c00 * _sx + c01 * _sxc + c02 * _sxs) / det;
+  const float b = (c01 * _sx + c11 * _sxc + c12 * _sxs) / det;
+  const float c = (c02 * _sx + c12 * _sxc + c22 * _sxs) / det;
+  mean = a + _x0;
+  amplitude = sqrtf(b * b + c * c);
+  float deg = atan2f(c, b) * (180.0f / (float)M_PI);
+  phaseDeg = deg < 0.0f ? deg + 360.0f : deg;
+  return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lock-in detection of one field period's fundamental (see CurrentSense's
+// synchronous sampling). Each sample comes with its field phase as a Q32
+// fraction of the period; solve() least-squares fits
+//   x = mean + b*cos(theta) + c*sin(theta)
+// over everything added since reset(). Unlike a plain single-bin DFT this
+// stays unbiased when the samples don't tile the period evenly (a few more in
+// one half, a partial last step), so the DC level can't leak into the
+// amplitude. Harmonics are rejected as long as the period holds more samples
+// than twice their order. add() is a table lookup and eight multiply-adds.
+class FundamentalFit {
+public:
+  FundamentalFit() { reset(); }
+  void reset();
+  void add(uint32_t phaseQ32, float x);
+  uint32_t count() const { return _n; }
+
+  // amplitude: of the fundamental, in x's units. phaseDeg (0..360): where its
+  // peak sits in the period, i.e. x ~ mean + amplitude*cos(theta - phase).
+  // False (outputs untouched) with fewer than 4 samples or if they don't span
+  // the period.
+  bool solve(float &mean, float &amplitude, float &phaseDeg) const;
+
+private:
+  uint32_t _n;
+  float _x0; // first sample: keeps the sums small for float precision
+  float _sx, _sc, _ss, _scc, _sss, _scs, _sxc, _sxs;
+};
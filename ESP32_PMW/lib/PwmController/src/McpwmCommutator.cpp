@@ -0,0 +1,238 @@
+#include "McpwmCommutator.h"
+#include "PwmController.h" // PhaseParams
+#include "hal/mcpwm_ll.h"
+#include "soc/mcpwm_struct.h"
+
+namespace {
+const mcpwm_timer_t REF_TIMER = MCPWM_TIMER_2;
+
+mcpwm_dev_t *hwOf(mcpwm_unit_t unit) {
+  return (unit == MCPWM_UNIT_0) ? &MCPWM0 : &MCPWM1;
+}
+
+// Generator A of timer t is IO signal MCPWM{t}A.
+mcpwm_io_signals_t signalOf(mcpwm_timer_t t) {
+  return (mcpwm_io_signals_t)((int)MCPWM0A + 2 * (int)t);
+}
+
+bool validPin(gpio_num_t pin) { return pin != GPIO_NUM_NC && pin <= GPIO_NUM_39; }
+} // namespace
+
+McpwmCommutator::McpwmCommutator(const gpio_num_t *pins, int numChannels) {
+  _numChannels = numChannels < MAX_CHANNELS ? numChannels : MAX_CHANNELS;
+  for (int i = 0; i < MAX_CHANNELS; i++) {
+    _pins[i] = (i < _numChannels) ? pins[i] : GPIO_NUM_NC;
+    _mode[i] = MODE_FORCED_OFF;
+  }
+}
+
+McpwmCommutator::~McpwmCommutator() { stop(); }
+
+bool McpwmCommutator::begin(gpio_num_t syncOutPin) {
+  if (_numChannels <= 0)
+    return false;
+
+  mcpwm_config_t cfg = {};
+  cfg.frequency = 1000; // placeholder; apply() writes the real peak in ticks
+  cfg.cmpr_a = 0.0f;
+  cfg.cmpr_b = 0.0f;
+  cfg.counter_mode = MCPWM_UP_COUNTER;
+
+  for (int u = 0; u < numUnits(); u++) {
+    mcpwm_unit_t unit = (mcpwm_unit_t)u;
+    // Resolutions must be set before mcpwm_init() picks up the prescalers.
+    if (mcpwm_group_set_resolution(unit, GROUP_RES_HZ) != ESP_OK)
+      return false;
+    for (int t = 0; t <= (int)REF_TIMER; t++) {
+      mcpwm_timer_t timer = (mcpwm_timer_t)t;
+      mcpwm_timer_set_resolution(unit, timer, GROUP_RES_HZ / _prescale);
+      cfg.duty_mode = (timer == REF_TIMER) ? MCPWM_DUTY_MODE_0 : MCPWM_DUTY_MODE_1;
+      if (mcpwm_init(unit, timer, &cfg) != ESP_OK)
+        return false;
+    }
+
+    // Reference: free-running, emits a sync pulse at every TEZ (cycle start).
+    // Its own sync input is unused except for the soft sync that aligns the
+    // two units below and re-scales position in setPrescale().
+    mcpwm_sync_config_t refSync = {};
+    refSync.sync_sig = MCPWM_SELECT_NO_INPUT;
+    refSync.timer_val = 0;
+    refSync.count_direction = MCPWM_TIMER_DIRECTION_UP;
+    mcpwm_sync_configure(unit, REF_TIMER, &refSync);
+    mcpwm_set_timer_sync_output(unit, REF_TIMER, MCPWM_SWSYNC_SOURCE_TEZ);
+
+    // Channel timers reload their phase value on every reference TEZ.
+    mcpwm_sync_config_t chSync = {};
+    chSync.sync_sig = MCPWM_SELECT_TIMER2_SYNC;
+    chSync.timer_val = 0;
+    chSync.count_direction = MCPWM_TIMER_DIRECTION_UP;
+    mcpwm_sync_configure(unit, MCPWM_TIMER_0, &chSync);
+    mcpwm_sync_configure(unit, MCPWM_TIMER_1, &chSync);
+  }
+
+  // Park every coil OFF (inverter logic: pin HIGH) before handing the pin over,
+  // so the GPIO-matrix switch can't emit a spurious active pulse.
+  for (int ch = 0; ch < _numChannels; ch++) {
+    if (!validPin(_pins[ch]))
+      continue;
+    mcpwm_set_signal_high(unitOf(ch), timerOf(ch), MCPWM_GEN_A);
+    _mode[ch] = MODE_FORCED_OFF;
+    mcpwm_gpio_init(unitOf(ch), signalOf(timerOf(ch)), _pins[ch]);
+  }
+
+#if USE_SYNC && SYNC_AS_SERVER
+  // Master sync: reference generator A, HIGH for the first half of the cycle.
+  if (validPin(syncOutPin)) {
+    mcpwm_gpio_init(MCPWM_UNIT_0, signalOf(REF_TIMER), syncOutPin);
+    _syncOut = true;
+  }
+#else
+  (void)syncOutPin;
+#endif
+
+  for (int u = 0; u < numUnits(); u++)
+    for (int t = 0; t <= (int)REF_TIMER; t++)
+      mcpwm_start((mcpwm_unit_t)u, (mcpwm_timer_t)t);
+
+  // Align both references (soft sync loads count 0) back-to-back, so unit 1's
+  // cycle start coincides with unit 0's to within a few APB cycles.
+  portENTER_CRITICAL(&_mux);
+  for (int u = 0; u < numUnits(); u++)
+    mcpwm_timer_trigger_soft_sync((mcpwm_unit_t)u, REF_TIMER);
+  portEXIT_CRITICAL(&_mux);
+
+  _running = true;
+  return true;
+}
+
+void McpwmCommutator::stop() {
+  if (!_running)
+    return;
+  for (int u = 0; u < numUnits(); u++)
+    for (int t = 0; t <= (int)REF_TIMER; t++)
+      mcpwm_stop((mcpwm_unit_t)u, (mcpwm_timer_t)t);
+  _running = false;
+}
+
+uint32_t McpwmCommutator::pickPrescale(uint32_t periodUs) const {
+  // Smallest power-of-two divider whose period fits 16 bits. Powers of two keep
+  // re-scales rare (8 boundaries between 0.6 Hz and 153 Hz) during a ramp.
+  uint32_t prescale = 1;
+  while (prescale < 256 &&
+         ((uint64_t)periodUs * (GROUP_RES_HZ / prescale)) / 1000000ULL >
+             MAX_PERIOD_TICKS)
+    prescale <<= 1;
+  return prescale;
+}
+
+void McpwmCommutator::setPrescale(uint32_t prescale, uint32_t periodTicks) {
+  // Re-scaling changes the tick length, so the counters must be re-scaled too or
+  // the field would jump. Same idea as setGlobalFrequency()'s phase-continuity
+  // correction: keep the fraction of the cycle already elapsed.
+  uint32_t count = mcpwm_ll_timer_get_count_value(hwOf(MCPWM_UNIT_0), REF_TIMER);
+  uint32_t pos = (_periodTicks > 0)
+                     ? (uint32_t)(((uint64_t)count * periodTicks) / _periodTicks)
+                     : 0;
+  if (pos >= periodTicks)
+    pos = 0;
+
+  for (int u = 0; u < numUnits(); u++)
+    for (int t = 0; t <= (int)REF_TIMER; t++)
+      mcpwm_timer_set_resolution((mcpwm_unit_t)u, (mcpwm_timer_t)t,
+                                 GROUP_RES_HZ / prescale);
+
+  portENTER_CRITICAL(&_mux);
+  for (int u = 0; u < numUnits(); u++) {
+    mcpwm_dev_t *hw = hwOf((mcpwm_unit_t)u);
+    mcpwm_ll_timer_set_peak(hw, REF_TIMER, periodTicks, false);
+    mcpwm_ll_timer_set_sync_phase_value(hw, REF_TIMER, pos);
+    mcpwm_timer_trigger_soft_sync((mcpwm_unit_t)u, REF_TIMER);
+  }
+  portEXIT_CRITICAL(&_mux);
+
+  _prescale = prescale;
+  _periodTicks = periodTicks;
+}
+
+void McpwmCommutator::setMode(int ch, Mode m) {
+  if (_mode[ch] == m)
+    return;
+  mcpwm_unit_t unit = unitOf(ch);
+  mcpwm_timer_t timer = timerOf(ch);
+  // ACTIVE LOW: coil ON = pin LOW (see PwmController::_timerCallback).
+  if (m == MODE_FORCED_ON)
+    mcpwm_set_signal_low(unit, timer, MCPWM_GEN_A);
+  else if (m == MODE_FORCED_OFF)
+    mcpwm_set_signal_high(unit, timer, MCPWM_GEN_A);
+  else
+    mcpwm_set_duty_type(unit, timer, MCPWM_GEN_A, MCPWM_DUTY_MODE_1);
+  _mode[ch] = m;
+}
+
+void McpwmCommutator::apply(const PhaseParams *params, uint32_t periodUs,
+                            bool dc) {
+  if (!_running || !params || periodUs == 0)
+    return;
+
+  const uint32_t prescale = pickPrescale(periodUs);
+  const uint32_t res = GROUP_RES_HZ / prescale;
+  uint32_t ticks = (uint32_t)(((uint64_t)periodUs * res) / 1000000ULL);
+  if (ticks > MAX_PERIOD_TICKS)
+    ticks = MAX_PERIOD_TICKS; // below ~0.6 Hz: runs at the slowest period
+  if (ticks < 2)
+    ticks = 2;
+  if (prescale != _prescale || _periodTicks == 0)
+    setPrescale(prescale, ticks);
+
+  for (int u = 0; u < numUnits(); u++)
+    mcpwm_ll_timer_set_peak(hwOf((mcpwm_unit_t)u), REF_TIMER, ticks, false);
+  if (_syncOut)
+    mcpwm_ll_operator_set_compare_value(hwOf(MCPWM_UNIT_0), REF_TIMER, 0,
+                                        ticks / 2);
+  _periodTicks = ticks;
+
+#if USE_SYNC && SYNC_AS_SERVER
+  const int channelLimit = 1; // master drives channel 0 only, like the ISR path
+#else
+  const int channelLimit = _numChannels;
+#endif
+
+  for (int ch = 0; ch < channelLimit; ch++) {
+    if (!validPin(_pins[ch]))
+      continue;
+    const PhaseParams &p = params[ch];
+    const uint32_t start = (uint32_t)p.startUs;
+    const uint32_t end = (uint32_t)p.endUs;
+
+    if (dc) {
+      // Same frozen-at-t=0 pattern the software path evaluates in DC mode.
+      bool active = p.wraps ? (start == 0 || end > 0) : (start == 0 && end > 0);
+      setMode(ch, active ? MODE_FORCED_ON : MODE_FORCED_OFF);
+      continue;
+    }
+
+    uint32_t widthUs = p.wraps ? (periodUs - start + end) : (end - start);
+    uint32_t startT = (uint32_t)(((uint64_t)start * res) / 1000000ULL);
+    uint32_t widthT = (uint32_t)(((uint64_t)widthUs * res) / 1000000ULL);
+    if (startT >= ticks)
+      startT = 0;
+
+    if (widthT == 0) {
+      setMode(ch, MODE_FORCED_OFF);
+      continue;
+    }
+    if (widthT >= ticks) {
+      setMode(ch, MODE_FORCED_ON);
+      continue;
+    }
+
+    // Channel TEZ (window start) lands (ticks - phase) after the reference
+    // TEZ, so load phase = ticks - startT. Compare A ends the window.
+    mcpwm_dev_t *hw = hwOf(unitOf(ch));
+    const int t = (int)timerOf(ch);
+    mcpwm_ll_timer_set_peak(hw, t, ticks, false);
+    mcpwm_ll_timer_set_sync_phase_value(hw, t, (ticks - startT) % ticks);
+    mcpwm_ll_operator_set_compare_value(hw, t, 0, widthT);
+    setMode(ch, MODE_PWM);
+  }
+}
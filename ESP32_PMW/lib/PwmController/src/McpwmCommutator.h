@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Arduino.h>
+#include "driver/gpio.h"
+#include "driver/mcpwm.h"
+
+struct PhaseParams; // PwmController.h
+
+// Hardware commutation backend: generates the per-channel active windows on the
+// ESP32 MCPWM peripheral instead of toggling GPIOs from the software edge timer.
+// Owned by PwmController (opt-in via enableMcpwmCommutation()), which keeps
+// computing PhaseParams exactly as before and hands them here after every change.
+//
+// Layout (4 channels over both MCPWM units): channel i runs on unit i/2, timer
+// i%2, generator A. Timer 2 of each unit is a free-running REFERENCE with no
+// coil output: it defines cycle start (t=0) and re-syncs both channel timers at
+// every reference TEZ, each loading a phase value that puts its own TEZ (window
+// start) at PhaseParams.startUs. Generators run MCPWM_DUTY_MODE_1 (LOW from TEZ
+// to compare A), which is the active-low coil drive the NC7SZ04 inverter needs.
+// Both units are clocked from the same 160 MHz PLL with identical prescalers, so
+// once their references are soft-synced together they cannot drift apart.
+class McpwmCommutator {
+public:
+  static const int MAX_CHANNELS = 4;
+
+  McpwmCommutator(const gpio_num_t *pins, int numChannels);
+  ~McpwmCommutator();
+
+  // Route pins to MCPWM and start the timers (outputs idle HIGH = coils off
+  // until the first apply()). syncOutPin: USE_SYNC server output (50% of the
+  // cycle HIGH, like the software path), or GPIO_NUM_NC.
+  bool begin(gpio_num_t syncOutPin = GPIO_NUM_NC);
+
+  // Program one field period. params[] as built by updatePhaseParams(), in us
+  // within periodUs. dc => freeze the pattern at t=0 (no rotation). Changes
+  // latch at the next TEZ, so a running cycle is never cut short.
+  void apply(const PhaseParams *params, uint32_t periodUs, bool dc);
+
+  // Freeze every timer (outputs hold their level), like stopping the esp_timer.
+  void stop();
+
+  // Timer resolution (Hz) currently selected by the prescale ladder.
+  uint32_t resolutionHz() const { return GROUP_RES_HZ / _prescale; }
+
+private:
+  // Group clock 160 MHz / 16 = 10 MHz; each timer divides by _prescale
+  // (power of two, 1..256) so the 16-bit period register fits the field
+  // period: 0.1 us ticks above ~153 Hz, down to ~0.6 Hz at /256.
+  static const uint32_t GROUP_RES_HZ = 10000000UL;
+  static const uint32_t MAX_PERIOD_TICKS = 65535UL;
+
+  // Force states so the driver is only called when a channel changes mode.
+  enum Mode : uint8_t { MODE_PWM, MODE_FORCED_ON, MODE_FORCED_OFF };
+
+  static mcpwm_unit_t unitOf(int ch) { return (mcpwm_unit_t)(ch / 2); }
+  static mcpwm_timer_t timerOf(int ch) { return (mcpwm_timer_t)(ch % 2); }
+  int numUnits() const { return (_numChannels + 1) / 2; }
+
+  uint32_t pickPrescale(uint32_t periodUs) const;
+  void setPrescale(uint32_t prescale, uint32_t periodTicks);
+  void setMode(int ch, Mode m);
+
+  int _numChannels;
+  gpio_num_t _pins[MAX_CHANNELS];
+  Mode _mode[MAX_CHANNELS];
+  bool _syncOut = false;
+  bool _running = false;
+  uint32_t _prescale = 1;
+  uint32_t _periodTicks = 0;
+  portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+};
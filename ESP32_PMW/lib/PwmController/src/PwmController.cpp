@@ -1,6 +1,9 @@
 #include "PwmController.h"
 #include <Arduino.h>
 #include <math.h>
+#include "hal/cpu_hal.h"
+#include "soc/gpio_struct.h"
+#include "soc/ledc_struct.h"
 
 #ifndef APB_CLK_FREQ
 #define APB_CLK_FREQ 80000000UL
@@ -57,6 +60,7 @@ PwmController::PwmController(const gpio_num_t* pins, const float* phaseOffsetsDe
     _phaseOffsetsPct = new float[_numChannels];
     _dutyCycles = new float[_numChannels];
     _params = new PhaseParams[_numChannels];
+    _edges = new CommutationEdge[2 * _numChannels + 2];
 
     _lastSyncTimeUs = 0;
     _averagedPeriodUs = 20000;
@@ -82,6 +86,12 @@ PwmController::PwmController(const gpio_num_t* pins, const float* phaseOffsetsDe
 }
 
 PwmController::~PwmController() {
+    _stopControlTask(); // before _sense/_balance go away
+    _stopEdgeTimer();
+    if (_edgeTimerClaimed) {
+        timer_isr_callback_remove(EDGE_TIMER_GROUP, EDGE_TIMER_IDX);
+        timer_deinit(EDGE_TIMER_GROUP, EDGE_TIMER_IDX);
+    }
     if (_periodicTimer) {
         esp_timer_stop(_periodicTimer);
         esp_timer_delete(_periodicTimer);
@@ -90,12 +100,14 @@ PwmController::~PwmController() {
     delete[] _phaseOffsetsPct; 
     delete[] _dutyCycles; 
     delete[] _params; 
+    delete[] _edges;
     if (_carrierPinsArray) delete[] _carrierPinsArray;
     if (_carrierDutyCyclePct) delete[] _carrierDutyCyclePct;
     if (_carrierLedcConfigured) delete[] _carrierLedcConfigured;
     if (_carrierLastDutyTicks) delete[] _carrierLastDutyTicks;
     if (_sense) delete _sense;
     if (_balance) delete _balance;
+    if (_mcpwm) delete _mcpwm;
 }
 
 void PwmController::begin(float initialFreqHz) {
@@ -135,6 +147,12 @@ void PwmController::begin(float initialFreqHz) {
         _lastSyncTimeUs = esp_timer_get_time();
     #endif
 
+    _cpuMhz = getCpuFrequencyMhz();
+    _tickPeriodCycles = 25 * _cpuMhz;
+
+    if (_startEdgeTimer()) return;
+
+    // Fallback: poll every 25us from the esp_timer task.
     const esp_timer_create_args_t timer_args = {
         .callback = &_timerCallback,
         .arg = this,
@@ -147,20 +165,33 @@ void PwmController::begin(float initialFreqHz) {
 }
 
 void IRAM_ATTR PwmController::_timerCallback(void* arg) {
-    PwmController* self = (PwmController*)arg;
-    int64_t now = esp_timer_get_time();
+    _commutationTick((PwmController*)arg, true);
+}
 
-    int64_t lastSync;
-    int64_t period;
-    bool dc;
+bool IRAM_ATTR PwmController::_edgeTimerIsr(void* arg) {
+    _commutationTick((PwmController*)arg, true); // writes the pins and re-arms
+    return false; // no task woken
+}
 
-    // When dispatch_method=ESP_TIMER_TASK, callback runs in task context, not ISR.
-    // Use portENTER_CRITICAL (task) not portENTER_CRITICAL_ISR
-    portENTER_CRITICAL(&self->_spinlock);
-    lastSync = self->_lastSyncTimeUs;
-    period = self->_averagedPeriodUs;
-    dc = self->_dcMode;
-    portEXIT_CRITICAL(&self->_spinlock);
+void IRAM_ATTR PwmController::_commutationTick(PwmController* self, bool record) {
+    uint32_t entryCycles = cpu_hal_get_cycle_count();
+
+    uint32_t timeInCycle;
+    uint32_t period32;
+    CommutationEdge seg;
+
+    // Called from the edge-timer ISR, the esp_timer task (fallback poll) or
+    // measureTickCycles(): the _SAFE variants pick the right critical section.
+    // The segment lookup stays inside the lock so a concurrent
+    // rebuildEdgeTable() can never hand us a half-written table. The clocks
+    // are read inside it too, so a wait on the lock can't skew the next alarm.
+    portENTER_CRITICAL_SAFE(&self->_spinlock);
+    const bool arm = record && self->_edgeTimerActive;
+    uint64_t armCount = arm ? timer_group_get_counter_value_in_isr(EDGE_TIMER_GROUP, EDGE_TIMER_IDX) : 0;
+    uint32_t armCycles = cpu_hal_get_cycle_count();
+    int64_t now = esp_timer_get_time();
+    int64_t lastSync = self->_lastSyncTimeUs;
+    int64_t period = self->_averagedPeriodUs;
 
     // Client fallback: If waiting for first sync, use default period
     #if USE_SYNC && !SYNC_AS_SERVER
@@ -177,43 +208,201 @@ void IRAM_ATTR PwmController::_timerCallback(void* arg) {
     if (delta < 0) delta += period; // Handle case if sync pushed lastSync slightly into the future
 
     uint32_t delta32 = (uint32_t)delta;
-    uint32_t period32 = (uint32_t)period;
-    uint32_t timeInCycle = delta32 % period32;
+    period32 = (uint32_t)period;
+    timeInCycle = delta32 % period32;
 
     // DC mode: freeze the phase so the active-channel pattern is static (the
     // field doesn't rotate). Current is still gated by the carrier, so DC + 0%
     // carrier = fully off. Frozen at cycle-start (t=0) for a well-defined pattern.
-    if (dc) timeInCycle = 0;
+    if (self->_dcMode) timeInCycle = 0;
+
+    // The edge scheduler looks EDGE_MIN_LEAD_US ahead: an edge that close is
+    // taken now instead of being re-armed below the minimum lead (the esp_timer
+    // clock and the alarm counter can also disagree by a count).
+    uint32_t lookup = timeInCycle;
+    if (arm && !self->_dcMode) {
+        lookup += EDGE_MIN_LEAD_US;
+        if (lookup >= period32) lookup -= period32;
+    }
 
-    // Master Sync Generation
-    #if USE_SYNC && SYNC_AS_SERVER
-        // Set sync high for first 50% of cycle
-        gpio_set_level(self->_syncPin, (timeInCycle < (period32 / 2)) ? 1 : 0);
-    #endif
+    // Segment lookup: advance the cursor (the common case, one compare), or
+    // binary-search after a wrap / table rebuild.
+    const CommutationEdge *edges = self->_edges;
+    int n = self->_numEdges;
+    int idx = self->_edgeCursor;
+    if (idx >= n || edges[idx].timeUs > lookup) {
+        int lo = 0, hi = n - 1; // edges[0].timeUs == 0 always
+        while (lo < hi) {
+            int mid = (lo + hi + 1) >> 1;
+            if (edges[mid].timeUs <= lookup) lo = mid;
+            else hi = mid - 1;
+        }
+        idx = lo;
+    } else {
+        while (idx + 1 < n && edges[idx + 1].timeUs <= lookup) idx++;
+    }
+    self->_edgeCursor = idx;
+    seg = (n > 0) ? edges[idx] : CommutationEdge{0, 0, 0, 0, 0, 0};
+
+    if (record) self->_recordTickLocked(entryCycles, timeInCycle, period32, seg.active);
+
+    // Next wake-up: the start of the following segment (the next cycle's t=0
+    // after the last one). All 32-bit: lookup only wrapped if it passed t=0.
+    if (arm) {
+        uint32_t waitUs = EDGE_MAX_SLEEP_US; // DC: nothing moves, just re-check
+        if (!self->_dcMode && n > 0) {
+            uint32_t next = (idx + 1 < n) ? edges[idx + 1].timeUs : period32;
+            waitUs = (lookup >= timeInCycle) ? next - timeInCycle
+                                             : next + (period32 - timeInCycle);
+        }
+        self->_armEdgeTimerLocked(armCount, armCycles, waitUs);
+    }
+    portEXIT_CRITICAL_SAFE(&self->_spinlock);
+
+    // Channel Generation (plus the USE_SYNC server output, which is part of
+    // the table): whole output state in one set/clear pair per bank.
+    // Off (HIGH) before on (LOW): break-before-make across the bridges.
+    // ACTIVE LOW LOGIC: Due to the NC7SZ04P5X inverter, to turn the H-Bridge ON (HIGH), 
+    // the ESP32 must output LOW (0). To turn it OFF, the ESP32 outputs HIGH (1).
+    GPIO.out_w1ts = seg.highMask;
+    GPIO.out1_w1ts.val = seg.highMask1;
+    GPIO.out_w1tc = seg.lowMask;
+    GPIO.out1_w1tc.val = seg.lowMask1;
+
+    // Recorded into the histogram by the next tick, under its lock: saves a
+    // second lock round-trip here. A single aligned word store is atomic.
+    if (record) self->_lastTickCycles = cpu_hal_get_cycle_count() - entryCycles;
+}
 
-    // Channel Generation
-    #if USE_SYNC && SYNC_AS_SERVER
-        const int channelLimit = 1;
-    #else
-        const int channelLimit = self->_numChannels;
-    #endif
+void IRAM_ATTR PwmController::_recordTickLocked(uint32_t entryCycles,
+                                                uint32_t timeInCycle,
+                                                uint32_t period32,
+                                                uint8_t active) {
+    // Dispatch latency against the time this tick was due. Edge scheduler:
+    // _armEdgeTimerLocked() stores the alarm time for every wake-up. Fallback
+    // poll: esp_timer re-arms a periodic alarm at previous alarm + period, so
+    // the schedule advances exactly one period per call, and late calls show
+    // up as (possibly back-to-back) positive lateness.
+    CommutationStats &st = _stats.beginWrite();
+    if (_statsReset.load(std::memory_order_relaxed)) {
+        _statsReset.store(false, std::memory_order_relaxed);
+        st.reset();
+        _tickPrimed = false;
+        _lastTickCycles = 0;
+    }
+    if (_tickPrimed) {
+        int32_t late = (int32_t)(entryCycles - _expectedTickCycles);
+        st.dispatchLatency.add(late > 0 ? (uint32_t)late : 0);
+        if (!_edgeTimerActive) _expectedTickCycles += _tickPeriodCycles;
+        if (_lastTickCycles) st.callbackDuration.add(_lastTickCycles);
+    } else if (!_edgeTimerActive) {
+        _expectedTickCycles = entryCycles + _tickPeriodCycles;
+        _tickPrimed = true;
+    }
 
-    for (int i = 0; i < channelLimit; i++) {
-        // Skip invalid GPIO pins to prevent crashes
-        if (self->_pins[i] == GPIO_NUM_NC || self->_pins[i] > GPIO_NUM_39) continue;
-        
-        // Local copies for speed
-        uint32_t start = (uint32_t)self->_params[i].startUs;
-        uint32_t end = (uint32_t)self->_params[i].endUs;
-        
-        bool active = self->_params[i].wraps ? 
-                      (timeInCycle >= start || timeInCycle < end) : 
-                      (timeInCycle >= start && timeInCycle < end);
-        
-        // ACTIVE LOW LOGIC: Due to the NC7SZ04P5X inverter, to turn the H-Bridge ON (HIGH), 
-        // the ESP32 must output LOW (0). To turn it OFF, the ESP32 outputs HIGH (1).
-        gpio_set_level(self->_pins[i], active ? 0 : 1);
+    // Edge error: every channel whose state flipped since the last tick, timed
+    // against its own ideal start/end. Skipped right after a table rebuild
+    // (that flip is a parameter change, not a scheduled edge) and in DC mode.
+    uint8_t changed = active ^ _lastActive;
+    if (changed && _tableGen == _tableGenSeen && !_dcMode) {
+        uint32_t sinceEntry = cpu_hal_get_cycle_count() - entryCycles;
+        for (int i = 0; i < _numChannels && i < CommutationStats::MAX_CHANNELS; i++) {
+            if (!((changed >> i) & 1)) continue;
+            uint32_t ideal = ((active >> i) & 1) ? (uint32_t)_params[i].startUs
+                                                 : (uint32_t)_params[i].endUs;
+            if (ideal >= period32) ideal -= period32; // endUs == period: next t=0
+            // Signed, wrapped into +-half a period. An edge the scheduler took
+            // early (within its look-ahead) counts as on time.
+            int32_t late = (int32_t)timeInCycle - (int32_t)ideal;
+            if (late < -(int32_t)(period32 / 2)) late += (int32_t)period32;
+            else if (late > (int32_t)(period32 / 2)) late -= (int32_t)period32;
+            uint32_t lateUs = late > 0 ? (uint32_t)late : 0;
+            st.edgeError[i].add(lateUs * _cpuMhz + sinceEntry);
+        }
     }
+    _stats.endWrite();
+    _lastActive = active;
+    _tableGenSeen = _tableGen;
+}
+
+void IRAM_ATTR PwmController::_armEdgeTimerLocked(uint64_t baseCount,
+                                                   uint32_t baseCycles,
+                                                   uint32_t waitUs) {
+    if (waitUs < EDGE_MIN_LEAD_US) waitUs = EDGE_MIN_LEAD_US;
+    if (waitUs > EDGE_MAX_SLEEP_US) waitUs = EDGE_MAX_SLEEP_US;
+    uint64_t alarm = baseCount + waitUs;
+    // The base was sampled at tick entry; if the tick itself ran long, don't
+    // arm a target the counter has already passed.
+    uint64_t nowCount = timer_group_get_counter_value_in_isr(EDGE_TIMER_GROUP, EDGE_TIMER_IDX);
+    if (alarm < nowCount + EDGE_MIN_LEAD_US) alarm = nowCount + EDGE_MIN_LEAD_US;
+    timer_group_set_alarm_value_in_isr(EDGE_TIMER_GROUP, EDGE_TIMER_IDX, alarm);
+    timer_group_enable_alarm_in_isr(EDGE_TIMER_GROUP, EDGE_TIMER_IDX);
+    _expectedTickCycles = baseCycles + (uint32_t)(alarm - baseCount) * _cpuMhz;
+    _tickPrimed = true;
+}
+
+void IRAM_ATTR PwmController::_kickEdgeTimerLocked() {
+    _armEdgeTimerLocked(timer_group_get_counter_value_in_isr(EDGE_TIMER_GROUP, EDGE_TIMER_IDX),
+                        cpu_hal_get_cycle_count(), 0);
+}
+
+bool PwmController::_startEdgeTimer() {
+    if (!_edgeTimerClaimed) {
+        // timer_init() would silently take over a timer another driver (e.g.
+        // Arduino's timerBegin()) already set up; it only has a config if so.
+        timer_config_t cfg = {};
+        if (timer_get_config(EDGE_TIMER_GROUP, EDGE_TIMER_IDX, &cfg) == ESP_OK) {
+            Serial.printf("[PwmController] hardware timer %d is already in use, "
+                          "using 25us poll (see PWM_EDGE_TIMER)\n", PWM_EDGE_TIMER);
+            return false;
+        }
+        cfg = timer_config_t();
+        cfg.alarm_en = TIMER_ALARM_EN;
+        cfg.counter_en = TIMER_PAUSE;
+        cfg.intr_type = TIMER_INTR_LEVEL;
+        cfg.counter_dir = TIMER_COUNT_UP;
+        cfg.auto_reload = TIMER_AUTORELOAD_DIS; // one-shot: every alarm is armed by hand
+        cfg.divider = EDGE_TIMER_DIVIDER;       // 80 MHz APB -> 1us per count
+
+        esp_err_t err = timer_init(EDGE_TIMER_GROUP, EDGE_TIMER_IDX, &cfg);
+        if (err == ESP_OK) err = timer_set_counter_value(EDGE_TIMER_GROUP, EDGE_TIMER_IDX, 0);
+        // IRAM ISR: keeps commutating while the flash cache is off (SPIFFS writes).
+        if (err == ESP_OK)
+            err = timer_isr_callback_add(EDGE_TIMER_GROUP, EDGE_TIMER_IDX, &_edgeTimerIsr,
+                                         this, ESP_INTR_FLAG_IRAM);
+        if (err != ESP_OK) {
+            Serial.printf("[PwmController] edge timer init failed: %d, using 25us poll\n",
+                          (int)err);
+            timer_deinit(EDGE_TIMER_GROUP, EDGE_TIMER_IDX);
+            return false;
+        }
+        _edgeTimerClaimed = true;
+    }
+
+    portENTER_CRITICAL(&_spinlock);
+    _edgeTimerActive = true;
+    _tickPrimed = false;
+    _kickEdgeTimerLocked(); // first tick EDGE_MIN_LEAD_US after start
+    portEXIT_CRITICAL(&_spinlock);
+    timer_start(EDGE_TIMER_GROUP, EDGE_TIMER_IDX);
+    return true;
+}
+
+void PwmController::_stopEdgeTimer() {
+    if (!_edgeTimerActive) return;
+    timer_pause(EDGE_TIMER_GROUP, EDGE_TIMER_IDX);
+    portENTER_CRITICAL(&_spinlock);
+    _edgeTimerActive = false;
+    _tickPrimed = false;
+    portEXIT_CRITICAL(&_spinlock);
+}
+
+void PwmController::commutationStats(CommutationStats &out) {
+    _stats.read(out); // retries if a tick landed mid-copy
+}
+
+void PwmController::resetCommutationStats() {
+    _statsReset = true; // the tick is the only writer; it clears on its next record
 }
 
 void IRAM_ATTR PwmController::_onSyncInterrupt() {
@@ -252,6 +441,9 @@ void IRAM_ATTR PwmController::_onSyncInterrupt() {
         _isrInstance->_lastSyncTimeUs = now - SYNC_LATENCY_US;
         
         _isrInstance->_firstSyncReceived = true;
+
+        // 3. The pending edge alarm was computed against the old cycle start
+        if (_isrInstance->_edgeTimerActive) _isrInstance->_kickEdgeTimerLocked();
         
         portEXIT_CRITICAL_ISR(&_isrInstance->_spinlock);
     #endif
@@ -263,6 +455,49 @@ void PwmController::enableSync(gpio_num_t syncPin) {
     #endif
 }
 
+bool PwmController::enableMcpwmCommutation() {
+    #if USE_SYNC && !SYNC_AS_SERVER
+        return false; // client phase tracks the sync ISR; stay on the software timer
+    #else
+        if (_mcpwm) return true;
+        if (_numChannels > McpwmCommutator::MAX_CHANNELS) return false;
+
+        // Stop the software path first so it can't fight MCPWM for the pins.
+        const bool edgeTimer = _edgeTimerActive;
+        _stopEdgeTimer();
+        if (_periodicTimer) esp_timer_stop(_periodicTimer);
+
+        McpwmCommutator *m = new McpwmCommutator(_pins, _numChannels);
+        if (!m->begin(_syncPin)) {
+            delete m;
+            if (edgeTimer) _startEdgeTimer();
+            else if (_periodicTimer) esp_timer_start_periodic(_periodicTimer, 25);
+            return false;
+        }
+        _mcpwm = m;
+        _pushCommutation();
+        return true;
+    #endif
+}
+
+void PwmController::_pushCommutation() {
+    if (!_mcpwm) return;
+
+    // Snapshot under the lock, program the peripheral outside it (the MCPWM
+    // driver takes its own spinlock).
+    PhaseParams snap[McpwmCommutator::MAX_CHANNELS];
+    uint32_t periodUs;
+    bool dc;
+    portENTER_CRITICAL(&_spinlock);
+    for (int i = 0; i < _numChannels && i < McpwmCommutator::MAX_CHANNELS; i++)
+        snap[i] = _params[i];
+    periodUs = (uint32_t)_averagedPeriodUs;
+    dc = _dcMode;
+    portEXIT_CRITICAL(&_spinlock);
+
+    _mcpwm->apply(snap, periodUs, dc);
+}
+
 void PwmController::updatePhaseParams(int channel) {
     #if USE_SYNC && SYNC_AS_SERVER
         if (channel > 0) return;
@@ -288,24 +523,125 @@ void PwmController::updatePhaseParams(int channel) {
     }
 }
 
+void PwmController::rebuildEdgeTable() {
+    #if USE_SYNC && SYNC_AS_SERVER
+        const int channelLimit = 1;
+        // Master sync output: HIGH for the first 50% of the cycle.
+        const bool syncOut = _syncPin != GPIO_NUM_NC && _syncPin <= GPIO_NUM_39;
+    #else
+        const int channelLimit = _numChannels;
+        const bool syncOut = false;
+    #endif
+    const uint32_t period = (uint32_t)_averagedPeriodUs;
+
+    // Breakpoints: cycle start plus every window start/end inside the period
+    // (and the sync half-cycle), sorted (insertion sort; at most 2*N+2
+    // entries) and de-duplicated.
+    int n = 0;
+    _edges[n++].timeUs = 0;
+    auto insert = [&](uint32_t t) {
+        if (t >= period) return; // never reached: timeInCycle < period
+        int j = n++;
+        while (j > 0 && _edges[j - 1].timeUs > t) {
+            _edges[j].timeUs = _edges[j - 1].timeUs;
+            j--;
+        }
+        _edges[j].timeUs = t;
+    };
+    for (int i = 0; i < channelLimit; i++) {
+        if (_pins[i] == GPIO_NUM_NC || _pins[i] > GPIO_NUM_39) continue;
+        insert((uint32_t)_params[i].startUs);
+        insert((uint32_t)_params[i].endUs);
+    }
+    if (syncOut) insert(period / 2);
+    int u = 0;
+    for (int j = 0; j < n; j++)
+        if (j == 0 || _edges[j].timeUs != _edges[u - 1].timeUs)
+            _edges[u++].timeUs = _edges[j].timeUs;
+    n = u;
+
+    // Full pin state for each segment, same active test the tick used to run.
+    for (int j = 0; j < n; j++) {
+        CommutationEdge &e = _edges[j];
+        e.highMask = e.lowMask = e.highMask1 = e.lowMask1 = 0;
+        e.active = 0;
+        for (int i = 0; i < channelLimit; i++) {
+            if (_pins[i] == GPIO_NUM_NC || _pins[i] > GPIO_NUM_39) continue;
+            uint32_t start = (uint32_t)_params[i].startUs;
+            uint32_t end = (uint32_t)_params[i].endUs;
+            bool active = _params[i].wraps ?
+                          (e.timeUs >= start || e.timeUs < end) :
+                          (e.timeUs >= start && e.timeUs < end);
+            if (active && i < 8) e.active |= (uint8_t)(1 << i);
+            int pin = (int)_pins[i];
+            if (pin < 32) {
+                if (active) e.lowMask |= (1UL << pin);
+                else e.highMask |= (1UL << pin);
+            } else {
+                if (active) e.lowMask1 |= (1UL << (pin - 32));
+                else e.highMask1 |= (1UL << (pin - 32));
+            }
+        }
+        if (syncOut) {
+            // Sync output is active-high (no inverter on that line).
+            int pin = (int)_syncPin;
+            bool high = e.timeUs < period / 2;
+            if (pin < 32) {
+                if (high) e.highMask |= (1UL << pin);
+                else e.lowMask |= (1UL << pin);
+            } else {
+                if (high) e.highMask1 |= (1UL << (pin - 32));
+                else e.lowMask1 |= (1UL << (pin - 32));
+            }
+        }
+    }
+    _numEdges = n;
+    _edgeCursor = 0;
+    _tableGen++;
+
+    // Reschedule: the pending alarm belongs to the old table. Re-evaluating
+    // EDGE_MIN_LEAD_US from now writes the new table's state at the current
+    // position (setGlobalFrequency keeps that position continuous), so no
+    // stale edge from the old period can fire afterwards.
+    if (_edgeTimerActive) _kickEdgeTimerLocked();
+}
+
+uint32_t PwmController::measureTickCycles(int iterations) {
+    if (iterations <= 0) iterations = 1;
+    uint32_t total = 0;
+    for (int i = 0; i < iterations; i++) {
+        uint32_t c0 = cpu_hal_get_cycle_count();
+        _commutationTick(this, false);
+        total += cpu_hal_get_cycle_count() - c0;
+    }
+    return total / (uint32_t)iterations;
+}
+
 void PwmController::setGlobalFrequency(float newHz) {
     #if USE_SYNC && !SYNC_AS_SERVER
         return; // Client ignores manual freq
     #endif
 
+    portENTER_CRITICAL(&_spinlock);
+    _setFrequencyLocked(newHz);
+    // Update params immediately inside lock to prevent tearing
+    for(int i=0; i<_numChannels; i++) updatePhaseParams(i);
+    rebuildEdgeTable();
+    portEXIT_CRITICAL(&_spinlock);
+    _pushCommutation();
+}
+
+void PwmController::_setFrequencyLocked(float newHz) {
     // DC / stationary: a non-positive or sub-microhertz frequency (or NaN) means
     // "don't rotate the field." Hold the commutation pattern static instead of
     // dividing by zero (1e6/newHz would). The carrier still sets current, so DC
     // with 0% carrier is a safe fully-stopped idle; this is begin()'s default.
     if (!(newHz >= 1e-6f)) {           // !(>=) also catches NaN
-        portENTER_CRITICAL(&_spinlock);
         _dcMode = true;
         _globalFreqHz = 0.0f;
         // _averagedPeriodUs keeps its last valid value (constructor seeds 20000us)
         // so the width/duty math and the ISR modulo stay well-defined; the ISR
         // freezes the phase while _dcMode is set, so no rotation occurs.
-        for (int i = 0; i < _numChannels; i++) updatePhaseParams(i);
-        portEXIT_CRITICAL(&_spinlock);
         return;
     }
     _dcMode = false;
@@ -314,8 +650,6 @@ void PwmController::setGlobalFrequency(float newHz) {
     int64_t now = esp_timer_get_time();
     _globalFreqHz = newHz;
 
-    portENTER_CRITICAL(&_spinlock);
-
     // === PHASE CONTINUITY CORRECTION ===
     if (_averagedPeriodUs > 0) {
         int64_t oldPos = (now - _lastSyncTimeUs) % _averagedPeriodUs;
@@ -329,11 +663,6 @@ void PwmController::setGlobalFrequency(float newHz) {
 
     _averagedPeriodUs = newPeriod;
     for(int i=0; i<FREQ_FILTER_SIZE; i++) _periodBuffer[i] = newPeriod;
-    
-    // Update params immediately inside lock to prevent tearing
-    for(int i=0; i<_numChannels; i++) updatePhaseParams(i);
-    
-    portEXIT_CRITICAL(&_spinlock);
 }
 
 void PwmController::setDutyCycle(int channel, float dutyPercent) {
@@ -342,7 +671,9 @@ void PwmController::setDutyCycle(int channel, float dutyPercent) {
     portENTER_CRITICAL(&_spinlock);
     _dutyCycles[channel] = constrain(dutyPercent, 0.0, 100.0);
     updatePhaseParams(channel);
+    rebuildEdgeTable();
     portEXIT_CRITICAL(&_spinlock);
+    _pushCommutation();
 }
 
 void PwmController::setPhase(int channel, float degrees) {
@@ -357,7 +688,75 @@ void PwmController::setPhase(int channel, float degrees) {
     portENTER_CRITICAL(&_spinlock);
     _phaseOffsetsPct[channel] = pct;
     updatePhaseParams(channel);
+    rebuildEdgeTable();
     portEXIT_CRITICAL(&_spinlock);
+    _pushCommutation();
+}
+
+bool PwmController::applyState(const DriveState &state) {
+    // Validate everything before touching anything: NAN means "leave as is",
+    // any other non-finite value rejects the whole state.
+    bool ok = !isinf(state.freqHz);
+    for (int i = 0; i < 4; i++) {
+        ok = ok && !isinf(state.dutyPct[i]) && !isinf(state.phaseDeg[i]) &&
+             !isinf(state.carrierPct[i]);
+    }
+    if (!ok) {
+        Serial.printf("[PwmController] applyState: non-finite field, ignored\n");
+        return false;
+    }
+
+    int n = _numChannels < 4 ? _numChannels : 4;
+    bool commutation = false;
+
+    // One critical section for frequency, duties and phases, so the tick never
+    // sees a half-applied state (new frequency with old phases).
+    portENTER_CRITICAL(&_spinlock);
+    #if !(USE_SYNC && !SYNC_AS_SERVER) // Client ignores manual freq
+    if (!isnan(state.freqHz)) {
+        _setFrequencyLocked(state.freqHz);
+        commutation = true;
+    }
+    #endif
+    for (int i = 0; i < n; i++) {
+        if (!isnan(state.dutyPct[i])) {
+            _dutyCycles[i] = constrain(state.dutyPct[i], 0.0f, 100.0f);
+            commutation = true;
+        }
+        #if !(USE_SYNC && SYNC_AS_SERVER) // Master ignores phase
+        if (!isnan(state.phaseDeg[i])) {
+            float pct = state.phaseDeg[i] / 360.0f;
+            pct -= floorf(pct);
+            _phaseOffsetsPct[i] = pct < 1.0f ? pct : 0.0f;
+            commutation = true;
+        }
+        #endif
+    }
+    if (commutation) {
+        for (int i = 0; i < _numChannels; i++) updatePhaseParams(i);
+        rebuildEdgeTable();
+    }
+    portEXIT_CRITICAL(&_spinlock);
+    if (commutation) _pushCommutation();
+
+    // Carriers, latched together. Balance on: they are ceilings, published to
+    // the control task once. Passthrough: stage every LEDC duty first, then
+    // latch them back to back so all channels switch on the same carrier period.
+    bool anyCarrier = false;
+    for (int i = 0; i < n; i++) anyCarrier = anyCarrier || !isnan(state.carrierPct[i]);
+    if (!anyCarrier) return true;
+    if (_balance) {
+        for (int i = 0; i < n; i++)
+            if (!isnan(state.carrierPct[i])) _ceiling[i] = state.carrierPct[i];
+        if (_controlTask) _publishSetpoints();
+        return true;
+    }
+    bool staged[4] = {false, false, false, false};
+    for (int i = 0; i < n; i++)
+        if (!isnan(state.carrierPct[i])) staged[i] = _writeCarrier(i, state.carrierPct[i], false);
+    for (int i = 0; i < n; i++)
+        if (staged[i]) ledc_update_duty(_carrierSpeedMode, (ledc_channel_t)i);
+    return true;
 }
 
 float PwmController::getFrequency() const {
@@ -377,6 +776,7 @@ float PwmController::getDutyCycle(int channel) const { return _dutyCycles[channe
 
 float PwmController::getCarrierDutyCycle(int channel) const {
     if (!_carrierDutyCyclePct || channel < 0 || channel >= _numChannels) return 0.0f;
+    if (_controlTask && channel < 4) return _view.carrierDuty[channel];
     return _carrierDutyCyclePct[channel];
 }
 
@@ -389,21 +789,33 @@ void PwmController::run() {
         for(int i=0; i<_numChannels; i++) {
             updatePhaseParams(i);
         }
+        rebuildEdgeTable();
         portEXIT_CRITICAL(&_spinlock);
+        _pushCommutation();
     }
 
     // Opted-in current sensing / overcurrent latch / PI balance. No-op if the
     // main never called enableCurrentSense(), so passthrough experiments are
     // untouched. Runs every call (NOT gated by the 100ms phase-drift block
     // above): the ADC is paced internally and the PI loop wants every iteration.
-    _serviceCurrentLoop();
+    // With the control task running, just pick up its latest snapshot (keep
+    // the previous one if this read raced a write).
+    if (_controlTask) {
+        ControlOutputs out;
+        if (_outputs.tryRead(out)) _view = out;
+        return;
+    }
+    _serviceCurrentLoop(_ceiling, false, _gains);
 }
 
 void PwmController::enableCurrentSense(const gpio_num_t *adcPins,
                                          const float *sensPerVolt,
-                                         float overcurrentTripA) {
+                                         float overcurrentTripA,
+                                         uint32_t adcSampleHz) {
     if (!adcPins || !sensPerVolt) return;
     if (!_sense) _sense = new CurrentSense(adcPins, sensPerVolt);
+    if (adcSampleHz > 0 && !_sense->dmaActive() && !_sense->enableDma(adcSampleHz))
+        Serial.printf("[PwmController] DMA current sense unavailable, polling\n");
     _sense->seed(); // coils must be OFF here (forceAllGatesLow + carriers at 0)
     _overcurrentTripA = overcurrentTripA;
     _tripped = false;
@@ -411,11 +823,59 @@ void PwmController::enableCurrentSense(const gpio_num_t *adcPins,
     _lastBalanceUs = _lastSenseUs;
 }
 
+bool PwmController::setCurrentSenseOversampling(uint8_t log2Factor) {
+    if (!_sense || _sense->dmaActive()) return false;
+    if (_controlTask) return false; // the task owns _sense
+    return _sense->setOversampling(log2Factor);
+}
+
+bool PwmController::setCurrentFilter(const CurrentFilter::Config &cfg) {
+    if (!_sense || _controlTask) return false; // the task owns _sense
+    _sense->setFilter(cfg);
+    return true;
+}
+
+bool PwmController::enableZeroTracking(const CurrentSense::ZeroTrackConfig &cfg) {
+    if (!_sense || _controlTask) return false; // the task owns _sense
+    _sense->enableZeroTracking(cfg);
+    return true;
+}
+
+const float *PwmController::zeroDrift() const {
+    if (!_sense) return nullptr;
+    return _controlTask ? _view.zeroDrift : _sense->zeroDrift;
+}
+
+uint32_t PwmController::zeroUpdates() const {
+    if (!_sense) return 0;
+    return _controlTask ? _view.zeroUpdates : _sense->zeroUpdates();
+}
+
+uint32_t PwmController::zeroRejects() const {
+    if (!_sense) return 0;
+    return _controlTask ? _view.zeroRejects : _sense->zeroRejects();
+}
+
+bool PwmController::_carriersAllOff() const {
+    if (!_carrierPinsArray || !_carrierDutyCyclePct) return false;
+    for (int i = 0; i < _numChannels; i++) {
+        if (_carrierPinsArray[i] != GPIO_NUM_NC && _carrierDutyCyclePct[i] > 0.0f)
+            return false;
+    }
+    return true;
+}
+
 void PwmController::enableCurrentBalance(const BalanceConfig &cfg,
-                                           float startDuty) {
+                                           float startDuty, float controlRateHz) {
     // Balance needs the sensed currents; enableCurrentSense() must precede this.
     if (!_sense) return;
-    if (!_balance) _balance = new CurrentBalanceController(cfg);
+    _stopControlTask(); // re-enable: never reset a controller the task is stepping
+    if (!_balance) {
+        _balance = new CurrentBalanceController(cfg);
+        _setpointsLocal.kp = cfg.kp; // the fixed gains a gain schedule falls back to
+        _setpointsLocal.ki = cfg.ki;
+        _setpointsLocal.kd = cfg.kd;
+    }
     _startDuty = startDuty;
     _balance->reset(startDuty);
     for (int i = 0; i < 4; i++) {
@@ -423,18 +883,337 @@ void PwmController::enableCurrentBalance(const BalanceConfig &cfg,
         _balanceDuty[i] = startDuty;
     }
     _lastBalanceUs = micros();
+
+    if (controlRateHz > 0.0f) _startControlTask(controlRateHz);
 }
 
 void PwmController::setBalanceGains(float kp, float ki, float kd) {
-    if (_balance) _balance->setGains(kp, ki, kd);
+    if (!_balance) return;
+    _setpointsLocal.kp = kp;
+    _setpointsLocal.ki = ki;
+    _setpointsLocal.kd = kd;
+    if (_controlTask) {
+        _setpointsLocal.tuningGen++;
+        _publishSetpoints();
+        return;
+    }
+    if (!_gains.size()) _balance->setGains(kp, ki, kd);
 }
 
 void PwmController::setBalanceRamp(float pctPerMs) {
-    if (_balance) _balance->setRamp(pctPerMs);
+    if (!_balance) return;
+    if (_controlTask) {
+        _setpointsLocal.rampPctPerMs = pctPerMs;
+        _setpointsLocal.tuningGen++;
+        _publishSetpoints();
+        return;
+    }
+    _balance->setRamp(pctPerMs);
+}
+
+bool PwmController::setBalanceGainSchedule(const BalanceGainPoint *points, int n) {
+    if (!_balance) return false;
+    BalanceGainSchedule g;
+    if (!g.set(points, n)) {
+        Serial.printf("[PwmController] gain schedule rejected (%d points; max %d, "
+                      "ascending freq, gains >= 0)\n", n, BalanceGainSchedule::MAX_POINTS);
+        return false;
+    }
+    _gains = g;
+    if (_controlTask) {
+        _gainsOut.write(g);
+        _setpointsLocal.gainsGen++;
+        _publishSetpoints();
+        return true;
+    }
+    _gainsHz = NAN;
+    if (!n) _balance->retuneGains(_setpointsLocal.kp, _setpointsLocal.ki, _setpointsLocal.kd);
+    return true;
+}
+
+bool PwmController::enableSynchronousSampling(int fieldBins, bool carrierMidOn,
+                                              float trimUs) {
+    if (!_sense || !_sense->dmaActive()) {
+        Serial.printf("[PwmController] synchronous sampling needs the DMA ADC "
+                      "(enableCurrentSense(..., adcSampleHz))\n");
+        return false;
+    }
+    if (_controlTask) {
+        Serial.printf("[PwmController] enable synchronous sampling before the control task\n");
+        return false;
+    }
+    if (carrierMidOn) {
+        if (!_carrierPinsArray || _carrierFreqHz <= 0.0f) {
+            Serial.printf("[PwmController] carrierMidOn needs initCarrierPWM first\n");
+            return false;
+        }
+        // Every channel comes round once per scan of 2*N conversions; that
+        // must be a whole number of carrier periods for its phase to hold.
+        float periods = _carrierFreqHz * 2.0f * CurrentSense::N /
+                        (float)_sense->dmaSampleHz();
+        if (periods < 0.5f || fabsf(periods - roundf(periods)) > 1e-4f) {
+            Serial.printf("[PwmController] %.0f Hz carrier is not coherent with the "
+                          "%u Hz ADC scan\n",
+                          _carrierFreqHz, (unsigned)_sense->dmaSampleHz());
+            return false;
+        }
+    }
+    if (!_sense->enableSyncSampling(fieldBins, trimUs)) return false;
+    _syncSampling = true;
+    _carrierMidOn = carrierMidOn;
+    _updateFieldRef();
+    if (_carrierMidOn) _alignCarriers();
+    return true;
+}
+
+bool PwmController::phaseCurrents(int channel, float *out) const {
+    if (!_syncSampling || !out || channel < 0 || channel >= CurrentSense::N) return false;
+    const int bins = _sense->phaseBins();
+    if (_controlTask) {
+        PhaseSnapshot snap;
+        _phaseOut.read(snap);
+        for (int b = 0; b < bins; b++) out[b] = snap.a[channel][b];
+    } else {
+        const float *a = _sense->phaseCurrents(channel);
+        for (int b = 0; b < bins; b++) out[b] = a[b];
+    }
+    return true;
+}
+
+const float *PwmController::fieldCurrents() const {
+    if (!_syncSampling) return nullptr;
+    return _controlTask ? _view.iField : _sense->i_field;
+}
+
+const float *PwmController::fundamentalCurrents() const {
+    if (!_syncSampling) return nullptr;
+    return _controlTask ? _view.iFund : _sense->i_fund;
+}
+
+const float *PwmController::fundamentalPhases() const {
+    if (!_syncSampling) return nullptr;
+    return _controlTask ? _view.fundPhaseDeg : _sense->fundPhaseDeg;
+}
+
+void PwmController::_updateFieldRef() {
+    // The software tick's own clock: timeInCycle = (now - _lastSyncTimeUs) %
+    // period. MCPWM keeps its phase in hardware, so there is no reference.
+    CurrentSense::FieldRef ref;
+    portENTER_CRITICAL(&_spinlock);
+    ref.cycleStartUs = _lastSyncTimeUs;
+    ref.periodUs = (uint32_t)_averagedPeriodUs;
+    ref.valid = !_dcMode && !_mcpwm;
+    portEXIT_CRITICAL(&_spinlock);
+    _sense->setFieldRef(ref);
+}
+
+void PwmController::_alignCarriers() {
+    // Carrier phase 0 in esp_timer time: counter and clock read back to back.
+    // Both run off the crystal, so this holds for as long as the ADC stream.
+    const uint32_t ticks = 1UL << _carrierDutyResolutionBits;
+    const uint32_t periodNs = (uint32_t)(1e9f / _carrierFreqHz);
+    portENTER_CRITICAL(&_spinlock);
+    uint32_t cnt = LEDC.timer_group[_carrierSpeedMode].timer[_carrierTimer].value.timer_cnt;
+    int64_t nowUs = esp_timer_get_time();
+    portEXIT_CRITICAL(&_spinlock);
+    int64_t zeroNs = nowUs * 1000 - (int64_t)((uint64_t)cnt * periodNs / ticks);
+
+    for (int i = 0; i < _numChannels && i < 4; i++) {
+        float phase = _sense->samplePhase(i, zeroNs, periodNs);
+        _carrierCenterTicks[i] = (uint32_t)lroundf(phase * ticks) % ticks;
+        // Re-issue the live duty so the new hpoint takes effect now.
+        if (_carrierLedcConfigured[i]) {
+            _carrierLastDutyTicks[i] = UINT32_MAX;
+            _writeCarrier(i, _carrierDutyCyclePct[i]);
+        }
+    }
+    _streamGenSeen = _sense->streamGen();
+}
+
+uint32_t PwmController::_carrierHpoint(int channel, uint32_t dutyTicks) const {
+    if (!_carrierMidOn || channel >= 4) return 0;
+    // On-window [hpoint, hpoint + duty) centred on the sample instant, kept
+    // inside the period (a window that wrapped would split the pulse).
+    const int32_t ticks = 1L << _carrierDutyResolutionBits;
+    int32_t h = (int32_t)_carrierCenterTicks[channel] - (int32_t)(dutyTicks / 2);
+    if (h < 0) h = 0;
+    if (h + (int32_t)dutyTicks > ticks) h = ticks - (int32_t)dutyTicks;
+    return (uint32_t)h;
 }
 
 const float *PwmController::measuredCurrents() const {
-    return _sense ? _sense->i_meas : nullptr;
+    if (!_sense) return nullptr;
+    return _controlTask ? _view.iMeas : _sense->i_meas;
+}
+
+void PwmController::_publishSetpoints() {
+    for (int i = 0; i < 4; i++) _setpointsLocal.ceiling[i] = _ceiling[i];
+    _setpoints.write(_setpointsLocal);
+}
+
+void PwmController::_startControlTask(float rateHz) {
+    // Seed both sides of the exchange from the current (just reset) state so
+    // the first iteration and the first run() see something sane.
+    // The gains stay as setBalanceGains left them: with a gain schedule the
+    // controller's own are the scheduled ones.
+    _setpointsLocal.rampPctPerMs = _balance->config().minRampPctPerMs;
+    _publishSetpoints();
+    _taskSetpoints = _setpointsLocal;
+    _tuningGenSeen = _setpointsLocal.tuningGen;
+    _gainsOut.write(_gains);
+    _taskGains = _gains;
+    _gainsGenSeen = _setpointsLocal.gainsGen;
+    _gainsHz = NAN;
+    for (int i = 0; i < 4; i++) {
+        _view.iMeas[i] = _sense->i_meas[i];
+        _view.iField[i] = _sense->i_field[i];
+        _view.iFund[i] = _sense->i_fund[i];
+        _view.fundPhaseDeg[i] = _sense->fundPhaseDeg[i];
+        _view.carrierDuty[i] = getCarrierDutyCycle(i);
+        _view.zeroDrift[i] = _sense->zeroDrift[i];
+    }
+    _view.zeroUpdates = _sense->zeroUpdates();
+    _view.zeroRejects = _sense->zeroRejects();
+    _view.tripped = _tripped;
+    _outputs.write(_view);
+    _loopStats.beginWrite().reset();
+    _loopStats.endWrite();
+    _ctlPrimed = false;
+    _controlRateHz = rateHz;
+    _controlPeriodCycles = (uint32_t)((float)_cpuMhz * 1000000.0f / rateHz);
+    _controlStop = false;
+    _controlExited = false;
+
+    // The other core from the caller: loop() runs on core 1, so normally core 0,
+    // away from the loop task and the commutation edge ISR.
+    const BaseType_t core = xPortGetCoreID() ? 0 : 1;
+    TaskHandle_t task = nullptr;
+    if (xTaskCreatePinnedToCore(_controlTaskMain, "pwm_ctl", CONTROL_TASK_STACK, this,
+                                CONTROL_TASK_PRIORITY, &task, core) != pdPASS) {
+        Serial.printf("[PwmController] control task create failed, balancing inline\n");
+        return;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &_controlTimerCallback,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "pwm_ctl"
+    };
+    if (esp_timer_create(&timer_args, &_controlTimer) != ESP_OK) {
+        _controlStop = true;
+        xTaskNotifyGive(task);
+        Serial.printf("[PwmController] control timer create failed, balancing inline\n");
+        return;
+    }
+    _controlTask = task;
+    esp_timer_start_periodic(_controlTimer, (uint64_t)(1000000.0f / rateHz));
+}
+
+void PwmController::_stopControlTask() {
+    if (!_controlTask) return;
+    if (_controlTimer) {
+        esp_timer_stop(_controlTimer);
+        esp_timer_delete(_controlTimer);
+        _controlTimer = nullptr;
+    }
+    _controlStop = true;
+    xTaskNotifyGive(_controlTask);
+    // The task exits as soon as its current step ends. Until then it still
+    // owns _sense, _balance and the seqlocks, so wait it out however long it
+    // takes: a re-enable must never start a second one beside it.
+    for (uint32_t t = 0; !_controlExited; t++) {
+        if (t == 100) Serial.printf("[PwmController] control task slow to stop, waiting\n");
+        vTaskDelay(1);
+    }
+    _controlTask = nullptr;
+}
+
+void PwmController::_controlTimerCallback(void *arg) {
+    PwmController *self = (PwmController *)arg;
+    if (self->_controlTask) xTaskNotifyGive(self->_controlTask);
+}
+
+void PwmController::_controlTaskMain(void *arg) {
+    PwmController *self = (PwmController *)arg;
+    for (;;) {
+        // Notification count > 1 => ticks arrived while the last iteration ran.
+        uint32_t pending = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (self->_controlStop) break;
+        if (pending) self->_controlStep(pending);
+    }
+    self->_controlExited = true;
+    vTaskDelete(nullptr);
+}
+
+void PwmController::_controlStep(uint32_t pending) {
+    uint32_t entry = cpu_hal_get_cycle_count();
+
+    // Never wait on loop(): if this read raced a setpoint write, run one more
+    // period on the previous setpoints.
+    ControlSetpoints sp;
+    if (_setpoints.tryRead(sp)) _taskSetpoints = sp;
+    if (_taskSetpoints.tuningGen != _tuningGenSeen) {
+        if (!_taskGains.size())
+            _balance->setGains(_taskSetpoints.kp, _taskSetpoints.ki, _taskSetpoints.kd);
+        _balance->setRamp(_taskSetpoints.rampPctPerMs);
+        _tuningGenSeen = _taskSetpoints.tuningGen;
+    }
+    // A torn table read is retried next period (gainsGen is still unseen).
+    if (_taskSetpoints.gainsGen != _gainsGenSeen && _gainsOut.tryRead(_taskGains)) {
+        if (!_taskGains.size())
+            _balance->retuneGains(_taskSetpoints.kp, _taskSetpoints.ki, _taskSetpoints.kd);
+        _gainsGenSeen = _taskSetpoints.gainsGen;
+        _gainsHz = NAN;
+    }
+
+    _serviceCurrentLoop(_taskSetpoints.ceiling, true, _taskGains);
+
+    ControlOutputs &out = _outputs.beginWrite();
+    for (int i = 0; i < 4; i++) {
+        out.iMeas[i] = _sense->i_meas[i];
+        out.iField[i] = _sense->i_field[i];
+        out.iFund[i] = _sense->i_fund[i];
+        out.fundPhaseDeg[i] = _sense->fundPhaseDeg[i];
+        out.carrierDuty[i] = (_carrierDutyCyclePct && i < _numChannels)
+                                 ? _carrierDutyCyclePct[i] : 0.0f;
+        out.zeroDrift[i] = _sense->zeroDrift[i];
+    }
+    out.zeroUpdates = _sense->zeroUpdates();
+    out.zeroRejects = _sense->zeroRejects();
+    out.tripped = _tripped;
+    _outputs.endWrite();
+    if (_syncSampling) {
+        PhaseSnapshot &ph = _phaseOut.beginWrite();
+        for (int i = 0; i < 4; i++)
+            memcpy(ph.a[i], _sense->phaseCurrents(i), sizeof(ph.a[i]));
+        _phaseOut.endWrite();
+    }
+
+    uint32_t busy = cpu_hal_get_cycle_count() - entry;
+    if (_loopStatsReset.exchange(false)) {
+        _loopStats.beginWrite().reset();
+        _loopStats.endWrite();
+        _ctlPrimed = false;
+    }
+    ControlLoopStats &st = _loopStats.beginWrite();
+    if (_ctlPrimed) st.interval.add(entry - _ctlLastEntry);
+    st.busy.add(busy);
+    if (busy > _controlPeriodCycles) st.overruns++;
+    if (pending > 1) st.missed += pending - 1;
+    _loopStats.endWrite();
+    _ctlLastEntry = entry;
+    _ctlPrimed = true;
+}
+
+bool PwmController::controlLoopStats(ControlLoopStats &out) const {
+    if (!_controlTask) return false;
+    _loopStats.read(out);
+    return true;
+}
+
+void PwmController::resetControlLoopStats() {
+    _loopStatsReset = true; // the task is the only writer; it resets on its next step
 }
 
 float PwmController::carrierCeiling(int channel) const {
@@ -443,17 +1222,33 @@ float PwmController::carrierCeiling(int channel) const {
     return getCarrierDutyCycle(channel);
 }
 
-void PwmController::_serviceCurrentLoop() {
+void PwmController::_serviceCurrentLoop(const float *ceiling, bool fixedRate,
+                                        const BalanceGainSchedule &gains) {
     if (!_sense) return;
 
     unsigned long nowUs = micros();
     // ADC pacing: the ESP32 ADC needs real settling time between conversions,
-    // separate from the control-loop rate below.
+    // separate from the control-loop rate below. The control task's period
+    // already is that pacing. With DMA the same 1 ms just sets how often the
+    // buffer is drained; an update with no new scan keeps dt accumulating.
     float dtSenseMs = (float)(nowUs - _lastSenseUs) / 1000.0f;
-    if (dtSenseMs >= 1.0f) {
-        _sense->update(dtSenseMs);
-        _lastSenseUs = nowUs;
+    if (_syncSampling) _updateFieldRef();
+    // Drive frequency (getFrequency(), read consistently) for the filter and
+    // the gain schedule.
+    float driveHz = 0.0f;
+    if (_sense->filterActive() || (_balance && gains.size())) {
+        portENTER_CRITICAL(&_spinlock);
+        const int64_t periodUs = _averagedPeriodUs;
+        const bool dc = _dcMode;
+        portEXIT_CRITICAL(&_spinlock);
+        driveHz = dc || periodUs <= 0 ? 0.0f : 1e6f / (float)periodUs;
     }
+    if (_sense->filterActive()) _sense->setDriveFrequency(driveHz);
+    // The carriers as last written, i.e. for the interval this update reads.
+    if (_sense->zeroTrackingActive()) _sense->setCoilsOff(_carriersAllOff());
+    if ((fixedRate || dtSenseMs >= 1.0f) && _sense->update(dtSenseMs))
+        _lastSenseUs = nowUs;
+    if (_carrierMidOn && _sense->streamGen() != _streamGenSeen) _alignCarriers();
 
     // Hard overcurrent latch: once tripped, force every carrier to 0 and stay
     // there (only a reboot clears it), regardless of what the schedule commands.
@@ -474,7 +1269,24 @@ void PwmController::_serviceCurrentLoop() {
         float dtCtrlMs = (float)(nowUs - _lastBalanceUs) / 1000.0f;
         if (dtCtrlMs <= 0.0f) dtCtrlMs = 0.001f; // guard div-by-zero only
         _lastBalanceUs = nowUs;
-        _balance->step(_sense->i_meas, dtCtrlMs, _ceiling, _balanceDuty);
+        const float *in = _sense->i_meas;
+        const uint8_t signal = _balanceSignal.load(std::memory_order_relaxed);
+        if (signal != (uint8_t)BalanceSignal::FILTERED) {
+            const float *alt = signal == (uint8_t)BalanceSignal::FUNDAMENTAL
+                                   ? _sense->i_fund : _sense->i_field;
+            for (int i = 0; i < 4; i++)
+                _balanceInput[i] = isnan(alt[i]) ? _sense->i_meas[i] : alt[i];
+            in = _balanceInput;
+        }
+        // Re-evaluated only when the drive frequency moves (or the table does).
+        if (gains.size() && driveHz != _gainsHz) {
+            _gainsHz = driveHz;
+            float kp, ki, kd;
+            gains.at(driveHz, kp, ki, kd);
+            const BalanceConfig &bc = _balance->config();
+            if (kp != bc.kp || ki != bc.ki || kd != bc.kd) _balance->retuneGains(kp, ki, kd);
+        }
+        _balance->step(in, dtCtrlMs, ceiling, _balanceDuty);
         for (int i = 0; i < _numChannels && i < 4; i++)
             _writeCarrier(i, _balanceDuty[i]);
     }
@@ -555,27 +1367,28 @@ void PwmController::setCarrierDutyCycle(int channel, float dutyPercent) {
     // (balance off) writes straight through, exactly as before.
     if (_balance) {
         if (channel < 4) _ceiling[channel] = dutyPercent;
+        if (_controlTask) _publishSetpoints();
         return;
     }
     _writeCarrier(channel, dutyPercent);
 }
 
-void PwmController::_writeCarrier(int channel, float dutyPercent) {
-    if (channel < 0 || channel >= _numChannels) return;
-    if (!_carrierPinsArray || !_carrierDutyCyclePct) return;
-    if (_carrierPinsArray[channel] == GPIO_NUM_NC) return;
-    if (_carrierFreqHz <= 0.0f) return;
+bool PwmController::_writeCarrier(int channel, float dutyPercent, bool latch) {
+    if (channel < 0 || channel >= _numChannels) return false;
+    if (!_carrierPinsArray || !_carrierDutyCyclePct) return false;
+    if (_carrierPinsArray[channel] == GPIO_NUM_NC) return false;
+    if (_carrierFreqHz <= 0.0f) return false;
 
     if (dutyPercent >= 100.0f) {
         if (_carrierDutyCyclePct[channel] >= 100.0f && !_carrierLedcConfigured[channel]) {
-            return; // already stopped, nothing to do
+            return false; // already stopped, nothing to do
         }
         _carrierDutyCyclePct[channel] = 100.0f;
         // 100% duty = carrier permanently ON. No inverter on the carrier line, so
         // stop LEDC and park the pin HIGH (idle_level = 1) = full drive to the bridge.
         ledc_stop(_carrierSpeedMode, (ledc_channel_t)channel, 1);
         _carrierLedcConfigured[channel] = false; // pin must be re-attached on next PWM duty
-        return;
+        return false;
     }
 
     float periodMs = 1000.0f / _carrierFreqHz;
@@ -598,32 +1411,37 @@ void PwmController::_writeCarrier(int channel, float dutyPercent) {
             .intr_type = LEDC_INTR_DISABLE,
             .timer_sel = _carrierTimer,
             .duty = dutyValue,
-            .hpoint = 0,
+            .hpoint = (int)_carrierHpoint(channel, dutyValue),
             .flags = {.output_invert = 0}
         };
         esp_err_t err = ledc_channel_config(&ledc_channel);
         if (err != ESP_OK) {
             Serial.printf("[PwmController] ledc_channel_config ch%d pin%d failed: %d\n",
                           channel, (int)_carrierPinsArray[channel], (int)err);
-            return; // stay unconfigured so the next call retries
+            return false; // stay unconfigured so the next call retries
         }
         // Explicit update: after ledc_stop() some IDF versions don't restart
         // the output from ledc_channel_config() alone.
-        ledc_set_duty(_carrierSpeedMode, (ledc_channel_t)channel, dutyValue);
+        ledc_set_duty_with_hpoint(_carrierSpeedMode, (ledc_channel_t)channel, dutyValue,
+                                  _carrierHpoint(channel, dutyValue));
         ledc_update_duty(_carrierSpeedMode, (ledc_channel_t)channel);
         _carrierLedcConfigured[channel] = true;
         _carrierLastDutyTicks[channel] = dutyValue;
-        return;
+        return false;
     }
 
     // Skip writes that don't change the duty at hardware resolution. This also
     // rate-limits ramps that call this function every loop() iteration.
-    if (dutyValue == _carrierLastDutyTicks[channel]) return;
+    if (dutyValue == _carrierLastDutyTicks[channel]) return false;
 
     // Glitch-free update: latched by hardware at the next PWM period boundary.
-    ledc_set_duty(_carrierSpeedMode, (ledc_channel_t)channel, dutyValue);
-    ledc_update_duty(_carrierSpeedMode, (ledc_channel_t)channel);
+    // hpoint is 0 unless synchronous sampling centres the pulse.
+    ledc_set_duty_with_hpoint(_carrierSpeedMode, (ledc_channel_t)channel, dutyValue,
+                              _carrierHpoint(channel, dutyValue));
     _carrierLastDutyTicks[channel] = dutyValue;
+    if (!latch) return true; // caller issues ledc_update_duty (applyState)
+    ledc_update_duty(_carrierSpeedMode, (ledc_channel_t)channel);
+    return false;
 }
 
 void PwmController::shutdown(unsigned long rampMs) {
@@ -633,7 +1451,7 @@ void PwmController::shutdown(unsigned long rampMs) {
     float startDuty[16];
     int n = _numChannels < 16 ? _numChannels : 16;
     for (int i = 0; i < n; i++)
-        startDuty[i] = _carrierDutyCyclePct ? _carrierDutyCyclePct[i] : 0.0f;
+        startDuty[i] = getCarrierDutyCycle(i);
 
     const int steps = 50;
     unsigned long stepMs = rampMs / steps;
@@ -646,11 +1464,14 @@ void PwmController::shutdown(unsigned long rampMs) {
     }
 
     // Force fully off (LEDC output held LOW = bridge disabled), then freeze the
-    // phase GPIOs by stopping the periodic timer. Object/timer stay allocated.
+    // phase GPIOs by stopping the commutation timer. Object/timer stay allocated.
     for (int i = 0; i < n; i++)
         setCarrierDutyCycle(i, 0.0f);
+    _stopEdgeTimer();
     if (_periodicTimer)
         esp_timer_stop(_periodicTimer);
+    if (_mcpwm)
+        _mcpwm->stop();
 }
 
 bool PwmController::rampDownStep(float stepPct) {
@@ -658,7 +1479,7 @@ bool PwmController::rampDownStep(float stepPct) {
     if (stepPct <= 0.0f) stepPct = 0.1f;   // guard: must make progress
     bool allZero = true;
     for (int i = 0; i < _numChannels; i++) {
-        float cur = _carrierDutyCyclePct[i];
+        float cur = getCarrierDutyCycle(i);
         if (cur <= 0.0f) continue;         // already down
         float next = cur - stepPct;        // subtract from the LIVE value
         if (next < 0.0f) next = 0.0f;
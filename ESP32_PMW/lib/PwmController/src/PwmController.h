@@ -2,12 +2,26 @@
 
 #include "driver/gpio.h"
 #include "driver/ledc.h"
+#include "driver/timer.h"
 #include "esp_timer.h"
+#include "freertos/task.h"
 #include <Arduino.h>
+#include <atomic>
 
+#include "CommutationStats.h"         // commutation timing histograms
 #include "CurrentBalanceController.h" // folded-in current-balance PI (opt-in)
+#include "McpwmCommutator.h"          // hardware commutation backend (opt-in)
+#include "SeqLock.h"                  // control-task <-> loop() state exchange
 #include "current_sense.h"            // folded-in VNH5019 CS reader (opt-in)
 
+// Hardware timer the commutation edge scheduler claims, numbered as Arduino's
+// timerBegin() does (0..3). Reserved from begin() on: a sketch that needs
+// timer 3 builds with -D PWM_EDGE_TIMER=<another>.
+#ifndef PWM_EDGE_TIMER
+#define PWM_EDGE_TIMER 3
+#endif
+static_assert(PWM_EDGE_TIMER >= 0 && PWM_EDGE_TIMER <= 3, "PWM_EDGE_TIMER is 0..3");
+
 #define FREQ_FILTER_SIZE 5
 
 struct PhaseParams {
@@ -16,6 +30,39 @@ struct PhaseParams {
   bool wraps;
 };
 
+// One segment of the field period: from timeUs (offset within the cycle) until
+// the next entry, every coil pin (and the USE_SYNC server output) holds this
+// state. Precomputed from PhaseParams so a commutation tick is a lookup plus
+// one set/clear register write per bank, and the next entry's timeUs is when
+// the edge scheduler has to wake up again.
+struct CommutationEdge {
+  uint32_t timeUs;
+  uint32_t highMask;  // GPIO0-31 driven HIGH (coil off, inverter logic)
+  uint32_t lowMask;   // GPIO0-31 driven LOW (coil on)
+  uint32_t highMask1; // GPIO32-39, bit n = GPIO(32+n)
+  uint32_t lowMask1;
+  uint8_t active;     // bit i = channel i on (instrumentation)
+};
+
+// A full drive command for PwmController::applyState(). NAN leaves a field as
+// it is, so a caller can send only what changed. freqHz <= 0 is DC, exactly
+// like setGlobalFrequency().
+struct DriveState {
+  float freqHz = NAN;
+  float dutyPct[4] = {NAN, NAN, NAN, NAN};
+  float phaseDeg[4] = {NAN, NAN, NAN, NAN};
+  float carrierPct[4] = {NAN, NAN, NAN, NAN}; // ceilings when balance is on
+};
+
+// What the balance loop regulates (PwmController::setBalanceSignal).
+enum class BalanceSignal : uint8_t {
+  FILTERED,   // CurrentSense::i_meas, the EMA-filtered reading (default)
+  FIELD_MEAN, // CurrentSense::i_field, one field period of synchronous samples;
+              // falls back to FILTERED per channel while it's NAN
+  FUNDAMENTAL, // CurrentSense::i_fund, amplitude at the field frequency (the
+               // part that makes thrust); same fallback
+};
+
 class PwmController {
 public:
   // Per-channel arrays of length numChannels: pins, phase offsets (deg),
@@ -24,7 +71,11 @@ public:
                   const float *dutyCycles, int numChannels);
   ~PwmController();
 
-  void begin(float initialFreqHz = 0.0f); ///< Init hardware; default (0) starts in DC (stationary, non-rotating) mode.
+  /// Init hardware; default (0) starts in DC (stationary, non-rotating) mode.
+  /// Commutation runs on a one-shot hardware timer armed for the next edge
+  /// (edgeScheduler()); if that timer can't be claimed it falls back to the
+  /// fixed 25us esp_timer poll.
+  void begin(float initialFreqHz = 0.0f);
   void run();                             ///< Drift compensation; call every loop().
 
   // Configuration
@@ -33,6 +84,17 @@ public:
   void setDutyCycle(int channel, float dutyPercent); ///< 0-100%.
   void setPhase(int channel, float degrees);         ///< 0-360 deg.
 
+  /**
+   * @brief Apply frequency, duties, phases and carriers as one update. Each
+   *        field is validated first. Frequency, duties and phases then commit
+   *        under a single lock hold, with one edge-table rebuild, so the tick
+   *        never sees a half-applied state. The carrier duties latch on the
+   *        same carrier period. Same per-field rules as the individual setters
+   *        (clamping, USE_SYNC client/server ignores).
+   * @return false (nothing applied) if any field is +-inf.
+   */
+  bool applyState(const DriveState &state);
+
   // Getters
   float getFrequency() const;            ///< Global frequency (Hz); 0 in DC mode.
   bool isDC() const { return _dcMode; }  ///< True when the field is held static (freq <= 0).
@@ -41,6 +103,33 @@ public:
 
   void enableSync(gpio_num_t syncPin); ///< Sync PWM to an external pulse on syncPin.
 
+  /// True while the one-shot edge scheduler (not the 25us poll) drives the pins.
+  bool edgeScheduler() const { return _edgeTimerActive; }
+
+  /**
+   * @brief Move commutation from the software edge timer onto the MCPWM
+   *        peripheral (see McpwmCommutator.h): edges are placed in hardware at
+   *        0.1-1.6us resolution with no task jitter and no CPU cost. Call after
+   *        begin(). setGlobalFrequency/setPhase/setDutyCycle, DC mode and the
+   *        USE_SYNC server output behave exactly as before.
+   * @return false (software timer stays in charge) for a USE_SYNC client, whose
+   *         phase comes from the sync ISR, or if the peripheral can't be set up.
+   */
+  bool enableMcpwmCommutation();
+  bool hardwareCommutation() const { return _mcpwm != nullptr; }
+
+  /** @brief Mean CPU cycles of one software commutation tick, measured by
+   *  running it inline `iterations` times (outputs are rewritten with the
+   *  state they already hold). Benchmark hook: src/examples/main_commutation_bench.cpp. */
+  uint32_t measureTickCycles(int iterations = 1000);
+
+  /** @brief Snapshot of the always-on software commutation timing histograms
+   *  (dispatch latency, tick duration, per-channel edge error; all in CPU
+   *  cycles, see cpuMhz()). Empty while MCPWM commutation is active. */
+  void commutationStats(CommutationStats &out);
+  void resetCommutationStats();
+  uint32_t cpuMhz() const { return _cpuMhz; }
+
   // Carrier PWM (multi-channel). pins[]/dutyPercents[] per channel; freqHz shared.
   void initCarrierPWM(const gpio_num_t *pins, float freqHz,
                       const float *dutyPercents);
@@ -62,9 +151,14 @@ public:
    * @param adcPins           VNH5019 CS ADC pins (constants.h::ADC_PINS).
    * @param sensPerVolt       per-board CS calibration, A/V (4 channels).
    * @param overcurrentTripA  per-channel latch level (A); 0 disables.
+   * @param adcSampleHz  0 (default): run() polls analogRead() every
+   *        1 ms. > 0: ADC1 scans the pins continuously over DMA at this total
+   *        conversion rate (e.g. CurrentSense::DMA_DEFAULT_SAMPLE_HZ) and each
+   *        sense update averages everything that arrived since the last one.
+   *        Falls back to polling if the DMA driver can't be started.
    */
   void enableCurrentSense(const gpio_num_t *adcPins, const float *sensPerVolt,
-                          float overcurrentTripA = 0.0f);
+                          float overcurrentTripA = 0.0f, uint32_t adcSampleHz = 0);
 
   /**
    * @brief Enable the current-balance PI loop (call enableCurrentSense first).
@@ -74,15 +168,33 @@ public:
    *        Leave off for characterization sweeps (carriers pass through verbatim).
    * @param cfg        balance tuning (defaults = converged KP/KI/KD).
    * @param startDuty  duty every channel begins equal at (default 50%).
+   * @param controlRateHz  0 (default): sensing/latch/PI run inline in run().
+   *        > 0: they run at this fixed rate (e.g. 1000) on a dedicated task
+   *        pinned to the other core, so serial parsing, telemetry and
+   *        sequencer work in loop() no longer jitter the PI dt. Setpoints and
+   *        readings then cross over through seqlocks; the getters below return
+   *        the snapshot run() last picked up.
    */
   void enableCurrentBalance(const BalanceConfig &cfg = BalanceConfig(),
-                            float startDuty = 50.0f);
+                            float startDuty = 50.0f, float controlRateHz = 0.0f);
 
   // Runtime balance tuning (the current_pid serial rig: kp=/ki=/kd=/ramp=).
   void setBalanceGains(float kp, float ki, float kd);
   
   void setBalanceRamp(float pctPerMs);
 
+  /**
+   * @brief Schedule the balance gains by drive frequency (see
+   *        BalanceGainSchedule): every step takes kp/ki/kd interpolated at
+   *        getFrequency() and moves to them bumplessly, so a sweep through
+   *        resonance doesn't kick the duties. While a table is set,
+   *        setBalanceGains only stores the fixed gains; n = 0 drops the table
+   *        and goes back to them. Call after enableCurrentBalance.
+   * @return false (table unchanged) with balance off or an invalid table.
+   */
+  bool setBalanceGainSchedule(const BalanceGainPoint *points, int n);
+  bool balanceGainScheduleActive() const { return _gains.size() > 0; }
+
   /** @brief Latest filtered per-channel current (A), or nullptr if sensing is
    *  off. Valid for the lifetime of the controller. */
   const float *measuredCurrents() const;
@@ -94,10 +206,79 @@ public:
 
   bool balanceActive() const { return _balance != nullptr; }
 
+  /// True while the fixed-rate control task (not run()) services sense/balance.
+  bool controlTaskActive() const { return _controlTask != nullptr; }
+  float controlRateHz() const { return _controlTask ? _controlRateHz : 0.0f; }
+
+  /** @brief Control task loop-rate / overrun statistics (CPU cycles, see
+   *  cpuMhz()). @return false (out untouched) when no control task runs. */
+  bool controlLoopStats(ControlLoopStats &out) const;
+  void resetControlLoopStats();
+
   bool currentSenseActive() const { return _sense != nullptr; }
+  /// Total DMA conversion rate, or 0 when sensing is off or polled.
+  uint32_t currentSenseSampleHz() const { return _sense ? _sense->dmaSampleHz() : 0; }
+  /// Polled sensing: 2^log2Factor raw reads per channel per update (0..4, see
+  /// CurrentSense::setOversampling). Call after enableCurrentSense and before
+  /// a control-task enableCurrentBalance. False when sensing is off or DMA.
+  bool setCurrentSenseOversampling(uint8_t log2Factor);
+  /// Run the sensed currents through a CurrentFilter chain instead of the
+  /// fixed 50 ms EMA; its notches / EMA follow getFrequency(). Call after
+  /// enableCurrentSense and before a control-task enableCurrentBalance.
+  /// False when sensing is off.
+  bool setCurrentFilter(const CurrentFilter::Config &cfg);
+  /// Re-track the current zero whenever every carrier is at 0% (the
+  /// schedule's rest phases, or after a trip), see
+  /// CurrentSense::enableZeroTracking. Call after enableCurrentSense and
+  /// before a control-task enableCurrentBalance. False when sensing is off.
+  bool enableZeroTracking(
+      const CurrentSense::ZeroTrackConfig &cfg = CurrentSense::ZeroTrackConfig());
+  bool zeroTrackingActive() const { return _sense && _sense->zeroTrackingActive(); }
+  /// Per-channel zero minus the enableCurrentSense() zero (A), or nullptr
+  /// when sensing is off; accepted / rejected averaging windows so far.
+  const float *zeroDrift() const;
+  uint32_t zeroUpdates() const;
+  uint32_t zeroRejects() const;
+
+  /**
+   * @brief Sample current synchronously with the drive (needs
+   *        enableCurrentSense(..., adcSampleHz); call before a control-task
+   *        enableCurrentBalance). The DMA samples are placed on the field
+   *        period and binned into fieldBins phase slots per channel
+   *        (phaseCurrents()), and their field-period mean is fieldCurrents().
+   *        carrierMidOn: also centre every carrier's on-time (LEDC hpoint) on
+   *        the instant its channel is sampled, so readings are taken mid-on,
+   *        away from the switching edges. That needs the ADC scan period to be
+   *        a whole number of carrier periods (the default 40 kHz ADC with the
+   *        20 kHz carrier is) and carrier PWM initialised first.
+   * @param trimUs  shifts the assumed sample instants (converter start
+   *        latency); 0 until measured on a scope.
+   * @return false (nothing changed) if a prerequisite is missing.
+   */
+  bool enableSynchronousSampling(int fieldBins = 16, bool carrierMidOn = true,
+                                 float trimUs = 0.0f);
+  bool synchronousSamplingActive() const { return _syncSampling; }
+  int phaseBins() const { return _syncSampling ? _sense->phaseBins() : 0; }
+  /** @brief Copy channel's phaseBins() field-phase bins (A, NAN = no sample
+   *  yet) into out. @return false (out untouched) when not active. */
+  bool phaseCurrents(int channel, float *out) const;
+  /** @brief Per-channel field-period mean of the synchronous samples (A, NAN
+   *  while incomplete or in DC mode), or nullptr when not active. */
+  const float *fieldCurrents() const;
+  /** @brief Per-channel fundamental at the field frequency, refitted every
+   *  field period from the synchronous samples: amplitude (A) and where its
+   *  peak sits in the period (deg from field phase 0). NAN until the first
+   *  full period; nullptr when synchronous sampling is off. */
+  const float *fundamentalCurrents() const;
+  const float *fundamentalPhases() const;
+  /// Which reading the balance loop regulates on (default FILTERED).
+  void setBalanceSignal(BalanceSignal signal) { _balanceSignal = (uint8_t)signal; }
+  BalanceSignal balanceSignal() const { return (BalanceSignal)_balanceSignal.load(); }
 
   /** @brief True once an overcurrent trip has latched all carriers off. */
-  bool overcurrentTripped() const { return _tripped; }
+  bool overcurrentTripped() const {
+    return _controlTask ? _view.tripped : _tripped;
+  }
 
   /**
    * @brief Gracefully de-energize all coils: ramp every carrier duty down to 0
@@ -124,16 +305,91 @@ private:
   // Minimum on/off period constraint: 0.0 ms
   const float MIN_ON_OFF_MS = 0.0f;
 
+  // Edge scheduler: hardware timer PWM_EDGE_TIMER (group n / 2, timer n % 2,
+  // as Arduino's timerBegin(n) numbers them), counting APB / 80 = 1us. Alarms are never armed closer than EDGE_MIN_LEAD_US (a
+  // target the 64-bit counter has already passed would not fire until it
+  // wraps), nor further out than EDGE_MAX_SLEEP_US, so DC mode and very slow
+  // fields are still re-evaluated.
+  static const timer_group_t EDGE_TIMER_GROUP = (timer_group_t)(PWM_EDGE_TIMER / 2);
+  static const timer_idx_t EDGE_TIMER_IDX = (timer_idx_t)(PWM_EDGE_TIMER % 2);
+  static const uint32_t EDGE_TIMER_DIVIDER = 80;
+  static const uint32_t EDGE_MIN_LEAD_US = 3;
+  static const uint32_t EDGE_MAX_SLEEP_US = 5000;
+
   // Internal methods
-  static void IRAM_ATTR _timerCallback(void *arg);
+  static void IRAM_ATTR _timerCallback(void *arg);   // 25us poll (fallback)
+  static bool IRAM_ATTR _edgeTimerIsr(void *arg);    // one-shot edge alarm
+  // The tick body; record=false for measureTickCycles() so a benchmark run
+  // from another task doesn't pollute the stats or re-arm the edge timer.
+  static void IRAM_ATTR _commutationTick(PwmController *self, bool record);
+  void IRAM_ATTR _recordTickLocked(uint32_t entryCycles, uint32_t timeInCycle,
+                                   uint32_t period32, uint8_t active);
+  // Arm the edge alarm waitUs after the timer count / CCOUNT pair sampled at
+  // baseCount / baseCycles (clamped to the lead/sleep limits, never in the
+  // past). Call under _spinlock; uses only the lock-free *_in_isr timer
+  // accessors, so it is safe from the tick, the sync ISR and task context.
+  void IRAM_ATTR _armEdgeTimerLocked(uint64_t baseCount, uint32_t baseCycles,
+                                     uint32_t waitUs);
+  // Re-evaluate the pins EDGE_MIN_LEAD_US from now (after a table rebuild or a
+  // sync pulse), replacing whatever alarm was pending. Call under _spinlock.
+  void IRAM_ATTR _kickEdgeTimerLocked();
+  bool _startEdgeTimer(); // claim (first call) and start the edge timer
+  void _stopEdgeTimer();  // pause it; pins hold their level
   static void IRAM_ATTR _onSyncInterrupt();
   void updatePhaseParams(int channel);
+  // Rebuild the per-period edge table from _params; call under _spinlock after
+  // any updatePhaseParams() batch.
+  void rebuildEdgeTable();
+  // Hand the current PhaseParams to the MCPWM backend (no-op when software).
+  void _pushCommutation();
+  // Frequency/DC-mode bookkeeping shared by setGlobalFrequency and applyState;
+  // call under _spinlock, then updatePhaseParams + rebuildEdgeTable.
+  void _setFrequencyLocked(float newHz);
   // Actually write a carrier duty to the LEDC hardware (the body that
   // setCarrierDutyCycle used to be). setCarrierDutyCycle now routes through here
   // for passthrough, or stashes a ceiling for the balance loop to drive.
-  void _writeCarrier(int channel, float dutyPercent);
-  // Sense/balance work done inside run() when opted in.
-  void _serviceCurrentLoop();
+  // latch=false stages a plain duty change without ledc_update_duty and
+  // returns true if the caller still has to latch it.
+  bool _writeCarrier(int channel, float dutyPercent, bool latch = true);
+  // Sense/balance work, inline from run() or from the control task (fixedRate:
+  // sample the ADC every call, the task already paces it).
+  void _serviceCurrentLoop(const float *ceiling, bool fixedRate,
+                           const BalanceGainSchedule &gains);
+  // Every configured carrier at 0% (coil current decaying to nothing).
+  bool _carriersAllOff() const;
+
+  // Fixed-rate control task (opt-in via enableCurrentBalance's rate). The
+  // task owns _sense, _balance, _tripped and the carrier LEDC writes while it
+  // runs; loop() only publishes setpoints and reads snapshots.
+  struct ControlSetpoints {
+    float ceiling[4];
+    float kp, ki, kd, rampPctPerMs; // the fixed gains, scheduled or not
+    uint32_t tuningGen; // bumped by setBalanceGains/setBalanceRamp
+    uint32_t gainsGen;  // bumped by setBalanceGainSchedule (see _gainsOut)
+  };
+  struct ControlOutputs {
+    float iMeas[4];
+    float iField[4];
+    float iFund[4];
+    float fundPhaseDeg[4];
+    float carrierDuty[4];
+    float zeroDrift[4];
+    uint32_t zeroUpdates, zeroRejects;
+    bool tripped;
+  };
+  static const uint32_t CONTROL_TASK_STACK = 4096;
+  static const UBaseType_t CONTROL_TASK_PRIORITY = 20; // below esp_timer (22)
+  static void _controlTaskMain(void *arg);
+  static void _controlTimerCallback(void *arg);
+  void _controlStep(uint32_t pending);
+  void _startControlTask(float rateHz);
+  void _stopControlTask();
+  void _publishSetpoints();
+  // Field timing for the synchronous sampler, and the carrier hpoints that
+  // put each channel's sample mid-on (recomputed when the ADC stream restarts).
+  void _updateFieldRef();
+  void _alignCarriers();
+  uint32_t _carrierHpoint(int channel, uint32_t dutyTicks) const;
 
   // Current sense + PI balance (opt-in; both null unless enabled).
   CurrentSense *_sense = nullptr;
@@ -145,11 +401,49 @@ private:
   bool _tripped = false;
   unsigned long _lastSenseUs = 0;
   unsigned long _lastBalanceUs = 0;
+  std::atomic<uint8_t> _balanceSignal{(uint8_t)BalanceSignal::FILTERED};
+  float _balanceInput[4] = {0, 0, 0, 0};
+  BalanceGainSchedule _gains;               // empty: fixed gains
+  float _gainsHz = NAN;                     // driveHz the gains were last set at
+
+  // Synchronous sampling (off unless enableSynchronousSampling succeeded).
+  struct PhaseSnapshot {
+    float a[4][CurrentSense::MAX_PHASE_BINS];
+  };
+  bool _syncSampling = false;
+  bool _carrierMidOn = false;
+  uint32_t _streamGenSeen = 0;
+  uint32_t _carrierCenterTicks[4] = {0, 0, 0, 0};
+  SeqLock<PhaseSnapshot> _phaseOut;       // task -> phaseCurrents()
+
+  // Control task (null unless enabled with a rate).
+  TaskHandle_t _controlTask = nullptr;
+  esp_timer_handle_t _controlTimer = nullptr;
+  float _controlRateHz = 0.0f;
+  uint32_t _controlPeriodCycles = 0;
+  volatile bool _controlStop = false;
+  volatile bool _controlExited = false;
+  SeqLock<ControlSetpoints> _setpoints;   // loop() -> task
+  SeqLock<ControlOutputs> _outputs;       // task -> loop()
+  SeqLock<ControlLoopStats> _loopStats;   // task -> any reader
+  std::atomic<bool> _loopStatsReset{false};
+  ControlSetpoints _setpointsLocal = {};  // loop() side of _setpoints
+  ControlSetpoints _taskSetpoints = {};   // last consistent copy, task side
+  uint32_t _tuningGenSeen = 0;
+  SeqLock<BalanceGainSchedule> _gainsOut; // loop() -> task, with gainsGen
+  BalanceGainSchedule _taskGains;         // task side of _gainsOut
+  uint32_t _gainsGenSeen = 0;
+  uint32_t _ctlLastEntry = 0;
+  bool _ctlPrimed = false;
+  ControlOutputs _view = {};              // what run() last read from _outputs
 
   // Hardware
   int _numChannels;
   gpio_num_t *_pins;
-  esp_timer_handle_t _periodicTimer;
+  esp_timer_handle_t _periodicTimer;  // fallback 25us poll (null if unused)
+  bool _edgeTimerActive = false;       // one-shot edge scheduler drives the pins
+  bool _edgeTimerClaimed = false;      // timer group ISR registered
+  McpwmCommutator *_mcpwm = nullptr; // non-null => hardware commutation
   gpio_num_t _syncPin;
 
   // Carrier PWM (multi-channel)
@@ -166,6 +460,24 @@ private:
   float *_phaseOffsetsPct;
   float *_dutyCycles;
   PhaseParams *_params;
+  CommutationEdge *_edges;  // 2*numChannels+2 entries, sorted by timeUs
+  int _numEdges = 0;
+  int _edgeCursor = 0;      // segment the last tick landed in
+  uint32_t _tableGen = 0;   // bumped by every rebuildEdgeTable()
+
+  // Commutation instrumentation. The tick is the only writer (under
+  // _spinlock); commutationStats() copies through the seqlock, so a reader
+  // never masks interrupts for the ~3.5 KB copy.
+  SeqLock<CommutationStats> _stats;
+  std::atomic<bool> _statsReset{false}; // taken by the next recorded tick
+  // The tick bookkeeping below is guarded by _spinlock.
+  uint32_t _cpuMhz = 240;
+  uint32_t _tickPeriodCycles = 25 * 240;
+  uint32_t _expectedTickCycles = 0; // CCOUNT the next tick is due at
+  bool _tickPrimed = false;
+  volatile uint32_t _lastTickCycles = 0;
+  uint8_t _lastActive = 0;
+  uint32_t _tableGenSeen = 0;
   float _globalFreqHz; // New global frequency variable
   bool _dcMode = false; // true => field held static (no rotation); see setGlobalFrequency
 
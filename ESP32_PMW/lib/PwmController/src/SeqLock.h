@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+
+// Single-writer sequence lock for handing a small POD between the loop task and
+// the control task (see PwmController::enableCurrentBalance) without a
+// critical section: the writer never blocks or disables interrupts, and a
+// reader retries the copy if it overlapped a write. One writer per instance;
+// any number of readers.
+template <typename T> class SeqLock {
+public:
+  // Writer: publish a whole new value.
+  void write(const T &value) {
+    T &d = beginWrite();
+    d = value;
+    endWrite();
+  }
+
+  // Writer: update in place (for large T that only changes a few fields per
+  // write). Every beginWrite() must be paired with endWrite(). Always inlined:
+  // the commutation tick writes from an IRAM ISR, where a call into flash
+  // would fault while the cache is off.
+  __attribute__((always_inline)) T &beginWrite() {
+    _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return _data;
+  }
+  __attribute__((always_inline)) void endWrite() {
+    _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Writer only: the current value, no copy.
+  const T &writerView() const { return _data; }
+
+  // Reader: one attempt; false if it raced a write (out is then garbage).
+  bool tryRead(T &out) const {
+    uint32_t s0 = _seq.load(std::memory_order_acquire);
+    if (s0 & 1)
+      return false;
+    out = _data;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return _seq.load(std::memory_order_relaxed) == s0;
+  }
+
+  // Reader: spin until a consistent copy. A write is a few hundred cycles at
+  // most, so this settles within a retry or two.
+  void read(T &out) const {
+    while (!tryRead(out)) {
+    }
+  }
+
+private:
+  std::atomic<uint32_t> _seq{0};
+  T _data{};
+};
@@ -1,4 +1,7 @@
 #include "current_sense.h"
+#include "driver/adc.h"
+#include "esp_adc_cal.h"
+#include "esp_timer.h"
 #include <math.h>
 
 CurrentSense::CurrentSense(const gpio_num_t adcPins[N],
@@ -7,35 +10,447 @@ CurrentSense::CurrentSense(const gpio_num_t adcPins[N],
   for (int i = 0; i < N; i++) {
     _adcPins[i] = adcPins[i];
     _sensPerVolt[i] = sensPerVolt[i];
-    _csMv[i] = 0.0f;
-    _adcZeroMv[i] = 0.0f;
+    _csA[i] = 0.0f;
+    _zeroA[i] = 0.0f;
+    _zeroTargetA[i] = 0.0f;
+    _seedZeroA[i] = 0.0f;
+    zeroDrift[i] = 0.0f;
+    _ztSum[i] = 0;
+    _ztCount[i] = 0;
+    for (int j = 0; j <= CAL_SEGMENTS; j++) _calQ4mA[i][j] = 0;
     i_meas[i] = 0.0f;
+    i_field[i] = NAN;
+    i_fund[i] = NAN;
+    fundPhaseDeg[i] = NAN;
+    for (int b = 0; b < MAX_PHASE_BINS; b++) _phaseA[i][b] = NAN;
   }
 }
 
-void CurrentSense::seed() {
-  analogReadResolution(12);
+CurrentSense::~CurrentSense() {
+  if (!_dma) return;
+  adc_digi_stop();
+  adc_digi_deinitialize();
+}
+
+bool CurrentSense::enableDma(uint32_t sampleHz) {
+  if (_dma) return true;
+
+  uint32_t mask = 0;
+  for (int c = 0; c < 16; c++) _chanIdx[c] = -1;
   for (int i = 0; i < N; i++) {
-    analogSetPinAttenuation(_adcPins[i], ADC_11db); // ~0..3.1V
-    analogReadMilliVolts(_adcPins[i]); // throwaway: let the ADC mux/S&H settle
-    _csMv[i] = analogReadMilliVolts(_adcPins[i]);
-    _adcZeroMv[i] = _csMv[i];
+    int8_t c = _adcPins[i] < 0 ? -1 : digitalPinToAnalogChannel(_adcPins[i]);
+    if (c < 0 || c >= ADC1_CHANNEL_MAX) {
+      Serial.printf("[CurrentSense] GPIO%d is not an ADC1 pin, DMA off\n", (int)_adcPins[i]);
+      return false;
+    }
+    _chanIdx[c] = i;
+    mask |= 1u << c;
+  }
+
+  adc_digi_init_config_t init = {};
+  init.max_store_buf_size = DMA_STORE_BYTES;
+  init.conv_num_each_intr = DMA_FRAME_BYTES;
+  init.adc1_chan_mask = mask;
+  init.adc2_chan_mask = 0;
+  esp_err_t err = adc_digi_initialize(&init);
+  if (err != ESP_OK) {
+    Serial.printf("[CurrentSense] DMA ADC init failed (%s)\n", esp_err_to_name(err));
+    return false;
+  }
+
+  // The settling quirk, handled by the scan order instead of throwaway reads:
+  // every pin is converted twice in a row and only the second conversion is
+  // kept (see _readDma), so the one right after the mux switch is dropped.
+  adc_digi_pattern_config_t pattern[2 * N];
+  for (int i = 0; i < 2 * N; i++) {
+    pattern[i].atten = ADC_ATTEN_DB_11; // ~0..3.1V, as the polled path
+    pattern[i].channel = digitalPinToAnalogChannel(_adcPins[i / 2]);
+    pattern[i].unit = 0; // ADC1
+    pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
   }
+  if (sampleHz < SOC_ADC_SAMPLE_FREQ_THRES_LOW) sampleHz = SOC_ADC_SAMPLE_FREQ_THRES_LOW;
+  if (sampleHz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) sampleHz = SOC_ADC_SAMPLE_FREQ_THRES_HIGH;
+  adc_digi_configuration_t cfg = {};
+  cfg.conv_limit_en = 1; // required on the ESP32
+  cfg.conv_limit_num = 250;
+  cfg.pattern_num = 2 * N;
+  cfg.adc_pattern = pattern;
+  cfg.sample_freq_hz = sampleHz;
+  cfg.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  cfg.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+  err = adc_digi_controller_configure(&cfg);
+  if (err == ESP_OK) err = adc_digi_start();
+  if (err != ESP_OK) {
+    Serial.printf("[CurrentSense] DMA ADC start failed (%s)\n", esp_err_to_name(err));
+    adc_digi_deinitialize();
+    return false;
+  }
+
+  _dma = true;
+  _dmaSampleHz = sampleHz;
+  _dmaOverruns = 0;
+  _prevChan = 0xFF;
+  _convNs = (uint32_t)((1000000000ULL + sampleHz / 2) / sampleHz);
+  _streamT0Us = esp_timer_get_time();
+  _convIndex = 0;
+  _streamGen++;
+  return true;
 }
 
-void CurrentSense::update(float dtMs) {
-  float alpha = 1.0f - expf(-dtMs / _tauFilterMs);
+void CurrentSense::_restartDma() {
+  adc_digi_stop();
+  uint32_t len = 0;
+  while (adc_digi_read_bytes(_dmaBuf, sizeof(_dmaBuf), &len, 0) != ESP_ERR_TIMEOUT && len) {
+  }
+  adc_digi_start();
+  _streamT0Us = esp_timer_get_time();
+  _convIndex = 0;
+  _prevChan = 0xFF;
+  _streamGen++;
+  _resetFits();
+}
+
+void CurrentSense::_resetFits() {
+  for (int i = 0; i < N; i++) _fit[i].reset();
+  _fitPrimed = false;
+}
+
+void CurrentSense::_finishFieldPeriod() {
+  if (_fitPrimed) {
+    for (int i = 0; i < N; i++) {
+      float mean, amp, deg;
+      if (!_fit[i].solve(mean, amp, deg)) continue;
+      // The fit is in raw codes; scale by the table's local slope.
+      int j = mean < 0.0f ? 0 : (int)mean >> CAL_STEP_BITS;
+      if (j > CAL_SEGMENTS - 1) j = CAL_SEGMENTS - 1;
+      const float ampsPerCode = (float)(_calQ4mA[i][j + 1] - _calQ4mA[i][j]) /
+                                (16000.0f * (1 << CAL_STEP_BITS));
+      i_fund[i] = amp * ampsPerCode;
+      fundPhaseDeg[i] = deg;
+    }
+    _fieldPeriods++;
+  }
+  for (int i = 0; i < N; i++) _fit[i].reset();
+  _fitPrimed = true;
+}
+
+bool CurrentSense::setOversampling(uint8_t log2Factor) {
+  if (log2Factor > MAX_OVERSAMPLE_LOG2) return false;
+  _osLog2 = log2Factor;
+  return true;
+}
+
+void CurrentSense::_buildCalTables() {
+  // Same eFuse calibration analogReadMilliVolts() uses, evaluated once per
+  // table entry here instead of once per reading.
+  for (int i = 0; i < N; i++) {
+    int8_t c = _adcPins[i] < 0 ? -1 : digitalPinToAnalogChannel(_adcPins[i]);
+    if (c < 0) continue;
+    esp_adc_cal_characteristics_t cal;
+    esp_adc_cal_characterize(c >= 10 ? ADC_UNIT_2 : ADC_UNIT_1, ADC_ATTEN_DB_11,
+                             ADC_WIDTH_BIT_12, 1100, &cal);
+    // mV * A/V = mA; * 16 for Q4.
+    const float q4PerMv = _sensPerVolt[i] * 16.0f;
+    for (int j = 0; j < CAL_SEGMENTS; j++)
+      _calQ4mA[i][j] = lroundf(q4PerMv *
+          (float)esp_adc_cal_raw_to_voltage(j << CAL_STEP_BITS, &cal));
+    // Code 4096 doesn't exist: continue the last segment's slope from 4095.
+    const uint32_t lastCode = (CAL_SEGMENTS - 1) << CAL_STEP_BITS;
+    const float top = (float)esp_adc_cal_raw_to_voltage(4095, &cal);
+    const float base = (float)esp_adc_cal_raw_to_voltage(lastCode, &cal);
+    _calQ4mA[i][CAL_SEGMENTS] =
+        lroundf(q4PerMv * (base + (top - base) * (4096 - lastCode) / (4095 - lastCode)));
+  }
+}
+
+int32_t CurrentSense::_codeToQ4mA(int i, uint32_t codeQ4) const {
+  const int shift = CAL_STEP_BITS + 4;
+  uint32_t j = codeQ4 >> shift;
+  uint32_t f = codeQ4 & ((1u << shift) - 1);
+  if (j >= (uint32_t)CAL_SEGMENTS) { // past 4095.9: clamp to the top entry
+    j = CAL_SEGMENTS - 1;
+    f = 1u << shift;
+  }
+  const int32_t a = _calQ4mA[i][j];
+  return a + (int32_t)(((_calQ4mA[i][j + 1] - a) * (int32_t)f) >> shift);
+}
+
+bool CurrentSense::enableSyncSampling(int fieldBins, float trimUs) {
+  if (!_dma || fieldBins < 1 || fieldBins > MAX_PHASE_BINS) return false;
+  _syncBins = fieldBins;
+  _trimNs = (int32_t)(trimUs * 1000.0f);
+  for (int i = 0; i < N; i++) {
+    i_field[i] = NAN;
+    i_fund[i] = NAN;
+    fundPhaseDeg[i] = NAN;
+    for (int b = 0; b < MAX_PHASE_BINS; b++) _phaseA[i][b] = NAN;
+  }
+  _resetFits();
+  return true;
+}
+
+void CurrentSense::setFieldRef(const FieldRef &ref) {
+  // Bins left from before a DC hold / backend switch describe another field.
+  if (ref.valid && !_field.valid)
+    for (int i = 0; i < N; i++)
+      for (int b = 0; b < MAX_PHASE_BINS; b++) _phaseA[i][b] = NAN;
+  // A window that straddles a frequency step (or a DC hold) isn't one period
+  // of anything; slow ramps (< 1/64 per update) are fine.
+  if (ref.valid != _field.valid ||
+      (uint32_t)abs((int32_t)(ref.periodUs - _field.periodUs)) > _field.periodUs / 64)
+    _resetFits();
+  if (!ref.valid)
+    for (int i = 0; i < N; i++) i_fund[i] = fundPhaseDeg[i] = NAN;
+  _field = ref;
+}
+
+float CurrentSense::samplePhase(int i, int64_t refNs, uint32_t periodNs) const {
+  if (!_dma || !periodNs) return NAN;
+  int64_t tNs = _streamT0Us * 1000 + _trimNs + (int64_t)(2 * i + 1) * _convNs - refNs;
+  int64_t m = tNs % (int64_t)periodNs;
+  if (m < 0) m += periodNs;
+  return (float)m / (float)periodNs;
+}
+
+bool CurrentSense::_readDma(int32_t q4mA[N]) {
+  uint32_t sum[N] = {0};
+  uint32_t count[N] = {0};
+  bool any = false;
+
+  // Field phase of the next conversion as a Q32 fraction of the period,
+  // advanced by one conversion per word; it wraps exactly when the period
+  // does. Two 64-bit divisions per drain. Periods over 4 s aren't binned.
+  const bool bin = _syncBins > 0 && _field.valid && _field.periodUs > 0 &&
+                   _field.periodUs < 4000000;
+  uint32_t phase = 0, step = 0;
+  if (bin) {
+    const uint64_t periodNs = (uint64_t)_field.periodUs * 1000u;
+    int64_t tNs = (_streamT0Us - _field.cycleStartUs) * 1000 + _trimNs +
+                  (int64_t)(_convIndex * _convNs);
+    int64_t m = tNs % (int64_t)periodNs;
+    if (m < 0) m += periodNs;
+    phase = (uint32_t)(((uint64_t)m << 32) / periodNs);
+    step = (uint32_t)(((uint64_t)_convNs << 32) / periodNs);
+    for (int i = 0; i < N; i++)
+      for (int b = 0; b < _syncBins; b++) {
+        _binSum[i][b] = 0;
+        _binCount[i][b] = 0;
+      }
+  }
+
+  // Bounded: the converter keeps filling while we drain.
+  for (uint32_t pass = 0; pass <= DMA_STORE_BYTES / sizeof(_dmaBuf); pass++) {
+    uint32_t len = 0;
+    esp_err_t err = adc_digi_read_bytes(_dmaBuf, sizeof(_dmaBuf), &len, 0);
+    if (err == ESP_ERR_INVALID_STATE) {
+      _dmaOverruns++; // data still returned
+      // Frames of unknown length were dropped: the timeline is off from here.
+      if (_syncBins) {
+        _restartDma();
+        break;
+      }
+    } else if (err != ESP_OK) {
+      break;
+    }
+    if (len == 0) break;
+    // Consumed in place; each entry is a 16-bit {data:12, channel:4} word.
+    for (uint32_t b = 0; b + sizeof(adc_digi_output_data_t) <= len;
+         b += sizeof(adc_digi_output_data_t)) {
+      const adc_digi_output_data_t *p = (const adc_digi_output_data_t *)&_dmaBuf[b];
+      uint8_t ch = p->type1.channel;
+      if (ch == _prevChan && _chanIdx[ch] >= 0) { // second of a pair: settled
+        const int i = _chanIdx[ch];
+        sum[i] += p->type1.data;
+        count[i]++;
+        any = true;
+        if (bin) {
+          const uint32_t k = (uint32_t)(((uint64_t)phase * _syncBins) >> 32);
+          _binSum[i][k] += p->type1.data;
+          _binCount[i][k]++;
+          _fit[i].add(phase, (float)p->type1.data);
+        }
+        ch = 0xFF; // a third in a row (dropped frame) pairs up afresh
+      }
+      _prevChan = ch;
+      _convIndex++;
+      if (bin) {
+        const uint32_t next = phase + step;
+        if (next < phase) _finishFieldPeriod();
+        phase = next;
+      }
+    }
+  }
+  // Means kept in Q4: the averaging is the oversampling.
+  for (int i = 0; i < N; i++)
+    q4mA[i] = count[i] ? _codeToQ4mA(i, ((sum[i] << 4) + count[i] / 2) / count[i])
+                       : NO_SAMPLE;
+
+  if (_syncBins) {
+    for (int i = 0; i < N; i++) {
+      float total = 0.0f;
+      bool full = bin;
+      for (int b = 0; b < _syncBins; b++) {
+        if (bin && _binCount[i][b]) {
+          uint32_t q4 = ((_binSum[i][b] << 4) + _binCount[i][b] / 2) / _binCount[i][b];
+          _phaseA[i][b] = _codeToAmps(i, q4) - _zeroA[i];
+        }
+        full = full && !isnan(_phaseA[i][b]);
+        total += _phaseA[i][b];
+      }
+      i_field[i] = full ? total / _syncBins : NAN;
+    }
+  }
+  return any;
+}
+
+void CurrentSense::setFilter(const CurrentFilter::Config &cfg) {
+  _filter.configure(cfg, _tauFilterMs);
+  for (int i = 0; i < N; i++)
+    _filter.reset(_filterState[i], (int32_t)lroundf(_csA[i] * 256000.0f));
+  _dtAvgMs = 0.0f;
+  _filterOn = true;
+}
+
+void CurrentSense::_readPolled(int32_t q4mA[N]) {
+  const uint32_t reads = 1u << _osLog2;
   for (int i = 0; i < N; i++) {
     // Throwaway read: the ESP32 ADC needs to settle after the mux switches
     // pins. Without it, two channels stuck at ~0 regardless of real current.
-    analogReadMilliVolts(_adcPins[i]);
-    _csMv[i] += alpha * (analogReadMilliVolts(_adcPins[i]) - _csMv[i]);
+    analogRead(_adcPins[i]);
+    uint32_t sum = 0;
+    for (uint32_t k = 0; k < reads; k++) sum += analogRead(_adcPins[i]);
+    q4mA[i] = _codeToQ4mA(i, sum << (4 - _osLog2));
+  }
+}
+
+void CurrentSense::_seedFrom(const int32_t q4mA[N]) {
+  for (int i = 0; i < N; i++) {
+    _csA[i] = (float)q4mA[i] * (1.0f / 16000.0f);
+    _zeroA[i] = _csA[i];
+    _zeroTargetA[i] = _csA[i];
+    _seedZeroA[i] = _csA[i];
+    zeroDrift[i] = 0.0f;
+    _filter.reset(_filterState[i], q4mA[i] * 16);
+  }
+}
+
+void CurrentSense::seed() {
+  if (!_dma) {
+    analogReadResolution(12);
+    for (int i = 0; i < N; i++)
+      analogSetPinAttenuation(_adcPins[i], ADC_11db); // ~0..3.1V
   }
+  _buildCalTables();
+  int32_t q[N];
+  if (_dma) {
+    // Drop whatever queued up before the coils were confirmed off, then take
+    // the first scans that cover every channel.
+    _readDma(q);
+    for (int tries = 0; tries < 50; tries++) {
+      delay(1);
+      if (!_readDma(q)) continue;
+      bool all = true;
+      for (int i = 0; i < N; i++) all = all && q[i] != NO_SAMPLE;
+      if (!all) continue;
+      _seedFrom(q);
+      return;
+    }
+    Serial.printf("[CurrentSense] no DMA samples to seed from\n");
+    return;
+  }
+  _readPolled(q);
+  _seedFrom(q);
+}
+
+bool CurrentSense::update(float dtMs) {
+  int32_t q[N];
+  if (_dma) {
+    if (!_readDma(q)) return false;
+  } else {
+    _readPolled(q);
+  }
+  if (_filterOn) {
+    // Slow average of the real update period (a stall doesn't count): the
+    // biquads are only right at the rate they were designed for.
+    if (dtMs > 0.0f && dtMs < 250.0f)
+      _dtAvgMs = _dtAvgMs > 0.0f ? _dtAvgMs + (dtMs - _dtAvgMs) / 16.0f : dtMs;
+    if (_dtAvgMs > 0.0f) _filter.retune(_driveHz, 1000.0f / _dtAvgMs);
+    for (int i = 0; i < N; i++)
+      if (q[i] != NO_SAMPLE)
+        _csA[i] = (float)_filter.step(_filterState[i], q[i] * 16) * (1.0f / 256000.0f);
+  } else {
+    // With DMA, q[] is the mean over the whole interval, so one EMA step per
+    // update keeps the same time constant as the polled path.
+    float alpha = 1.0f - expf(-dtMs / _tauFilterMs);
+    for (int i = 0; i < N; i++)
+      if (q[i] != NO_SAMPLE)
+        _csA[i] += alpha * ((float)q[i] * (1.0f / 16000.0f) - _csA[i]);
+  }
+  if (_zt) _trackZero(q, dtMs);
   for (int i = 0; i < N; i++)
-    i_meas[i] = _sensPerVolt[i] * (_csMv[i] - _adcZeroMv[i]) / 1000.0f;
+    i_meas[i] = _csA[i] - _zeroA[i];
+  return true;
 }
 
 void CurrentSense::recalibrateZero() {
-  for (int i = 0; i < N; i++)
-    _adcZeroMv[i] = _csMv[i];
+  for (int i = 0; i < N; i++) {
+    _zeroA[i] = _csA[i];
+    _zeroTargetA[i] = _csA[i];
+    zeroDrift[i] = _zeroA[i] - _seedZeroA[i];
+  }
+}
+
+void CurrentSense::enableZeroTracking(const ZeroTrackConfig &cfg) {
+  _ztCfg = cfg;
+  _offMs = 0.0f;
+  _ztWindowMs = 0.0f;
+  for (int i = 0; i < N; i++) {
+    _ztSum[i] = 0;
+    _ztCount[i] = 0;
+    _zeroTargetA[i] = _zeroA[i];
+  }
+  _zt = true;
+}
+
+void CurrentSense::_trackZero(const int32_t q4mA[N], float dtMs) {
+  // The reading covers the last dtMs (the DMA mean) or was just taken
+  // (polled): only count it once that whole interval is past the settle time.
+  const float before = _offMs;
+  _offMs = _coilsOff ? _offMs + dtMs : 0.0f;
+  if (!_coilsOff || before < _ztCfg.settleMs) {
+    _ztWindowMs = 0.0f;
+    for (int i = 0; i < N; i++) {
+      _ztSum[i] = 0;
+      _ztCount[i] = 0;
+    }
+  } else {
+    for (int i = 0; i < N; i++)
+      if (q4mA[i] != NO_SAMPLE) {
+        _ztSum[i] += q4mA[i];
+        _ztCount[i]++;
+      }
+    _ztWindowMs += dtMs;
+    if (_ztWindowMs >= _ztCfg.averageMs) {
+      for (int i = 0; i < N; i++) {
+        if (!_ztCount[i]) continue;
+        const float est = (float)_ztSum[i] / (float)_ztCount[i] * (1.0f / 16000.0f);
+        if (fabsf(est - _seedZeroA[i]) > _ztCfg.maxDriftA) {
+          _ztRejects++;
+        } else {
+          _zeroTargetA[i] = est;
+          _ztUpdates++;
+        }
+        _ztSum[i] = 0;
+        _ztCount[i] = 0;
+      }
+      _ztWindowMs = 0.0f;
+    }
+  }
+
+  const float step = _ztCfg.slewAPerS * dtMs * 0.001f;
+  for (int i = 0; i < N; i++) {
+    const float d = _zeroTargetA[i] - _zeroA[i];
+    _zeroA[i] += d > step ? step : d < -step ? -step : d;
+    zeroDrift[i] = _zeroA[i] - _seedZeroA[i];
+  }
 }
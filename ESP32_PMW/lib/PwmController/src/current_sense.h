@@ -2,40 +2,241 @@
 
 #include <Arduino.h>
 #include "driver/gpio.h"
+#include "FundamentalFit.h"
+#include "CurrentFilter.h"
 
 // Self-calibrating zero-offset + EMA filter over the VNH5019 CS pins. Two quirks
 // in current_sense.cpp are hard-won on this hardware; don't simplify them away.
 // ADC pins are passed in by the caller (constants.h::ADC_PINS) to keep the
 // library self-contained.
+//
+// Two sampling backends: polled analogRead() from update() (default), or
+// enableDma(): ADC1's digital controller scans all four pins continuously into
+// a DMA ring buffer and update() just averages whatever arrived since the last
+// call. Both read raw codes and convert through a per-pin table built in seed()
+// (eFuse calibration with the pin's A/V folded in), so a reading costs one
+// interpolation instead of an esp_adc_cal call per conversion.
 class CurrentSense {
 public:
   static const int N = 4; // 4-channel rig (matches CurrentBalanceController)
 
+  // DMA backend defaults: total conversion rate (each channel is converted
+  // twice per scan, so a settled sample per channel every 2*N conversions:
+  // 5 kHz per channel at 40 kHz) and the driver's buffering.
+  static const uint32_t DMA_DEFAULT_SAMPLE_HZ = 40000;
+  static const uint32_t DMA_FRAME_BYTES = 64;   // 4 scans per DMA interrupt (~0.8 ms)
+  static const uint32_t DMA_STORE_BYTES = 1024; // ~12 ms of backlog at 40 kHz
+
+  // Calibration table: one entry every 2^CAL_STEP_BITS codes of the 12-bit
+  // range, linearly interpolated. Inputs are Q4 codes (12.4 fixed point).
+  static const int CAL_STEP_BITS = 6;
+  static const int CAL_SEGMENTS = 4096 >> CAL_STEP_BITS;
+  // Polled oversampling: up to 2^4 = 16 reads per channel per update.
+  static const uint8_t MAX_OVERSAMPLE_LOG2 = 4;
+
   // adcPins[N]: VNH5019 CS ADC pins (constants.h::ADC_PINS).
   // sensPerVolt[N]: per-board CS calibration (A/V).
   // tauFilterMs: EMA constant; 50ms is best on this rig (less reintroduces
   //   argmin flapping in the balance loop).
   CurrentSense(const gpio_num_t adcPins[N], const float sensPerVolt[N],
                float tauFilterMs = 50.0f);
+  ~CurrentSense();
+
+  // Switch to the continuous DMA backend (call before seed()). sampleHz is the
+  // total conversion rate, clamped to what the ESP32 digital controller
+  // supports (20 kHz .. 2 MHz). Every pin must be on ADC1 (GPIO32-39), and
+  // while it runs ADC1 belongs to it: no analogRead() on ADC1 pins. Returns
+  // false (and stays polled) if the pins or the driver refuse.
+  bool enableDma(uint32_t sampleHz = DMA_DEFAULT_SAMPLE_HZ);
+  bool dmaActive() const { return _dma; }
+  uint32_t dmaSampleHz() const { return _dma ? _dmaSampleHz : 0; }
+  // Times the driver's buffer filled up before update() drained it (the
+  // oldest backlog was kept, the newest frames dropped).
+  uint32_t dmaOverruns() const { return _dmaOverruns; }
+
+  // Polled backend: sum 2^log2Factor raw reads per channel per update (after
+  // the settling throwaway) and keep the sum as a Q4 code. 16x gives ~14
+  // effective bits, ~3 mA per step at 15 A/V, against ~12 mA for one read;
+  // each read costs ~10 us of blocking conversion. The DMA backend already
+  // averages every settled sample since the last update into the same Q4, so
+  // this doesn't apply to it. False if log2Factor > MAX_OVERSAMPLE_LOG2.
+  bool setOversampling(uint8_t log2Factor);
+  uint8_t oversampling() const { return _osLog2; }
+
+  // ---- Filter chain ----
+  // Replace the float EMA with a CurrentFilter chain (median / notches /
+  // low-pass / drive-following EMA, all fixed point), restarted from the
+  // current reading. An all-default cfg is the same fixed-tau EMA. The chain
+  // is tuned per update, at the update rate measured from dtMs.
+  void setFilter(const CurrentFilter::Config &cfg);
+  bool filterActive() const { return _filterOn; }
+  const CurrentFilter &filter() const { return _filter; }
+  // Drive (field) frequency the chain follows, Hz; 0 in DC mode. Call before
+  // every update(); cheap (coefficients move only on a real change).
+  void setDriveFrequency(float hz) { _driveHz = hz; }
+
+  // ---- Synchronous sampling (DMA backend only) ----
+  // The DMA stream is a fixed-rate timeline: conversion k happened at
+  // streamStart + trimUs + k/sampleHz, on the same crystal as esp_timer and the
+  // LEDC carrier. That places every kept sample in field phase (binned here
+  // into phaseCurrents) and, when the scan rate is coherent with the carrier,
+  // at a fixed carrier phase (samplePhase; PwmController centres the carrier
+  // on-window there).
+  static const int MAX_PHASE_BINS = 32;
+
+  // Field timing from PwmController: phase 0 at cycleStartUs + k*periodUs.
+  // valid=false (DC mode, MCPWM) stops binning and reads i_field as NAN.
+  struct FieldRef {
+    int64_t cycleStartUs;
+    uint32_t periodUs;
+    bool valid;
+  };
+
+  // Start binning kept samples into fieldBins (1..MAX_PHASE_BINS) slots of
+  // the field period. trimUs shifts the whole timeline (start latency of the
+  // converter, calibrate on a scope). False unless enableDma() succeeded.
+  bool enableSyncSampling(int fieldBins, float trimUs = 0.0f);
+  int phaseBins() const { return _syncBins; }
+  // Call before every update(); cheap.
+  void setFieldRef(const FieldRef &ref);
+  // Phase (0..1) within a signal of period periodNs and phase 0 at refNs
+  // (esp_timer ns) at which channel i's kept samples land; only meaningful
+  // when 2*N/sampleHz is a whole number of those periods.
+  float samplePhase(int i, int64_t refNs, uint32_t periodNs) const;
+  // Bumped whenever the stream (re)starts: anything derived from samplePhase()
+  // has to be recomputed.
+  uint32_t streamGen() const { return _streamGen; }
 
-  // Call once at boot, coils confirmed OFF: seeds filter + zero-offset from the
-  // floating baseline.
+  // Per-channel current (A) in each field-phase bin, from the latest field
+  // period that hit it (NAN: no sample yet).
+  const float *phaseCurrents(int i) const { return _phaseA[i]; }
+  // Field periods fitted so far (see i_fund).
+  uint32_t fieldPeriods() const { return _fieldPeriods; }
+
+  // Call once at boot, coils confirmed OFF: builds the calibration tables, then
+  // seeds filter + zero-offset from the floating baseline.
   void seed();
 
-  // Updates filtered mV and i_meas[]. Pace separately from any fast control
-  // loop: the ESP32 ADC needs real settling time between conversions.
-  void update(float dtMs);
+  // Updates the filtered reading and i_meas[]. Pace separately from any fast
+  // control loop: polled, the ESP32 ADC needs real settling time between
+  // conversions.
+  // With DMA, returns false (nothing changed) when no complete scan arrived
+  // since the last call; keep dtMs running from the last update that
+  // returned true. Polled always returns true.
+  bool update(float dtMs);
 
   // Re-zero against the current reading (coils OFF) to track warm-up drift; stop
   // once the run starts to freeze calibration.
   void recalibrateZero();
 
+  // ---- Zero re-tracking ----
+  // Follow warm-up drift during a run: while the caller reports the coils off
+  // (setCoilsOff, before every update), wait settleMs for the coil current
+  // and the last on-time samples to clear, then average the raw reading over
+  // averageMs windows. Each window's mean becomes the new zero target, unless
+  // it is more than maxDriftA from the seed() zero (the coils weren't really
+  // off). The zero itself moves toward the target at no more than slewAPerS,
+  // so a correction never steps i_meas. zeroUpdates / zeroRejects count
+  // windows per channel.
+  struct ZeroTrackConfig {
+    float settleMs = 200.0f;
+    float averageMs = 500.0f;
+    float slewAPerS = 0.01f;
+    float maxDriftA = 0.3f;
+  };
+  void enableZeroTracking(const ZeroTrackConfig &cfg);
+  bool zeroTrackingActive() const { return _zt; }
+  void setCoilsOff(bool off) { _coilsOff = off; }
+  uint32_t zeroUpdates() const { return _ztUpdates; }
+  uint32_t zeroRejects() const { return _ztRejects; }
+
   float i_meas[N];
+  // Mean of phaseCurrents over one field period (A), NAN until every bin of
+  // that channel has a sample or while the field reference is invalid.
+  float i_field[N];
+  // Fundamental of each channel's current at the field frequency, fitted
+  // (FundamentalFit) over every complete field period of kept samples:
+  // amplitude (A) and where its peak sits in the period (deg from field phase
+  // 0). NAN until the first full period after enabling / a stream restart /
+  // a field reference change. fieldPeriods() counts the fits.
+  float i_fund[N];
+  float fundPhaseDeg[N];
+  float zeroDrift[N]; // zero minus the seed() zero (A), see zero re-tracking
 
 private:
+  // Drain the DMA buffer into per-channel mean current in Q4 mA, zero not
+  // removed (NO_SAMPLE for a channel with no settled sample). False if nothing arrived at all.
+  bool _readDma(int32_t q4mA[N]);
+  // One (oversampled) polled reading per channel, as _readDma.
+  void _readPolled(int32_t q4mA[N]);
+  // Filter state and zero from one reading per channel.
+  void _seedFrom(const int32_t q4mA[N]);
+  // One update's worth of zero re-tracking on the raw readings.
+  void _trackZero(const int32_t q4mA[N], float dtMs);
+  // Tabulate each pin's code -> current from the eFuse calibration.
+  void _buildCalTables();
+  // Q4 code (0 .. 4095 * 16) -> current in Q4 mA / A, zero not removed.
+  int32_t _codeToQ4mA(int i, uint32_t codeQ4) const;
+  float _codeToAmps(int i, uint32_t codeQ4) const {
+    return (float)_codeToQ4mA(i, codeQ4) * (1.0f / 16000.0f);
+  }
+  static const int32_t NO_SAMPLE = INT32_MIN;
+  // Stop, flush and restart the stream so its timeline is exact again (after
+  // an overrun dropped frames of unknown length).
+  void _restartDma();
+  // A field period ended: publish each channel's fit and start the next.
+  void _finishFieldPeriod();
+  void _resetFits();
+
   gpio_num_t _adcPins[N];
   float _sensPerVolt[N];
   float _tauFilterMs;
-  float _csMv[N];
-  float _adcZeroMv[N];
+  float _csA[N];    // filtered reading, zero not removed
+  float _zeroA[N];
+  // Per pin, in Q4 mA at codes 0, 64, .. 4096 (the last one extrapolated).
+  int32_t _calQ4mA[N][CAL_SEGMENTS + 1];
+  uint8_t _osLog2 = 0;
+
+  // Filter chain (the float EMA above unless setFilter() was called).
+  bool _filterOn = false;
+  CurrentFilter _filter;
+  CurrentFilter::State _filterState[N];
+  float _driveHz = 0.0f;
+  float _dtAvgMs = 0.0f; // update period the chain is tuned for
+
+  // Zero re-tracking (off unless enableZeroTracking()).
+  bool _zt = false;
+  ZeroTrackConfig _ztCfg;
+  bool _coilsOff = false;
+  float _offMs = 0.0f;     // since the coils were last reported off
+  float _ztWindowMs = 0.0f;
+  int64_t _ztSum[N];       // Q4 mA over the current window
+  uint32_t _ztCount[N];
+  float _zeroTargetA[N];
+  float _seedZeroA[N];
+  uint32_t _ztUpdates = 0;
+  uint32_t _ztRejects = 0;
+
+  // DMA backend (inactive unless enableDma() succeeded).
+  bool _dma = false;
+  uint32_t _dmaSampleHz = 0;
+  uint32_t _dmaOverruns = 0;
+  int8_t _chanIdx[16];        // ADC1 channel -> index into _adcPins, -1 unused
+  uint8_t _prevChan = 0xFF;   // channel of the previous conversion
+  uint8_t _dmaBuf[256];
+
+  // Synchronous sampling (off unless enableSyncSampling() succeeded).
+  int _syncBins = 0;
+  int32_t _trimNs = 0;
+  uint32_t _convNs = 0;        // one conversion
+  int64_t _streamT0Us = 0;     // esp_timer at adc_digi_start()
+  uint64_t _convIndex = 0;     // conversions read since then
+  uint32_t _streamGen = 0;
+  FieldRef _field = {0, 0, false};
+  uint32_t _binSum[N][MAX_PHASE_BINS];
+  uint16_t _binCount[N][MAX_PHASE_BINS];
+  float _phaseA[N][MAX_PHASE_BINS];
+  FundamentalFit _fit[N];
+  bool _fitPrimed = false;   // the current window started at phase 0
+  uint32_t _fieldPeriods = 0;
 };
@@ -0,0 +1,187 @@
+#include "CurveKernel.h"
+#include <math.h>
+#include <string.h>
+
+namespace {
+// Largest exponent taken by repeated multiplication instead of exp2/log2.
+const int MAX_INT_EXPONENT = 16;
+
+bool asSmallInt(float v, int &n) {
+  if (v < 1.0f || v > (float)MAX_INT_EXPONENT || v != floorf(v))
+    return false;
+  n = (int)v;
+  return true;
+}
+
+uint32_t bitsOf(float x) {
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  return u;
+}
+
+float fromBits(uint32_t u) {
+  float x;
+  memcpy(&x, &u, sizeof(x));
+  return x;
+}
+} // namespace
+
+float CurveKernel::reference(TaskMode mode, float t, float shape) {
+  if (t <= 0.0f)
+    return 0.0f;
+  if (t >= 1.0f)
+    return 1.0f;
+
+  switch (mode) {
+  case TaskMode::EASE: {
+    // Symmetric S-curve (sigmoid), not a power: it eases in AND out about
+    // t=0.5. k=1 is linear, larger k sharpens the transition.
+    float k = isnan(shape) ? 2.0f : shape;
+    if (k < 1.0f)
+      k = 1.0f;
+    float a = powf(t, k);
+    float b = powf(1.0f - t, k);
+    return a / (a + b);
+  }
+  case TaskMode::EXPONENTIAL: {
+    // Exponent multiplier: k>0 slow-start/fast-finish, k<0 the reverse.
+    float k = isnan(shape) ? 2.0f : shape;
+    if (fabsf(k) < 1e-6f)
+      return t; // degenerates to linear
+    return (expf(k * t) - 1.0f) / (expf(k) - 1.0f);
+  }
+  case TaskMode::POLYNOMIAL:
+  default: {
+    // t^p about the origin: p=1 linear, p>1 slow-start, 0<p<1 fast-start.
+    // p<=0 would step or blow up, so it falls back to linear.
+    float p = (isnan(shape) || shape <= 0.0f) ? 1.0f : shape;
+    return powf(t, p);
+  }
+  }
+}
+
+CurveKernel::CurveKernel(TaskMode mode, float shape) {
+  // Same defaults and clamps as reference().
+  switch (mode) {
+  case TaskMode::EASE: {
+    float k = isnan(shape) ? 2.0f : shape;
+    if (k < 1.0f)
+      k = 1.0f;
+    if (k == 1.0f)
+      _kind = LINEAR;
+    else if (asSmallInt(k, _n))
+      _kind = EASE_INT;
+    else
+      _kind = EASE;
+    _k = k;
+    break;
+  }
+  case TaskMode::EXPONENTIAL: {
+    float k = isnan(shape) ? 2.0f : shape;
+    if (fabsf(k) < 1e-6f) {
+      _kind = LINEAR;
+      break;
+    }
+    _kind = EXP;
+    _k = k;
+    _invDen = (float)(1.0 / expm1((double)k)); // once per task
+    break;
+  }
+  case TaskMode::POLYNOMIAL:
+  default: {
+    float p = (isnan(shape) || shape <= 0.0f) ? 1.0f : shape;
+    if (p == 1.0f)
+      _kind = LINEAR;
+    else if (asSmallInt(p, _n))
+      _kind = POW_INT;
+    else
+      _kind = POW;
+    _k = p;
+    break;
+  }
+  }
+}
+
+float CurveKernel::powInt(float x, int n) {
+  float r = 1.0f;
+  while (n) {
+    if (n & 1)
+      r *= x;
+    x *= x;
+    n >>= 1;
+  }
+  return r;
+}
+
+float CurveKernel::fastLog2(float x) {
+  // x = 2^e * m with m in [sqrt(1/2), sqrt(2)), then
+  // log2(m) = 2/ln2 * atanh(s), s = (m-1)/(m+1), |s| < 0.172: four odd terms
+  // leave < 2e-8 truncation error.
+  uint32_t u = bitsOf(x);
+  int e = (int)((u >> 23) & 0xFF) - 127;
+  u = (u & 0x007FFFFFUL) | 0x3F800000UL; // m in [1, 2)
+  float m = fromBits(u);
+  if (m > 1.41421356f) {
+    m *= 0.5f;
+    e++;
+  }
+  float s = (m - 1.0f) / (m + 1.0f);
+  float s2 = s * s;
+  float p = 1.0f + s2 * (1.0f / 3 + s2 * (1.0f / 5 + s2 * (1.0f / 7)));
+  return (float)e + 2.88539008f * s * p; // 2/ln2
+}
+
+float CurveKernel::fastExp2(float x) {
+  if (x < -126.0f)
+    return 0.0f;
+  if (x > 127.0f)
+    x = 127.0f;
+  // 2^x = 2^i * e^(f ln2) with i = round(x), |f| <= 0.5: degree-6 Taylor,
+  // truncation < 1.3e-7 relative.
+  float fi = floorf(x + 0.5f);
+  float y = (x - fi) * 0.693147181f;
+  float p = 1.0f + y * (1.0f + y * (0.5f + y * (1.0f / 6 + y * (1.0f / 24 +
+            y * (1.0f / 120 + y * (1.0f / 720))))));
+  int i = (int)fi;
+  if (i < -126) // keep the scale a normal float; the product underflows gently
+    return p * fromBits((uint32_t)1 << 23) * fastExp2((float)(i + 126));
+  return p * fromBits((uint32_t)(i + 127) << 23);
+}
+
+float CurveKernel::fastExpm1(float x) {
+  if (fabsf(x) < 0.5f) {
+    // Direct series, no 1 - 1 cancellation: truncation < 1e-7 relative.
+    return x * (1.0f + x * (0.5f + x * (1.0f / 6 + x * (1.0f / 24 +
+           x * (1.0f / 120 + x * (1.0f / 720 + x * (1.0f / 5040)))))));
+  }
+  return fastExp2(x * 1.44269504f) - 1.0f; // log2(e)
+}
+
+float CurveKernel::eval(float t) const {
+  if (t <= 0.0f)
+    return 0.0f;
+  if (t >= 1.0f)
+    return 1.0f;
+
+  switch (_kind) {
+  case POW_INT:
+    return powInt(t, _n);
+  case POW:
+    return fastExp2(_k * fastLog2(t));
+  case EASE_INT: {
+    float a = powInt(t, _n);
+    float b = powInt(1.0f - t, _n);
+    return a / (a + b);
+  }
+  case EASE: {
+    // a/(a+b) = 1/(1 + ((1-t)/t)^k): one log/exp pair instead of two.
+    float r = fastExp2(_k * (fastLog2(1.0f - t) - fastLog2(t)));
+    return 1.0f / (1.0f + r);
+  }
+  case EXP:
+    return fastExpm1(_k * t) * _invDen;
+  case LINEAR:
+  default:
+    return t;
+  }
+}
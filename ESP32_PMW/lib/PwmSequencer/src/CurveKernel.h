@@ -0,0 +1,48 @@
+#pragma once
+
+#include "TaskMode.h"
+#include <stdint.h>
+
+// A ramp's progress curve f(t), t in [0,1] -> [0,1], with its TaskMode and
+// shape parameter resolved once per task (defaults, clamps, integer exponents,
+// the EXPONENTIAL normalizer). eval() then runs without libm: integer
+// exponents are plain multiplies, everything else goes through the log2/exp2
+// polynomials below. reference() is the libm definition it replaces.
+//
+// Error bound: |eval(t) - reference(t)| <= MAX_ABS_ERROR for every t in
+// [0,1] and shapes POLYNOMIAL p in [0.1, 10], EASE k in [1, 10],
+// EXPONENTIAL k in [-10, 10] (the ranges the JSON schedules use).
+// tools/curve_check_host.cpp measures it against the host libm (worst case
+// 1.8e-7 for POLYNOMIAL/EASE, 7.2e-7 for EXPONENTIAL with glibc);
+// src/examples/main_curve_check.cpp repeats the sweep against the target's
+// newlib and times both there. Either way it is far below the 0.01-unit
+// quantization of the precompiled ramp tables.
+class CurveKernel {
+public:
+  static constexpr float MAX_ABS_ERROR = 1e-5f;
+
+  CurveKernel() : CurveKernel((TaskMode)0, 1.0f) {}
+  CurveKernel(TaskMode mode, float shape);
+
+  float eval(float t) const;
+
+  // libm definition (the pre-kernel PwmSequencer::applyCurve).
+  static float reference(TaskMode mode, float t, float shape);
+
+  // Building blocks, exposed for the check sketch. fastLog2 expects a normal
+  // x > 0; fastExp2 saturates outside [-126, 127].
+  static float fastLog2(float x);
+  static float fastExp2(float x);
+  // e^x - 1 without cancellation near 0.
+  static float fastExpm1(float x);
+
+private:
+  enum Kind : uint8_t { LINEAR, POW_INT, POW, EASE_INT, EASE, EXP };
+
+  static float powInt(float x, int n);
+
+  Kind _kind = LINEAR;
+  int _n = 1;        // POW_INT / EASE_INT exponent
+  float _k = 1.0f;   // POW / EASE exponent, EXP multiplier
+  float _invDen = 1; // EXP: 1 / (e^k - 1)
+};
@@ -1,5 +1,7 @@
 #include "PwmSequencer.h"
 #include <math.h>
+#include <string.h>
+#include <utility> // std::swap
 
 static float clampDuty(float v) {
   if (v < 0.0f)
@@ -9,6 +11,589 @@ static float clampDuty(float v) {
   return v;
 }
 
+// _dirty layout: bit 0 the global frequency, then one bit per channel for duty
+// (1..4), phase (5..8) and carrier duty (9..12).
+static const uint16_t DIRTY_FREQ = 1u << 0;
+static const uint16_t DIRTY_ALL = 0x1FFF;
+
+static uint16_t dirtyBit(TaskType type, int i) {
+  switch (type) {
+  case TaskType::PWM_DUTY:
+    return (uint16_t)(1u << (1 + i));
+  case TaskType::PWM_PHASE:
+    return (uint16_t)(1u << (5 + i));
+  case TaskType::CARRIER_DUTY:
+    return (uint16_t)(1u << (9 + i));
+  default:
+    return DIRTY_FREQ;
+  }
+}
+
+static bool isRampType(TaskType type) {
+  return type == TaskType::PWM_FREQ || type == TaskType::PWM_DUTY ||
+         type == TaskType::PWM_PHASE || type == TaskType::CARRIER_DUTY;
+}
+
+// How long a task holds the schedule: WAITs and ramps their duration (a
+// non-positive one finishes at once), everything else nothing.
+static int64_t nominalUs(const SequenceTask &task) {
+  if (task.type != TaskType::WAIT && !isRampType(task.type))
+    return 0;
+  return task.durationUs > 0 ? task.durationUs : 0;
+}
+
+// Start/end of channel i for a ramp task (PWM_FREQ: the global frequency).
+static void rampEndpoints(const SequenceTask &task, int i, float &s, float &e) {
+  switch (task.type) {
+  case TaskType::CARRIER_DUTY:
+    s = task.startCarriers[i];
+    e = task.endCarriers[i];
+    break;
+  case TaskType::PWM_DUTY:
+    s = task.startDuties[i];
+    e = task.endDuties[i];
+    break;
+  case TaskType::PWM_PHASE:
+    s = task.startPhases[i];
+    e = task.endPhases[i];
+    break;
+  default:
+    s = task.startFreq;
+    e = task.endFreq;
+    break;
+  }
+}
+
+// Channels a ramp drives: the non-NAN ones, same skip rule as run().
+static uint8_t rampLaneMask(const SequenceTask &task) {
+  if (task.type == TaskType::PWM_FREQ)
+    return 1;
+  uint8_t mask = 0;
+  for (int i = 0; i < 4; i++) {
+    float s, e;
+    rampEndpoints(task, i, s, e);
+    if (!isnan(s))
+      mask |= (uint8_t)(1 << i);
+  }
+  return mask;
+}
+
+// Table samples are centi-units in a uint16: 0..655.35 Hz / % / deg. Phase is
+// wrapped into [0, 360) first (setPhase() wraps anyway), so it always fits.
+static const float CENTI_MAX = 655.35f;
+
+static bool fitsCenti(float v) { return v >= 0.0f && v <= CENTI_MAX; }
+
+static uint16_t toCenti(float v) {
+  if (!(v > 0.0f))
+    return 0;
+  if (v >= CENTI_MAX)
+    return 65535;
+  return (uint16_t)(v * 100.0f + 0.5f);
+}
+
+static float wrapDegrees(float v) {
+  v = fmodf(v, 360.0f);
+  return v < 0.0f ? v + 360.0f : v;
+}
+
+// ---------------------------------------------------------------------------
+// Queue record encoding (TASK_ENCODING 3). Each record is a run of uint32
+// words:
+//
+//   header            bits 0-3 record type, 4-5 TaskMode (ramps), 6 REC_LONG,
+//                     8-11 channel mask (ramps other than PWM_FREQ),
+//                     16-28 field mask (TRAJECTORY_POINT, _dirty layout)
+//   WAIT              duration
+//   ramps             duration, shape, then start,end: once for PWM_FREQ,
+//                     else for each channel in the mask, ascending
+//   TRAJECTORY_POINT  one value per field-mask bit, ascending
+//
+// duration is durationUs as one uint32, or with REC_LONG as two words (int64,
+// low word first). Values are raw float bits. A TRAJECTORY_POINT only
+// carries the fields the records before it do not already leave at that
+// value (anything a ramp touched counts as unknown), so a snapshot that
+// changes one carrier is two words instead of a 160-byte SequenceTask.
+//
+// Record types 0-5 are the TaskTypes. The rest is control flow, which run()
+// follows with its frame stack:
+//
+//   REC_REPEAT  count, skipWords, skipRecords: the records up to the
+//               matching REC_END run count times (0 = skipped)
+//   REC_SUB     skipWords, skipRecords: a subroutine body up to the matching
+//               REC_END, skipped in place and run by REC_CALL
+//   REC_END     closes the innermost REC_REPEAT or REC_SUB
+//   REC_CALL    bits 8-10 argument count, 12-15 arguments that are the
+//               caller's own (slot number) rather than float bits; then the
+//               body's first word and record index, then the arguments
+//   REC_PARAM   a ParamTask with argument operands: bits 4-5 ParamOp, 8-11
+//               channels, 12-15 TaskType, 16-17 TaskMode, 20-23 operands that
+//               are argument slots; then its operands (ParamTask order; mask
+//               and durationMs as uint32, the rest float bits), RAMP shape last
+//   REC_SWEEP   addSweep(): bits 8-15 level count, 16-23 mask count; then
+//               dwellMs, restMs, the levels (float bits), and the masks four
+//               bits each, eight to a word, lowest first. run() expands it
+//               into SWEEP_STEPS steps per point as it goes
+//
+// skipWords/skipRecords count what follows the opener, its REC_END included.
+// Records after a control record, REC_PARAM or REC_SWEEP assume no known
+// state.
+// tools/compile_schedules.py writes the same encoding: keep them in step.
+// ---------------------------------------------------------------------------
+static const uint32_t REC_LONG = 1u << 6;
+static const uint32_t REC_REPEAT = 6;
+static const uint32_t REC_SUB = 7;
+static const uint32_t REC_END = 8;
+static const uint32_t REC_CALL = 9;
+static const uint32_t REC_PARAM = 10;
+static const uint32_t REC_SWEEP = 11;
+static const int NUM_FIELDS = 13; // _dirty bits
+
+static uint32_t floatBits(float v) {
+  uint32_t w;
+  memcpy(&w, &v, sizeof(w));
+  return w;
+}
+
+static float bitsFloat(uint32_t w) {
+  float v;
+  memcpy(&v, &w, sizeof(v));
+  return v;
+}
+
+// The value a TRAJECTORY_POINT gives state field `bit` (_dirty layout).
+static float &pointField(SequenceTask &t, int bit) {
+  if (bit == 0)
+    return t.startFreq;
+  if (bit < 5)
+    return t.dutyCycles[bit - 1];
+  if (bit < 9)
+    return t.startPhases[bit - 5];
+  return t.carrierDuties[bit - 9];
+}
+
+// Update the encoder's picture of the state after task `t` (fields: the
+// fields a TRAJECTORY_POINT record carries).
+static void trackKnown(SequenceTask &t, uint16_t fields, float *value,
+                       uint16_t &known) {
+  if (t.type == TaskType::TRAJECTORY_POINT) {
+    for (int b = 0; b < NUM_FIELDS; b++)
+      if ((fields >> b) & 1)
+        value[b] = pointField(t, b);
+    known |= fields; // the fields a full snapshot left out were known already
+  } else if (t.type == TaskType::PWM_FREQ) {
+    known &= (uint16_t)~DIRTY_FREQ;
+  } else if (isRampType(t.type)) {
+    uint8_t mask = rampLaneMask(t);
+    for (int i = 0; i < 4; i++)
+      if ((mask >> i) & 1)
+        known &= (uint16_t)~dirtyBit(t.type, i);
+  }
+}
+
+// Decode the record at `w` (`avail` words left) into `t`; a TRAJECTORY_POINT
+// sets only the fields in `fields`. Returns the record length in words, or 0
+// if it is malformed or runs past `avail`.
+static size_t decodeTask(const uint32_t *w, size_t avail, SequenceTask &t,
+                         uint16_t &fields) {
+  if (avail == 0)
+    return 0;
+  const uint32_t h = w[0];
+  const uint32_t type = h & 0x0F;
+  const uint32_t mode = (h >> 4) & 0x03;
+  if (type > (uint32_t)TaskType::TRAJECTORY_POINT ||
+      mode > (uint32_t)TaskMode::EXPONENTIAL)
+    return 0;
+  t = SequenceTask{};
+  t.type = (TaskType)type;
+  t.mode = (TaskMode)mode;
+  fields = 0;
+  size_t n = 1;
+
+  if (t.type == TaskType::TRAJECTORY_POINT) {
+    fields = (uint16_t)((h >> 16) & DIRTY_ALL);
+    if (n + __builtin_popcount(fields) > avail)
+      return 0;
+    for (int b = 0; b < NUM_FIELDS; b++)
+      if ((fields >> b) & 1)
+        pointField(t, b) = bitsFloat(w[n++]);
+    return n;
+  }
+  if (t.type != TaskType::WAIT && !isRampType(t.type))
+    return n;
+
+  if (h & REC_LONG) {
+    if (n + 2 > avail)
+      return 0;
+    t.durationUs = (int64_t)((uint64_t)w[n] | ((uint64_t)w[n + 1] << 32));
+    n += 2;
+  } else {
+    if (n + 1 > avail)
+      return 0;
+    t.durationUs = (int64_t)w[n++];
+  }
+  if (t.type == TaskType::WAIT)
+    return n;
+
+  const uint32_t mask = (t.type == TaskType::PWM_FREQ) ? 1 : (h >> 8) & 0x0F;
+  if (n + 1 + 2 * __builtin_popcount(mask) > avail)
+    return 0;
+  t.shape = bitsFloat(w[n++]);
+  if (t.type == TaskType::PWM_FREQ) {
+    t.startFreq = bitsFloat(w[n++]);
+    t.endFreq = bitsFloat(w[n++]);
+    return n;
+  }
+  float *starts = (t.type == TaskType::CARRIER_DUTY) ? t.startCarriers
+                  : (t.type == TaskType::PWM_DUTY)   ? t.startDuties
+                                                     : t.startPhases;
+  float *ends = (t.type == TaskType::CARRIER_DUTY) ? t.endCarriers
+                : (t.type == TaskType::PWM_DUTY)   ? t.endDuties
+                                                   : t.endPhases;
+  for (int i = 0; i < 4; i++) {
+    if ((mask >> i) & 1) {
+      starts[i] = bitsFloat(w[n++]);
+      ends[i] = bitsFloat(w[n++]);
+    } else {
+      starts[i] = NAN;
+      ends[i] = NAN;
+    }
+  }
+  return n;
+}
+
+// Operand words of a REC_PARAM record with header `h`.
+static int paramOperands(uint32_t h) {
+  switch ((ParamOp)((h >> 4) & 0x03)) {
+  case ParamOp::SET:
+    return __builtin_popcount((h >> 8) & 0x0F);
+  case ParamOp::ACTIVATE:
+    return 2;
+  case ParamOp::WAIT:
+    return 1;
+  default:
+    return 4; // RAMP: from, to, durationMs, shape
+  }
+}
+
+// ParamTask operands stored as uint32 rather than float bits.
+static bool intOperand(ParamOp op, int k) {
+  return (op == ParamOp::ACTIVATE && k == 0) || (op == ParamOp::WAIT && k == 0) ||
+         (op == ParamOp::RAMP && k == 2);
+}
+
+static uint32_t sweepLevels(uint32_t h) { return (h >> 8) & 0xFF; }
+static uint32_t sweepMasks(uint32_t h) { return (h >> 16) & 0xFF; }
+
+// Mask `k` of the REC_SWEEP record at `w`.
+static uint32_t sweepMask(const uint32_t *w, uint32_t k) {
+  return (w[3 + sweepLevels(w[0]) + k / 8] >> (4 * (k % 8))) & 0x0F;
+}
+
+// Step `s` of the (checked) REC_SWEEP record at `w`, as the task it runs.
+static void decodeSweepStep(const uint32_t *w, uint32_t s, SequenceTask &t,
+                            uint16_t &fields) {
+  const uint32_t point = s / PwmSequencer::SWEEP_STEPS;
+  t = SequenceTask{};
+  fields = 0;
+  switch (s % PwmSequencer::SWEEP_STEPS) {
+  case 0:
+  case 2: {
+    t.type = TaskType::TRAJECTORY_POINT;
+    const uint32_t nMasks = sweepMasks(w[0]);
+    const uint32_t mask =
+        s % PwmSequencer::SWEEP_STEPS ? 0 : sweepMask(w, point % nMasks);
+    const float level = bitsFloat(w[3 + point / nMasks]);
+    for (int i = 0; i < 4; i++) {
+      t.carrierDuties[i] = ((mask >> i) & 1) ? level : 0.0f;
+      fields |= dirtyBit(TaskType::CARRIER_DUTY, i);
+    }
+    break;
+  }
+  default:
+    t.type = TaskType::WAIT;
+    t.durationUs = (int64_t)w[s % PwmSequencer::SWEEP_STEPS == 1 ? 1 : 2] * 1000LL;
+    break;
+  }
+}
+
+// Schedule time from the start of the sweep at `w` to its step `s`.
+static int64_t sweepStepUs(const uint32_t *w, uint32_t s) {
+  const int64_t dwellUs = (int64_t)w[1] * 1000LL;
+  const int64_t pointUs = dwellUs + (int64_t)w[2] * 1000LL;
+  return (int64_t)(s / PwmSequencer::SWEEP_STEPS) * pointUs +
+         (s % PwmSequencer::SWEEP_STEPS >= 2 ? dwellUs : 0);
+}
+
+// Step of the sweep at `w` (`steps` in all) still running `intoUs` after it
+// started: the first that does not end by then (the last if none).
+static uint32_t sweepStepAt(const uint32_t *w, uint32_t steps, int64_t intoUs) {
+  const int64_t pointUs = ((int64_t)w[1] + w[2]) * 1000LL;
+  uint32_t s = steps - 1;
+  if (pointUs > 0 && intoUs / pointUs < steps / PwmSequencer::SWEEP_STEPS)
+    s = (uint32_t)(intoUs / pointUs) * PwmSequencer::SWEEP_STEPS;
+  while (s + 1 < steps && sweepStepUs(w, s + 1) <= intoUs)
+    s++;
+  return s;
+}
+
+// Length in words of any record at `w`, or 0 if it runs past `avail` (or is
+// a malformed task record).
+static size_t recordLength(const uint32_t *w, size_t avail) {
+  if (avail == 0)
+    return 0;
+  const uint32_t h = w[0];
+  size_t n;
+  switch (h & 0x0F) {
+  case REC_REPEAT:
+    n = 4;
+    break;
+  case REC_SUB:
+    n = 3;
+    break;
+  case REC_END:
+    n = 1;
+    break;
+  case REC_CALL:
+    n = 3 + ((h >> 8) & 0x07);
+    break;
+  case REC_PARAM:
+    n = 1 + paramOperands(h);
+    break;
+  case REC_SWEEP:
+    n = 3 + sweepLevels(h) + (sweepMasks(h) + 7) / 8;
+    break;
+  default: {
+    SequenceTask t;
+    uint16_t fields;
+    return decodeTask(w, avail, t, fields);
+  }
+  }
+  return n <= avail ? n : 0;
+}
+
+// Replay the encoder's view of the state over the record at `w`; returns
+// its length.
+static size_t trackRecord(const uint32_t *w, size_t avail, float *value,
+                          uint16_t &known) {
+  if ((w[0] & 0x0F) <= (uint32_t)TaskType::TRAJECTORY_POINT) {
+    SequenceTask t;
+    uint16_t fields;
+    size_t len = decodeTask(w, avail, t, fields);
+    trackKnown(t, fields, value, known);
+    return len;
+  }
+  known = 0; // control flow: no single state follows it (a sweep: not tracked)
+  return recordLength(w, avail);
+}
+
+// Fill a ramp task's per-channel start/end arrays from starts/ends (NAN or
+// past numChannels = channel skipped; duty and carrier clamped). False if
+// task.type cannot be ramped.
+static bool setRampEndpoints(SequenceTask &task, const float *starts,
+                             const float *ends, int numChannels) {
+  if (task.type == TaskType::PWM_FREQ) {
+    // Frequency is global; only channel 0 is meaningful.
+    task.startFreq = starts[0];
+    task.endFreq = ends[0];
+    return true;
+  }
+
+  float *start_traj = nullptr;
+  float *end_traj = nullptr;
+  bool clamp = false;
+
+  switch (task.type) {
+  case TaskType::CARRIER_DUTY:
+    start_traj = task.startCarriers;
+    end_traj = task.endCarriers;
+    clamp = true;
+    break;
+  case TaskType::PWM_DUTY:
+    start_traj = task.startDuties;
+    end_traj = task.endDuties;
+    clamp = true;
+    break;
+  case TaskType::PWM_PHASE:
+    start_traj = task.startPhases;
+    end_traj = task.endPhases;
+    break;
+  default:
+    return false; // you can only ramp frequency, duty, carrier duty, or phase
+  }
+
+  for (int i = 0; i < 4; i++) {
+    if (i < numChannels && !isnan(starts[i])) {
+      float s = starts[i];
+      float e = ends[i];
+      if (clamp) {
+        s = clampDuty(s);
+        e = clampDuty(e);
+      }
+      start_traj[i] = s;
+      end_traj[i] = e;
+    } else {
+      start_traj[i] = NAN; // if channel is not selected (NAN), skip
+      end_traj[i] = NAN;
+    }
+  }
+  return true;
+}
+
+// Resolve the (checked) REC_PARAM record at `w` into task `t`, reading
+// argument operands from `params` (null: all 0). A SET or ACTIVATE becomes a
+// TRAJECTORY_POINT of just the fields it touches. Returns the record length.
+static size_t decodeParamTask(const uint32_t *w, const float *params,
+                              SequenceTask &t, uint16_t &fields) {
+  const uint32_t h = w[0];
+  const ParamOp op = (ParamOp)((h >> 4) & 0x03);
+  const uint32_t channels = (h >> 8) & 0x0F;
+  const TaskType type = (TaskType)((h >> 12) & 0x0F);
+  const uint32_t args = (h >> 20) & 0x0F;
+  auto arg = [&](int k) { return params ? params[w[1 + k]] : 0.0f; };
+  auto value = [&](int k) {
+    return ((args >> k) & 1) ? arg(k) : bitsFloat(w[1 + k]);
+  };
+  auto count = [&](int k) -> uint32_t {
+    if (!((args >> k) & 1))
+      return w[1 + k];
+    float v = arg(k);
+    return v > 0.0f ? (v < 4294967040.0f ? (uint32_t)v : UINT32_MAX) : 0;
+  };
+
+  t = SequenceTask{};
+  fields = 0;
+  switch (op) {
+  case ParamOp::SET: {
+    t.type = TaskType::TRAJECTORY_POINT;
+    int k = 0;
+    for (int i = 0; i < 4; i++) {
+      if (!((channels >> i) & 1))
+        continue;
+      float v = value(k++);
+      if (type == TaskType::PWM_DUTY || type == TaskType::CARRIER_DUTY)
+        v = clampDuty(v);
+      uint16_t bit = dirtyBit(type, i);
+      pointField(t, __builtin_ctz(bit)) = v;
+      fields |= bit;
+    }
+    return 1 + k;
+  }
+  case ParamOp::ACTIVATE: {
+    t.type = TaskType::TRAJECTORY_POINT;
+    const uint32_t mask = count(0);
+    const float on = clampDuty(value(1));
+    for (int i = 0; i < 4; i++) {
+      t.carrierDuties[i] = ((mask >> i) & 1) ? on : 0.0f;
+      fields |= dirtyBit(TaskType::CARRIER_DUTY, i);
+    }
+    return 3;
+  }
+  case ParamOp::WAIT:
+    t.type = TaskType::WAIT;
+    t.durationUs = (int64_t)count(0) * 1000LL;
+    return 2;
+  default: {
+    t.type = type;
+    t.mode = (TaskMode)((h >> 16) & 0x03);
+    t.durationUs = (int64_t)count(2) * 1000LL;
+    t.shape = bitsFloat(w[4]);
+    float starts[4], ends[4];
+    for (int i = 0; i < 4; i++) {
+      bool on = type == TaskType::PWM_FREQ || ((channels >> i) & 1);
+      starts[i] = on ? value(0) : NAN;
+      ends[i] = on ? value(1) : NAN;
+    }
+    setRampEndpoints(t, starts, ends, 4);
+    return 5;
+  }
+  }
+}
+
+// Check that `nWords` words are exactly `nTasks` well-formed records: blocks
+// balanced, no deeper than MAX_DEPTH and each running some task; calls only
+// into subroutine bodies closed before them; argument operands only inside a
+// body. run() then follows them without checks of its own.
+static bool checkRecords(const uint32_t *w, size_t nWords, size_t nTasks) {
+  struct Open {
+    uint32_t word;
+    uint32_t index;
+    uint32_t head; // opener length
+    bool sub;
+    bool work;
+  };
+  Open open[PwmSequencer::MAX_DEPTH];
+  int depth = 0, subs = 0;
+  std::vector<uint32_t> bodies; // closed subroutines: word, index pairs
+  size_t at = 0, i = 0;
+  while (at < nWords) {
+    const size_t len = recordLength(w + at, nWords - at);
+    if (!len)
+      return false;
+    const uint32_t h = w[at];
+    const uint32_t type = h & 0x0F;
+    bool work = type <= (uint32_t)TaskType::TRAJECTORY_POINT;
+    if (type == REC_REPEAT || type == REC_SUB) {
+      if (depth == PwmSequencer::MAX_DEPTH)
+        return false;
+      open[depth++] = Open{(uint32_t)at, (uint32_t)i, (uint32_t)len,
+                           type == REC_SUB, false};
+      subs += type == REC_SUB;
+    } else if (type == REC_END) {
+      if (depth == 0)
+        return false;
+      const Open o = open[--depth];
+      const uint32_t body = o.word + o.head;
+      if (!o.work || w[body - 2] != at + 1 - body || w[body - 1] != i - o.index)
+        return false;
+      if (o.sub) {
+        subs--;
+        bodies.push_back(body);
+        bodies.push_back(o.index + 1);
+      } else {
+        work = w[o.word + 1] > 0; // the repeat count
+      }
+    } else if (type == REC_CALL) {
+      const uint32_t nargs = (h >> 8) & 0x07, args = (h >> 12) & 0x0F;
+      if (nargs > PwmSequencer::MAX_PARAMS || (args >> nargs) || (args && !subs))
+        return false;
+      for (uint32_t k = 0; k < nargs; k++)
+        if (((args >> k) & 1) && w[at + 3 + k] >= PwmSequencer::MAX_PARAMS)
+          return false;
+      bool found = false;
+      for (size_t b = 0; b < bodies.size() && !found; b += 2)
+        found = bodies[b] == w[at + 1] && bodies[b + 1] == w[at + 2];
+      if (!found)
+        return false;
+      work = true;
+    } else if (type == REC_PARAM) {
+      const ParamOp op = (ParamOp)((h >> 4) & 0x03);
+      const TaskType t = (TaskType)((h >> 12) & 0x0F);
+      const uint32_t args = (h >> 20) & 0x0F;
+      const int n = paramOperands(h) - (op == ParamOp::RAMP ? 1 : 0);
+      if (((op == ParamOp::SET || op == ParamOp::RAMP) && !isRampType(t)) ||
+          ((h >> 16) & 0x03) > (uint32_t)TaskMode::EXPONENTIAL ||
+          (args >> n) || (args && !subs))
+        return false;
+      for (int k = 0; k < n; k++)
+        if (((args >> k) & 1) && w[at + 1 + k] >= PwmSequencer::MAX_PARAMS)
+          return false;
+      work = true;
+    } else if (type == REC_SWEEP) {
+      if (!sweepLevels(h) || !sweepMasks(h))
+        return false;
+      work = true;
+    } else if (type > (uint32_t)TaskType::TRAJECTORY_POINT) {
+      return false;
+    }
+    if (work && depth > 0)
+      open[depth - 1].work = true;
+    at += len;
+    i++;
+  }
+  return depth == 0 && i == nTasks;
+}
+
 SequenceTask makeTrajectoryTask(float freq, const float *duty,
                                 const float *phase, const float *carrier,
                                 int numChannels, int64_t durationUs) {
@@ -31,29 +616,335 @@ PwmSequencer::PwmSequencer(PwmController *phaseCtrl) {
   _currentFrameIdx = 0;
   _taskStartTimeUs = 0;
   _taskFrameOffsetUs = 0;
+  _taskSampleIdx = 0;
   _taskStepUs = 1000;
   _initialFreqHz = 0.0f;
   _currentFreqHz = 0.0f;
+  for (int b = 0; b < NUM_FIELDS; b++)
+    _encValue[b] = 0.0f;
   for (int i = 0; i < 4; i++) {
     _initialDutyCycles[i] = 0.0f;
     _initialPhaseDegrees[i] = 0.0f;
     _currentDutyCycles[i] = 0.0f;
     _currentPhaseDegrees[i] = 0.0f;
+    _initialCarrierDutyCycles[i] = NAN;
     _currentCarrierDutyCycles[i] = NAN;
   }
 }
 
-void PwmSequencer::reserve(size_t size) { _queue.reserve(size); }
+// About four words a task: a WAIT is two, a one-carrier snapshot two or three.
+void PwmSequencer::reserve(size_t size) { _arena.reserve(size * 4); }
+
+bool PwmSequencer::useExternalTasks(const uint32_t *words, size_t wordCount,
+                                    size_t taskCount) {
+  if (words) {
+    // Check every record once here, so run() can decode without bounds checks.
+    if (!checkRecords(words, wordCount, taskCount))
+      return false;
+    std::vector<uint32_t>().swap(_arena);
+    _arenaTasks = 0;
+    _encKnown = 0;
+    _encDepth = 0;
+  }
+  _extWords = words;
+  _extWordCount = words ? wordCount : 0;
+  _extTasks = words ? taskCount : 0;
+  std::vector<RampTable>().swap(_rampTables); // compile() rebuilds them
+  std::vector<uint16_t>().swap(_table);
+  std::vector<Checkpoint>().swap(_checkpoints);
+  std::vector<Frame>().swap(_checkpointFrames);
+  std::vector<Fold>().swap(_folds);
+  std::vector<uint32_t>().swap(_stepCheckpoints);
+  _durationUs = 0;
+  resetCursor();
+  return true;
+}
+
+void PwmSequencer::truncateQueue(size_t n) {
+  while (_encDepth > 0 && _encBlocks[_encDepth - 1].index >= n)
+    _encDepth--; // their openers go too
+  if (n >= _arenaTasks)
+    return;
+  // Walk to record n, replaying the encoder's view of the state on the way.
+  size_t at = 0;
+  _encKnown = 0;
+  for (size_t i = 0; i < n; i++)
+    at += trackRecord(&_arena[at], _arena.size() - at, _encValue, _encKnown);
+  _arena.resize(at);
+  _arenaTasks = n;
+}
+
+void PwmSequencer::pushedRecord(bool runs) {
+  _arenaTasks++;
+  if (runs && _encDepth > 0)
+    _encBlocks[_encDepth - 1].hasWork = true;
+}
+
+void PwmSequencer::encodeTask(const SequenceTask &task) {
+  if (_extWords)
+    return; // see useExternalTasks()
+  SequenceTask t = task;
+  if ((uint32_t)t.type > (uint32_t)TaskType::TRAJECTORY_POINT) {
+    t = SequenceTask{}; // run() never did anything with these but skip them
+    t.type = TaskType::WAIT;
+  }
+  if (!isRampType(t.type) || (uint32_t)t.mode > (uint32_t)TaskMode::EXPONENTIAL)
+    t.mode = TaskMode::POLYNOMIAL;
+
+  if (t.type == TaskType::TRAJECTORY_POINT) {
+    encodePoint(t, DIRTY_ALL);
+    return;
+  }
+
+  const size_t at = _arena.size();
+  uint32_t h = (uint32_t)t.type | ((uint32_t)t.mode << 4);
+  _arena.push_back(0); // header, filled in below
+
+  if (t.type == TaskType::WAIT || isRampType(t.type)) {
+    if (t.durationUs < 0 || t.durationUs > (int64_t)UINT32_MAX) {
+      h |= REC_LONG;
+      _arena.push_back((uint32_t)((uint64_t)t.durationUs & 0xFFFFFFFFULL));
+      _arena.push_back((uint32_t)((uint64_t)t.durationUs >> 32));
+    } else {
+      _arena.push_back((uint32_t)t.durationUs);
+    }
+    if (isRampType(t.type)) {
+      _arena.push_back(floatBits(t.shape));
+      uint8_t mask = rampLaneMask(t);
+      if (t.type != TaskType::PWM_FREQ)
+        h |= (uint32_t)mask << 8;
+      for (int i = 0; i < 4; i++) {
+        if (!((mask >> i) & 1))
+          continue;
+        float s, e;
+        rampEndpoints(t, i, s, e);
+        _arena.push_back(floatBits(s));
+        _arena.push_back(floatBits(e));
+      }
+    }
+  }
+  _arena[at] = h;
+  pushedRecord(true);
+  trackKnown(t, 0, _encValue, _encKnown);
+}
+
+void PwmSequencer::encodePoint(const SequenceTask &task, uint16_t fields) {
+  SequenceTask t = task;
+  const size_t at = _arena.size();
+  _arena.push_back(0); // header, filled in below
+  uint16_t carried = 0;
+  for (int b = 0; b < NUM_FIELDS; b++) {
+    if (!((fields >> b) & 1))
+      continue;
+    float v = pointField(t, b);
+    float k = _encValue[b];
+    bool same = ((_encKnown >> b) & 1) && (v == k || (isnan(v) && isnan(k)));
+    if (same)
+      continue; // run() would find the field already at v
+    carried |= (uint16_t)(1u << b);
+    _arena.push_back(floatBits(v));
+  }
+  _arena[at] = (uint32_t)TaskType::TRAJECTORY_POINT | (uint32_t)carried << 16;
+  pushedRecord(true);
+  trackKnown(t, carried, _encValue, _encKnown);
+}
+
+void PwmSequencer::addSequenceTask(SequenceTask task) { encodeTask(task); }
+
+bool PwmSequencer::beginRepeat(uint32_t count) {
+  if (_extWords || _encDepth == MAX_DEPTH)
+    return false;
+  _encBlocks[_encDepth++] =
+      OpenBlock{(uint32_t)_arena.size(), (uint32_t)_arenaTasks, false, false};
+  _arena.push_back(REC_REPEAT);
+  _arena.push_back(count);
+  _arena.push_back(0); // skipWords, skipRecords: endBlock()
+  _arena.push_back(0);
+  _arenaTasks++;
+  _encKnown = 0; // reached from the block's end as well
+  return true;
+}
+
+bool PwmSequencer::beginSubroutine(Subroutine &sub) {
+  if (_extWords || _encDepth == MAX_DEPTH)
+    return false;
+  _encBlocks[_encDepth++] =
+      OpenBlock{(uint32_t)_arena.size(), (uint32_t)_arenaTasks, true, false};
+  _arena.push_back(REC_SUB);
+  _arena.push_back(0); // skipWords, skipRecords: endBlock()
+  _arena.push_back(0);
+  _arenaTasks++;
+  sub.word = (uint32_t)_arena.size();
+  sub.index = (uint32_t)_arenaTasks;
+  _encKnown = 0; // entered from any call
+  return true;
+}
+
+bool PwmSequencer::endBlock() {
+  if (_extWords || _encDepth == 0)
+    return false;
+  const OpenBlock b = _encBlocks[--_encDepth];
+  if (!b.hasWork) {
+    truncateQueue(b.index);
+    return false;
+  }
+  _arena.push_back(REC_END);
+  _arenaTasks++;
+  const uint32_t body = b.word + (b.sub ? 3 : 4);
+  _arena[body - 2] = (uint32_t)(_arena.size() - body);
+  _arena[body - 1] = (uint32_t)(_arenaTasks - 1 - b.index);
+  if (!b.sub && _arena[b.word + 1] > 0 && _encDepth > 0)
+    _encBlocks[_encDepth - 1].hasWork = true;
+  _encKnown = 0;
+  return true;
+}
+
+void PwmSequencer::addCall(const Subroutine &sub, const Operand *args,
+                           int numArgs) {
+  if (_extWords || sub.word < 3 || sub.word > _arena.size() ||
+      (_arena[sub.word - 3] & 0x0F) != REC_SUB)
+    return;
+  for (int d = 0; d < _encDepth; d++)
+    if (_encBlocks[d].sub && _encBlocks[d].word + 3 == sub.word)
+      return; // still open
+  if (numArgs < 0)
+    numArgs = 0;
+  if (numArgs > MAX_PARAMS)
+    numArgs = MAX_PARAMS;
+  uint32_t h = REC_CALL | (uint32_t)numArgs << 8;
+  uint32_t argWords[MAX_PARAMS];
+  for (int k = 0; k < numArgs; k++) {
+    if (args[k].param >= 0) {
+      if (args[k].param >= MAX_PARAMS || !insideSubroutine())
+        return;
+      h |= 1u << (12 + k);
+      argWords[k] = (uint32_t)args[k].param;
+    } else {
+      argWords[k] = floatBits(args[k].value);
+    }
+  }
+  _arena.push_back(h);
+  _arena.push_back(sub.word);
+  _arena.push_back(sub.index);
+  _arena.insert(_arena.end(), argWords, argWords + numArgs);
+  pushedRecord(true);
+  _encKnown = 0;
+}
+
+void PwmSequencer::addParamTask(const ParamTask &task) {
+  if (_extWords)
+    return;
+  const bool ramps = isRampType(task.type);
+  if ((task.op == ParamOp::SET || task.op == ParamOp::RAMP) && !ramps)
+    return; // same rule as addRampTask()
+  uint32_t channels = task.channels & 0x0F;
+  if (task.type == TaskType::PWM_FREQ)
+    channels = 1;
+  if (task.op == ParamOp::ACTIVATE || task.op == ParamOp::WAIT)
+    channels = 0;
+  uint32_t h = REC_PARAM | (uint32_t)task.op << 4 | channels << 8 |
+               (uint32_t)task.type << 12 |
+               ((uint32_t)task.mode & 0x03) << 16;
+  if ((uint32_t)task.mode > (uint32_t)TaskMode::EXPONENTIAL)
+    h &= ~(0x03u << 16);
+
+  // Operands in record order: SET takes a[i] for each channel i it sets.
+  uint32_t w[5] = {0, 0, 0, 0, 0};
+  const int n = paramOperands(h) - (task.op == ParamOp::RAMP ? 1 : 0);
+  for (int k = 0, i = 0; k < n; k++) {
+    if (task.op == ParamOp::SET)
+      while (!((channels >> i) & 1))
+        i++;
+    const Operand &o = task.a[task.op == ParamOp::SET ? i++ : k];
+    if (o.param >= 0) {
+      if (o.param >= MAX_PARAMS || !insideSubroutine())
+        return;
+      h |= 1u << (20 + k);
+      w[1 + k] = (uint32_t)o.param;
+    } else if (intOperand(task.op, k)) {
+      float v = o.value;
+      w[1 + k] = v > 0.0f ? (v < 4294967040.0f ? (uint32_t)v : UINT32_MAX) : 0;
+    } else {
+      w[1 + k] = floatBits(o.value);
+    }
+  }
+  if (task.op == ParamOp::RAMP)
+    w[4] = floatBits(task.shape);
+  w[0] = h;
+
+  if (!(h >> 20 & 0x0F)) {
+    // Nothing to resolve at run time: queue the plain record it amounts to.
+    SequenceTask t;
+    uint16_t fields;
+    decodeParamTask(w, nullptr, t, fields);
+    if (t.type == TaskType::TRAJECTORY_POINT)
+      encodePoint(t, fields);
+    else
+      encodeTask(t);
+    return;
+  }
+  _arena.insert(_arena.end(), w, w + 1 + paramOperands(h));
+  pushedRecord(true);
+  _encKnown = 0;
+}
+
+bool PwmSequencer::addSweep(const float *levels, int numLevels,
+                            const uint8_t *masks, int numMasks,
+                            uint32_t dwellMs, uint32_t restMs) {
+  if (_extWords || numLevels < 1 || numLevels > MAX_SWEEP_AXIS ||
+      numMasks < 1 || numMasks > MAX_SWEEP_AXIS)
+    return false;
+  _arena.push_back(REC_SWEEP | (uint32_t)numLevels << 8 |
+                   (uint32_t)numMasks << 16);
+  _arena.push_back(dwellMs);
+  _arena.push_back(restMs);
+  for (int k = 0; k < numLevels; k++)
+    _arena.push_back(floatBits(clampDuty(levels[k])));
+  for (int k = 0; k < numMasks; k++) {
+    if (k % 8 == 0)
+      _arena.push_back(0);
+    _arena.back() |= (uint32_t)(masks[k] & 0x0F) << (4 * (k % 8));
+  }
+  pushedRecord(true);
+  _encKnown = 0;
+  return true;
+}
+
+uint32_t PwmSequencer::sweepAt(size_t word, uint32_t point, float *level,
+                               uint8_t *mask) const {
+  if (word >= wordCount() || (words()[word] & 0x0F) != REC_SWEEP ||
+      !recordLength(words() + word, wordCount() - word))
+    return 0;
+  const uint32_t *w = words() + word;
+  const uint32_t nMasks = sweepMasks(w[0]);
+  const uint32_t points = sweepLevels(w[0]) * nMasks;
+  if (point < points) {
+    if (level)
+      *level = bitsFloat(w[3 + point / nMasks]);
+    if (mask)
+      *mask = (uint8_t)sweepMask(w, point % nMasks);
+  }
+  return points;
+}
+
+int32_t PwmSequencer::sweepStep() const {
+  if (isDone() || (words()[_taskWord] & 0x0F) != REC_SWEEP)
+    return -1;
+  return (int32_t)_sweepStep;
+}
 
-void PwmSequencer::addSequenceTask(SequenceTask task) {
-  _queue.push_back(task);
+bool PwmSequencer::insideSubroutine() const {
+  for (int d = 0; d < _encDepth; d++)
+    if (_encBlocks[d].sub)
+      return true;
+  return false;
 }
 
 void PwmSequencer::addWaitTask(uint32_t durationMs) {
   SequenceTask task = {};
   task.type = TaskType::WAIT;
   task.durationUs = (int64_t)durationMs * 1000LL;
-  _queue.push_back(task);
+  encodeTask(task);
 }
 
 // Global ramp
@@ -73,117 +964,186 @@ void PwmSequencer::addRampTask(const float *starts, const float *ends,
   task.mode = ramp_mode;
   task.shape = shape;
   task.durationUs = (int64_t)durationMs * 1000LL;
+  if (setRampEndpoints(task, starts, ends, numChannels))
+    encodeTask(task);
+}
 
-  if (type == TaskType::PWM_FREQ) {
-    // Frequency is global; only channel 0 is meaningful.
-    task.startFreq = starts[0];
-    task.endFreq = ends[0];
-    _queue.push_back(task);
-    return;
-  }
-
-  float *start_traj = nullptr;
-  float *end_traj = nullptr;
-  bool clamp = false;
-
-  switch (type) {
-  case TaskType::CARRIER_DUTY:
-    start_traj = task.startCarriers;
-    end_traj = task.endCarriers;
-    clamp = true;
-    break;
-  case TaskType::PWM_DUTY:
-    start_traj = task.startDuties;
-    end_traj = task.endDuties;
-    clamp = true;
-    break;
-  case TaskType::PWM_PHASE:
-    start_traj = task.startPhases;
-    end_traj = task.endPhases;
-    break;
-  default:
-    return; // you can only ramp frequency, duty, carrier duty, or phase
-  }
+void PwmSequencer::resetCursor() {
+  _currentFrameIdx = 0;
+  _taskWord = 0;
+  _taskWords = 0;
+  _taskLoaded = false;
+  _sweepStep = 0;
+  _sweepSteps = 0;
+  _depth = 0;
+  _taskTimelineUs = 0;
+  _taskStartTimeUs = 0;
+  _taskFrameOffsetUs = 0;
+  _taskSampleIdx = 0;
+  _curveReady = false;
+  settle();
+}
 
-  for (int i = 0; i < 4; i++) {
-    if (i < numChannels && !isnan(starts[i])) {
-      float s = starts[i];
-      float e = ends[i];
-      if (clamp) {
-        s = clampDuty(s);
-        e = clampDuty(e);
+void PwmSequencer::settle() {
+  // Records were checked on the way in (encoder, useExternalTasks()), and
+  // every block runs some task, so this always reaches one.
+  const uint32_t *w = words();
+  const size_t n = wordCount();
+  while (_taskWord < n) {
+    const uint32_t *r = w + _taskWord;
+    switch (r[0] & 0x0F) {
+    case REC_REPEAT:
+      if (r[1] == 0 || _depth == MAX_DEPTH) {
+        _taskWord += 4 + r[2]; // skipped, as is a repeat nested too deep
+        _currentFrameIdx += 1 + r[3];
+      } else {
+        Frame &f = _frames[_depth];
+        for (int k = 0; k < MAX_PARAMS; k++)
+          f.params[k] = _depth ? _frames[_depth - 1].params[k] : 0.0f;
+        f.word = (uint32_t)_taskWord + 4;
+        f.index = (uint32_t)_currentFrameIdx + 1;
+        f.remaining = r[1] - 1;
+        _depth++;
+        _taskWord = f.word;
+        _currentFrameIdx = f.index;
       }
-      start_traj[i] = s;
-      end_traj[i] = e;
-    } else {
-      start_traj[i] = NAN; // if channel is not selected (NAN), skip
-      end_traj[i] = NAN;
+      break;
+    case REC_SUB:
+      _taskWord += 3 + r[1]; // a body only runs through a call
+      _currentFrameIdx += 1 + r[2];
+      break;
+    case REC_CALL: {
+      const uint32_t nargs = (r[0] >> 8) & 0x07, args = (r[0] >> 12) & 0x0F;
+      if (_depth == MAX_DEPTH) {
+        _taskWord += 3 + nargs;
+        _currentFrameIdx++;
+        break;
+      }
+      Frame &f = _frames[_depth];
+      const float *outer = _depth ? _frames[_depth - 1].params : nullptr;
+      for (uint32_t k = 0; k < (uint32_t)MAX_PARAMS; k++) {
+        float v = 0.0f;
+        if (k < nargs)
+          v = ((args >> k) & 1) ? (outer ? outer[r[3 + k]] : 0.0f)
+                                : bitsFloat(r[3 + k]);
+        f.params[k] = v;
+      }
+      f.word = (uint32_t)_taskWord + 3 + nargs;
+      f.index = (uint32_t)_currentFrameIdx + 1;
+      f.remaining = CALL_FRAME;
+      _depth++;
+      _taskWord = r[1];
+      _currentFrameIdx = r[2];
+      break;
+    }
+    case REC_END: {
+      Frame &f = _frames[_depth - 1];
+      if (_folding && f.remaining && f.remaining != CALL_FRAME)
+        foldPasses(f);
+      if (f.remaining == CALL_FRAME || f.remaining == 0) {
+        _depth--;
+        if (f.remaining == CALL_FRAME) {
+          _taskWord = f.word; // back to the caller
+          _currentFrameIdx = f.index;
+          break;
+        }
+        _taskWord++; // last pass done
+        _currentFrameIdx++;
+      } else {
+        f.remaining--;
+        _taskWord = f.word;
+        _currentFrameIdx = f.index;
+      }
+      break;
+    }
+    default:
+      return; // a task
     }
   }
-  _queue.push_back(task);
 }
 
-float PwmSequencer::applyCurve(TaskMode mode, float t, float shape) {
-  if (t <= 0.0f)
-    return 0.0f;
-  if (t >= 1.0f)
-    return 1.0f;
-
-  switch (mode) {
-  case TaskMode::EASE: {
-    // Symmetric S-curve (sigmoid), not a power: it eases in AND out about
-    // t=0.5. k=1 is linear, larger k sharpens the transition.
-    float k = isnan(shape) ? 2.0f : shape;
-    if (k < 1.0f)
-      k = 1.0f;
-    float a = powf(t, k);
-    float b = powf(1.0f - t, k);
-    return a / (a + b);
-  }
-  case TaskMode::EXPONENTIAL: {
-    // Exponent multiplier: k>0 slow-start/fast-finish, k<0 the reverse.
-    float k = isnan(shape) ? 2.0f : shape;
-    if (fabsf(k) < 1e-6f)
-      return t; // degenerates to linear
-    return (expf(k * t) - 1.0f) / (expf(k) - 1.0f);
-  }
-  case TaskMode::POLYNOMIAL:
-  default: {
-    // t^p about the origin: p=1 linear, p>1 slow-start, 0<p<1 fast-start.
-    // p<=0 would step or blow up, so it falls back to linear.
-    float p = (isnan(shape) || shape <= 0.0f) ? 1.0f : shape;
-    return powf(t, p);
+void PwmSequencer::loadTask() {
+  const uint32_t *w = words() + _taskWord;
+  _sweepSteps = 0;
+  if ((w[0] & 0x0F) == REC_SWEEP) {
+    _taskWords = recordLength(w, wordCount() - _taskWord);
+    _sweepSteps = sweepLevels(w[0]) * sweepMasks(w[0]) * SWEEP_STEPS;
+    decodeSweepStep(w, _sweepStep, _task, _taskFields);
+    _taskRamp = nullptr;
+  } else if ((w[0] & 0x0F) == REC_PARAM) {
+    _taskWords = decodeParamTask(w, _depth ? _frames[_depth - 1].params : nullptr,
+                                 _task, _taskFields);
+    _taskRamp = nullptr; // operands vary per call: never tabulated
+  } else {
+    _taskWords = decodeTask(w, wordCount() - _taskWord, _task, _taskFields);
+    _taskRamp = isRampType(_task.type) ? rampTable(_taskWord) : nullptr;
   }
+  _taskLoaded = true;
+  _curveReady = false;
+}
+
+void PwmSequencer::advanceTask(int64_t nowUs) {
+  _taskTimelineUs += nominalUs(_task);
+  if (!_sweepSteps || ++_sweepStep == _sweepSteps) {
+    _sweepStep = 0; // else the same sweep's next step
+    _taskWord += _taskWords;
+    _currentFrameIdx++;
   }
+  _taskLoaded = false;
+  _taskStartTimeUs = nowUs;
+  _taskFrameOffsetUs = 0;
+  _taskSampleIdx = 0;
+  _taskEnded = true;
+  settle();
+}
+
+void PwmSequencer::jumpSweep(uint32_t s) {
+  if (s <= _sweepStep)
+    return;
+  // The steps skipped leave what the last on/off step among them set (dwell
+  // and rest change nothing), so this is O(1) however many points it skips.
+  const uint32_t *w = words() + _taskWord;
+  SequenceTask t;
+  uint16_t fields;
+  decodeSweepStep(w, (s - 1) & ~1u, t, fields);
+  finishTask(t, fields, nullptr);
+  _taskTimelineUs += sweepStepUs(w, s) - sweepStepUs(w, _sweepStep);
+  _sweepStep = s;
+  loadTask();
 }
 
 void PwmSequencer::resetStreamingState() {
-  _currentFrameIdx = 0;
-  _taskStartTimeUs = 0;
-  _taskFrameOffsetUs = 0;
+  resetCursor();
   _currentFreqHz = _initialFreqHz;
 
   for (int i = 0; i < 4; i++) {
     _currentDutyCycles[i] = _initialDutyCycles[i];
     _currentPhaseDegrees[i] = _initialPhaseDegrees[i];
-    _currentCarrierDutyCycles[i] = NAN;
+    _currentCarrierDutyCycles[i] = _initialCarrierDutyCycles[i];
   }
 }
 
-void PwmSequencer::applyCurrentState() {
-  if (!_phaseCtrl)
+void PwmSequencer::flushState() {
+  if (!_phaseCtrl || !_dirty) {
+    _dirty = 0;
     return;
+  }
 
-  _phaseCtrl->setGlobalFrequency(_currentFreqHz);
-
+  // Unchanged fields stay NAN, which applyState() leaves alone (and a NAN
+  // carrier, i.e. never commanded, is skipped the same way).
+  DriveState state;
+  if (_dirty & DIRTY_FREQ)
+    state.freqHz = _currentFreqHz;
   for (int i = 0; i < 4; i++) {
-    _phaseCtrl->setDutyCycle(i, _currentDutyCycles[i]);
-    _phaseCtrl->setPhase(i, _currentPhaseDegrees[i]);
-
-    if (!isnan(_currentCarrierDutyCycles[i])) {
-      _phaseCtrl->setCarrierDutyCycle(i, _currentCarrierDutyCycles[i]);
-    }
+    if (_dirty & dirtyBit(TaskType::PWM_DUTY, i))
+      state.dutyPct[i] = _currentDutyCycles[i];
+    if (_dirty & dirtyBit(TaskType::PWM_PHASE, i))
+      state.phaseDeg[i] = _currentPhaseDegrees[i];
+    if (_dirty & dirtyBit(TaskType::CARRIER_DUTY, i))
+      state.carrierPct[i] = _currentCarrierDutyCycles[i];
   }
+  _phaseCtrl->applyState(state);
+  _dirty = 0;
 }
 
 void PwmSequencer::compile(uint32_t resolutionMs, float initialFreq,
@@ -197,141 +1157,592 @@ void PwmSequencer::compile(uint32_t resolutionMs, float initialFreq,
   for (int i = 0; i < 4; i++) {
     _initialDutyCycles[i] = initialDuty ? initialDuty[i] : 0.0f;
     _initialPhaseDegrees[i] = initialPhase ? initialPhase[i] : 0.0f;
+    _initialCarrierDutyCycles[i] = NAN;
   }
 
+  while (_encDepth > 0)
+    endBlock(); // close what the builder left open
+  _arena.shrink_to_fit(); // the queue is built: drop the growth slack
+  _hasControl = false;
+  for (size_t at = 0; at < wordCount() && !_hasControl;
+       at += recordLength(words() + at, wordCount() - at))
+    _hasControl = (words()[at] & 0x0F) > (uint32_t)TaskType::TRAJECTORY_POINT &&
+                  (words()[at] & 0x0F) != REC_SWEEP; // a sweep runs in place
+  buildRampTables();
+  buildCheckpoints();
   resetStreamingState();
 }
 
+const RampTable *PwmSequencer::rampTable(size_t word) const {
+  size_t lo = 0, hi = _rampTables.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (_rampTables[mid].word < word)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < _rampTables.size() && _rampTables[lo].word == word
+             ? &_rampTables[lo]
+             : nullptr;
+}
+
+void PwmSequencer::pushCheckpoint(int64_t startUs) {
+  Checkpoint cp;
+  cp.startUs = startUs;
+  cp.word = (uint32_t)_taskWord;
+  cp.index = (uint32_t)_currentFrameIdx;
+  cp.frame = (uint32_t)_checkpointFrames.size();
+  cp.depth = _depth;
+  cp.freq = _currentFreqHz;
+  for (int c = 0; c < 4; c++) {
+    cp.duty[c] = _currentDutyCycles[c];
+    cp.phase[c] = _currentPhaseDegrees[c];
+    cp.carrier[c] = _currentCarrierDutyCycles[c];
+  }
+  _checkpointFrames.insert(_checkpointFrames.end(), _frames, _frames + _depth);
+  _checkpoints.push_back(cp);
+}
+
+void PwmSequencer::foldPasses(Frame &f) {
+  // Every task sets absolute values, so a pass leaves the same state
+  // whatever it started from: from the second pass on, each starts from the
+  // state the first left. The index runs two and skips the rest, so a
+  // repeat costs compile() its body twice, not its count times.
+  const uint8_t d = _depth - 1;
+  int64_t passUs;
+  if (_folding == FOLD_BUILD) {
+    if (words()[f.word - 3] - f.remaining == 1) { // pass 1 just ended
+      _passStartUs[d] = _taskTimelineUs;
+      return;
+    }
+    passUs = _taskTimelineUs - _passStartUs[d];
+    Fold fold = {_taskTimelineUs, passUs, f.remaining, d};
+    _folds.push_back(fold);
+  } else {
+    // A replay from a checkpoint reaching the fold the build made here.
+    size_t lo = 0, hi = _folds.size(); // first fold starting at or after now
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (_folds[mid].startUs < _taskTimelineUs)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    while (lo < _folds.size() && _folds[lo].startUs == _taskTimelineUs &&
+           (_folds[lo].depth != d || _folds[lo].passes != f.remaining))
+      lo++;
+    if (lo == _folds.size() || _folds[lo].startUs != _taskTimelineUs)
+      return;
+    passUs = _folds[lo].passUs;
+  }
+  _taskTimelineUs += (int64_t)f.remaining * passUs;
+  f.remaining = 0;
+}
+
+void PwmSequencer::buildCheckpoints() {
+  // Run the queue the way run() would, from the initial state, and keep a
+  // snapshot every _checkpointEvery tasks. Repeats are folded (see
+  // foldPasses()), but calls still run their body each time: at
+  // MAX_CHECKPOINTS, every other snapshot is dropped and the spacing
+  // doubles. A sweep counts as one task: seekFrom() works out where in it a
+  // time falls, so its steps need no checkpoints. It starts from an all-NAN
+  // state, so a field no task has set yet stays NAN and seekFrom() reads
+  // the initial state for it: the index holds for any initial state, and
+  // handOver() needs no new one.
+  resetCursor();
+  _currentFreqHz = NAN;
+  for (int i = 0; i < 4; i++) {
+    _currentDutyCycles[i] = NAN;
+    _currentPhaseDegrees[i] = NAN;
+    _currentCarrierDutyCycles[i] = NAN;
+  }
+  std::vector<Checkpoint>().swap(_checkpoints);
+  std::vector<Frame>().swap(_checkpointFrames);
+  std::vector<Fold>().swap(_folds);
+  std::vector<uint32_t>().swap(_stepCheckpoints);
+  if (_hasControl) // by value: NO_CHECKPOINT has no out-of-class definition
+    _stepCheckpoints.assign(taskCount(), (uint32_t)NO_CHECKPOINT);
+  _checkpointEvery = CHECKPOINT_EVERY;
+  _folding = FOLD_BUILD;
+  for (size_t ran = 0; !isDone(); ran++) {
+    if (ran % _checkpointEvery == 0 && _checkpoints.size() == MAX_CHECKPOINTS) {
+      std::vector<Frame> frames;
+      size_t kept = 0;
+      for (size_t c = 0; c < _checkpoints.size(); c += 2) {
+        Checkpoint cp = _checkpoints[c];
+        const Frame *f = _checkpointFrames.data() + cp.frame;
+        cp.frame = (uint32_t)frames.size();
+        frames.insert(frames.end(), f, f + cp.depth);
+        _checkpoints[kept++] = cp;
+      }
+      _checkpoints.resize(kept);
+      _checkpointFrames.swap(frames);
+      _checkpointEvery *= 2;
+      for (uint32_t &c : _stepCheckpoints) // c, or c - 1 if dropped
+        if (c != NO_CHECKPOINT)
+          c /= 2;
+    }
+    if (ran % _checkpointEvery == 0)
+      pushCheckpoint(_taskTimelineUs);
+    if (_hasControl && _stepCheckpoints[_currentFrameIdx] == NO_CHECKPOINT)
+      _stepCheckpoints[_currentFrameIdx] = (uint32_t)_checkpoints.size() - 1;
+    loadTask();
+    if (_sweepSteps)
+      jumpSweep(_sweepSteps - 1);
+    finishTask(_task, _taskFields, _taskRamp);
+    advanceTask(0);
+  }
+  _folding = FOLD_OFF;
+  _checkpoints.shrink_to_fit();
+  _checkpointFrames.shrink_to_fit();
+  _folds.shrink_to_fit();
+  _durationUs = _taskTimelineUs;
+  _dirty = 0;
+}
+
+void PwmSequencer::buildRampTables() {
+  std::vector<uint16_t>().swap(_table); // release the previous compile's table
+  std::vector<RampTable>().swap(_rampTables);
+  const uint32_t *w = words();
+  const size_t nWords = wordCount();
+  SequenceTask task;
+  uint16_t fields;
+  _tabulatedRamps = 0;
+  _fallbackRamps = 0;
+
+  size_t budget = _tableBudgetBytes;
+  size_t heapCap = ESP.getMaxAllocHeap() / 2;
+  if (heapCap < budget)
+    budget = heapCap;
+  const size_t budgetSamples = budget / sizeof(uint16_t);
+
+  // Pass 1: decide which ramps get a table, so it is allocated exactly once.
+  // Sample offsets 0, step, ... <= duration, then the t=1 endpoint: the same
+  // instants run() used to evaluate the curve at.
+  size_t total = 0;
+  for (size_t at = 0; at < nWords; at += recordLength(w + at, nWords - at)) {
+    const uint32_t type = w[at] & 0x0F;
+    if (type == REC_PARAM && ((w[at] >> 4) & 0x03) == (uint32_t)ParamOp::RAMP)
+      _fallbackRamps++; // operands only known when it runs
+    if (!isRampType((TaskType)type))
+      continue;
+    decodeTask(w + at, nWords - at, task, fields);
+    if (task.durationUs <= 0)
+      continue; // instant sets need no table
+    uint8_t mask = rampLaneMask(task);
+    int lanes = __builtin_popcount(mask);
+    if (lanes == 0)
+      continue;
+
+    // The curves map [0,1] monotonically onto [0,1], so every sample lies
+    // between the endpoints: checking those is enough.
+    bool fits = true;
+    for (int i = 0; i < 4 && fits; i++) {
+      if (!((mask >> i) & 1) || task.type == TaskType::PWM_PHASE)
+        continue;
+      float s, e;
+      rampEndpoints(task, i, s, e);
+      fits = fitsCenti(s) && fitsCenti(e);
+    }
+    int64_t count = task.durationUs / _taskStepUs + 2;
+    size_t need = (size_t)count * (size_t)lanes;
+    if (!fits || count > 65535 || total + need > budgetSamples) {
+      _fallbackRamps++;
+      continue;
+    }
+    _rampTables.push_back(RampTable{(uint32_t)at, (uint32_t)total,
+                                    (uint16_t)count, mask});
+    total += need;
+    _tabulatedRamps++;
+  }
+  _rampTables.shrink_to_fit();
+  if (total == 0)
+    return;
+
+  // Pass 2: evaluate each curve once, here instead of in run().
+  _table.resize(total);
+  for (const RampTable &rt : _rampTables) {
+    decodeTask(w + rt.word, nWords - rt.word, task, fields);
+    const bool phase = task.type == TaskType::PWM_PHASE;
+    const CurveKernel curve(task.mode, task.shape);
+    uint16_t *lane = &_table[rt.offset];
+    for (int i = 0; i < 4; i++) {
+      if (!((rt.laneMask >> i) & 1))
+        continue;
+      float s, e;
+      rampEndpoints(task, i, s, e);
+      for (uint32_t k = 0; k < rt.count; k++) {
+        float t = 1.0f;
+        if (k + 1 < rt.count)
+          t = curve.eval((float)((int64_t)k * _taskStepUs) /
+                         (float)task.durationUs);
+        float v = s + t * (e - s);
+        lane[k] = toCenti(phase ? wrapDegrees(v) : v);
+      }
+      lane += rt.count;
+    }
+  }
+}
+
+void PwmSequencer::applyTableSample(const SequenceTask &task,
+                                    const RampTable &rt, uint32_t k) {
+  const uint16_t *lane = &_table[rt.offset + k];
+  if (task.type == TaskType::PWM_FREQ) {
+    setField(_currentFreqHz, *lane * 0.01f, DIRTY_FREQ);
+    return;
+  }
+  float *dst = (task.type == TaskType::CARRIER_DUTY) ? _currentCarrierDutyCycles
+               : (task.type == TaskType::PWM_DUTY)   ? _currentDutyCycles
+                                                     : _currentPhaseDegrees;
+  for (int i = 0; i < 4; i++) {
+    if (!((rt.laneMask >> i) & 1))
+      continue;
+    setField(dst[i], *lane * 0.01f, dirtyBit(task.type, i));
+    lane += rt.count;
+  }
+}
+
 void PwmSequencer::start() {
-  _currentFrameIdx = 0;
+  resetCursor();
+  _paused = false;
   _taskStartTimeUs = esp_timer_get_time();
-  _taskFrameOffsetUs = 0;
   _currentFreqHz = _initialFreqHz;
 
   for (int i = 0; i < 4; i++) {
     _currentDutyCycles[i] = _initialDutyCycles[i];
     _currentPhaseDegrees[i] = _initialPhaseDegrees[i];
-    _currentCarrierDutyCycles[i] = NAN;
+    _currentCarrierDutyCycles[i] = _initialCarrierDutyCycles[i];
   }
 
   // Push the initial state to the hardware immediately, so the configured
   // frequency/duty/phase are driven even before (or without) any queued task.
-  applyCurrentState();
+  _coalescedSamples = 0;
+  _dirty = DIRTY_ALL;
+  flushState();
+}
+
+bool PwmSequencer::handOver(PwmSequencer &next, int64_t nowUs,
+                            bool ownPhases) {
+  std::swap(*this, next);
+  std::swap(_phaseCtrl, next._phaseCtrl);
+
+  uint16_t phases = 0; // own initial phases the drive does not hold yet
+  _initialFreqHz = next._currentFreqHz;
+  for (int i = 0; i < 4; i++) {
+    _initialDutyCycles[i] = next._currentDutyCycles[i];
+    if (!ownPhases)
+      _initialPhaseDegrees[i] = next._currentPhaseDegrees[i];
+    else if (_initialPhaseDegrees[i] != next._currentPhaseDegrees[i])
+      phases |= dirtyBit(TaskType::PWM_PHASE, i);
+    _initialCarrierDutyCycles[i] = next._currentCarrierDutyCycles[i];
+  }
+  resetStreamingState(); // compile()'s seek index holds as it is
+
+  // As start(), but the drive already holds this state: push only the
+  // phases that changed.
+  _paused = false;
+  _stopAtBoundary = false;
+  _taskEnded = false;
+  _taskStartTimeUs = nowUs;
+  _coalescedSamples = 0;
+  _dirty = phases;
+  flushState();
+  return phases != 0;
 }
 
 bool PwmSequencer::isDone() const {
-  return _currentFrameIdx >= _queue.size();
+  return _currentFrameIdx >= taskCount();
+}
+
+void PwmSequencer::seekTo(int64_t timeUs) {
+  if (_checkpoints.empty())
+    return; // empty queue (or not compiled)
+  if (timeUs < 0)
+    timeUs = 0;
+  // Inside passes the index folded: seek the same point in the second
+  // pass, which runs from the same state, and let seekFrom() move on. Each
+  // step goes one block level in, as inner folds lie in that second pass.
+  Unfold unfold[MAX_DEPTH];
+  int unfolds = 0;
+  while (unfolds < MAX_DEPTH) {
+    size_t lo = 0, hi = _folds.size(); // first fold starting after timeUs
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (_folds[mid].startUs <= timeUs)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == 0)
+      break;
+    const Fold &f = _folds[lo - 1];
+    if (timeUs - f.startUs >= (int64_t)f.passes * f.passUs)
+      break; // past it (or it is empty)
+    uint32_t back = (uint32_t)((timeUs - f.startUs) / f.passUs) + 1;
+    timeUs -= (int64_t)back * f.passUs;
+    unfold[unfolds].fold = (uint32_t)(lo - 1);
+    unfold[unfolds].passes = back;
+    unfolds++;
+  }
+  size_t lo = 0, hi = _checkpoints.size(); // last checkpoint starting <= timeUs
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (_checkpoints[mid].startUs <= timeUs)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  seekFrom(lo, (size_t)-1, timeUs, 0, unfold, unfolds);
+}
+
+void PwmSequencer::seekToStep(size_t step, uint32_t sweepPoint) {
+  if (_checkpoints.empty())
+    return;
+  // Without control flow steps run in queue order, so the checkpoints are
+  // sorted by step too. With it a step can run many times (and a subroutine
+  // body first runs after later steps): use the one kept for its first run.
+  // A step that never runs as a task replays to the end, as it is not met.
+  size_t lo = 0, hi = _checkpoints.size(); // last checkpoint at step <= step
+  if (_hasControl) {
+    lo = hi - 1;
+    if (step < _stepCheckpoints.size() && _stepCheckpoints[step] != NO_CHECKPOINT)
+      lo = _stepCheckpoints[step];
+  }
+  while (!_hasControl && hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (_checkpoints[mid].index <= step)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  seekFrom(lo, step, INT64_MAX, sweepPoint);
+}
+
+void PwmSequencer::seekFrom(size_t c, size_t step, int64_t timeUs,
+                            uint32_t point, const Unfold *unfold,
+                            int unfolds) {
+  const Checkpoint &cp = _checkpoints[c];
+  // NAN: not set by any task yet, so still the initial value.
+  _currentFreqHz = isnan(cp.freq) ? _initialFreqHz : cp.freq;
+  for (int i = 0; i < 4; i++) {
+    _currentDutyCycles[i] = isnan(cp.duty[i]) ? _initialDutyCycles[i] : cp.duty[i];
+    _currentPhaseDegrees[i] =
+        isnan(cp.phase[i]) ? _initialPhaseDegrees[i] : cp.phase[i];
+    _currentCarrierDutyCycles[i] =
+        isnan(cp.carrier[i]) ? _initialCarrierDutyCycles[i] : cp.carrier[i];
+  }
+  _taskWord = cp.word;
+  _currentFrameIdx = cp.index;
+  _depth = cp.depth;
+  if (cp.depth)
+    memcpy(_frames, _checkpointFrames.data() + cp.frame,
+           cp.depth * sizeof(Frame));
+  _taskTimelineUs = cp.startUs;
+  _taskLoaded = false;
+  _sweepStep = 0;
+
+  // Replay what the tasks between the checkpoint and the target leave
+  // behind, skipping the passes the index folded as it did.
+  _folding = FOLD_REPLAY;
+  while (!isDone() && _currentFrameIdx != step) {
+    loadTask();
+    if (_sweepSteps) // from its first step: checkpoints sit between records
+      jumpSweep(sweepStepAt(words() + _taskWord, _sweepSteps,
+                            timeUs - _taskTimelineUs));
+    if (_taskTimelineUs + nominalUs(_task) > timeUs)
+      break; // still running at timeUs
+    finishTask(_task, _taskFields, _taskRamp);
+    advanceTask(0);
+  }
+  _folding = FOLD_OFF;
+  for (int k = 0; k < unfolds; k++) { // the passes seekTo() stepped back
+    const Fold &f = _folds[unfold[k].fold];
+    _frames[f.depth].remaining -= unfold[k].passes;
+    _taskTimelineUs += (int64_t)unfold[k].passes * f.passUs;
+    timeUs += (int64_t)unfold[k].passes * f.passUs;
+  }
+  if (point && !isDone() && _currentFrameIdx == step) {
+    loadTask();
+    if (_sweepSteps)
+      jumpSweep(point < _sweepSteps / SWEEP_STEPS ? point * SWEEP_STEPS
+                                                  : _sweepSteps - 1);
+  }
+
+  const int64_t intoTaskUs = timeUs == INT64_MAX ? 0 : timeUs - _taskTimelineUs;
+  _taskFrameOffsetUs = 0;
+  // Not a stall: start the sample count where the ramp is, so
+  // coalescedSamples() doesn't count the jump.
+  _taskSampleIdx = (uint32_t)(intoTaskUs / _taskStepUs);
+
+  // Push everything, plus the running ramp's due sample (runAt() stops at
+  // that task: it does not end before timeUs).
+  int64_t nowUs = esp_timer_get_time();
+  _taskStartTimeUs = nowUs - intoTaskUs;
+  _dirty = DIRTY_ALL;
+  runAt(nowUs);
+  flushState(); // runAt() returns early once isDone()
+  if (_paused)
+    _pausedElapsedUs = intoTaskUs;
+}
+
+void PwmSequencer::pause() {
+  if (_paused)
+    return;
+  int64_t elapsedUs = esp_timer_get_time() - _taskStartTimeUs;
+  _pausedElapsedUs = elapsedUs > 0 ? elapsedUs : 0;
+  _paused = true;
+}
+
+void PwmSequencer::resume() {
+  if (!_paused)
+    return;
+  _paused = false;
+  int64_t nowUs = esp_timer_get_time();
+  _taskStartTimeUs = nowUs - _pausedElapsedUs;
+  _dirty = DIRTY_ALL;
+  runAt(nowUs);
+  flushState();
+}
+
+int64_t PwmSequencer::positionUs() const {
+  if (isDone())
+    return _taskTimelineUs;
+  int64_t elapsedUs = _paused ? _pausedElapsedUs
+                              : esp_timer_get_time() - _taskStartTimeUs;
+  if (elapsedUs < 0)
+    elapsedUs = 0;
+  if (_taskLoaded && elapsedUs > nominalUs(_task))
+    elapsedUs = nominalUs(_task); // due to finish on the next run()
+  return _taskTimelineUs + elapsedUs;
+}
+
+void PwmSequencer::applyRampAt(const SequenceTask &task, float t) {
+  // Interpolate the quantity selected by task.type at fraction t.
+  if (task.type == TaskType::PWM_FREQ) {
+    setField(_currentFreqHz,
+             task.startFreq + t * (task.endFreq - task.startFreq), DIRTY_FREQ);
+    return;
+  }
+  for (int i = 0; i < 4; i++) {
+    float s, e;
+    rampEndpoints(task, i, s, e);
+    if (isnan(s))
+      continue;
+    float *dst = (task.type == TaskType::CARRIER_DUTY) ? &_currentCarrierDutyCycles[i]
+                 : (task.type == TaskType::PWM_DUTY)   ? &_currentDutyCycles[i]
+                                                       : &_currentPhaseDegrees[i];
+    setField(*dst, s + t * (e - s), dirtyBit(task.type, i));
+  }
+}
+
+void PwmSequencer::finishTask(const SequenceTask &task, uint16_t fields,
+                              const RampTable *rt) {
+  if (task.type == TaskType::TRAJECTORY_POINT) {
+    // Only the fields the record carries; the rest already hold its value.
+    if (fields & DIRTY_FREQ)
+      setField(_currentFreqHz, task.startFreq, DIRTY_FREQ);
+    for (int i = 0; i < 4; i++) {
+      uint16_t bit = dirtyBit(TaskType::PWM_DUTY, i);
+      if (fields & bit)
+        setField(_currentDutyCycles[i], task.dutyCycles[i], bit);
+      bit = dirtyBit(TaskType::PWM_PHASE, i);
+      if (fields & bit)
+        setField(_currentPhaseDegrees[i], task.startPhases[i], bit);
+      bit = dirtyBit(TaskType::CARRIER_DUTY, i);
+      if (fields & bit)
+        setField(_currentCarrierDutyCycles[i], task.carrierDuties[i], bit);
+    }
+  } else if (isRampType(task.type)) {
+    // A zero-duration ramp is an instant set (never tabulated).
+    if (rt)
+      applyTableSample(task, *rt, rt->count - 1u);
+    else
+      applyRampAt(task, 1.0f);
+  }
 }
 
 // =========================================================
-// HIGH-SPEED HOT LOOP: No math, just pointer lookups
+// HIGH-SPEED HOT LOOP: No math, just table lookups (ramps compile() could not
+// tabulate still evaluate their curve here). Tasks only update the _current*
+// fields; flushState() at the end hands the controller the final value of
+// each changed field once, however far a stalled loop() fell behind.
 // =========================================================
 void PwmSequencer::run() {
-  if (_queue.empty() || _currentFrameIdx >= _queue.size())
-    return;
+  if (!_paused)
+    runAt(esp_timer_get_time());
+}
 
-  int64_t nowUs = esp_timer_get_time();
+void PwmSequencer::runAt(int64_t nowUs) {
+  _taskEnded = false;
+  if (isDone())
+    return;
 
-  while (_currentFrameIdx < _queue.size()) {
-    SequenceTask &task = _queue[_currentFrameIdx];
+  while (!isDone() && !(_stopAtBoundary && _taskEnded)) {
+    if (!_taskLoaded)
+      loadTask();
+    const SequenceTask &task = _task;
     int64_t elapsedUs = nowUs - _taskStartTimeUs;
     if (elapsedUs < 0)
       elapsedUs = 0;
 
     if (task.type == TaskType::WAIT) {
       if (elapsedUs < task.durationUs)
-        return;
-      _currentFrameIdx++;
-      _taskStartTimeUs = nowUs;
-      _taskFrameOffsetUs = 0;
+        break;
+      advanceTask(nowUs);
       continue;
     }
 
     if (task.type == TaskType::TRAJECTORY_POINT) {
-      _currentFreqHz = task.startFreq;
-      for (int i = 0; i < 4; i++) {
-        _currentDutyCycles[i] = task.dutyCycles[i];
-        _currentPhaseDegrees[i] = task.startPhases[i];
-        _currentCarrierDutyCycles[i] = task.carrierDuties[i];
-      }
-      applyCurrentState();
-      _currentFrameIdx++;
-      _taskStartTimeUs = nowUs;
-      _taskFrameOffsetUs = 0;
+      finishTask(task, _taskFields, nullptr);
+      advanceTask(nowUs);
       continue;
     }
 
-    if (task.type == TaskType::PWM_FREQ || task.type == TaskType::PWM_DUTY ||
-        task.type == TaskType::PWM_PHASE || task.type == TaskType::CARRIER_DUTY) {
-      // Interpolate the quantity selected by task.type at fraction t. A
-      // zero-duration task is an instant set (handled below via t = 1).
-      auto applyRampAt = [&](float t) {
-        switch (task.type) {
-        case TaskType::CARRIER_DUTY:
-          for (int i = 0; i < 4; i++)
-            if (!isnan(task.startCarriers[i]))
-              _currentCarrierDutyCycles[i] =
-                  task.startCarriers[i] +
-                  t * (task.endCarriers[i] - task.startCarriers[i]);
-          break;
-        case TaskType::PWM_DUTY:
-          for (int i = 0; i < 4; i++)
-            if (!isnan(task.startDuties[i]))
-              _currentDutyCycles[i] =
-                  task.startDuties[i] +
-                  t * (task.endDuties[i] - task.startDuties[i]);
-          break;
-        case TaskType::PWM_PHASE:
-          for (int i = 0; i < 4; i++)
-            if (!isnan(task.startPhases[i]))
-              _currentPhaseDegrees[i] =
-                  task.startPhases[i] +
-                  t * (task.endPhases[i] - task.startPhases[i]);
-          break;
-        case TaskType::PWM_FREQ:
-        default:
-          _currentFreqHz = task.startFreq + t * (task.endFreq - task.startFreq);
-          break;
-        }
-      };
-
+    if (isRampType(task.type)) {
       if (task.durationUs <= 0) {
-        applyRampAt(1.0f);
-        applyCurrentState();
-        _currentFrameIdx++;
-        _taskStartTimeUs = nowUs;
-        _taskFrameOffsetUs = 0;
+        finishTask(task, 0, nullptr);
+        advanceTask(nowUs);
         continue;
       }
 
-      int64_t sampleOffsetUs = _taskFrameOffsetUs;
-      while (sampleOffsetUs <= elapsedUs && sampleOffsetUs <= task.durationUs) {
-        float t = (float)sampleOffsetUs / (float)task.durationUs;
-        t = applyCurve(task.mode, t, task.shape);
+      const RampTable *rt = _taskRamp;
+      if (!rt && !_curveReady) {
+        _curve = CurveKernel(task.mode, task.shape);
+        _curveReady = true;
+      }
 
-        applyRampAt(t);
-        applyCurrentState();
+      // Samples sit at k * _taskStepUs. Only the latest one that is due can
+      // be observed (earlier ones would be overwritten before flushState()),
+      // so after a stall jump straight to it instead of replaying the rest.
+      int64_t dueUs = elapsedUs < task.durationUs ? elapsedUs : task.durationUs;
+      if (_taskFrameOffsetUs <= dueUs) {
+        uint32_t k = (uint32_t)(dueUs / _taskStepUs);
+        int64_t sampleOffsetUs = (int64_t)k * _taskStepUs;
+        _coalescedSamples += k - _taskSampleIdx;
+        if (rt)
+          applyTableSample(task, *rt, k);
+        else
+          applyRampAt(task, _curve.eval((float)sampleOffsetUs / (float)task.durationUs));
 
-        if (sampleOffsetUs >= task.durationUs)
-          break;
-        sampleOffsetUs += _taskStepUs;
+        _taskSampleIdx = k;
         _taskFrameOffsetUs = sampleOffsetUs;
+        if (sampleOffsetUs < task.durationUs) {
+          _taskSampleIdx++;
+          _taskFrameOffsetUs += _taskStepUs;
+        }
       }
 
       if (elapsedUs < task.durationUs)
-        return;
+        break;
 
-      applyRampAt(1.0f);
-      applyCurrentState();
-
-      _currentFrameIdx++;
-      _taskStartTimeUs = nowUs;
-      _taskFrameOffsetUs = 0;
+      finishTask(task, 0, rt);
+      advanceTask(nowUs);
       continue;
     }
 
-    _currentFrameIdx++;
-    _taskStartTimeUs = nowUs;
-    _taskFrameOffsetUs = 0;
+    advanceTask(nowUs);
   }
+
+  flushState();
 }
@@ -1,5 +1,7 @@
 #pragma once
 #include "../../PwmController/src/PwmController.h"
+#include "CurveKernel.h"
+#include "TaskMode.h"
 #include "esp_timer.h"
 #include <Arduino.h>
 #include <vector>
@@ -13,13 +15,8 @@ enum class TaskType {
   TRAJECTORY_POINT
 };
 
-// Add to this for a sub-specification for TaskType:
-enum class TaskMode {
-  POLYNOMIAL,   // power ramp about the origin, t^p; shape p>0, p=1 is linear
-  EASE,         // symmetric S-curve (sigmoid), t^k/(t^k+(1-t)^k); shape k>=1 sharpens
-  EXPONENTIAL   // (e^(k*t)-1)/(e^k-1); shape k>0 ease-in, k<0 ease-out
-};
-
+// One task as the queue builders take it (and as run() sees it). The queue
+// itself stores a compact encoding of it; see PwmSequencer::useExternalTasks().
 struct SequenceTask {
   TaskType type;
   TaskMode mode;
@@ -46,6 +43,58 @@ struct TrajectoryPoint {
   float carrierDuties[4];
 };
 
+// One ramp precompiled by PwmSequencer::compile(). Its samples live in the
+// sequencer's shared uint16 table as struct-of-arrays: one lane per channel the
+// ramp drives, lane L of sample k at table[offset + L*count + k], in
+// centi-units (0.01 Hz / 0.01 % / 0.01 deg).
+struct RampTable {
+  uint32_t word;    // queue word where the ramp's record starts
+  uint32_t offset;  // into the table
+  uint16_t count;   // one sample per resolution step, plus the t=1 endpoint
+  uint8_t laneMask; // bit i = channel i has a lane (PWM_FREQ: bit 0 only)
+};
+
+// A value a ParamTask or a subroutine call takes: a constant, or (param >= 0)
+// argument slot `param` of the subroutine call it runs in.
+struct Operand {
+  float value = 0.0f;
+  int8_t param = -1;
+
+  Operand() {}
+  Operand(float v) : value(v) {}
+  static Operand arg(int slot) {
+    Operand o;
+    o.param = (int8_t)slot;
+    return o;
+  }
+};
+
+// What a ParamTask does. Operands a[] per op:
+//   SET       a[i]: the new value of channel i, for each i in `channels`
+//   ACTIVATE  a[0]: channel mask, a[1]: carrier duty for the masked channels
+//             (the others get 0)
+//   WAIT      a[0]: duration in ms
+//   RAMP      a[0] -> a[1] over a[2] ms (mode, shape as addRampTask())
+enum class ParamOp : uint8_t { SET, ACTIVATE, WAIT, RAMP };
+
+// A task whose operands are resolved when it runs, so a subroutine body can
+// take them from its call. Unlike a TRAJECTORY_POINT it only touches the
+// fields it names, which is what a block that runs more than once needs.
+struct ParamTask {
+  ParamOp op = ParamOp::WAIT;
+  TaskType type = TaskType::PWM_FREQ; // SET / RAMP: the quantity
+  TaskMode mode = TaskMode::POLYNOMIAL;
+  uint8_t channels = 0; // SET / RAMP: channel mask (PWM_FREQ: ignored)
+  Operand a[4];
+  float shape = NAN;
+};
+
+// Handle beginSubroutine() returns, for addCall().
+struct Subroutine {
+  uint32_t word = 0;  // first body record
+  uint32_t index = 0;
+};
+
 // Shared TRAJECTORY_POINT builder (CSV/JSON import).
 SequenceTask makeTrajectoryTask(float freq, const float *duty,
                                 const float *phase, const float *carrier,
@@ -55,12 +104,40 @@ class PwmSequencer {
 public:
   PwmSequencer(PwmController *phaseCtrl);
 
+  // Version of the record encoding the queue uses; bumped on any change, so
+  // prebuilt task images (tools/compile_schedules.py) can be checked against it.
+  static const uint16_t TASK_ENCODING = 3;
+
+  // Deepest nesting of repeat blocks and subroutine calls, and the most
+  // arguments a subroutine takes.
+  static const int MAX_DEPTH = 8;
+  static const int MAX_PARAMS = 4;
+  // Longest addSweep() axis, and the steps each sweep point runs as: carriers
+  // on, dwell, carriers off, rest.
+  static const int MAX_SWEEP_AXIS = 255;
+  static const uint32_t SWEEP_STEPS = 4;
+
   // Queue Builders
-  /** @brief Reserve queue capacity for `size` tasks. */
+  /** @brief Reserve queue capacity for about `size` tasks. */
   void reserve(size_t size);
   /** @brief Push a hand-built task (e.g. from makeTrajectoryTask()). */
   void addSequenceTask(SequenceTask task);
 
+  /**
+   * @brief Run `taskCount` tasks straight from caller-owned memory (e.g. a
+   *        schedule mapped from flash) instead of the queue. `words` holds
+   *        them in the queue's own record encoding (TASK_ENCODING, described
+   *        in PwmSequencer.cpp). Nothing is copied, so `words` must stay
+   *        valid and unchanged while the sequencer uses it. Frees anything
+   *        queued; the queue builders are ignored until
+   *        useExternalTasks(nullptr, 0, 0) switches back. Call compile()
+   *        afterwards as usual.
+   * @return False (and nothing changes) if the records are malformed or
+   *         are not exactly `taskCount` tasks in `wordCount` words.
+   */
+  bool useExternalTasks(const uint32_t *words, size_t wordCount,
+                        size_t taskCount);
+
   /** @brief Insert a pause of `durationMs` in the sequence. */
   void addWaitTask(uint32_t durationMs);
 
@@ -90,25 +167,137 @@ public:
                    uint32_t durationMs, TaskType type = TaskType::PWM_FREQ,
                    TaskMode ramp_mode = TaskMode::POLYNOMIAL, float shape = NAN);
 
+  // Control flow. run() follows these through a small call stack; nothing
+  // is expanded into the queue, so a block costs its records once however
+  // often it runs.
+  /** @brief Open a block that runs `count` times (0 = skipped); endBlock()
+   *  closes it. Blocks nest up to MAX_DEPTH deep.
+   *  @return False (nothing queued) if blocks are already MAX_DEPTH deep. */
+  bool beginRepeat(uint32_t count);
+  /** @brief Open a subroutine body; endBlock() closes it. run() skips the
+   *  body where it stands: it only runs through addCall() with `sub`, once
+   *  the body is closed. Operand::arg() operands inside it read the call's
+   *  arguments. Same false return as beginRepeat(). */
+  bool beginSubroutine(Subroutine &sub);
+  /** @brief Close the innermost open block.
+   *  @return False if none is open, or the block runs no task at all (it is
+   *          dropped: looping over nothing would only stall run()). */
+  bool endBlock();
+  /** @brief Run subroutine `sub` with `numArgs` (<= MAX_PARAMS) arguments;
+   *  an Operand::arg() passes on one of the enclosing call's own. Ignored for
+   *  a body that is still open (no recursion). Calls and repeats nested
+   *  deeper than MAX_DEPTH at run time are skipped. */
+  void addCall(const Subroutine &sub, const Operand *args, int numArgs);
+  /** @brief Push a ParamTask. One without argument operands is stored as the
+   *  plain record it amounts to. */
+  void addParamTask(const ParamTask &task);
+
+  /**
+   * @brief Queue a carrier sweep as one record: for each of `levels` (carrier
+   *        duty %, clamped; the outer loop) and each of `masks` in turn, the
+   *        masked channels' carriers go to the level and the rest to 0 for
+   *        dwellMs, then all four to 0 for restMs. run() generates these
+   *        steps as it reaches them, so the record is a few words however
+   *        many points the sweep has. sweepStep() tells where it is.
+   * @return False (nothing queued) if either axis is empty or longer than
+   *         MAX_SWEEP_AXIS.
+   */
+  bool addSweep(const float *levels, int numLevels, const uint8_t *masks,
+                int numMasks, uint32_t dwellMs, uint32_t restMs);
+
   // Compiler
   /**
-   * @brief Compile the queue into a trajectory; call before start().
+   * @brief Compile the queue into a trajectory; call before start(). Every
+   *        ramp is expanded into a table of quantized samples, one per
+   *        resolution step, so run() only indexes and applies. A ramp falls
+   *        back to on-the-fly curve evaluation if it needs more than 65535
+   *        samples, its values don't fit the centi-unit range (frequency
+   *        above 655.35 Hz or negative), or it would exceed the table budget.
    * @param resolutionMs Trajectory timestep in ms.
    */
   void compile(uint32_t resolutionMs, float initialFreq,
                const float *initialDuty, const float *initialPhase);
 
+  /** @brief Cap on the precomputed ramp table in bytes (default 32 KB; also
+   *  never more than half the largest free heap block at compile time). Ramps
+   *  are tabulated in queue order until the next one would not fit. Ramps
+   *  whose operands come from a subroutine call are never tabulated. */
+  void setTableBudget(size_t bytes) { _tableBudgetBytes = bytes; }
+  size_t tableBytes() const { return _table.size() * sizeof(uint16_t); }
+  size_t tabulatedRamps() const { return _tabulatedRamps; }
+  /** @brief Ramps compile() left to on-the-fly evaluation. */
+  size_t fallbackRamps() const { return _fallbackRamps; }
+
   // Control
   void start();
 
-  /** @brief Advance the running sequence. Call every loop() iteration. */
+  /**
+   * @brief Jump to schedule time `timeUs` (from the first task's start, as
+   *        scheduled). Restores the exact state run() would have reached
+   *        there (every task that ends by then applied, the running ramp at
+   *        its due sample) and pushes all of it to the controller. Carriers
+   *        no task has commanded yet stay NAN, i.e. untouched, as after
+   *        start(). Past the end: the final state, isDone(). Keeps a pause.
+   *        O(log n): a binary search over compile()'s checkpoints, then at
+   *        most checkpointEvery() - 1 tasks replayed. Call after start().
+   */
+  void seekTo(int64_t timeUs);
+  /** @brief Jump to where queue step `step` first starts (same rules as
+   *  seekTo()); for a sweep, to where its point `sweepPoint` starts. With
+   *  repeat blocks or calls in the queue, steps no longer run in queue
+   *  order: compile() keeps the checkpoint before each step's first run. */
+  void seekToStep(size_t step, uint32_t sweepPoint = 0);
+  /** @brief Freeze the schedule where it is; the drive holds its state and
+   *  run() does nothing until resume(). */
+  void pause();
+  /** @brief Continue a pause()d schedule from the same point, first pushing
+   *  the full state again (e.g. after a fault changed the drive). */
+  void resume();
+  bool isPaused() const { return _paused; }
+  /** @brief Current schedule time, as seekTo() counts it. */
+  int64_t positionUs() const;
+  /** @brief Scheduled length of the whole queue (sum of task durations, each
+   *  as often as it runs). */
+  int64_t durationUs() const { return _durationUs; }
+
+  /** @brief Advance the running sequence. Call every loop() iteration. Each
+   *  call writes only the fields that changed, once, with their latest value:
+   *  after a loop() stall the missed ramp samples are skipped, not replayed.
+   *  Does nothing while paused. */
   void run();
 
+  /** @brief Ramp samples run() skipped since start() because a later sample
+   *  was already due (i.e. loop() stalled for more than one resolution step). */
+  uint32_t coalescedSamples() const { return _coalescedSamples; }
+
   bool isDone() const;
-  
+
+  /** @brief Bytes the task queue, its per-ramp index and the seek
+   *  checkpoints take (0 for the queue itself while running external tasks). */
+  size_t queueBytes() const {
+    return _arena.capacity() * sizeof(uint32_t) +
+           _rampTables.capacity() * sizeof(RampTable) +
+           _checkpoints.capacity() * sizeof(Checkpoint) +
+           _checkpointFrames.capacity() * sizeof(Frame) +
+           _folds.capacity() * sizeof(Fold) +
+           _stepCheckpoints.capacity() * sizeof(uint32_t);
+  }
+
+  // compile() keeps one Checkpoint every CHECKPOINT_EVERY tasks it runs,
+  // spaced wider when calls would otherwise need more than MAX_CHECKPOINTS.
+  // It runs each repeat body at most twice, whatever its count.
+  static const size_t CHECKPOINT_EVERY = 32;
+  static const size_t MAX_CHECKPOINTS = 256;
+  size_t checkpointEvery() const { return _checkpointEvery; }
+
   /** @brief Queue index currently running (== queue size once isDone()). Lets
-   *  callers track per-step data in parallel with the queue. */
+   *  callers track per-step data in parallel with the queue. A step inside a
+   *  repeat block or subroutine has the same index every time it runs. */
   size_t currentIndex() const { return _currentFrameIdx; }
+  /** @brief Step the running sweep (addSweep()) has generated, or -1 if the
+   *  current queue step is not a sweep. Its point is sweepStep() /
+   *  SWEEP_STEPS, counting through `masks` for each level in turn. */
+  int32_t sweepStep() const;
 
   /** @brief Carrier duty (%) the schedule last COMMANDED for channel `i`, or NAN
    *  if none yet. This is the sequencer's intent, independent of what wrote the
@@ -118,12 +307,58 @@ public:
     return (i >= 0 && i < 4) ? _currentCarrierDutyCycles[i] : NAN;
   }
 
+protected:
+  PwmController *controller() const { return _phaseCtrl; }
+  // For loaders that build the queue incrementally and need to undo a
+  // partial load (JsonPwmSequencer).
+  size_t queueSize() const { return _arenaTasks; }
+  size_t queueWords() const { return _arena.size(); }
+  void truncateQueue(size_t n);
+  // Points of the sweep whose record starts at queue word `word` (0 if none
+  // does), and the level and mask of its point `point`.
+  uint32_t sweepAt(size_t word, uint32_t point, float *level,
+                   uint8_t *mask) const;
+  // Hot swap (JsonPwmSequencer::loadNext()). While stopAtTaskBoundary(true),
+  // run() returns as soon as a task ends, before the next one starts, and
+  // atTaskBoundary() then says it stopped there.
+  void stopAtTaskBoundary(bool on) { _stopAtBoundary = on; }
+  bool atTaskBoundary() const { return _taskEnded; }
+  // Trade the whole compiled schedule (queue, ramp tables, seek index,
+  // cursor) with `next` and start it at `nowUs` from the drive state this
+  // one has reached: that state becomes its initial state, so no field jumps
+  // and nothing is pushed. With `ownPhases`, the phases are the exception:
+  // it keeps its own initial phases (its direction) and pushes the ones
+  // that differ; returns true if any did. Each keeps its own controller,
+  // and `next` is left holding the old schedule. The seek index compile()
+  // built (in the loader task) does not depend on the initial state, so
+  // this is O(1).
+  bool handOver(PwmSequencer &next, int64_t nowUs, bool ownPhases = false);
+
 private:
   PwmController *_phaseCtrl;
-  std::vector<SequenceTask> _queue;
+  // The queue: variable-length task records, back to back (PwmSequencer.cpp).
+  std::vector<uint32_t> _arena;
+  size_t _arenaTasks = 0;
+  // What the records so far leave each state field at, for the encoder's
+  // TRAJECTORY_POINT deltas: one value per _dirty bit, valid where the
+  // matching _encKnown bit is set.
+  float _encValue[13];
+  uint16_t _encKnown = 0;
+  // Blocks the encoder has open: where each opener record is, and whether
+  // anything that runs a task has been queued inside it yet.
+  struct OpenBlock {
+    uint32_t word;
+    uint32_t index;
+    bool sub;
+    bool hasWork;
+  };
+  OpenBlock _encBlocks[MAX_DEPTH];
+  int _encDepth = 0;
+  bool _hasControl = false; // queue has control records (set by compile())
   float _initialFreqHz;
   float _initialDutyCycles[4];
   float _initialPhaseDegrees[4];
+  float _initialCarrierDutyCycles[4]; // NAN unless handOver() carried them
   float _currentFreqHz;
   float _currentDutyCycles[4];
   float _currentPhaseDegrees[4];
@@ -132,10 +367,155 @@ private:
   int64_t _taskStartTimeUs;
   int64_t _taskFrameOffsetUs;
   int64_t _taskStepUs;
+  uint32_t _taskSampleIdx; // tabulated ramps: sample at _taskFrameOffsetUs
+  // Set by useExternalTasks(); run() and compile() then read these instead
+  // of _arena. Always go through words()/wordCount()/taskCount().
+  const uint32_t *_extWords = nullptr;
+  size_t _extWordCount = 0;
+  size_t _extTasks = 0;
+  // The running task, decoded once on entry: its record starts at word
+  // _taskWord and is _taskWords long. TRAJECTORY_POINT: _taskFields says
+  // which fields it sets (_dirty layout). _taskRamp: its table, if any.
+  SequenceTask _task;
+  uint16_t _taskFields = 0;
+  size_t _taskWord = 0;
+  size_t _taskWords = 0;
+  bool _taskLoaded = false;
+  const RampTable *_taskRamp = nullptr;
+  // Inside a sweep record: the step it generated into _task, of
+  // _sweepSteps (0 = the running task is not a sweep's).
+  uint32_t _sweepStep = 0;
+  uint32_t _sweepSteps = 0;
+  // Open repeat blocks and subroutine calls around the cursor, innermost
+  // last. A repeat frame resumes at its body for `remaining` more passes; a
+  // call frame (remaining == CALL_FRAME) returns to word/index. Each frame
+  // carries the arguments its body sees.
+  struct Frame {
+    uint32_t word;
+    uint32_t index;
+    uint32_t remaining;
+    float params[MAX_PARAMS];
+  };
+  static const uint32_t CALL_FRAME = 0xFFFFFFFFUL;
+  Frame _frames[MAX_DEPTH];
+  uint8_t _depth = 0;
+  // Scheduled start of the running task (seekTo() time) and pause state.
+  int64_t _taskTimelineUs = 0;
+  bool _paused = false;
+  int64_t _pausedElapsedUs = 0; // into the running task when paused
+  // stopAtTaskBoundary(), and whether the last run() ended a task.
+  bool _stopAtBoundary = false;
+  bool _taskEnded = false;
 
-  void resetStreamingState();
-  void applyCurrentState();
+  // Seek index: the full state before the (_checkpointEvery * c)th task to
+  // run, and the cursor there (its frames are _checkpointFrames[frame..]).
+  // Built by compile(). A field no task has set by then is NAN: seekFrom()
+  // takes the initial value.
+  struct Checkpoint {
+    int64_t startUs; // scheduled start of that task
+    uint32_t word;
+    uint32_t index;
+    uint32_t frame;
+    uint8_t depth;
+    float freq;
+    float duty[4];
+    float phase[4];
+    float carrier[4];
+  };
+  std::vector<Checkpoint> _checkpoints;
+  std::vector<Frame> _checkpointFrames;
+  size_t _checkpointEvery = CHECKPOINT_EVERY;
+  // Passes the index skips: the frame at `depth` would run `passes` more
+  // of passUs each from startUs, all like its second (see foldPasses()).
+  // In schedule order, so no two overlap.
+  struct Fold {
+    int64_t startUs;
+    int64_t passUs;
+    uint32_t passes;
+    uint8_t depth;
+  };
+  std::vector<Fold> _folds;
+  // With control records: per queue step, the checkpoint before its first
+  // run (NO_CHECKPOINT if it never runs as a task).
+  static const uint32_t NO_CHECKPOINT = 0xFFFFFFFFUL;
+  std::vector<uint32_t> _stepCheckpoints;
+  // buildCheckpoints() records folds and seekFrom() replays them; run()
+  // never folds. FOLD_BUILD: when each open repeat's second pass began.
+  enum : uint8_t { FOLD_OFF, FOLD_BUILD, FOLD_REPLAY } _folding = FOLD_OFF;
+  int64_t _passStartUs[MAX_DEPTH];
+  int64_t _durationUs = 0;
+
+  // Untabulated ramps: curve of the running task, resolved on task entry.
+  CurveKernel _curve;
+  bool _curveReady = false;
+
+  // Precompiled ramps (see compile()); one RampTable per tabulated ramp
+  // record, in queue order.
+  static const size_t DEFAULT_TABLE_BUDGET = 32 * 1024;
+  std::vector<uint16_t> _table;
+  std::vector<RampTable> _rampTables;
+  size_t _tableBudgetBytes = DEFAULT_TABLE_BUDGET;
+  size_t _tabulatedRamps = 0;
+  size_t _fallbackRamps = 0;
 
-  // Map linear progress t in [0,1] through the ramp's curve.
-  float applyCurve(TaskMode mode, float t, float shape);
+  // Changed since the last flushState(); bit layout in PwmSequencer.cpp.
+  uint16_t _dirty = 0;
+  uint32_t _coalescedSamples = 0;
+
+  const uint32_t *words() const { return _extWords ? _extWords : _arena.data(); }
+  size_t wordCount() const { return _extWords ? _extWordCount : _arena.size(); }
+  size_t taskCount() const { return _extWords ? _extTasks : _arenaTasks; }
+
+  void encodeTask(const SequenceTask &task);
+  // Push a TRAJECTORY_POINT that sets only `fields` (_dirty layout).
+  void encodePoint(const SequenceTask &task, uint16_t fields);
+  // Bookkeeping after a record is pushed: counts it and tells the open
+  // blocks whether it runs a task.
+  void pushedRecord(bool runs);
+  bool insideSubroutine() const; // an open block is a subroutine body
+  void resetCursor();
+  // Follow control records from the cursor to the next task (or the end).
+  void settle();
+  void loadTask();
+  void advanceTask(int64_t nowUs);
+  // Move the loaded sweep on to its step `s`, applying what the steps
+  // skipped leave behind.
+  void jumpSweep(uint32_t s);
+  void runAt(int64_t nowUs);
+  // Apply what a task leaves behind once done: a TRAJECTORY_POINT's
+  // `fields`, a ramp's final sample (from `rt` if tabulated).
+  void finishTask(const SequenceTask &task, uint16_t fields,
+                  const RampTable *rt);
+  void applyRampAt(const SequenceTask &task, float t);
+  const RampTable *rampTable(size_t word) const;
+  void buildCheckpoints();
+  void pushCheckpoint(int64_t startUs);
+  // At the end of a pass of repeat frame `f` (innermost): while folding,
+  // skip the passes after the second.
+  void foldPasses(Frame &f);
+  // seekTo() into folded passes: seek `passes` passes earlier within
+  // _folds[fold], then move the cursor on by that much.
+  struct Unfold {
+    uint32_t fold;
+    uint32_t passes;
+  };
+  // Restore checkpoint `c`, replay tasks up to step `step` (a sweep: its
+  // point `point`) or schedule time `timeUs`, whichever comes first, undo
+  // `unfolds` folds, then resume there.
+  void seekFrom(size_t c, size_t step, int64_t timeUs, uint32_t point = 0,
+                const Unfold *unfold = nullptr, int unfolds = 0);
+
+  void resetStreamingState();
+  // Push the fields marked in _dirty to the controller, then clear it.
+  void flushState();
+  void setField(float &field, float v, uint16_t bit) {
+    if (field != v) { // NaN (carrier unset) always marks; flushState skips it
+      field = v;
+      _dirty |= bit;
+    }
+  }
+  void buildRampTables();
+  // Load tabulated sample k of `task` into the current state.
+  void applyTableSample(const SequenceTask &task, const RampTable &rt,
+                        uint32_t k);
 };
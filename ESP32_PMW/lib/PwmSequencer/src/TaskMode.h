@@ -0,0 +1,10 @@
+#pragma once
+
+// How a ramp task moves between its endpoints (SequenceTask::mode). Its own
+// header so CurveKernel builds without the sequencer (tools/curve_check_host.cpp).
+// Add to this for a sub-specification for TaskType:
+enum class TaskMode {
+  POLYNOMIAL,   // power ramp about the origin, t^p; shape p>0, p=1 is linear
+  EASE,         // symmetric S-curve (sigmoid), t^k/(t^k+(1-t)^k); shape k>=1 sharpens
+  EXPONENTIAL   // (e^(k*t)-1)/(e^k-1); shape k>0 ease-in, k<0 ease-out
+};
@@ -13,7 +13,7 @@ void setup() {
   ctl.begin(); // DC (stationary); the schedule sets the running frequency
   ctl.initCarrierPWM(CARRIER_PINS, PWM_FREQ, CARRIER_ZERO);
   ctl.enableCurrentSense(ADC_PINS, SENS, /*tripA*/ 10.0f); // no balance: passthrough
-  seq.loadFromJsonFile("/comp_test.json");
+  driveLoadSchedule(seq, "/comp_test.json");
   seq.start();
 }
 
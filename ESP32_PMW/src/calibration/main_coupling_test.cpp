@@ -2,8 +2,8 @@
 // levels), CW. PASSTHROUGH (no enableCurrentBalance): it deliberately drives
 // channels unequally to measure mutual coupling, so the balance loop must NOT
 // equalize them. Runs on boot -- no arming. Loads /coupling_cw.json (swap to
-// /coupling_ccw.json for the other direction). Generated by
-// ai/gen_coupling_experiment.py -- do not hand-edit the JSON.
+// /coupling_ccw.json for the other direction): one "sweep" entry, which the
+// sequencer expands point by point as it runs.
 #include "drive_common.h"
 
 static PwmController ctl(PWM_PINS, PHASES_CW, INITIAL_DUTY, NUM_CHANNELS);
@@ -14,7 +14,8 @@ void setup() {
   ctl.begin(); // DC (stationary); the schedule sets the running frequency
   ctl.initCarrierPWM(CARRIER_PINS, PWM_FREQ, CARRIER_ZERO);
   ctl.enableCurrentSense(ADC_PINS, SENS, /*tripA*/ 10.0f); // no balance: passthrough
-  seq.loadFromJsonFile("/coupling_cw.json");
+  ctl.enableZeroTracking(); // re-zero in each rest_ms gap: the sweep runs long
+  driveLoadSchedule(seq, "/coupling_cw.json");
   seq.start();
 }
 
@@ -23,10 +24,14 @@ void loop() {
   ctl.run();
 
   // --- experiment-specific behavior: blink the LED once per schedule step ---
+  // (a sweep's generated steps count as steps)
   static size_t lastStep = (size_t)-1;
+  static int32_t lastSweepStep = -1;
   size_t step = seq.currentIndex();
-  if (step != lastStep) {
+  int32_t sweepStep = seq.sweepStep();
+  if (step != lastStep || sweepStep != lastSweepStep) {
     lastStep = step;
+    lastSweepStep = sweepStep;
     digitalWrite(LED_PIN, !digitalRead(LED_PIN));
   }
 
@@ -5,6 +5,7 @@
 
 #include "JsonPwmSequencer.h"
 #include "PwmController.h"
+#include "SerialComm.h"
 #include "constants.h"
 #include "reset_button.h"
 #include "safety_startup.h"
@@ -33,11 +34,218 @@ inline void driveBoot() {
     Serial.println("[driveBoot] SPIFFS mount FAILED -- run `pio run -t uploadfs` to update json changes");
 }
 
+// Schedule whose step label driveTelemetry() reports (set by driveLoadSchedule).
+static JsonPwmSequencer *driveSeq = nullptr;
+
+// "labels: 0=NAME 1=NAME ..." -- the IDs the telemetry line reports as lbl=.
+inline void drivePrintLabels(const JsonPwmSequencer &seq) {
+  if (!seq.labelCount())
+    return;
+  Serial.print("labels:");
+  for (size_t id = 0; id < seq.labelCount(); id++)
+    Serial.printf(" %u=%s", (unsigned)id, seq.labelName((uint16_t)id));
+  Serial.println();
+}
+
+// Load `path` for setup(): its compiled copy from the "schedules" flash
+// partition when that is current (tools/compile_schedules.py --flash), which
+// runs in place with no parse and no queue on the heap, else the JSON on
+// SPIFFS. Prints when it was ready relative to reset, so the two paths can be
+// compared from the boot log, then the schedule's label table once (again
+// after every loadNext() swap, from driveTelemetry()).
+inline bool driveLoadSchedule(JsonPwmSequencer &seq, const char *path) {
+  bool ok = seq.loadFromPartition(path) || seq.loadFromJsonFile(path);
+  Serial.printf("[driveLoadSchedule] %s %s, ready %.1f ms after reset, "
+                "free heap %u bytes\n",
+                path, !ok ? "FAILED" : seq.lastLoad().fromFlash ? "from flash" : "from JSON",
+                esp_timer_get_time() / 1000.0f, (unsigned)ESP.getFreeHeap());
+  driveSeq = &seq;
+  drivePrintLabels(seq);
+  return ok;
+}
+
+// Opt-in extra telemetry lines with the commutation (and control task) timing
+// histograms (see driveCommand). Off by default so the ai/ parsers see the
+// usual single line.
+static bool driveTimingOn = false;
+
+// "timing: lat[us] .. | cb[us] .. | edge p99/max[us]: A=.. B=.. C=.. D=.." --
+// min/p99/max of tick dispatch latency and duration, and per-channel p99/max
+// lateness of each real coil edge vs its ideal PhaseParams time.
+inline void printTiming(PwmController &c) {
+  static CommutationStats st; // ~3.5 KB: keep it off the loop() stack
+  c.commutationStats(st);
+  const float mhz = (float)c.cpuMhz();
+  const CycleHistogram &lat = st.dispatchLatency;
+  const CycleHistogram &cb = st.callbackDuration;
+  Serial.printf("timing: lat[us] min=%.1f p99=%.1f max=%.1f | "
+                "cb[us] min=%.2f p99=%.2f max=%.2f | edge p99/max[us]:",
+                lat.min() / mhz, lat.percentile(0.99f) / mhz, lat.max() / mhz,
+                cb.min() / mhz, cb.percentile(0.99f) / mhz, cb.max() / mhz);
+  for (int i = 0; i < NUM_CHANNELS && i < CommutationStats::MAX_CHANNELS; i++)
+    Serial.printf(" %c=%.1f/%.1f", 'A' + i,
+                  st.edgeError[i].percentile(0.99f) / mhz,
+                  st.edgeError[i].max() / mhz);
+  Serial.printf(" | n=%u\n", (unsigned)lat.count());
+
+  // Fixed-rate control task (enableCurrentBalance with a rate), if running:
+  // "ctl: set=..Hz p50=..Hz dt[us] .. | busy[us] .. | overrun=.. missed=..".
+  static ControlLoopStats ls; // ~1 KB, same reason as above
+  if (!c.controlLoopStats(ls))
+    return;
+  const CycleHistogram &dt = ls.interval;
+  const uint32_t p50 = dt.percentile(0.5f);
+  Serial.printf("ctl: set=%.0fHz p50=%.0fHz dt[us] min=%.0f p99=%.0f max=%.0f | "
+                "busy[us] p99=%.0f max=%.0f | overrun=%u missed=%u\n",
+                c.controlRateHz(), p50 ? mhz * 1e6f / p50 : 0.0f, dt.min() / mhz,
+                dt.percentile(0.99f) / mhz, dt.max() / mhz,
+                ls.busy.percentile(0.99f) / mhz, ls.busy.max() / mhz,
+                (unsigned)ls.overruns, (unsigned)ls.missed);
+}
+
+// Lowercase a command's verb, i.e. up to the first '=' (the whole line if
+// there is none). The argument keeps its case: SPIFFS paths are
+// case-sensitive, and labels print as they were written.
+inline void driveLowerVerb(String &cmd) {
+  int eq = cmd.indexOf('=');
+  String verb = eq < 0 ? cmd : cmd.substring(0, eq);
+  verb.toLowerCase();
+  cmd = eq < 0 ? verb : verb + cmd.substring(eq);
+}
+
+// Schedule control for the driveLoadSchedule()d sequencer: pause | resume |
+// seek=<ms> (schedule time) | seek=<label> (its first step, or the sweep
+// point it names) | next=<path> (loadNext(): take over once this schedule
+// ends) | swap=<path> (take over as soon as a task ends). Replies
+// "seq: t=..ms step=.. lbl=.. paused=..", plus " next=loading|ready|failed"
+// while a loadNext() schedule is pending. Returns false if it isn't one.
+inline bool driveSeqCommand(const String &cmd) {
+  if (!driveSeq)
+    return false;
+  if (cmd == "pause") {
+    driveSeq->pause();
+  } else if (cmd == "resume") {
+    driveSeq->resume();
+  } else if (cmd.startsWith("seek=")) {
+    String arg = cmd.substring(5);
+    const char *a = arg.c_str();
+    if (*a && a[strspn(a, "0123456789.")] == '\0')
+      driveSeq->seekTo((int64_t)(arg.toFloat() * 1000.0f));
+    else if (!driveSeq->seekToLabel(a))
+      return true; // already reported
+  } else if (cmd.startsWith("next=") || cmd.startsWith("swap=")) {
+    JsonPwmSequencer::SwapAt when = cmd.startsWith("swap=")
+                                        ? JsonPwmSequencer::SwapAt::STEP
+                                        : JsonPwmSequencer::SwapAt::END;
+    if (!driveSeq->loadNext(cmd.c_str() + 5, when))
+      return true; // already reported
+  } else {
+    return false;
+  }
+  static const char *const NEXT[] = {"", " next=loading", " next=ready", " next=failed"};
+  uint16_t id = driveSeq->currentLabelId();
+  Serial.printf("seq: t=%.0fms step=%u lbl=%d paused=%d%s\n",
+                driveSeq->positionUs() / 1000.0f, (unsigned)driveSeq->currentIndex(),
+                id == JsonPwmSequencer::NO_LABEL ? -1 : (int)id,
+                driveSeq->isPaused() ? 1 : 0, NEXT[(int)driveSeq->nextState()]);
+  return true;
+}
+
+// Opt-in phase-resolved current lines (see driveCommand), printed while
+// synchronous sampling runs.
+static bool driveWaveOn = false;
+
+// "wave A[A]: b0 b1 .. | field=.. fund=..@..deg" per channel: phaseCurrents()
+// bins over one field period (nan = bin not hit yet), their mean
+// (fieldCurrents()) and the fitted fundamental's amplitude and phase.
+inline void printWave(PwmController &c) {
+  const int bins = c.phaseBins();
+  const float *field = c.fieldCurrents();
+  const float *fund = c.fundamentalCurrents();
+  const float *fundDeg = c.fundamentalPhases();
+  float a[CurrentSense::MAX_PHASE_BINS];
+  for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+    if (!c.phaseCurrents(ch, a))
+      return;
+    Serial.printf("wave %c[A]:", 'A' + ch);
+    for (int b = 0; b < bins; b++)
+      Serial.printf(" %.2f", a[b]);
+    Serial.printf(" | field=%.2f fund=%.2f@%.0fdeg\n", field ? field[ch] : NAN,
+                  fund ? fund[ch] : NAN, fundDeg ? fundDeg[ch] : NAN);
+  }
+}
+
+// "zero[mA]: A=.. B=.. C=.. D=.. | updates=.. rejects=.." -- each channel's
+// zero drift since boot, printed when zero re-tracking accepts or rejects a
+// coil-off window (not every line: it moves over minutes).
+inline void printZero(PwmController &c) {
+  static uint32_t seen = 0;
+  const float *drift = c.zeroDrift();
+  if (!c.zeroTrackingActive() || !drift)
+    return;
+  const uint32_t windows = c.zeroUpdates() + c.zeroRejects();
+  if (windows == seen)
+    return;
+  seen = windows;
+  Serial.printf("zero[mA]:");
+  for (int ch = 0; ch < NUM_CHANNELS; ch++)
+    Serial.printf(" %c=%.1f", 'A' + ch, drift[ch] * 1000.0f);
+  Serial.printf(" | updates=%u rejects=%u\n", (unsigned)c.zeroUpdates(),
+                (unsigned)c.zeroRejects());
+}
+
+// Drive-level serial commands shared by every experiment: timing=on|off|reset, wave=on|off,
+// plus driveSeqCommand()'s. `cmd` is already trimmed, its verb lowercased
+// (driveLowerVerb); on/off/reset match in any case. Returns false if it isn't
+// one of ours.
+inline bool driveCommand(PwmController &c, const String &cmd) {
+  if (driveSeqCommand(cmd))
+    return true;
+  if (cmd.equalsIgnoreCase("timing=on")) {
+    driveTimingOn = true;
+  } else if (cmd.equalsIgnoreCase("timing=off")) {
+    driveTimingOn = false;
+  } else if (cmd.equalsIgnoreCase("timing=reset")) {
+    c.resetCommutationStats();
+    c.resetControlLoopStats();
+  } else if (cmd.equalsIgnoreCase("wave=on") || cmd.equalsIgnoreCase("wave=off")) {
+    driveWaveOn = cmd.equalsIgnoreCase("wave=on");
+    Serial.printf("wave=%d%s\n", driveWaveOn ? 1 : 0,
+                  c.synchronousSamplingActive() ? "" : " (synchronous sampling off)");
+    return true;
+  } else {
+    return false;
+  }
+  Serial.printf("timing=%d\n", driveTimingOn ? 1 : 0);
+  return true;
+}
+
 // Shared 2 Hz telemetry line, same field layout the ai/ log parsers expect:
-// "t=.. freq=.. | I[A]: .. | duty[%]: .. | spread=.. bal=.. trip=..".
-inline void driveTelemetry(PwmController &c) {
+// "t=.. freq=.. | I[A]: .. | duty[%]: .. | spread=.. bal=.. trip=..", plus
+// " lbl=<id>" (-1 = none) at the end when the loaded schedule has labels.
+// pollCommands: read driveCommand()s from Serial here. Pass false from a main
+// that owns its own SerialComm and forwards to driveCommand() itself.
+inline void driveTelemetry(PwmController &c, bool pollCommands = true) {
   checkResetButton(); // poll every loop (before the 500 ms print throttle below)
 
+  if (pollCommands) {
+    static SerialComm comm;
+    String line = comm.handleSerialComm();
+    line.trim();
+    driveLowerVerb(line);
+    if (line.length() && !driveCommand(c, line))
+      Serial.printf("? '%s' (timing=on|off|reset, wave=on|off, "
+                    "pause|resume|seek=<ms>|seek=<label>|next=<path>|swap=<path>)\n",
+                    line.c_str());
+  }
+
+  // A loadNext() schedule took over: its labels replace the old IDs.
+  static uint32_t swapsSeen = 0;
+  if (driveSeq && driveSeq->swapCount() != swapsSeen) {
+    swapsSeen = driveSeq->swapCount();
+    drivePrintLabels(*driveSeq);
+  }
+
   static unsigned long last = 0;
   unsigned long now = millis();
   if (now - last < 500)
@@ -59,6 +267,16 @@ inline void driveTelemetry(PwmController &c) {
   Serial.printf("t=%lu freq=%.1f | ", now, c.getFrequency());
   if (im)
     printCurrentAndDuty(im, duty);
-  Serial.printf(" | spread=%.3f bal=%d trip=%d\n", imax - imin,
+  Serial.printf(" | spread=%.3f bal=%d trip=%d", imax - imin,
                 c.balanceActive() ? 1 : 0, c.overcurrentTripped() ? 1 : 0);
+  if (driveSeq && driveSeq->labelCount()) {
+    uint16_t id = driveSeq->currentLabelId();
+    Serial.printf(" lbl=%d", id == JsonPwmSequencer::NO_LABEL ? -1 : (int)id);
+  }
+  Serial.println();
+  printZero(c);
+  if (driveTimingOn)
+    printTiming(c);
+  if (driveWaveOn)
+    printWave(c);
 }
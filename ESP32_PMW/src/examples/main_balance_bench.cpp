@@ -0,0 +1,127 @@
+// Balance bench: runs CurrentBalanceFloat and CurrentBalanceFixed side by side
+// on a simulated four-coil plant (closed loop, 1 ms steps with loop() jitter;
+// ceilings uniform 100% -> tilt -> C parked -> all off -> uniform) and checks
+// the fixed-point duties stay within CurrentBalanceFixed::DUTY_TOLERANCE of
+// the float ones (the only PASS/FAIL check). Then times one step of each per
+// branch mix: min / max CPU cycles over TIMED steps, and the spread of the
+// worst case across mixes. tools/balance_bench_host.cpp is the same
+// comparison on the host, replaying the recorded PicoScope traces. No PWM is
+// started and all gates are forced LOW.
+#include <Arduino.h>
+#include "CurrentBalanceController.h"
+#include "safety_startup.h"
+
+static const int N = CurrentBalanceFixed::N;
+static const float START_DUTY = 50.0f;
+static const int STEPS = 60000;
+static const int TIMED = 2000;
+#if BALANCE_FIXED_POINT
+static const char *const SELECTED = "fixed";
+#else
+static const char *const SELECTED = "float";
+#endif
+
+// Each channel's current follows gain[i] * duty, minus a little of the
+// others' (shared supply), through a 5 ms lag.
+struct Plant {
+  float i[N] = {0, 0, 0, 0};
+  void step(const float *duty, float dtMs) {
+    static const float GAIN[N] = {0.070f, 0.064f, 0.073f, 0.060f}; // A per %
+    float sum = 0.0f;
+    for (int k = 0; k < N; k++) sum += duty[k];
+    for (int k = 0; k < N; k++) {
+      const float target = GAIN[k] * duty[k] * (1.0f - 0.0008f * (sum - duty[k]));
+      i[k] += (1.0f - expf(-dtMs / 5.0f)) * (target - i[k]);
+    }
+  }
+};
+
+static void ceilingAt(int k, int n, float *c) {
+  const float f = (float)k / (float)n;
+  for (int i = 0; i < N; i++) c[i] = 100.0f;
+  if (f >= 0.4f && f < 0.7f) c[0] = c[3] = 80.0f;
+  if (f >= 0.7f && f < 0.8f) c[2] = NAN;
+  if (f >= 0.8f && f < 0.85f)
+    for (int i = 0; i < N; i++) c[i] = 0.0f;
+}
+
+struct Cycles {
+  uint32_t lo, hi;
+};
+
+template <class C> static Cycles timeStep(const float *iMeas, const float *ceil) {
+  C ctl;
+  ctl.reset(START_DUTY);
+  float out[N];
+  Cycles cy = {UINT32_MAX, 0};
+  for (int k = 0; k < TIMED; k++) {
+    const uint32_t c0 = ESP.getCycleCount();
+    ctl.step(iMeas, 1.0f, ceil, out);
+    const uint32_t d = ESP.getCycleCount() - c0;
+    cy.lo = min(cy.lo, d);
+    cy.hi = max(cy.hi, d);
+  }
+  return cy;
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  forceAllGatesLow();
+  Serial.printf("balance_bench: CPU %u MHz, CurrentBalanceController = %s\n",
+                (unsigned)ESP.getCpuFreqMHz(), SELECTED);
+
+  CurrentBalanceFloat fl;
+  CurrentBalanceFixed fx;
+  fl.reset(START_DUTY);
+  fx.reset(START_DUTY);
+  Plant pFl, pFx;
+  float c[N], dFl[N], dFx[N];
+  float worst = 0.0f;
+  int anchorMismatch = 0;
+  for (int k = 0; k < STEPS; k++) {
+    const float dt = (k % 7 == 3) ? 1.3f : 1.0f;
+    ceilingAt(k, STEPS, c);
+    fl.step(pFl.i, dt, c, dFl);
+    fx.step(pFx.i, dt, c, dFx);
+    pFl.step(dFl, dt);
+    pFx.step(dFx, dt);
+    for (int i = 0; i < N; i++) worst = max(worst, fabsf(dFl[i] - dFx[i]));
+    anchorMismatch += fl.latchedMinIndex() != fx.latchedMinIndex();
+  }
+  const bool pass = worst <= CurrentBalanceFixed::DUTY_TOLERANCE;
+  Serial.printf("closed loop: %d steps, worst %.5f %% (tolerance %.4f), anchor differs "
+                "on %d steps  %s\n",
+                STEPS, worst, CurrentBalanceFixed::DUTY_TOLERANCE, anchorMismatch,
+                pass ? "ok" : "FAIL");
+
+  static const float UNIFORM[N] = {100, 100, 100, 100};
+  static const float TILT[N] = {80, 100, 100, 80};
+  static const float FAINT[N] = {0.1f, 0.1f, 0.1f, 0.1f};
+  static const float BAL[N] = {5.0f, 5.2f, 4.9f, 5.1f};
+  static const float HOT[N] = {13.0f, 13.0f, 13.0f, 13.0f};
+  struct Mix {
+    const char *name;
+    const float *i, *c;
+  } mixes[] = {{"co-ramp", FAINT, UNIFORM}, {"anchor + PI", BAL, UNIFORM},
+               {"tilt PI", BAL, TILT},      {"overcurrent", HOT, UNIFORM},
+               {"all parked", BAL, nullptr}};
+  uint32_t flMin = UINT32_MAX, flMax = 0, fxMin = UINT32_MAX, fxMax = 0;
+  for (const Mix &m : mixes) {
+    const Cycles a = timeStep<CurrentBalanceFloat>(m.i, m.c);
+    const Cycles b = timeStep<CurrentBalanceFixed>(m.i, m.c);
+    Serial.printf("  %-12s float %5u..%5u cyc  fixed %5u..%5u cyc\n", m.name,
+                  (unsigned)a.lo, (unsigned)a.hi, (unsigned)b.lo, (unsigned)b.hi);
+    flMin = min(flMin, a.hi);
+    flMax = max(flMax, a.hi);
+    fxMin = min(fxMin, b.hi);
+    fxMax = max(fxMax, b.hi);
+  }
+  Serial.printf("worst case per step: float %u cyc (spread %u across mixes), "
+                "fixed %u cyc (spread %u)\n",
+                (unsigned)flMax, (unsigned)(flMax - flMin), (unsigned)fxMax,
+                (unsigned)(fxMax - fxMin));
+  Serial.println(pass ? "balance_bench: PASS" : "balance_bench: FAIL");
+}
+
+void loop() { delay(1000); }
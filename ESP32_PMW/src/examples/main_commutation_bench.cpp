@@ -0,0 +1,83 @@
+// Commutation tick benchmark: CPU cycles per software tick, before vs after the
+// edge-table rewrite. "legacy" replays the old _timerCallback body (per-channel
+// window test + one gpio_set_level per coil); "table" is PwmController's
+// current tick (segment lookup + one set/clear register pair per bank), timed
+// via measureTickCycles(). "wake" is how often the tick actually ran over the
+// last second: 40000/s for the old fixed poll, a few edges per field period
+// with the one-shot edge scheduler. Carriers are never initialized and stay forced LOW,
+// so the coils cannot energize however the phase pins toggle. Prints once per
+// second at each test frequency; read it with any serial monitor.
+#include <Arduino.h>
+#include "PwmController.h"
+#include "constants.h"
+#include "safety_startup.h"
+
+static const float PHASES[NUM_CHANNELS] = {90.0f, 270.0f, 180.0f, 0.0f};
+static const float DUTY[NUM_CHANNELS] = {50.0f, 50.0f, 50.0f, 50.0f};
+static const float TEST_HZ[] = {1.0f, 150.0f, 350.0f};
+static const int ITERATIONS = 10000;
+
+static PwmController ctl(PWM_PINS, PHASES, DUTY, NUM_CHANNELS);
+
+// The pre-edge-table tick: same lock, same math, same driver calls.
+static portMUX_TYPE legacyLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t legacyTickCycles(float hz, int iterations) {
+  uint32_t period = (uint32_t)(1000000.0f / hz);
+  uint32_t start[NUM_CHANNELS], end[NUM_CHANNELS];
+  bool wraps[NUM_CHANNELS];
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    start[i] = (uint32_t)(period * PHASES[i] / 360.0f);
+    end[i] = start[i] + (uint32_t)(period * DUTY[i] / 100.0f);
+    wraps[i] = end[i] > period;
+    if (wraps[i]) end[i] -= period;
+  }
+  const int64_t lastSync = esp_timer_get_time();
+
+  uint32_t total = 0;
+  for (int n = 0; n < iterations; n++) {
+    uint32_t c0 = ESP.getCycleCount();
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&legacyLock);
+    int64_t sync = lastSync;
+    portEXIT_CRITICAL(&legacyLock);
+    uint32_t timeInCycle = (uint32_t)(now - sync) % period;
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+      if (PWM_PINS[i] == GPIO_NUM_NC || PWM_PINS[i] > GPIO_NUM_39) continue;
+      bool active = wraps[i] ? (timeInCycle >= start[i] || timeInCycle < end[i])
+                             : (timeInCycle >= start[i] && timeInCycle < end[i]);
+      gpio_set_level(PWM_PINS[i], active ? 0 : 1);
+    }
+    total += ESP.getCycleCount() - c0;
+  }
+  return total / (uint32_t)iterations;
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  forceAllGatesLow();
+  ctl.begin(TEST_HZ[0]);
+  Serial.printf("commutation_bench: %d iterations per figure, CPU %u MHz\n",
+                ITERATIONS, (unsigned)ESP.getCpuFreqMHz());
+}
+
+void loop() {
+  static int k = 0;
+  float hz = TEST_HZ[k];
+  k = (k + 1) % (int)(sizeof(TEST_HZ) / sizeof(TEST_HZ[0]));
+
+  ctl.setGlobalFrequency(hz);
+  uint32_t legacy = legacyTickCycles(hz, ITERATIONS);
+  uint32_t table = ctl.measureTickCycles(ITERATIONS);
+  float mhz = (float)ESP.getCpuFreqMHz();
+
+  static CommutationStats st; // ~3.5 KB: keep it off the loop() stack
+  ctl.resetCommutationStats();
+  delay(1000);
+  ctl.commutationStats(st);
+  Serial.printf("f=%.0fHz legacy=%u cyc (%.2f us) table=%u cyc (%.2f us) "
+                "wake=%u/s (%s)\n",
+                hz, (unsigned)legacy, legacy / mhz, (unsigned)table, table / mhz,
+                (unsigned)st.dispatchLatency.count(),
+                ctl.edgeScheduler() ? "edge" : "poll");
+}
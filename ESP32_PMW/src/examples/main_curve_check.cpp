@@ -0,0 +1,75 @@
+// Curve kernel check: sweeps every TaskMode across the shape ranges the JSON
+// schedules use and compares CurveKernel::eval() against the libm definition
+// (CurveKernel::reference), then times both. Prints the worst absolute error
+// (and where it happened) and the mean CPU cycles per evaluation, once, then
+// idles. No PWM is started and all gates are forced LOW.
+#include <Arduino.h>
+#include "CurveKernel.h"
+#include "PwmSequencer.h"
+#include "safety_startup.h"
+
+struct ShapeRange {
+  TaskMode mode;
+  float lo, hi;
+  const char *name;
+};
+
+static const ShapeRange RANGES[] = {
+    {TaskMode::POLYNOMIAL, 0.1f, 10.0f, "POLYNOMIAL"},
+    {TaskMode::EASE, 1.0f, 10.0f, "EASE"},
+    {TaskMode::EXPONENTIAL, -10.0f, 10.0f, "EXPONENTIAL"},
+};
+static const int SHAPE_STEPS = 200;
+static const int T_STEPS = 2000;
+static const int TIMED_EVALS = 10000;
+// Non-integer shapes so the timing exercises the log2/exp2 path, not the
+// repeated-multiply one.
+static const float TIMED_SHAPE[] = {2.5f, 3.5f, -2.5f};
+
+static volatile float sink;
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  forceAllGatesLow();
+  Serial.printf("curve_check: bound %.1e, CPU %u MHz\n",
+                CurveKernel::MAX_ABS_ERROR, (unsigned)ESP.getCpuFreqMHz());
+
+  bool pass = true;
+  for (int r = 0; r < 3; r++) {
+    const ShapeRange &sr = RANGES[r];
+    float worst = 0.0f, worstK = 0.0f, worstT = 0.0f;
+    for (int ks = 0; ks <= SHAPE_STEPS; ks++) {
+      float k = sr.lo + (sr.hi - sr.lo) * ks / SHAPE_STEPS;
+      CurveKernel curve(sr.mode, k);
+      for (int i = 0; i <= T_STEPS; i++) {
+        float t = (float)i / T_STEPS;
+        float d = fabsf(curve.eval(t) - CurveKernel::reference(sr.mode, t, k));
+        if (d > worst) {
+          worst = d;
+          worstK = k;
+          worstT = t;
+        }
+      }
+    }
+
+    CurveKernel curve(sr.mode, TIMED_SHAPE[r]);
+    uint32_t c0 = ESP.getCycleCount();
+    for (int i = 0; i < TIMED_EVALS; i++)
+      sink = curve.eval((float)i / TIMED_EVALS);
+    uint32_t fast = (ESP.getCycleCount() - c0) / TIMED_EVALS;
+    c0 = ESP.getCycleCount();
+    for (int i = 0; i < TIMED_EVALS; i++)
+      sink = CurveKernel::reference(sr.mode, (float)i / TIMED_EVALS, TIMED_SHAPE[r]);
+    uint32_t libm = (ESP.getCycleCount() - c0) / TIMED_EVALS;
+
+    bool ok = worst <= CurveKernel::MAX_ABS_ERROR;
+    pass = pass && ok;
+    Serial.printf("%-11s max err %.2e (k=%.3f t=%.4f) %s | kernel %u cyc, libm %u cyc\n",
+                  sr.name, worst, worstK, worstT, ok ? "ok" : "FAIL",
+                  (unsigned)fast, (unsigned)libm);
+  }
+  Serial.println(pass ? "curve_check: PASS" : "curve_check: FAIL");
+}
+
+void loop() { delay(1000); }
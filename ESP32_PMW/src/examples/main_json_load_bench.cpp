@@ -0,0 +1,63 @@
+// JSON schedule load benchmark: for every .json on SPIFFS, the old
+// whole-file approach (read into a heap buffer, then one JsonDocument DOM)
+// next to JsonPwmSequencer's streaming loader. Prints load time and peak heap
+// for each, once, then idles. "legacy" is parse only; "stream" is the full
+// load including the queue and compile(), so it is the larger job.
+// Upload the filesystem image first (pio run -t uploadfs).
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <SPIFFS.h>
+#include "JsonPwmSequencer.h"
+#include "safety_startup.h"
+
+static void legacyLoad(const char *path, uint32_t &us, uint32_t &peak) {
+  uint32_t free0 = ESP.getFreeHeap();
+  int64_t t0 = esp_timer_get_time();
+  File file = SPIFFS.open(path, "r");
+  size_t size = file.size();
+  std::unique_ptr<char[]> buf(new char[size + 1]);
+  file.readBytes(buf.get(), size);
+  buf[size] = '\0';
+  file.close();
+  JsonDocument doc;
+  deserializeJson(doc, buf.get());
+  us = (uint32_t)(esp_timer_get_time() - t0);
+  peak = free0 - ESP.getFreeHeap(); // buffer + DOM both still alive here
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  forceAllGatesLow();
+  if (!SPIFFS.begin(/*formatOnFail*/ false)) {
+    Serial.println("json_load_bench: SPIFFS mount FAILED -- run `pio run -t uploadfs`");
+    return;
+  }
+  Serial.printf("json_load_bench: parse buffer %u bytes, free heap %u\n",
+                (unsigned)JsonPwmSequencer::PARSE_BUFFER_BYTES,
+                (unsigned)ESP.getFreeHeap());
+  Serial.println("file                      bytes entries | legacy ms  heap | stream ms  heap");
+
+  File root = SPIFFS.open("/");
+  for (File f = root.openNextFile(); f; f = root.openNextFile()) {
+    String path = f.name();
+    f.close();
+    if (!path.endsWith(".json"))
+      continue;
+    if (!path.startsWith("/"))
+      path = "/" + path;
+
+    uint32_t legacyUs, legacyPeak;
+    legacyLoad(path.c_str(), legacyUs, legacyPeak);
+
+    JsonPwmSequencer seq(nullptr);
+    seq.loadFromJsonFile(path.c_str());
+    const JsonLoadReport &r = seq.lastLoad();
+    Serial.printf("%-24s %6u %7u | %9.1f %5u | %9.1f %5u%s\n", path.c_str(),
+                  (unsigned)r.fileBytes, (unsigned)r.entries,
+                  legacyUs / 1000.0f, (unsigned)legacyPeak, r.loadUs / 1000.0f,
+                  (unsigned)r.peakHeapBytes, r.ok ? "" : "  (load FAILED)");
+  }
+}
+
+void loop() { delay(1000); }
@@ -0,0 +1,125 @@
+// Lock-in check: feeds synthetic per-channel current waveforms through
+// FundamentalFit the way CurrentSense does (one kept sample every 200 us, the
+// 40 kHz default scan, phase as a Q32 fraction of the field period) and
+// compares the fitted fundamental against the exact one, computed by dense
+// integration of the same waveform. Covers DC offsets, harmonics, RL-shaped
+// commutation pulses, noise and the few-samples-per-period case at cruise
+// frequencies. Prints the amplitude / phase error per case and the CPU cycles
+// of add() and solve(), once, then idles. No PWM is started and all gates are
+// forced LOW.
+#include <Arduino.h>
+#include "FundamentalFit.h"
+#include "safety_startup.h"
+
+struct Case {
+  const char *name;
+  float freqHz;
+  float dc;          // codes
+  float h[8];        // harmonic amplitudes (codes), h[0] = fundamental
+  float phaseDeg[8]; // harmonic phases
+  float noise;       // +- uniform (codes)
+  float ampTol;      // max |amplitude error| (codes)
+  float degTol;      // max |phase error| (deg)
+};
+
+// Coil current under commutation is the winding's RL response to a pulse, so
+// its harmonics fall off roughly as 1/h^2; the pulse cases approximate that.
+static const Case CASES[] = {
+    {"sine 350 Hz", 350.0f, 1800.0f, {400}, {123}, 0.0f, 4.0f, 1.0f},
+    {"sine 200 Hz + h2..h5", 200.0f, 1500.0f, {300, 60, 30, 15, 9}, {10, 40, 80, 120, 160}, 0.0f, 4.0f, 1.0f},
+    {"sine 1 Hz + noise", 1.0f, 1200.0f, {250}, {300}, 20.0f, 4.0f, 1.0f},
+    {"RL pulse 35 Hz", 35.0f, 900.0f, {500, 0, 56, 0, 20, 0, 10, 0}, {45, 0, 135, 0, 225, 0, 315, 0}, 5.0f, 5.0f, 1.0f},
+    {"RL pulse 350 Hz", 350.0f, 900.0f, {500, 0, 56, 0, 20, 0, 10, 0}, {200, 0, 60, 0, 280, 0, 140, 0}, 5.0f, 10.0f, 1.5f},
+    {"small 0.25 A-ish 150 Hz", 150.0f, 1900.0f, {6}, {90}, 2.0f, 1.5f, 15.0f},
+};
+static const float SAMPLE_US = 200.0f; // one kept sample per channel per scan
+static const int DENSE = 20000;
+static const int TIMED = 10000;
+
+static uint32_t rng = 12345;
+static float noise(float a) {
+  rng = rng * 1664525u + 1013904223u;
+  return a * ((float)(rng >> 8) / 8388608.0f - 1.0f);
+}
+
+static float wave(const Case &c, float theta) {
+  float x = c.dc;
+  for (int k = 0; k < 8; k++)
+    if (c.h[k] != 0.0f)
+      x += c.h[k] * cosf((k + 1) * theta - c.phaseDeg[k] * (float)DEG_TO_RAD);
+  return x;
+}
+
+static float phaseErr(float a, float b) {
+  float d = fmodf(a - b + 540.0f, 360.0f) - 180.0f;
+  return fabsf(d);
+}
+
+static volatile float sink;
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  forceAllGatesLow();
+  Serial.printf("lockin_check: CPU %u MHz\n", (unsigned)ESP.getCpuFreqMHz());
+
+  bool pass = true;
+  for (const Case &c : CASES) {
+    // Exact fundamental of the noiseless waveform.
+    double re = 0.0, im = 0.0;
+    for (int i = 0; i < DENSE; i++) {
+      float th = 2.0f * (float)M_PI * i / DENSE;
+      re += wave(c, th) * cos(th);
+      im += wave(c, th) * sin(th);
+    }
+    const float refAmp = 2.0f * sqrtf((float)(re * re + im * im)) / DENSE;
+    float refDeg = atan2f((float)im, (float)re) * (float)RAD_TO_DEG;
+    if (refDeg < 0.0f) refDeg += 360.0f;
+
+    // Several periods, each starting at a different sub-sample offset (the
+    // scan and the field aren't locked to each other).
+    const float periodUs = 1e6f / c.freqHz;
+    float worstAmp = 0.0f, worstDeg = 0.0f, lastAmp = NAN;
+    uint32_t n = 0;
+    for (int start = 0; start < 8; start++) {
+      FundamentalFit fit;
+      for (float t = start * SAMPLE_US / 8.0f; t < periodUs; t += SAMPLE_US) {
+        float f = t / periodUs;
+        fit.add((uint32_t)(f * 4294967296.0f), wave(c, 2.0f * (float)M_PI * f) + noise(c.noise));
+      }
+      float mean, amp, deg;
+      if (!fit.solve(mean, amp, deg)) {
+        worstAmp = INFINITY;
+        break;
+      }
+      n = fit.count();
+      lastAmp = amp;
+      worstAmp = max(worstAmp, fabsf(amp - refAmp));
+      worstDeg = max(worstDeg, phaseErr(deg, refDeg));
+    }
+
+    bool ok = worstAmp <= c.ampTol && worstDeg <= c.degTol;
+    pass = pass && ok;
+    Serial.printf("%-24s n=%-5u amp %.1f (ref %.1f) err %.2f, phase err %.2f deg %s\n",
+                  c.name, (unsigned)n, lastAmp, refAmp, worstAmp, worstDeg,
+                  ok ? "ok" : "FAIL");
+  }
+
+  FundamentalFit fit;
+  uint32_t c0 = ESP.getCycleCount();
+  for (int i = 0; i < TIMED; i++)
+    fit.add((uint32_t)i * 429497u, (float)(i & 1023));
+  uint32_t addCyc = (ESP.getCycleCount() - c0) / TIMED;
+  float mean, amp, deg;
+  c0 = ESP.getCycleCount();
+  for (int i = 0; i < 100; i++) {
+    fit.solve(mean, amp, deg);
+    sink = amp;
+  }
+  uint32_t solveCyc = (ESP.getCycleCount() - c0) / 100;
+  Serial.printf("add %u cyc/sample, solve %u cyc/period/channel\n",
+                (unsigned)addCyc, (unsigned)solveCyc);
+  Serial.println(pass ? "lockin_check: PASS" : "lockin_check: FAIL");
+}
+
+void loop() { delay(1000); }
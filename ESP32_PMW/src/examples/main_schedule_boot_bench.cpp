@@ -0,0 +1,55 @@
+// Schedule boot benchmark: JSON on SPIFFS vs the compiled image in the
+// "schedules" flash partition, for the two largest flight schedules. Per path:
+// load (+ compile) + start() time, "boot->edge" = time from reset to setup()
+// plus SPIFFS mount plus that, i.e. when the first edge is armed if setup() did
+// nothing else (start() pushes the initial state, which arms the edge timer),
+// and the heap the loaded schedule keeps. Needs both uploads:
+// `pio run -t uploadfs` and `python3 tools/compile_schedules.py --flash PORT`.
+// Carriers are never initialized, so the coils cannot energize.
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "JsonPwmSequencer.h"
+#include "PwmController.h"
+#include "constants.h"
+#include "safety_startup.h"
+
+static const float PHASES[NUM_CHANNELS] = {90.0f, 270.0f, 180.0f, 0.0f};
+static const float DUTY[NUM_CHANNELS] = {50.0f, 50.0f, 50.0f, 50.0f};
+static const char *FILES[] = {"/tilt.json", "/takeoff_upside_down.json"};
+
+static PwmController ctl(PWM_PINS, PHASES, DUTY, NUM_CHANNELS);
+
+void setup() {
+  const int64_t setupUs = esp_timer_get_time(); // reset -> setup()
+  Serial.begin(115200);
+  delay(1000);
+  forceAllGatesLow();
+  ctl.begin();
+
+  int64_t t = esp_timer_get_time();
+  bool mounted = SPIFFS.begin(/*formatOnFail*/ false);
+  const int64_t mountUs = esp_timer_get_time() - t;
+  Serial.printf("schedule_boot_bench: reset->setup %.1f ms, SPIFFS mount %.1f ms%s\n",
+                setupUs / 1000.0f, mountUs / 1000.0f,
+                mounted ? "" : " (FAILED -- run `pio run -t uploadfs`)");
+  Serial.println("file                path  | load+start ms  boot->edge ms | heap held");
+
+  for (const char *path : FILES) {
+    for (int flash = 0; flash < 2; flash++) {
+      uint32_t free0 = ESP.getFreeHeap();
+      JsonPwmSequencer seq(&ctl);
+      t = esp_timer_get_time();
+      bool ok = flash ? seq.loadFromPartition(path) : seq.loadFromJsonFile(path);
+      if (ok)
+        seq.start();
+      const int64_t loadUs = esp_timer_get_time() - t;
+      Serial.printf("%-19s %-5s | %13.1f %14.1f | %9d%s\n", path,
+                    flash ? "flash" : "json", loadUs / 1000.0f,
+                    (setupUs + mountUs + loadUs) / 1000.0f,
+                    (int)(free0 - ESP.getFreeHeap()),
+                    ok ? "" : "  (load FAILED)");
+    }
+  }
+}
+
+void loop() { delay(1000); }
@@ -12,7 +12,7 @@ void setup() {
   ctl.initCarrierPWM(CARRIER_PINS, PWM_FREQ, CARRIER_ZERO);
   ctl.enableCurrentSense(ADC_PINS, SENS, /*tripA*/ 10.0f);
   ctl.enableCurrentBalance();
-  seq.loadFromJsonFile("/carrier_ramp.json");
+  driveLoadSchedule(seq, "/carrier_ramp.json");
   seq.start();
 }
 
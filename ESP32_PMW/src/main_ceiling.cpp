@@ -8,7 +8,7 @@ void setup() {
   ctl.begin(); // DC (stationary); the schedule sets the running frequency
   ctl.initCarrierPWM(CARRIER_PINS, PWM_FREQ, CARRIER_ZERO);
   ctl.enableCurrentSense(ADC_PINS, SENS, /*tripA*/ 10.0f); // no balance: passthrough
-  seq.loadFromJsonFile("/ceiling_sweep.json");
+  driveLoadSchedule(seq, "/ceiling_sweep.json");
   seq.start();
 }
 
@@ -1,9 +1,10 @@
 // Live PC-commanded flight: takeoff -> hover -> directional acceleration.
 // Commands (newline, 115200): takeoff | throttle=<pct> | az=<deg> | mag=<0..1> |
-// hover | land | stop | freq=<hz>. freq= is the altitude-loop handle (ai/z_track.py),
-// accepted in FLIGHT only. With enableCurrentBalance on, setCarrierDutyCycle sets each
-// channel's ceiling and run() balances thrust beneath it, so a differential
-// ceiling tilts the disk. One flight per boot; reset to re-arm.
+// hover | land | stop | freq=<hz>, plus the shared timing=on|off|reset. freq=
+// is the altitude-loop handle (ai/z_track.py), accepted in FLIGHT only. With
+// enableCurrentBalance on, setCarrierDutyCycle sets each channel's ceiling
+// and run() balances thrust beneath it, so a differential ceiling tilts the
+// disk. One flight per boot; reset to re-arm.
 #include "drive_common.h"
 #include "SerialComm.h"
 
@@ -36,11 +37,14 @@ static float clampf(float v, float lo, float hi) { return v < lo ? lo : (v > hi
 
 // Thrust-vector mixer: drop the az-facing coils' ceilings so the disk tilts toward
 // az. Strong side stays at collective, the balance reference. Verify sign on rig.
+// All four ceilings go out in one applyState(), so they latch together.
 static void applyMixer() {
+  DriveState mix;
   for (int i = 0; i < NUM_CHANNELS; i++) {
     float drop = MIX_GAIN * magSet * max(0.0f, cosf((azSet - COIL_AZ[i]) * (float)DEG_TO_RAD));
-    ctl.setCarrierDutyCycle(i, clampf(collective * (1.0f - drop), 0.0f, 100.0f));
+    mix.carrierPct[i] = clampf(collective * (1.0f - drop), 0.0f, 100.0f);
   }
+  ctl.applyState(mix);
 }
 
 static void allCoilsOff() {
@@ -49,7 +53,7 @@ static void allCoilsOff() {
 
 static void dispatch(String cmd) {
   cmd.trim();
-  cmd.toLowerCase();
+  driveLowerVerb(cmd); // next=/swap= paths keep their case
   if (cmd == "takeoff") {
     if (state == IDLE) { collective = SPINUP_THROTTLE; seq.start(); state = SPINUP; }
   } else if (cmd.startsWith("throttle=")) {
@@ -72,8 +76,11 @@ static void dispatch(String cmd) {
     if (state == SPINUP || state == FLIGHT) state = LANDING;
   } else if (cmd == "stop") {
     allCoilsOff(); state = OFF;
+  } else if (driveCommand(ctl, cmd)) {
+    return; // shared drive command (drive_common.h), already acknowledged
   } else {
-    Serial.printf("? '%s' (takeoff|throttle=|az=|mag=|hover|land|stop|freq=)\n", cmd.c_str());
+    Serial.printf("? '%s' (takeoff|throttle=|az=|mag=|hover|land|stop|freq=|timing=)\n",
+                  cmd.c_str());
     return;
   }
   Serial.printf("state=%d col=%.0f az=%.0f mag=%.2f freq=%.2f\n",
@@ -121,5 +128,5 @@ void loop() {
       break;
   }
 
-  driveTelemetry(ctl);
+  driveTelemetry(ctl, /*pollCommands*/ false); // comm above owns Serial
 }
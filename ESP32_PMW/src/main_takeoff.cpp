@@ -12,7 +12,7 @@ void setup() {
   ctl.initCarrierPWM(CARRIER_PINS, PWM_FREQ, CARRIER_ZERO);
   ctl.enableCurrentSense(ADC_PINS, SENS);
   // ctl.enableCurrentBalance();
-  seq.loadFromJsonFile("/takeoff.json");
+  driveLoadSchedule(seq, "/takeoff.json");
   seq.start();
 }
 
@@ -13,7 +13,7 @@ void setup() {
   ctl.initCarrierPWM(CARRIER_PINS, PWM_FREQ, CARRIER_ZERO);
   ctl.enableCurrentSense(ADC_PINS, SENS);
   ctl.enableCurrentBalance();
-  seq.loadFromJsonFile("/takeoff_upside_down.json");
+  driveLoadSchedule(seq, "/takeoff_upside_down.json");
   seq.start();
 }
 
@@ -27,8 +27,10 @@ void loop() {
   size_t step = seq.currentIndex();
   if (step != lastStep) {
     lastStep = step;
-    Serial.printf("[step %u] %s freq=%.1f\n", (unsigned)step,
-                  seq.labelForStep(step), ctl.getFrequency());
+    uint16_t id = seq.labelIdForStep(step); // names: the boot "labels:" line
+    Serial.printf("[step %u] lbl=%d freq=%.1f\n", (unsigned)step,
+                  id == JsonPwmSequencer::NO_LABEL ? -1 : (int)id,
+                  ctl.getFrequency());
   }
 
   driveTelemetry(ctl);
@@ -13,7 +13,7 @@ void setup() {
 
   ctl.enableCurrentBalance(); // enable PI current balancing
 
-  seq.loadFromJsonFile("/tilt.json");
+  driveLoadSchedule(seq, "/tilt.json");
   seq.start();
 }
 
@@ -0,0 +1,214 @@
+// Host-side twin of src/examples/main_balance_bench.cpp: runs
+// CurrentBalanceFloat and CurrentBalanceFixed side by side and reports how far
+// the fixed-point duties stray from the float ones, and ns per step per
+// branch mix (host timings only; the target bound is main_balance_bench's).
+//
+// From ESP32_PMW/ (the controller sources don't need the Arduino core):
+//   g++ -std=gnu++17 -O2 -I lib/PwmController/src tools/balance_bench_host.cpp
+//       lib/PwmController/src/CurrentBalanceController.cpp
+//       lib/PwmController/src/CurrentBalanceFixed.cpp -o balance_bench
+//   ./balance_bench ../pico/channel_duty_cycle_experiment/20260628_7_03pm.csv ...
+//
+// Each CSV is a PicoScope sense-voltage record (Time, Channel A..D; a units
+// line after the header). It's replayed open loop: volts * SENS, through the
+// 50 ms EMA CurrentSense applies, one step per sample, while the ceilings go
+// uniform 100% -> tilt (A, D at 80%) -> C parked -> all off -> uniform. With
+// no CSV only the closed-loop plant runs. Per run: the worst duty deviation,
+// how many channel-steps were off by more than 0.01 %, and how often the
+// latched anchor differed. Exit status 1 if any run strays more than
+// CurrentBalanceFixed::DUTY_TOLERANCE.
+#include "CurrentBalanceController.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static const int N = CurrentBalanceFixed::N;
+static const float SENS[N] = {15.26f, 15.28f, 15.57f, 15.34f};
+static const float TAU_MS = 50.0f;
+static const float START_DUTY = 50.0f;
+
+struct Sample {
+  float dtMs;
+  float v[N];
+};
+
+static bool loadCsv(const char *path, std::vector<Sample> &out) {
+  FILE *f = fopen(path, "r");
+  if (!f) return false;
+  char line[256];
+  double lastT = NAN;
+  int row = 0;
+  while (fgets(line, sizeof(line), f)) {
+    Sample s;
+    double t;
+    if (row++ < 2 || sscanf(line, "%lf,%f,%f,%f,%f", &t, &s.v[0], &s.v[1], &s.v[2],
+                            &s.v[3]) != 5)
+      continue;
+    s.dtMs = std::isnan(lastT) ? 1.0f : (float)((t - lastT) * 1000.0);
+    lastT = t;
+    out.push_back(s);
+  }
+  fclose(f);
+  return !out.empty();
+}
+
+// Ceiling schedule over a run of n steps (see the header comment).
+static void ceilingAt(size_t k, size_t n, float *c) {
+  const float f = (float)k / (float)n;
+  for (int i = 0; i < N; i++) c[i] = 100.0f;
+  if (f >= 0.4f && f < 0.7f) c[0] = c[3] = 80.0f;
+  if (f >= 0.7f && f < 0.8f) c[2] = NAN;
+  if (f >= 0.8f && f < 0.85f)
+    for (int i = 0; i < N; i++) c[i] = 0.0f;
+}
+
+struct Diff {
+  float worst = 0.0f;
+  size_t over = 0, anchorMismatch = 0, steps = 0;
+  void add(const float *a, const float *b, int ia, int ib) {
+    for (int i = 0; i < N; i++) {
+      const float d = fabsf(a[i] - b[i]);
+      worst = fmaxf(worst, d);
+      over += d > 0.01f;
+    }
+    anchorMismatch += ia != ib;
+    steps++;
+  }
+  bool ok() const { return worst <= CurrentBalanceFixed::DUTY_TOLERANCE; }
+};
+
+static Diff replay(const std::vector<Sample> &trace) {
+  CurrentBalanceFloat fl;
+  CurrentBalanceFixed fx;
+  fl.reset(START_DUTY);
+  fx.reset(START_DUTY);
+  float ema[N] = {0, 0, 0, 0}, c[N], dFl[N], dFx[N];
+  Diff d;
+  for (size_t k = 0; k < trace.size(); k++) {
+    const Sample &s = trace[k];
+    const float alpha = 1.0f - expf(-s.dtMs / TAU_MS);
+    for (int i = 0; i < N; i++) ema[i] += alpha * (s.v[i] * SENS[i] - ema[i]);
+    ceilingAt(k, trace.size(), c);
+    fl.step(ema, s.dtMs, c, dFl);
+    fx.step(ema, s.dtMs, c, dFx);
+    d.add(dFl, dFx, fl.latchedMinIndex(), fx.latchedMinIndex());
+  }
+  return d;
+}
+
+// Four coils on a shared supply: each channel's current follows
+// gain[i] * duty, minus a little of the others', through a 5 ms lag.
+struct Plant {
+  float i[N] = {0, 0, 0, 0};
+  void step(const float *duty, float dtMs) {
+    static const float GAIN[N] = {0.070f, 0.064f, 0.073f, 0.060f}; // A per %
+    float sum = 0.0f;
+    for (int k = 0; k < N; k++) sum += duty[k];
+    for (int k = 0; k < N; k++) {
+      const float target = GAIN[k] * duty[k] * (1.0f - 0.0008f * (sum - duty[k]));
+      i[k] += (1.0f - expf(-dtMs / 5.0f)) * (target - i[k]);
+    }
+  }
+};
+
+static Diff closedLoop(int steps) {
+  CurrentBalanceFloat fl;
+  CurrentBalanceFixed fx;
+  fl.reset(START_DUTY);
+  fx.reset(START_DUTY);
+  Plant pFl, pFx;
+  float c[N], dFl[N], dFx[N];
+  Diff d;
+  for (int k = 0; k < steps; k++) {
+    const float dt = (k % 7 == 3) ? 1.3f : 1.0f; // loop() jitter
+    ceilingAt(k, steps, c);
+    fl.step(pFl.i, dt, c, dFl);
+    fx.step(pFx.i, dt, c, dFx);
+    pFl.step(dFl, dt);
+    pFx.step(dFx, dt);
+    d.add(dFl, dFx, fl.latchedMinIndex(), fx.latchedMinIndex());
+  }
+  return d;
+}
+
+// ns per step over a fixed input, per branch mix: the fastest and slowest
+// of BATCHES batches. The fastest is the least disturbed by the host (the
+// spread across mixes is the data dependence); the slowest bounds it.
+struct Ns {
+  double lo, hi;
+};
+
+template <class C> static Ns nsPerStep(const float *iMeas, const float *ceil) {
+  C ctl;
+  ctl.reset(START_DUTY);
+  float out[N];
+  volatile float sink = 0.0f;
+  const int BATCHES = 50, REPS = 4000;
+  Ns ns = {1e30, 0.0};
+  for (int b = 0; b < BATCHES; b++) {
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int k = 0; k < REPS; k++) {
+      ctl.step(iMeas, 1.0f, ceil, out);
+      sink = sink + out[0];
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t = std::chrono::duration<double, std::nano>(t1 - t0).count() / REPS;
+    ns.lo = t < ns.lo ? t : ns.lo;
+    ns.hi = t > ns.hi ? t : ns.hi;
+  }
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  bool pass = true;
+  for (int a = 1; a < argc; a++) {
+    std::vector<Sample> trace;
+    if (!loadCsv(argv[a], trace)) {
+      printf("%s: unreadable\n", argv[a]);
+      pass = false;
+      continue;
+    }
+    const Diff d = replay(trace);
+    printf("replay %s: %zu steps, worst %.5f %%, %zu channel-steps > 0.01 %%, "
+           "anchor differs on %zu steps  %s\n",
+           argv[a], d.steps, d.worst, d.over, d.anchorMismatch, d.ok() ? "ok" : "FAIL");
+    pass = pass && d.ok();
+  }
+  const Diff d = closedLoop(120000);
+  printf("closed loop: %zu steps, worst %.5f %%, %zu channel-steps > 0.01 %%, "
+         "anchor differs on %zu steps  %s\n",
+         d.steps, d.worst, d.over, d.anchorMismatch, d.ok() ? "ok" : "FAIL");
+  pass = pass && d.ok();
+
+  static const float UNIFORM[N] = {100, 100, 100, 100};
+  static const float TILT[N] = {80, 100, 100, 80};
+  static const float FAINT[N] = {0.1f, 0.1f, 0.1f, 0.1f};
+  static const float BAL[N] = {5.0f, 5.2f, 4.9f, 5.1f};
+  static const float HOT[N] = {13.0f, 13.0f, 13.0f, 13.0f};
+  struct Mix {
+    const char *name;
+    const float *i, *c;
+  } mixes[] = {{"co-ramp", FAINT, UNIFORM}, {"anchor + PI", BAL, UNIFORM},
+               {"tilt PI", BAL, TILT},      {"overcurrent", HOT, UNIFORM},
+               {"all parked", BAL, nullptr}};
+  double flMin = 1e30, flMax = 0.0, fxMin = 1e30, fxMax = 0.0;
+  for (const Mix &m : mixes) {
+    const Ns a = nsPerStep<CurrentBalanceFloat>(m.i, m.c);
+    const Ns b = nsPerStep<CurrentBalanceFixed>(m.i, m.c);
+    printf("  %-12s float %6.1f..%6.1f ns  fixed %6.1f..%6.1f ns\n", m.name, a.lo,
+           a.hi, b.lo, b.hi);
+    flMin = a.lo < flMin ? a.lo : flMin;
+    flMax = a.lo > flMax ? a.lo : flMax;
+    fxMin = b.lo < fxMin ? b.lo : fxMin;
+    fxMax = b.lo > fxMax ? b.lo : fxMax;
+  }
+  printf("fastest batch per mix: float %.1f..%.1f ns, fixed %.1f..%.1f ns "
+         "(host timings; the target bound is main_balance_bench's)\n",
+         flMin, flMax, fxMin, fxMax);
+  printf(pass ? "balance_bench: PASS\n" : "balance_bench: FAIL\n");
+  return pass ? 0 : 1;
+}
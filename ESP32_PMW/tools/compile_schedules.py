@@ -0,0 +1,903 @@
+"""Compile spiffs_data/*.json schedules into one binary image for the flash
+"schedules" partition.
+
+JsonPwmSequencer::loadFromPartition() memory-maps that partition and runs the
+tasks in place. There is no JSON parse at boot and no heap copy of the queue.
+This script mirrors JsonPwmSequencer::loadFromJsonFile() exactly: the same
+defaults, methods, clamping and NaN rules. Each schedule's tasks are the
+records the JSON loader would have queued, in the sequencer's own encoding
+(PwmSequencer's builders, TASK_ENCODING), word for word: repeat, sub, call,
+include and sweep entries included. Layout: lib/JsonPwmSequencer/ScheduleImage.h.
+Keep the three in step.
+
+Unknown methods are reported and skipped, as on the board. The image keeps
+a CRC-32 of each schedule's JSON and of every file it includes, and the
+firmware refuses a schedule whose files on SPIFFS no longer match. So rerun
+this after editing a schedule or anything it includes (and uploadfs).
+Includes are read from the schedule's own directory, i.e. spiffs_data/.
+
+Writes .pio/schedules.bin, or the -o path. With --flash PORT it also writes
+the image to the partition offset in partitions.csv, via esptool.
+
+Usage:  python3 tools/compile_schedules.py [-o out.bin] [--flash PORT] [file.json ...]
+        (no files = every spiffs_data/*.json except include-only ones)
+"""
+import glob
+import json
+import math
+import os
+import struct
+import subprocess
+import sys
+import zlib
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+# ScheduleImage.h
+MAGIC = 0x31515350  # "PSQ1"
+VERSION = 5
+TASK_ENCODING = 3  # PwmSequencer::TASK_ENCODING
+IMAGE_HEADER = struct.Struct("<IHHII")
+DIR_ENTRY = struct.Struct("<32sII")
+SCHEDULE_HEADER = struct.Struct("<IIIf4f4f13I")
+SWEEP_LABEL = struct.Struct("<III")  # ScheduleSweepLabel
+GAIN_POINT = struct.Struct("<4f")  # BalanceGainPoint
+INCLUDE = struct.Struct("<II")  # ScheduleInclude
+NO_GAIN_SCHEDULE = 0xFFFFFFFF
+MAX_GAIN_POINTS = 8  # BalanceGainSchedule::MAX_POINTS
+NO_LABEL = 0xFFFF
+PARTITION = "schedules"
+
+# TaskType / TaskMode (PwmSequencer.h)
+PWM_DUTY, PWM_FREQ, PWM_PHASE, CARRIER_DUTY, WAIT, TRAJECTORY_POINT = range(6)
+POLYNOMIAL, EASE, EXPONENTIAL = range(3)
+SET, ACTIVATE, PARAM_WAIT, RAMP = range(4)  # ParamOp
+MAX_DEPTH = 8  # PwmSequencer::MAX_DEPTH
+MAX_PARAMS = 4
+MAX_SWEEP_AXIS = 255
+MAX_INCLUDE_DEPTH = 3  # JsonPwmSequencer::MAX_INCLUDE_DEPTH
+
+# JsonPwmSequencer.cpp
+PHASES_CW = [270.0, 90.0, 180.0, 0.0]
+PHASES_CCW = [90.0, 270.0, 180.0, 0.0]
+NAN = float("nan")
+METHODS = {  # name: (op, ramp mode, needs "channels")
+    "activateChannels": ("ACTIVATE", POLYNOMIAL, False),
+    "addCarrierDutyCycleTask": ("CARRIER_DUTY", POLYNOMIAL, True),
+    "addCarrierEaseRampTask": ("CARRIER_RAMP", EASE, False),
+    "addCarrierExponentialRampTask": ("CARRIER_RAMP", EXPONENTIAL, False),
+    "addCarrierRampTask": ("CARRIER_RAMP", POLYNOMIAL, False),
+    "addDutyCycleTask": ("DUTY", POLYNOMIAL, True),
+    "addEaseRampTask": ("FREQ_RAMP", EASE, False),
+    "addExponentialRampTask": ("FREQ_RAMP", EXPONENTIAL, False),
+    "addLinearRampTask": ("FREQ_RAMP", POLYNOMIAL, False),
+    "addPhaseRampTask": ("PHASE_RAMP", EASE, True),
+    "addPhaseTask": ("PHASE", POLYNOMIAL, True),
+    "addWaitTask": ("WAIT", POLYNOMIAL, False),
+    "call": ("CALL", POLYNOMIAL, False),
+    "end": ("END", POLYNOMIAL, False),
+    "include": ("INCLUDE", POLYNOMIAL, False),
+    "label": ("LABEL", POLYNOMIAL, False),
+    "repeat": ("REPEAT", POLYNOMIAL, False),
+    "setDirection": ("DIRECTION", POLYNOMIAL, False),
+    "sub": ("SUB", POLYNOMIAL, False),
+    "sweep": ("SWEEP", POLYNOMIAL, False),
+}
+
+
+def f32(x):
+    """Round to float, as the firmware stores it."""
+    try:
+        return struct.unpack("<f", struct.pack("<f", x))[0]
+    except OverflowError:
+        return math.copysign(math.inf, x)
+
+
+# ArduinoJson `variant | default`: the value if it has the default's type.
+def as_float(v, default):
+    if isinstance(v, (int, float)) and not isinstance(v, bool):
+        return f32(v)
+    return default
+
+
+def as_int(v, default):
+    if isinstance(v, int) and not isinstance(v, bool) and -2**31 <= v < 2**31:
+        return v
+    return default
+
+
+def as_str(v, default):
+    return v if isinstance(v, str) else default
+
+
+def to_int(v):
+    """ArduinoJson as<int>(): numbers truncate, true is 1, anything else 0."""
+    if isinstance(v, bool):
+        return int(v)
+    if isinstance(v, int):
+        return v
+    if isinstance(v, float) and math.isfinite(v):
+        return int(v)
+    return 0
+
+
+def clamp_duty(v):
+    return min(max(v, 0.0), 100.0)
+
+
+def strip_comments(text):
+    """Drop // and /* */ comments outside strings (ARDUINOJSON_ENABLE_COMMENTS)."""
+    out, i, n = [], 0, len(text)
+    in_string = escaped = False
+    while i < n:
+        c = text[i]
+        if in_string:
+            out.append(c)
+            if escaped:
+                escaped = False
+            elif c == "\\":
+                escaped = True
+            elif c == '"':
+                in_string = False
+        elif c == '"':
+            in_string = True
+            out.append(c)
+        elif text.startswith("//", i):
+            j = text.find("\n", i)
+            i = n if j < 0 else j
+            continue
+        elif text.startswith("/*", i):
+            j = text.find("*/", i + 2)
+            i = n if j < 0 else j + 2
+            continue
+        else:
+            out.append(c)
+        i += 1
+    return "".join(out)
+
+
+class Obj(list):
+    """A JSON object as its (key, value) pairs, duplicates and order kept."""
+
+
+def reject_constant(name):
+    raise ValueError(f"{name} is not valid JSON here")
+
+
+class Task:
+    """A zeroed SequenceTask, as `SequenceTask task = {}`."""
+
+    def __init__(self, type_, mode=POLYNOMIAL, duration_us=0, shape=0.0):
+        self.type, self.mode, self.duration_us, self.shape = type_, mode, duration_us, shape
+        self.start_freq = self.end_freq = 0.0
+        self.arrays = {k: [0.0] * 4 for k in (
+            "startCarriers", "endCarriers", "startDuties", "endDuties",
+            "startPhases", "endPhases", "dutyCycles", "carrierDuties")}
+
+    def point_fields(self):
+        """The 13 values a TRAJECTORY_POINT sets, in _dirty bit order."""
+        a = self.arrays
+        return [self.start_freq, *a["dutyCycles"], *a["startPhases"], *a["carrierDuties"]]
+
+    def ramp_lanes(self):
+        """(channel mask, [(start, end)] per masked channel) of a ramp."""
+        if self.type == PWM_FREQ:
+            return 1, [(self.start_freq, self.end_freq)]
+        key = {CARRIER_DUTY: "Carriers", PWM_DUTY: "Duties", PWM_PHASE: "Phases"}[self.type]
+        starts, ends = self.arrays["start" + key], self.arrays["end" + key]
+        lanes = [i for i in range(4) if not math.isnan(starts[i])]
+        return sum(1 << i for i in lanes), [(starts[i], ends[i]) for i in lanes]
+
+
+REC_LONG = 1 << 6
+REC_REPEAT, REC_SUB, REC_END, REC_CALL, REC_PARAM, REC_SWEEP = range(6, 12)
+RAMPS = (PWM_FREQ, PWM_DUTY, PWM_PHASE, CARRIER_DUTY)
+DIRTY_BASE = {PWM_DUTY: 1, PWM_PHASE: 5, CARRIER_DUTY: 9}  # _dirty layout
+
+
+def word(x):
+    return struct.unpack("<I", struct.pack("<f", x))[0]
+
+
+def count_word(v):
+    """A float operand stored as a uint32 (mask, durationMs), as the C++ casts."""
+    if not v > 0.0:
+        return 0
+    return int(v) if v < 4294967040.0 else 0xFFFFFFFF
+
+
+class Arg:
+    """Operand::arg(): argument slot `slot` of the enclosing subroutine call."""
+
+    def __init__(self, slot):
+        self.slot = slot
+
+
+class Encoder:
+    """The queue as PwmSequencer's builders append to it, record for record."""
+
+    def __init__(self):
+        self.words = []
+        self.records = 0
+        self.value, self.known = [0.0] * 13, 0  # the encoder's picture of the state
+        self.blocks = []  # open: [word, index, is_sub, has_work]
+
+    def pushed(self):
+        self.records += 1
+        if self.blocks:
+            self.blocks[-1][3] = True
+
+    def task(self, t):
+        """encodeTask()"""
+        if t.type == TRAJECTORY_POINT:
+            self.point(dict(enumerate(t.point_fields())))
+            return
+        words = self.words
+        h = t.type | (t.mode if t.type in RAMPS else POLYNOMIAL) << 4
+        at = len(words)
+        words.append(0)
+        d = t.duration_us
+        if 0 <= d <= 0xFFFFFFFF:
+            words.append(d)
+        else:
+            h |= REC_LONG
+            words += [d & 0xFFFFFFFF, (d >> 32) & 0xFFFFFFFF]
+        if t.type in RAMPS:
+            words.append(word(t.shape))
+            mask, lanes = t.ramp_lanes()
+            if t.type != PWM_FREQ:
+                h |= mask << 8
+            for s, e in lanes:
+                words += [word(s), word(e)]
+            # Ramped fields are no longer known (trackKnown()).
+            if t.type == PWM_FREQ:
+                self.known &= ~1
+            else:
+                for i in range(4):
+                    if (mask >> i) & 1:
+                        self.known &= ~(1 << (DIRTY_BASE[t.type] + i))
+        words[at] = h
+        self.pushed()
+
+    def point(self, fields):
+        """encodePoint(): a TRAJECTORY_POINT of {_dirty bit: value}."""
+        at = len(self.words)
+        self.words.append(0)
+        carried = 0
+        for b in sorted(fields):
+            v, k = f32(fields[b]), self.value[b]
+            if (self.known >> b) & 1 and (v == k or (math.isnan(v) and math.isnan(k))):
+                continue  # run() would find the field already at v
+            carried |= 1 << b
+            self.words.append(word(v))
+            self.value[b] = v
+        self.words[at] = TRAJECTORY_POINT | carried << 16
+        self.known |= carried
+        self.pushed()
+
+    def begin_block(self, head, is_sub):
+        if len(self.blocks) == MAX_DEPTH:
+            raise ValueError("blocks nested too deep")
+        self.blocks.append([len(self.words), self.records, is_sub, False])
+        self.words += head
+        self.records += 1
+        self.known = 0
+        return len(self.words), self.records  # a sub's body: word, index
+
+    def end_block(self):
+        if not self.blocks:
+            raise ValueError('"end" without an open block')
+        at, index, is_sub, work = self.blocks.pop()
+        if not work:
+            raise ValueError("block has no tasks")
+        self.words.append(REC_END)
+        self.records += 1
+        body = at + (3 if is_sub else 4)
+        self.words[body - 2] = len(self.words) - body
+        self.words[body - 1] = self.records - 1 - index
+        if not is_sub and self.words[at + 1] > 0 and self.blocks:
+            self.blocks[-1][3] = True
+        self.known = 0
+
+    def call(self, sub, args):
+        """addCall(): sub is begin_block()'s (word, index)."""
+        h = REC_CALL | len(args) << 8
+        tail = []
+        for k, a in enumerate(args):
+            if isinstance(a, Arg):
+                h |= 1 << (12 + k)
+                tail.append(a.slot)
+            else:
+                tail.append(word(a))
+        self.words += [h, *sub, *tail]
+        self.pushed()
+        self.known = 0
+
+    def sweep(self, levels, masks, dwell_ms, rest_ms):
+        """addSweep()"""
+        if not (0 < len(levels) <= MAX_SWEEP_AXIS and 0 < len(masks) <= MAX_SWEEP_AXIS):
+            raise ValueError('sweep needs 1-255 "levels" and "masks"')
+        self.words += [REC_SWEEP | len(levels) << 8 | len(masks) << 16, dwell_ms, rest_ms]
+        self.words += [word(clamp_duty(f32(v))) for v in levels]
+        for k in range(0, len(masks), 8):
+            self.words.append(sum(m << 4 * i for i, m in enumerate(masks[k:k + 8])))
+        self.pushed()
+        self.known = 0
+
+    def param(self, op, type_, mode, channels, a, shape=NAN):
+        """addParamTask(); a[]: floats or Arg."""
+        if type_ == PWM_FREQ:
+            channels = 1
+        if op in (ACTIVATE, PARAM_WAIT):
+            channels = 0
+        h = REC_PARAM | op << 4 | channels << 8 | type_ << 12 | mode << 16
+        if op == SET:
+            operands = [a[i] for i in range(4) if (channels >> i) & 1]
+        else:
+            operands = a[:{ACTIVATE: 2, PARAM_WAIT: 1, RAMP: 3}[op]]
+        words = []
+        for k, o in enumerate(operands):
+            if isinstance(o, Arg):
+                h |= 1 << (20 + k)
+                words.append(o.slot)
+            elif (op, k) in ((ACTIVATE, 0), (PARAM_WAIT, 0), (RAMP, 2)):
+                words.append(count_word(o))
+            else:
+                words.append(word(o))
+        if op == RAMP:
+            words.append(word(shape))
+        if not h >> 20 & 0x0F:
+            # Nothing to resolve at run time: the plain record it amounts to.
+            # The loader only sends SET and ACTIVATE this way.
+            if op == SET:
+                clamp = type_ in (PWM_DUTY, CARRIER_DUTY)
+                self.point({DIRTY_BASE[type_] + i: clamp_duty(v) if clamp else v
+                            for i, v in zip([i for i in range(4) if (channels >> i) & 1],
+                                            operands)})
+            else:
+                mask, on = count_word(operands[0]), clamp_duty(f32(operands[1]))
+                self.point({9 + i: on if (mask >> i) & 1 else 0.0 for i in range(4)})
+            return
+        self.words += [h, *words]
+        self.pushed()
+        self.known = 0
+
+
+def trajectory_task(freq, duty, phase, carrier):
+    t = Task(TRAJECTORY_POINT)
+    t.start_freq = t.end_freq = freq
+    t.arrays["dutyCycles"] = list(duty)
+    t.arrays["startPhases"] = list(phase)
+    t.arrays["endPhases"] = list(phase)
+    t.arrays["carrierDuties"] = list(carrier)
+    return t
+
+
+def ramp_task(starts, ends, duration_ms, type_, mode, shape):
+    t = Task(type_, mode, duration_ms * 1000, shape)
+    if type_ == PWM_FREQ:
+        t.start_freq, t.end_freq = starts[0], ends[0]
+        return t
+    key = {CARRIER_DUTY: "Carriers", PWM_DUTY: "Duties", PWM_PHASE: "Phases"}[type_]
+    for i in range(4):
+        s, e = starts[i], ends[i]
+        if math.isnan(s):
+            s = e = NAN
+        elif type_ != PWM_PHASE:
+            s, e = clamp_duty(s), clamp_duty(e)
+        t.arrays["start" + key][i] = s
+        t.arrays["end" + key][i] = e
+    return t
+
+
+def file_crc32(path):
+    """What loadFromPartition() streams the SPIFFS copy through."""
+    with open(path, "rb") as f:
+        return zlib.crc32(f.read())
+
+
+def read_json(path):
+    with open(path, encoding="utf-8") as f:
+        text = strip_comments(f.read())
+    return json.loads(text, object_pairs_hook=Obj, parse_constant=reject_constant)
+
+
+def include_only(path):
+    """A file with "params" is only there to be included, not run on its own."""
+    try:
+        top = read_json(path)
+    except ValueError:
+        return False  # let compile_schedule() report it
+    return isinstance(top, Obj) and any(key == "params" for key, _ in top)
+
+
+class Loader:
+    """JsonPwmSequencer::applyEntry() and includeFile(), over an Encoder."""
+
+    def __init__(self, root, freq, duty, phase):
+        self.root = root  # SPIFFS "/" (spiffs_data)
+        self.enc = Encoder()
+        self.cur_freq = freq
+        self.cur_duty = list(duty)
+        self.cur_phase = list(phase)
+        self.cur_carrier = [NAN] * 4
+        self.label = ""
+        self.labels = []  # per record
+        self.sweeps = []  # labelled sweeps: (record, word, label template)
+        self.unknown = []
+        # Control flow (LoadState): from the first block or call on, setters
+        # are partial ParamTasks instead of full snapshots.
+        self.subs = []  # [name, (word, index), closed, params]
+        self.blocks = []  # open: index into subs, -1 = repeat
+        self.includes = 0
+        self.include_depth = 0
+        self.deferred = False
+        self.sources = []  # included files: (SPIFFS path, CRC-32 of the bytes)
+
+    def find_param(self, name):
+        for b in reversed(self.blocks):
+            if b >= 0:
+                params = self.subs[b][3]
+                return params.index(name) if name in params else -1
+        return -1
+
+    def find_sub(self, name):
+        for i in reversed(range(len(self.subs))):
+            if self.subs[i][2] and self.subs[i][0] == name:
+                return i
+        return -1
+
+    def operand(self, obj, key, default):
+        v = obj.get(key)
+        ref = as_str(v, "")
+        if not ref.startswith("$"):
+            return as_float(v, default)
+        slot = self.find_param(ref[1:])
+        if slot < 0:
+            raise ValueError(f"'{ref}' is not a parameter of the enclosing sub")
+        return Arg(slot)
+
+    def label_records(self):
+        while len(self.labels) < self.enc.records:
+            self.labels.append(self.label)
+
+    def stream(self, schedule):
+        if type(schedule) is not list:
+            raise ValueError("schedule is not an array")
+        for pairs in schedule:
+            if not isinstance(pairs, Obj):
+                raise ValueError("schedule entry is not an object")
+            self.apply(dict(pairs))  # a repeated key: the last one wins
+
+    def call(self, sub, obj):
+        name, body, _, params = self.subs[sub]
+        given = dict(obj["args"]) if isinstance(obj.get("args"), Obj) else {}
+        args = []
+        for p in params:
+            if given.get(p) is None:
+                raise ValueError(f"{name}: no value for '{p}'")
+            args.append(self.operand(given, p, 0.0))
+        self.enc.call(body, args)
+
+    def parse_params(self, names):
+        params = []
+        for p in names:
+            p = as_str(p, "")
+            if len(params) == MAX_PARAMS or not p or len(p.encode()) >= 16:
+                raise ValueError('too many "params", or a bad name')
+            params.append(p)
+        return params
+
+    def include(self, path):
+        if len(path.encode()) >= 32:
+            raise ValueError("include path too long")
+        file = os.path.join(self.root, path.lstrip("/"))
+        if not os.path.isfile(file):
+            raise ValueError(f"included file {path} not found")
+        top = read_json(file)
+        self.sources.append((path, file_crc32(file)))
+        outer_label = self.label
+        self.includes += 1
+        done = False
+        params = []
+
+        def body(schedule):
+            enc = self.enc
+            sub = enc.begin_block([REC_SUB, 0, 0], True)
+            me, depth = len(self.subs), len(self.blocks)
+            self.subs.append([path, sub, False, params])
+            self.blocks.append(me)
+            self.label_records()  # the opener
+            self.stream(schedule)
+            if len(self.blocks) != depth + 1:
+                raise ValueError("block not closed by 'end'")
+            self.blocks.pop()
+            enc.end_block()
+            self.subs[me][2] = True
+            self.label_records()
+
+        try:
+            if isinstance(top, Obj):
+                for key, v in top:
+                    if key == "schedule":
+                        if done:
+                            raise ValueError('more than one "schedule"')
+                        body(v)
+                        done = True
+                    elif key == "params" and not done:
+                        if type(v) is not list:
+                            raise ValueError('"params" is not an array')
+                        params = self.parse_params(v)
+            elif isinstance(top, list):
+                body(top)
+                done = True
+            else:
+                raise ValueError("expected '{' or '['")
+            if not done:
+                raise ValueError('no "schedule"')
+        except ValueError as e:
+            raise ValueError(f"included {path}: {e}")
+        self.includes -= 1
+        self.label = outer_label  # labels set in the file stay in it
+
+    def apply(self, obj):
+        enc = self.enc
+        method = as_str(obj.get("method"), "")
+        shape = as_float(obj.get("shape"), NAN)
+
+        channels = []
+        ch = obj.get("channels")
+        if type(ch) is list:
+            for c in ch:
+                ci = to_int(c)
+                if 0 <= ci < 4 and len(channels) < 4:
+                    channels.append(ci)
+        elif as_int(ch, None) is not None and 0 <= ch < 4:
+            channels.append(ch)
+        channel_mask = sum(1 << c for c in set(channels))
+
+        m = METHODS.get(method)
+        if m is None or (m[2] and not channels):
+            self.unknown.append(method)
+            return
+        op, mode, _ = m
+        if op == "LABEL":
+            self.label = as_str(obj.get("value"), "")
+            return
+
+        value = self.operand(obj, "value", 0.0)
+        from_ = self.operand(obj, "from", 0.0)
+        to = self.operand(obj, "to", 0.0)
+        mask = self.operand(obj, "mask", 0.0)
+        duration = self.operand(obj, "duration_ms", 0.0)
+        duration_ms = as_int(obj.get("duration_ms"), 0) & 0xFFFFFFFF
+        literal = not any(isinstance(o, Arg) for o in (value, from_, to, mask, duration))
+
+        if op in ("DUTY", "PHASE", "CARRIER_DUTY"):
+            type_ = {"DUTY": PWM_DUTY, "PHASE": PWM_PHASE, "CARRIER_DUTY": CARRIER_DUTY}[op]
+            if self.deferred:
+                enc.param(SET, type_, mode, channel_mask, [value] * 4)
+            else:
+                cur = {PWM_DUTY: self.cur_duty, PWM_PHASE: self.cur_phase,
+                       CARRIER_DUTY: self.cur_carrier}[type_]
+                for c in channels:
+                    cur[c] = value if type_ == PWM_PHASE else clamp_duty(value)
+                self.snapshot()
+        elif op == "WAIT":
+            if not literal:
+                enc.param(PARAM_WAIT, PWM_FREQ, mode, 0, [duration])
+            else:
+                enc.task(Task(WAIT, duration_us=duration_ms * 1000))
+        elif op in ("FREQ_RAMP", "CARRIER_RAMP", "PHASE_RAMP"):
+            type_ = {"FREQ_RAMP": PWM_FREQ, "CARRIER_RAMP": CARRIER_DUTY,
+                     "PHASE_RAMP": PWM_PHASE}[op]
+            if not literal:
+                enc.param(RAMP, type_, mode, channel_mask if type_ == PWM_PHASE else 0x0F,
+                          [from_, to, duration], shape)
+            elif type_ == PWM_FREQ:
+                enc.task(ramp_task([from_] * 4, [to] * 4, duration_ms, PWM_FREQ, mode, shape))
+                self.cur_freq = to
+            elif type_ == CARRIER_DUTY:
+                enc.task(ramp_task([from_] * 4, [to] * 4, duration_ms, CARRIER_DUTY, mode,
+                                   shape))
+                self.cur_carrier = [to] * 4
+            else:
+                starts, ends = [NAN] * 4, [NAN] * 4
+                for c in channels:
+                    starts[c], ends[c] = from_, to
+                    self.cur_phase[c] = to
+                enc.task(ramp_task(starts, ends, duration_ms, PWM_PHASE, mode, shape))
+        elif op == "DIRECTION":
+            if isinstance(value, Arg):
+                raise ValueError("setDirection takes no parameter")
+            phases = PHASES_CCW if value != 0.0 else PHASES_CW
+            if self.deferred:
+                enc.param(SET, PWM_PHASE, mode, 0x0F, list(phases))
+            else:
+                self.cur_phase = list(phases)
+                self.snapshot()
+        elif op == "ACTIVATE":
+            if self.deferred:
+                enc.param(ACTIVATE, PWM_FREQ, mode, 0, [mask, value])
+            else:
+                bits = as_int(obj.get("mask"), 0)
+                self.cur_carrier = [clamp_duty(value) if (bits >> i) & 1 else 0.0
+                                    for i in range(4)]
+                self.snapshot()
+        elif op == "REPEAT":
+            self.deferred = True
+            count = obj.get("count")
+            if not (isinstance(count, int) and not isinstance(count, bool)
+                    and 0 <= count < 2**32):
+                raise ValueError('repeat needs a literal "count"')
+            enc.begin_block([REC_REPEAT, count, 0, 0], False)
+            self.blocks.append(-1)
+        elif op == "SUB":
+            self.deferred = True
+            name = as_str(obj.get("name"), "")
+            if not name or len(name.encode()) >= 32:
+                raise ValueError('sub needs a "name" of at most 31 characters')
+            names = obj.get("params")
+            params = self.parse_params(names if type(names) is list else [])
+            sub = enc.begin_block([REC_SUB, 0, 0], True)
+            self.blocks.append(len(self.subs))
+            self.subs.append([name, sub, False, params])
+        elif op == "END":
+            if len(self.blocks) <= self.include_depth:
+                raise ValueError('"end" without an open block')
+            enc.end_block()
+            b = self.blocks.pop()
+            if b >= 0:
+                self.subs[b][2] = True
+        elif op == "CALL":
+            self.deferred = True
+            name = as_str(obj.get("name"), "")
+            sub = self.find_sub(name)
+            if sub < 0:
+                raise ValueError(f"no sub '{name}' defined before this call")
+            self.call(sub, obj)
+        elif op == "SWEEP":
+            template = as_str(obj.get("label"), "")
+            if len(template.encode()) >= 32:
+                raise ValueError('sweep "label" longer than 31 characters')
+            levels = obj.get("levels")
+            levels = levels if type(levels) is list else []
+            if any(as_float(v, None) is None for v in levels):
+                raise ValueError('sweep "levels" are numbers')
+            masks = obj.get("masks")
+            masks = masks if type(masks) is list else []
+            if any(as_int(m, -1) not in range(16) for m in masks):
+                raise ValueError('sweep "masks" are 0-15')
+            at = len(enc.words)
+            enc.sweep([as_float(v, 0.0) for v in levels], masks,
+                      as_int(obj.get("dwell_ms"), 0) & 0xFFFFFFFF,
+                      as_int(obj.get("rest_ms"), 0) & 0xFFFFFFFF)
+            self.cur_carrier = [0.0] * 4
+            if template:
+                self.sweeps.append((enc.records - 1, at, template))
+        elif op == "INCLUDE":
+            self.deferred = True
+            path = as_str(obj.get("file"), "")
+            sub = self.find_sub(path)
+            if sub < 0:
+                if any(not closed and name == path for name, _, closed, _ in self.subs):
+                    raise ValueError("include loop")
+                if self.includes >= MAX_INCLUDE_DEPTH:
+                    raise ValueError("includes nested too deep")
+                include_depth = self.include_depth
+                self.include_depth = len(self.blocks) + 1  # its "end"s can't close ours
+                self.include(path)
+                self.include_depth = include_depth
+                sub = self.find_sub(path)
+            self.call(sub, obj)
+        self.label_records()  # one label per record queued
+
+    def snapshot(self):
+        self.enc.task(trajectory_task(self.cur_freq, self.cur_duty, self.cur_phase,
+                                      self.cur_carrier))
+
+
+def gain_schedule(v):
+    """"gain_schedule" -> [(freq, kp, ki, kd)], as BalanceGainSchedule::set()
+    accepts it; anything else fails the load, as on the board."""
+    bad = ValueError("bad gain_schedule (an array of at most 8 {freq, kp, ki, kd}, "
+                     "freq ascending, gains >= 0)")
+    if type(v) is not list or len(v) > MAX_GAIN_POINTS:
+        raise bad
+    points = []
+    for p in v:
+        if not isinstance(p, Obj):
+            raise bad
+        fields = dict(p)  # later keys win
+        point = tuple(as_float(fields.get(k), NAN) for k in ("freq", "kp", "ki", "kd"))
+        if not all(math.isfinite(x) and x >= 0.0 for x in point):
+            raise bad
+        if points and point[0] <= points[-1][0]:
+            raise bad
+        points.append(point)
+    return points
+
+
+def compile_schedule(path):
+    """-> (header fields, record words, record count, [label per record],
+    [labelled sweeps], gain points or None, [included files]) for one JSON
+    file."""
+    top = read_json(path)
+
+    resolution_ms = 25
+    initial_freq = 0.0
+    initial_duty = [50.0] * 4
+    cw = False
+    phase_override = [NAN] * 4
+    gains = None
+    if isinstance(top, Obj):
+        # Config object. Later keys win, as on the board; initial_duty and
+        # initial_phase merge per element.
+        schedule = None
+        for key, v in top:
+            if key == "schedule":
+                if schedule is not None:
+                    raise ValueError("more than one \"schedule\" key")
+                schedule = v
+            elif key == "resolution_ms":
+                if isinstance(v, int) and not isinstance(v, bool) and 0 <= v < 2**32:
+                    resolution_ms = v
+            elif key == "initial_freq":
+                initial_freq = as_float(v, initial_freq)
+            elif key == "initial_duty" and type(v) is list:
+                for i, d in enumerate(v[:4]):
+                    initial_duty[i] = as_float(d, initial_duty[i])
+            elif key == "direction":
+                cw = as_str(v, "").lower() == "cw"
+            elif key == "initial_phase" and type(v) is list:
+                for i, p in enumerate(v[:4]):
+                    phase_override[i] = as_float(p, phase_override[i])
+            elif key == "gain_schedule":
+                gains = gain_schedule(v)
+        if schedule is None:
+            schedule = []
+    elif isinstance(top, list):
+        schedule = top  # bare array: the schedule with all defaults
+    else:
+        raise ValueError("expected '{' or '['")
+    if type(schedule) is not list:
+        raise ValueError("schedule is not an array")
+    initial_phase = [(PHASES_CW if cw else PHASES_CCW)[i]
+                     if math.isnan(phase_override[i]) else phase_override[i]
+                     for i in range(4)]
+
+    loader = Loader(os.path.dirname(os.path.abspath(path)), initial_freq, initial_duty,
+                    initial_phase)
+    loader.stream(schedule)
+    if loader.blocks:
+        raise ValueError("block not closed by 'end'")
+    if loader.unknown:
+        print(f"  {os.path.basename(path)}: unknown methods skipped: "
+              f"{', '.join(loader.unknown)}")
+    return ((resolution_ms, initial_freq, initial_duty, initial_phase), loader.enc.words,
+            loader.enc.records, loader.labels, loader.sweeps, gains, loader.sources)
+
+
+def align(buf, n):
+    buf.extend(b"\0" * (-len(buf) % n))
+
+
+def build_image(paths):
+    entries = []
+    body = bytearray()
+    dir_end = IMAGE_HEADER.size + DIR_ENTRY.size * len(paths)
+    for path in paths:
+        name = "/" + os.path.basename(path)
+        if len(name.encode()) > 31:
+            raise SystemExit(f"{name}: SPIFFS path longer than 31 bytes")
+        try:
+            (res, freq, duty, phase), words, ntasks, labels, sweeps, gains, includes = \
+                compile_schedule(path)
+        except ValueError as e:  # json.JSONDecodeError included
+            raise SystemExit(f"{path}: {e}")
+
+        table = [l for l in dict.fromkeys(labels) if l]
+        if len(table) >= NO_LABEL:
+            raise SystemExit(f"{name}: too many distinct labels")
+        index = {l: i for i, l in enumerate(table)}
+
+        align(body, 4)
+        at = dir_end + len(body)
+        tasks_off = at + SCHEDULE_HEADER.size  # header is a multiple of 4
+        data = bytearray(struct.pack(f"<{len(words)}I", *words))
+        label_idx_off = tasks_off + len(data)
+        data += struct.pack(f"<{len(labels)}H", *[index.get(l, NO_LABEL) for l in labels])
+        align(data, 4)
+        labels_off = tasks_off + len(data)
+        sweeps_off = labels_off + 4 * len(table)
+        strings = bytearray()
+        offsets = []
+        gains_off = sweeps_off + SWEEP_LABEL.size * len(sweeps)
+        includes_off = gains_off + GAIN_POINT.size * len(gains or [])
+        str_base = includes_off + INCLUDE.size * len(includes)
+        for l in table + [t for _, _, t in sweeps] + [p for p, _ in includes]:
+            offsets.append(str_base + len(strings))
+            strings += l.encode("utf-8") + b"\0"
+        data += struct.pack(f"<{len(table)}I", *offsets[:len(table)])
+        for (step, at_word, _), text in zip(sweeps, offsets[len(table):]):
+            data += SWEEP_LABEL.pack(step, at_word, text)
+        for point in gains or []:
+            data += GAIN_POINT.pack(*point)
+        for (_, crc), text in zip(includes, offsets[len(table) + len(sweeps):]):
+            data += INCLUDE.pack(text, crc)
+        data += strings
+
+        body += SCHEDULE_HEADER.pack(
+            ntasks, len(words), res, freq, *duty, *phase, tasks_off, label_idx_off,
+            labels_off, len(table), sweeps_off, len(sweeps), gains_off,
+            NO_GAIN_SCHEDULE if gains is None else len(gains), includes_off, len(includes),
+            len(data), zlib.crc32(data), file_crc32(path))
+        body += data
+        entries.append((name, at, ntasks, len(data)))
+
+    align(body, 4)
+    image = bytearray(IMAGE_HEADER.pack(MAGIC, VERSION, TASK_ENCODING, len(paths),
+                                        dir_end + len(body)))
+    for name, at, _, _ in entries:
+        image += DIR_ENTRY.pack(name.encode(), at, 0)
+    image += body
+    return bytes(image), entries
+
+
+def partition_offset(name):
+    """(offset, size) of partition `name` in partitions.csv."""
+    with open(os.path.join(ROOT, "partitions.csv")) as f:
+        for line in f:
+            cols = [c.strip() for c in line.split("#")[0].split(",")]
+            if cols and cols[0] == name:
+                return int(cols[3], 0), int(cols[4], 0)
+    raise SystemExit(f"no '{name}' partition in partitions.csv")
+
+
+def main():
+    args = sys.argv[1:]
+    out = os.path.join(ROOT, ".pio", "schedules.bin")
+    port = None
+    paths = []
+    while args:
+        a = args.pop(0)
+        if a in ("-o", "--flash"):
+            if not args:
+                raise SystemExit(f"{a} needs a value")
+            if a == "-o":
+                out = args.pop(0)
+            else:
+                port = args.pop(0)
+        else:
+            paths.append(a)
+    if not paths:
+        paths = [p for p in sorted(glob.glob(os.path.join(ROOT, "spiffs_data", "*.json")))
+                 if not include_only(p)]
+    if not paths:
+        raise SystemExit("no schedules to compile")
+
+    image, entries = build_image(paths)
+    offset, size = partition_offset(PARTITION)
+    for name, _, ntasks, nbytes in entries:
+        print(f"  {name:<28} {ntasks:5d} tasks {nbytes:7d} bytes")
+    print(f"{len(entries)} schedules, {len(image)} bytes "
+          f"({100.0 * len(image) / size:.0f}% of '{PARTITION}')")
+    if len(image) > size:
+        raise SystemExit(f"image does not fit the {size}-byte '{PARTITION}' partition")
+
+    os.makedirs(os.path.dirname(os.path.abspath(out)), exist_ok=True)
+    with open(out, "wb") as f:
+        f.write(image)
+    print(f"wrote {out}")
+
+    cmd = [sys.executable, "-m", "esptool", "--chip", "esp32", "--port", port or "<PORT>",
+           "write_flash", hex(offset), out]
+    if port is None:
+        print("flash with:  " + " ".join(cmd))
+        return
+    subprocess.run(cmd, check=True)
+
+
+if __name__ == "__main__":
+    main()
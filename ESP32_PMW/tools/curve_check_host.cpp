@@ -0,0 +1,80 @@
+// Host-side twin of src/examples/main_curve_check.cpp: sweeps every TaskMode
+// across the shape ranges the JSON schedules use and compares
+// CurveKernel::eval() against the libm definition (CurveKernel::reference),
+// then times both. Prints the worst absolute error (and where it happened)
+// and ns per evaluation; exit status 1 if any mode exceeds
+// CurveKernel::MAX_ABS_ERROR. The timings are the host's: a desktop libm is
+// no slower than the kernel, so the speedup only shows in the target
+// sketch's cycle counts.
+//
+// From ESP32_PMW/ (the kernel doesn't need the Arduino core):
+//   g++ -std=gnu++17 -O2 -I lib/PwmSequencer/src tools/curve_check_host.cpp
+//       lib/PwmSequencer/src/CurveKernel.cpp -o curve_check
+//   ./curve_check
+#include "CurveKernel.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+struct ShapeRange {
+  TaskMode mode;
+  float lo, hi;
+  const char *name;
+};
+
+static const ShapeRange RANGES[] = {
+    {TaskMode::POLYNOMIAL, 0.1f, 10.0f, "POLYNOMIAL"},
+    {TaskMode::EASE, 1.0f, 10.0f, "EASE"},
+    {TaskMode::EXPONENTIAL, -10.0f, 10.0f, "EXPONENTIAL"},
+};
+static const int SHAPE_STEPS = 200;
+static const int T_STEPS = 2000;
+static const int TIMED_EVALS = 1000000;
+// Non-integer shapes so the timing exercises the log2/exp2 path, not the
+// repeated-multiply one.
+static const float TIMED_SHAPE[] = {2.5f, 3.5f, -2.5f};
+
+static volatile float sink;
+
+template <class F> static double nsPerEval(F f) {
+  const auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < TIMED_EVALS; i++)
+    sink = f((float)i / TIMED_EVALS);
+  const auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(t1 - t0).count() / TIMED_EVALS;
+}
+
+int main() {
+  printf("curve_check: bound %.1e\n", CurveKernel::MAX_ABS_ERROR);
+  bool pass = true;
+  for (int r = 0; r < 3; r++) {
+    const ShapeRange &sr = RANGES[r];
+    float worst = 0.0f, worstK = 0.0f, worstT = 0.0f;
+    for (int ks = 0; ks <= SHAPE_STEPS; ks++) {
+      float k = sr.lo + (sr.hi - sr.lo) * ks / SHAPE_STEPS;
+      CurveKernel curve(sr.mode, k);
+      for (int i = 0; i <= T_STEPS; i++) {
+        float t = (float)i / T_STEPS;
+        float d = fabsf(curve.eval(t) - CurveKernel::reference(sr.mode, t, k));
+        if (d > worst) {
+          worst = d;
+          worstK = k;
+          worstT = t;
+        }
+      }
+    }
+
+    CurveKernel curve(sr.mode, TIMED_SHAPE[r]);
+    double fast = nsPerEval([&](float t) { return curve.eval(t); });
+    double libm = nsPerEval(
+        [&](float t) { return CurveKernel::reference(sr.mode, t, TIMED_SHAPE[r]); });
+
+    bool ok = worst <= CurveKernel::MAX_ABS_ERROR;
+    pass = pass && ok;
+    printf("%-11s max err %.2e (k=%.3f t=%.4f) %s | kernel %.1f ns, libm %.1f ns\n",
+           sr.name, worst, worstK, worstT, ok ? "ok" : "FAIL", fast, libm);
+  }
+  printf(pass ? "curve_check: PASS\n" : "curve_check: FAIL\n");
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+// Host-side twin of src/examples/main_filter_bench.cpp: the same synthetic
+// RL-pulse coil current, fed through the same four filter setups the way
+// CurrentSense::update() sees it (one value per 1 ms update, the mean of the
+// five settled DMA samples that interval). Per drive frequency it prints the
+// residual ripple, the lag to 90% of a clean 1 A step and ns per channel per
+// update. Exit status 1 if the default-config CurrentFilter strays more
+// than 2 mA from the float EMA (the sketch's only PASS/FAIL check). The
+// timings are the host's; the target sketch reports cycles.
+//
+// From ESP32_PMW/ (the filter doesn't need the Arduino core):
+//   g++ -std=gnu++17 -O2 -I lib/PwmController/src tools/filter_bench_host.cpp
+//       lib/PwmController/src/CurrentFilter.cpp -o filter_bench
+//   ./filter_bench
+#include "CurrentFilter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+using std::max;
+using std::min;
+
+static const float UPDATE_HZ = 1000.0f;
+static const int SUB = 5;             // DMA samples per channel per update
+static const float MEAN_A = 2.0f;
+static const float TAU_MS = 50.0f;    // CurrentSense default
+static const int SETTLE = 3000;       // updates before measuring ripple
+static const int WINDOW = 1000;
+static const int STEP_MAX = 3000;     // updates to wait for the step
+static const int TIMED = 2000000;
+
+// Commutation pulse, RL-shaped: harmonics falling off as ~1/h^2 (A, deg).
+static const float H_AMP[4] = {0.8f, 0.2f, 0.09f, 0.05f};
+static const float H_DEG[4] = {0.0f, 60.0f, 140.0f, 230.0f};
+
+struct Setup {
+  const char *name;
+  bool isFloat;
+  CurrentFilter::Config cfg;
+};
+
+static Setup setups[4];
+
+static void buildSetups() {
+  setups[0] = {"float EMA 50 ms", true, CurrentFilter::Config()};
+  setups[1] = {"fixed EMA 50 ms", false, CurrentFilter::Config()};
+  CurrentFilter::Config c;
+  c.notchHarmonics = 3;
+  c.emaFieldPeriods = 1.0f;
+  c.tauMinMs = 2.0f;
+  c.tauMaxMs = 200.0f;
+  setups[2] = {"notch x3 + EMA 1 period", false, c};
+  c.median3 = true;
+  c.medianGateA = 2.0f; // above the ripple's update-to-update swing
+  c.lowPassFieldRatio = 0.5f;
+  c.emaFieldPeriods = 0.5f;
+  setups[3] = {"median + notch x3 + LP + EMA", false, c};
+}
+
+static uint32_t rng = 12345;
+static float noise(float a) {
+  rng = rng * 1664525u + 1013904223u;
+  return a * ((float)(rng >> 8) / 8388608.0f - 1.0f);
+}
+
+// Update n's reading (A): mean of the SUB samples in its interval.
+static float reading(int n, float freqHz, float meanA, bool clean = false) {
+  if (clean) return meanA;
+  float x = 0.0f;
+  for (int s = 0; s < SUB; s++) {
+    const float t = (n + (s + 0.5f) / SUB) / UPDATE_HZ;
+    float v = meanA;
+    for (int k = 0; k < 4; k++)
+      v += H_AMP[k] * cosf(2.0f * (float)M_PI * (k + 1) * freqHz * t -
+                           H_DEG[k] * (float)M_PI / 180.0f);
+    x += v;
+  }
+  x = x / SUB + noise(0.01f);
+  if (n % 997 == 500) x += 5.0f; // a single-update glitch
+  return x;
+}
+
+// One channel's filter, float or fixed, behind one interface.
+struct Runner {
+  const Setup &s;
+  CurrentFilter f;
+  CurrentFilter::State st;
+  float ema;
+  Runner(const Setup &setup, float freqHz, float x0) : s(setup) {
+    f.configure(s.cfg, TAU_MS);
+    f.retune(freqHz, UPDATE_HZ);
+    f.reset(st, toQ8(x0));
+    ema = x0;
+  }
+  static int32_t toQ8(float a) { return (int32_t)lroundf(a * 256000.0f); }
+  float step(float x) {
+    if (s.isFloat) {
+      ema += (1.0f - expf(-1.0f / (UPDATE_HZ * TAU_MS / 1000.0f))) * (x - ema);
+      return ema;
+    }
+    return (float)f.step(st, toQ8(x)) / 256000.0f;
+  }
+};
+
+static volatile int32_t sink;
+
+template <class F> static double nsPerUpdate(F f) {
+  const auto t0 = std::chrono::steady_clock::now();
+  for (int k = 0; k < TIMED; k++)
+    f();
+  const auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(t1 - t0).count() / TIMED;
+}
+
+int main() {
+  printf("filter_bench: %.0f Hz updates\n", UPDATE_HZ);
+  buildSetups();
+
+  bool pass = true;
+  const float FREQS[] = {1.0f, 35.0f, 150.0f, 350.0f};
+  for (float freq : FREQS) {
+    printf("-- drive %.0f Hz\n", freq);
+    float floatOut[WINDOW];
+    for (const Setup &s : setups) {
+      rng = 12345; // same noise for every setup
+      Runner r(s, freq, MEAN_A);
+      int n = 0;
+      for (; n < SETTLE; n++) r.step(reading(n, freq, MEAN_A));
+      float lo = INFINITY, hi = -INFINITY, worstVsFloat = 0.0f;
+      for (int w = 0; w < WINDOW; w++, n++) {
+        float y = r.step(reading(n, freq, MEAN_A));
+        lo = min(lo, y);
+        hi = max(hi, y);
+        if (s.isFloat) floatOut[w] = y;
+        else if (&s == &setups[1]) worstVsFloat = max(worstVsFloat, fabsf(y - floatOut[w]));
+      }
+      // Clean 1 A step from a fresh filter: first update at or past 90%.
+      Runner rs(s, freq, MEAN_A);
+      int lag = -1;
+      for (int k = 0; k < STEP_MAX; k++) {
+        if (rs.step(reading(k, freq, MEAN_A + 1.0f, true)) >= MEAN_A + 0.9f) {
+          lag = k + 1;
+          break;
+        }
+      }
+
+      // Cost: one channel, steady input, as on the target.
+      double ns;
+      if (s.isFloat) {
+        volatile float x = 2.0f;
+        float ema = 0.0f;
+        ns = nsPerUpdate([&] {
+          ema += (1.0f - expf(-1.0f / (UPDATE_HZ * TAU_MS / 1000.0f))) * (x - ema);
+        });
+        sink = (int32_t)ema;
+      } else {
+        CurrentFilter::State st;
+        r.f.reset(st, 0);
+        volatile int32_t x = 512000;
+        ns = nsPerUpdate([&] { sink = r.f.step(st, x); });
+      }
+
+      printf("  %-30s ripple %6.1f mA p-p, 90%% step %5d ms, %5.1f ns/update",
+             s.name, (hi - lo) * 1000.0f, lag, ns);
+      if (&s == &setups[1]) {
+        bool ok = worstVsFloat < 0.002f;
+        pass = pass && ok;
+        printf("  (vs float %.2f mA %s)", worstVsFloat * 1000.0f, ok ? "ok" : "FAIL");
+      }
+      if (!s.isFloat && s.cfg.emaFieldPeriods > 0.0f)
+        printf("  tau %.1f ms", r.f.emaTauMs());
+      printf("\n");
+    }
+  }
+  printf(pass ? "filter_bench: PASS\n" : "filter_bench: FAIL\n");
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,35 @@
+// Host stand-in for the Arduino core, just enough of it for the PwmSequencer
+// and PwmController headers (tools/seek_check_host.cpp, swap_check_host.cpp).
+// Declarations only; the harness defines what it links against.
+#pragma once
+#include <algorithm>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+using std::max;
+using std::min;
+
+class HardwareSerial {
+public:
+  template <typename... A> int printf(const char *fmt, A... a) {
+    return ::printf(fmt, a...);
+  }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  uint32_t getMaxAllocHeap() { return 110000; } // a typical ESP32 figure
+};
+extern EspClass ESP;
+
+unsigned long micros();
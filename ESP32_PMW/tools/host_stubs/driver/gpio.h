@@ -0,0 +1,3 @@
+#pragma once
+typedef int esp_err_t;
+typedef enum { GPIO_NUM_NC = -1, GPIO_NUM_MAX = 40 } gpio_num_t;
@@ -0,0 +1,4 @@
+#pragma once
+typedef enum { LEDC_LOW_SPEED_MODE } ledc_mode_t;
+typedef int ledc_channel_t;
+typedef enum { LEDC_TIMER_0 } ledc_timer_t;
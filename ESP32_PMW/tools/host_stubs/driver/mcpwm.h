@@ -0,0 +1,3 @@
+#pragma once
+typedef enum { MCPWM_UNIT_0, MCPWM_UNIT_1 } mcpwm_unit_t;
+typedef enum { MCPWM_TIMER_0, MCPWM_TIMER_1, MCPWM_TIMER_2 } mcpwm_timer_t;
@@ -0,0 +1,3 @@
+#pragma once
+typedef enum { TIMER_GROUP_0, TIMER_GROUP_1 } timer_group_t;
+typedef enum { TIMER_0, TIMER_1 } timer_idx_t;
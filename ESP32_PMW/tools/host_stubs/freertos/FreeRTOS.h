@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+typedef struct {
+  volatile uint32_t owner;
+  uint32_t count;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void *TaskHandle_t;
@@ -0,0 +1,127 @@
+// Host-side twin of src/examples/main_lockin_check.cpp: the same synthetic
+// per-channel current waveforms (DC offsets, harmonics, RL-shaped
+// commutation pulses, noise, few samples per period) fed through
+// FundamentalFit the way CurrentSense does, one kept sample every 200 us
+// with the phase as a Q32 fraction of the field period. Each fitted
+// fundamental is compared against the exact one from dense integration of
+// the same waveform. Prints the amplitude / phase error per case and ns per
+// add() and solve(); exit status 1 if any case exceeds its tolerance. The
+// timings are the host's; the target sketch reports cycles.
+//
+// From ESP32_PMW/ (the fit doesn't need the Arduino core):
+//   g++ -std=gnu++17 -O2 -I lib/PwmController/src tools/lockin_check_host.cpp
+//       lib/PwmController/src/FundamentalFit.cpp -o lockin_check
+//   ./lockin_check
+#include "FundamentalFit.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+struct Case {
+  const char *name;
+  float freqHz;
+  float dc;          // codes
+  float h[8];        // harmonic amplitudes (codes), h[0] = fundamental
+  float phaseDeg[8]; // harmonic phases
+  float noise;       // +- uniform (codes)
+  float ampTol;      // max |amplitude error| (codes)
+  float degTol;      // max |phase error| (deg)
+};
+
+// Same cases and tolerances as the target sketch.
+static const Case CASES[] = {
+    {"sine 350 Hz", 350.0f, 1800.0f, {400}, {123}, 0.0f, 4.0f, 1.0f},
+    {"sine 200 Hz + h2..h5", 200.0f, 1500.0f, {300, 60, 30, 15, 9}, {10, 40, 80, 120, 160}, 0.0f, 4.0f, 1.0f},
+    {"sine 1 Hz + noise", 1.0f, 1200.0f, {250}, {300}, 20.0f, 4.0f, 1.0f},
+    {"RL pulse 35 Hz", 35.0f, 900.0f, {500, 0, 56, 0, 20, 0, 10, 0}, {45, 0, 135, 0, 225, 0, 315, 0}, 5.0f, 5.0f, 1.0f},
+    {"RL pulse 350 Hz", 350.0f, 900.0f, {500, 0, 56, 0, 20, 0, 10, 0}, {200, 0, 60, 0, 280, 0, 140, 0}, 5.0f, 10.0f, 1.5f},
+    {"small 0.25 A-ish 150 Hz", 150.0f, 1900.0f, {6}, {90}, 2.0f, 1.5f, 15.0f},
+};
+static const float SAMPLE_US = 200.0f; // one kept sample per channel per scan
+static const int DENSE = 20000;
+static const int TIMED = 1000000;
+static const float DEG = 180.0f / (float)M_PI;
+
+static uint32_t rng = 12345;
+static float noise(float a) {
+  rng = rng * 1664525u + 1013904223u;
+  return a * ((float)(rng >> 8) / 8388608.0f - 1.0f);
+}
+
+static float wave(const Case &c, float theta) {
+  float x = c.dc;
+  for (int k = 0; k < 8; k++)
+    if (c.h[k] != 0.0f)
+      x += c.h[k] * cosf((k + 1) * theta - c.phaseDeg[k] / DEG);
+  return x;
+}
+
+static float phaseErr(float a, float b) {
+  float d = fmodf(a - b + 540.0f, 360.0f) - 180.0f;
+  return fabsf(d);
+}
+
+static volatile float sink;
+
+int main() {
+  bool pass = true;
+  for (const Case &c : CASES) {
+    // Exact fundamental of the noiseless waveform.
+    double re = 0.0, im = 0.0;
+    for (int i = 0; i < DENSE; i++) {
+      float th = 2.0f * (float)M_PI * i / DENSE;
+      re += wave(c, th) * cos(th);
+      im += wave(c, th) * sin(th);
+    }
+    const float refAmp = 2.0f * sqrtf((float)(re * re + im * im)) / DENSE;
+    float refDeg = atan2f((float)im, (float)re) * DEG;
+    if (refDeg < 0.0f) refDeg += 360.0f;
+
+    // Several periods, each starting at a different sub-sample offset (the
+    // scan and the field aren't locked to each other).
+    const float periodUs = 1e6f / c.freqHz;
+    float worstAmp = 0.0f, worstDeg = 0.0f, lastAmp = NAN;
+    uint32_t n = 0;
+    for (int start = 0; start < 8; start++) {
+      FundamentalFit fit;
+      for (float t = start * SAMPLE_US / 8.0f; t < periodUs; t += SAMPLE_US) {
+        float f = t / periodUs;
+        fit.add((uint32_t)(f * 4294967296.0f), wave(c, 2.0f * (float)M_PI * f) + noise(c.noise));
+      }
+      float mean, amp, deg;
+      if (!fit.solve(mean, amp, deg)) {
+        worstAmp = INFINITY;
+        break;
+      }
+      n = fit.count();
+      lastAmp = amp;
+      worstAmp = std::max(worstAmp, fabsf(amp - refAmp));
+      worstDeg = std::max(worstDeg, phaseErr(deg, refDeg));
+    }
+
+    bool ok = worstAmp <= c.ampTol && worstDeg <= c.degTol;
+    pass = pass && ok;
+    printf("%-24s n=%-5u amp %.1f (ref %.1f) err %.2f, phase err %.2f deg %s\n",
+           c.name, (unsigned)n, lastAmp, refAmp, worstAmp, worstDeg,
+           ok ? "ok" : "FAIL");
+  }
+
+  FundamentalFit fit;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < TIMED; i++)
+    fit.add((uint32_t)i * 429497u, (float)(i & 1023));
+  auto t1 = std::chrono::steady_clock::now();
+  float mean, amp, deg;
+  for (int i = 0; i < TIMED / 100; i++) {
+    fit.solve(mean, amp, deg);
+    sink = amp;
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  printf("add %.1f ns/sample, solve %.1f ns/period/channel\n",
+         std::chrono::duration<double, std::nano>(t1 - t0).count() / TIMED,
+         std::chrono::duration<double, std::nano>(t2 - t1).count() / (TIMED / 100));
+  printf(pass ? "lockin_check: PASS\n" : "lockin_check: FAIL\n");
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+// Host check of PwmSequencer's seek index (compile()'s checkpoints, repeat
+// folding, the NAN fill of fields no task has set yet). Every schedule in a
+// tools/compile_schedules.py image is run uninterrupted, run() every 1 ms
+// (durations are whole ms, so every task boundary lands on a run()), as the
+// reference. Against it, per schedule:
+//   seekTo()      TRIALS random times, every step's start, 0 and the end,
+//                 from a sequencer that has already run a little: the state
+//                 right after the seek, then CONTINUE_MS of run() from there;
+//                 every other trial pauses 3 ms in, holds for half a second
+//                 and resumes (the held state and everything after checked);
+//   seekToStep()  every queue step: the reference's state at the step's
+//                 first start (seekTo()'s rules: what has ended by then is
+//                 applied), found by a second reference run that stops at
+//                 every task boundary; or the end, for a step that never
+//                 runs as a task.
+// Prints each mismatch (the first few per schedule) and a line per schedule;
+// exit status 1 on any mismatch.
+//
+// From ESP32_PMW/ (PwmSequencer.h pulls in PwmController.h, so the Arduino
+// and IDF headers come from tools/host_stubs/, declarations only):
+//   python3 tools/compile_schedules.py -o .pio/seek_check.bin spiffs_data/*.json
+//       tools/sequencer_fixtures/nested.json
+//   g++ -std=gnu++17 -O2 -I tools/host_stubs -I lib/PwmSequencer/src
+//       -I lib/JsonPwmSequencer tools/seek_check_host.cpp
+//       lib/PwmSequencer/src/PwmSequencer.cpp lib/PwmSequencer/src/CurveKernel.cpp
+//       lib/PwmController/src/CommutationStats.cpp -o seek_check
+//   ./seek_check .pio/seek_check.bin [trials]
+#include "sequencer_host.h"
+
+#include <cstdlib>
+
+static const int64_t CONTINUE_MS = 10000;
+static const int64_t PAUSE_AFTER_MS = 3;
+static const int64_t PAUSE_HOLD_US = 500000;
+static const int REPORT = 5;
+
+static const int64_t NEVER = -1;
+
+static int checkSchedule(const std::vector<uint32_t> &image, const std::string &name,
+                         int trials) {
+  const ScheduleHeader *sh = findSchedule(image, name);
+  PwmController refPc(nullptr, nullptr, nullptr, 4);
+  HostSequencer ref(&refPc);
+  if (!sh || !loadSchedule(ref, image, sh)) {
+    printf("  %s: cannot load it from the image\n", name.c_str());
+    return 1;
+  }
+
+  // The reference: one Snap per ms, after that ms's run().
+  std::vector<Snap> traj;
+  g_nowUs = 0;
+  ref.start();
+  for (;;) {
+    g_nowUs = (int64_t)traj.size() * 1000;
+    ref.run();
+    traj.push_back(snap(ref, refPc));
+    if (ref.isDone()) break;
+  }
+  const int64_t endMs = (int64_t)traj.size() - 1;
+
+  // Step starts: the same run, stopping at every task boundary. At each stop
+  // the next step is about to start; after the last one each ms has to end
+  // where the uninterrupted run did.
+  PwmController stepPc(nullptr, nullptr, nullptr, 4);
+  HostSequencer stepRef(&stepPc);
+  loadSchedule(stepRef, image, sh);
+  std::vector<int64_t> firstUs(sh->taskCount + 1, NEVER);
+  int bad = 0, badSteps = 0, badTimes = 0, badPauses = 0;
+  g_nowUs = 0;
+  stepRef.start();
+  firstUs[stepRef.currentIndex()] = 0;
+  stepRef.stopAtTaskBoundary(true);
+  for (int64_t ms = 0; ms <= endMs; ms++) {
+    g_nowUs = ms * 1000;
+    do {
+      stepRef.run();
+      int64_t &at = firstUs[stepRef.currentIndex()];
+      if (stepRef.atTaskBoundary() && !stepRef.isDone() && at == NEVER)
+        at = stepRef.positionUs();
+    } while (stepRef.atTaskBoundary() && !stepRef.isDone());
+    if (!same(snap(stepRef, stepPc), traj[ms])) {
+      if (bad++ < REPORT) {
+        printf("    run with task-boundary stops differs at %lld ms\n", (long long)ms);
+        printSnap("stops", snap(stepRef, stepPc));
+        printSnap("plain", traj[ms]);
+      }
+      break;
+    }
+  }
+  // seekTo(): fixed points first, then random ones.
+  std::vector<int64_t> times = {0, endMs};
+  for (size_t i = 0; i < sh->taskCount; i++)
+    if (firstUs[i] != NEVER) times.push_back(firstUs[i] / 1000);
+  uint32_t lcg = 12345;
+  for (int k = 0; k < trials; k++) {
+    lcg = lcg * 1103515245u + 12345u;
+    times.push_back((int64_t)((lcg >> 4) % (uint32_t)(endMs + 1)));
+  }
+  for (size_t k = 0; k < times.size(); k++) {
+    const int64_t t = times[k];
+    PwmController pc(nullptr, nullptr, nullptr, 4);
+    PwmSequencer s(&pc);
+    loadSchedule(s, image, sh);
+    g_nowUs = 5000000;
+    s.start();
+    g_nowUs += 1234;
+    s.run();
+    const int64_t base = 77000000 + (int64_t)k * 1000; // wall time at the seek
+    g_nowUs = base;
+    s.seekTo(t * 1000);
+    if (!same(snap(s, pc), traj[t])) {
+      if (bad++ < REPORT) {
+        printf("    seekTo(%lld ms) differs\n", (long long)t);
+        printSnap("seek", snap(s, pc));
+        printSnap("run ", traj[t]);
+      }
+      badTimes++;
+      continue;
+    }
+    const int64_t pauseAt = (k & 1) ? t + PAUSE_AFTER_MS : -1;
+    int64_t shift = 0;
+    for (int64_t u = t + 1; u <= endMs && u <= t + CONTINUE_MS; u++) {
+      if (u == pauseAt) {
+        g_nowUs = base + (u - t) * 1000 + shift;
+        s.pause();
+        const Snap held = snap(s, pc);
+        shift += PAUSE_HOLD_US;
+        g_nowUs = base + (u - t) * 1000 + shift;
+        s.run();
+        if (!same(snap(s, pc), held)) {
+          if (bad++ < REPORT) {
+            printf("    seekTo(%lld ms): state moved while paused at %lld ms\n",
+                   (long long)t, (long long)u);
+            printSnap("now ", snap(s, pc));
+            printSnap("held", held);
+          }
+          badPauses++;
+          break;
+        }
+        s.resume();
+      }
+      g_nowUs = base + (u - t) * 1000 + shift;
+      s.run();
+      if (!same(snap(s, pc), traj[u])) {
+        if (bad++ < REPORT) {
+          printf("    seekTo(%lld ms)%s, then run(): differs at %lld ms\n", (long long)t,
+                 pauseAt >= 0 ? " with a pause" : "", (long long)u);
+          printSnap("seek", snap(s, pc));
+          printSnap("run ", traj[u]);
+        }
+        if (pauseAt >= 0 && u >= pauseAt)
+          badPauses++;
+        else
+          badTimes++;
+        break;
+      }
+    }
+  }
+
+  // seekToStep(): every step, plus one past the end.
+  for (size_t st = 0; st <= sh->taskCount; st++) {
+    PwmController pc(nullptr, nullptr, nullptr, 4);
+    PwmSequencer s(&pc);
+    loadSchedule(s, image, sh);
+    g_nowUs = 9000000;
+    s.start();
+    s.seekToStep(st);
+    const Snap &want = traj[firstUs[st] == NEVER ? endMs : firstUs[st] / 1000];
+    if (!same(snap(s, pc), want)) {
+      if (bad++ < REPORT) {
+        printf("    seekToStep(%zu) differs\n", st);
+        printSnap("seek", snap(s, pc));
+        printSnap("ref ", want);
+      }
+      badSteps++;
+    }
+  }
+
+  printf("  %-26s %4u steps %8lld ms  seekTo %zu (%d bad, %d bad after a pause)  "
+         "seekToStep %u (%d bad)\n",
+         name.c_str(), (unsigned)sh->taskCount, (long long)endMs, times.size(), badTimes,
+         badPauses, (unsigned)sh->taskCount + 1, badSteps);
+  return bad;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s image.bin [trials]\n", argv[0]);
+    return 2;
+  }
+  std::vector<uint32_t> image;
+  if (!readImage(argv[1], image)) {
+    fprintf(stderr, "%s: not a schedule image of version %u, task encoding %u\n", argv[1],
+            (unsigned)SCHEDULE_IMAGE_VERSION, (unsigned)PwmSequencer::TASK_ENCODING);
+    return 2;
+  }
+  const int trials = argc > 2 ? atoi(argv[2]) : 200;
+  int bad = 0;
+  for (const std::string &name : scheduleNames(image)) bad += checkSchedule(image, name, trials);
+  printf(bad ? "seek_check: FAIL\n" : "seek_check: PASS\n");
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+// Shared by the PwmSequencer host checks (seek_check_host.cpp,
+// swap_check_host.cpp): a wall clock the check sets, a PwmController that
+// only records what it was told, and schedules loaded from a
+// tools/compile_schedules.py image the way loadFromPartition() loads them
+// (the same task records the JSON loader queues).
+#pragma once
+#include "PwmSequencer.h"
+#include "ScheduleImage.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static int64_t g_nowUs = 0; // what esp_timer_get_time() returns
+int64_t esp_timer_get_time() { return g_nowUs; }
+unsigned long micros() { return (unsigned long)g_nowUs; }
+
+// What a controller was last told, field by field (NAN: never).
+struct Drive {
+  float freq = NAN;
+  float duty[4] = {NAN, NAN, NAN, NAN};
+  float phase[4] = {NAN, NAN, NAN, NAN};
+  float carrier[4] = {NAN, NAN, NAN, NAN};
+};
+static std::map<const PwmController *, Drive> g_drive;
+
+PwmController::PwmController(const gpio_num_t *, const float *, const float *, int) {}
+PwmController::~PwmController() { g_drive.erase(this); }
+
+bool PwmController::applyState(const DriveState &s) {
+  Drive &d = g_drive[this];
+  if (!std::isnan(s.freqHz)) d.freq = s.freqHz;
+  for (int i = 0; i < 4; i++) {
+    if (!std::isnan(s.dutyPct[i])) d.duty[i] = s.dutyPct[i];
+    if (!std::isnan(s.phaseDeg[i])) d.phase[i] = s.phaseDeg[i];
+    if (!std::isnan(s.carrierPct[i])) d.carrier[i] = s.carrierPct[i];
+  }
+  return true;
+}
+
+// The protected hot-swap hooks, as JsonPwmSequencer uses them.
+class HostSequencer : public PwmSequencer {
+public:
+  explicit HostSequencer(PwmController *pc) : PwmSequencer(pc) {}
+  using PwmSequencer::atTaskBoundary;
+  using PwmSequencer::handOver;
+  using PwmSequencer::stopAtTaskBoundary;
+};
+
+// Everything run() leaves observable: the drive, the commanded carriers and
+// the cursor.
+struct Snap {
+  Drive drive;
+  float commanded[4];
+  size_t step;
+  int32_t sweepStep;
+  int64_t posUs;
+  bool done;
+};
+
+inline Snap snap(const PwmSequencer &s, const PwmController &pc) {
+  Snap x;
+  x.drive = g_drive[&pc];
+  for (int i = 0; i < 4; i++) x.commanded[i] = s.getCommandedCarrier(i);
+  x.step = s.currentIndex();
+  x.sweepStep = s.sweepStep();
+  x.posUs = s.positionUs();
+  x.done = s.isDone();
+  return x;
+}
+
+inline bool sameFloat(float a, float b) {
+  return std::isnan(a) ? std::isnan(b) : memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// Bit-exact, apart from the drive's carriers on channels no task has
+// commanded yet: the sequencer leaves those as they were, whatever that is.
+inline bool same(const Snap &a, const Snap &b) {
+  bool ok = sameFloat(a.drive.freq, b.drive.freq) && a.step == b.step &&
+            a.sweepStep == b.sweepStep && a.posUs == b.posUs && a.done == b.done;
+  for (int i = 0; i < 4; i++) {
+    ok = ok && sameFloat(a.drive.duty[i], b.drive.duty[i]) &&
+         sameFloat(a.drive.phase[i], b.drive.phase[i]) &&
+         sameFloat(a.commanded[i], b.commanded[i]);
+    if (!std::isnan(a.commanded[i]))
+      ok = ok && sameFloat(a.drive.carrier[i], b.drive.carrier[i]);
+  }
+  return ok;
+}
+
+inline void printSnap(const char *what, const Snap &x) {
+  printf("      %s: step %zu sweep %d at %lld us%s, %.2f Hz, duty %.2f %.2f %.2f %.2f, "
+         "phase %.1f %.1f %.1f %.1f, carrier %.2f %.2f %.2f %.2f\n",
+         what, x.step, (int)x.sweepStep, (long long)x.posUs, x.done ? " (done)" : "",
+         x.drive.freq, x.drive.duty[0], x.drive.duty[1], x.drive.duty[2], x.drive.duty[3],
+         x.drive.phase[0], x.drive.phase[1], x.drive.phase[2], x.drive.phase[3],
+         x.commanded[0], x.commanded[1], x.commanded[2], x.commanded[3]);
+}
+
+// The whole image, word-aligned as the mapped partition is.
+inline bool readImage(const char *path, std::vector<uint32_t> &image) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  const long bytes = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  image.assign((bytes + 3) / 4, 0);
+  const bool ok = bytes >= (long)sizeof(ScheduleImageHeader) &&
+                  fread(image.data(), 1, bytes, f) == (size_t)bytes;
+  fclose(f);
+  const ScheduleImageHeader *ih = (const ScheduleImageHeader *)image.data();
+  return ok && ih->magic == SCHEDULE_IMAGE_MAGIC && ih->version == SCHEDULE_IMAGE_VERSION &&
+         ih->taskEncoding == PwmSequencer::TASK_ENCODING;
+}
+
+inline std::vector<std::string> scheduleNames(const std::vector<uint32_t> &image) {
+  const ScheduleImageHeader *ih = (const ScheduleImageHeader *)image.data();
+  const ScheduleDirEntry *dir = (const ScheduleDirEntry *)(ih + 1);
+  std::vector<std::string> names;
+  for (uint32_t i = 0; i < ih->scheduleCount; i++)
+    names.push_back(std::string(dir[i].name, strnlen(dir[i].name, sizeof(dir[i].name))));
+  return names;
+}
+
+inline const ScheduleHeader *findSchedule(const std::vector<uint32_t> &image,
+                                          const std::string &name) {
+  const uint8_t *base = (const uint8_t *)image.data();
+  const ScheduleImageHeader *ih = (const ScheduleImageHeader *)base;
+  const ScheduleDirEntry *dir = (const ScheduleDirEntry *)(ih + 1);
+  for (uint32_t i = 0; i < ih->scheduleCount; i++)
+    if (strncmp(dir[i].name, name.c_str(), sizeof(dir[i].name)) == 0)
+      return (const ScheduleHeader *)(base + dir[i].offset);
+  return nullptr;
+}
+
+// loadFromPartition() without the checks: run the records in place, compile.
+inline bool loadSchedule(PwmSequencer &s, const std::vector<uint32_t> &image,
+                         const ScheduleHeader *sh) {
+  const uint8_t *base = (const uint8_t *)image.data();
+  if (!s.useExternalTasks((const uint32_t *)(base + sh->tasksOffset), sh->taskWords,
+                          sh->taskCount))
+    return false;
+  s.compile(sh->resolutionMs, sh->initialFreq, sh->initialDuty, sh->initialPhase);
+  return true;
+}
@@ -0,0 +1,195 @@
+// Host check of PwmSequencer's hot swap, as JsonPwmSequencer::run() does it
+// with "when": "step" (stopAtTaskBoundary(), then handOver(next, now, true)
+// at the first task boundary from the swap time on). Per case:
+//   at the swap   frequency, duty and carriers are what the old schedule
+//                 left (nothing jumps), the phases are the new schedule's
+//                 own initial phases in the sequencer and the controller,
+//                 and handOver() returns true exactly when they differed;
+//   after it      the new schedule runs to its end, run() every 1 ms, as
+//                 the reference; seekTo() at SEEKS evenly spread times,
+//                 from a second identical swap, has to land on the same
+//                 state and stay on it for CONTINUE_MS. The seek index was
+//                 compiled before the swap, so a field no task has set by
+//                 then must come from the carried-over state, not the new
+//                 schedule's header.
+// Prints each mismatch (the first few per case) and a line per case; exit
+// status 1 on any mismatch.
+//
+// From ESP32_PMW/ (the image as for seek_check_host.cpp):
+//   python3 tools/compile_schedules.py -o .pio/seek_check.bin spiffs_data/*.json
+//       tools/sequencer_fixtures/nested.json
+//   g++ -std=gnu++17 -O2 -I tools/host_stubs -I lib/PwmSequencer/src
+//       -I lib/JsonPwmSequencer tools/swap_check_host.cpp
+//       lib/PwmSequencer/src/PwmSequencer.cpp lib/PwmSequencer/src/CurveKernel.cpp
+//       lib/PwmController/src/CommutationStats.cpp -o swap_check
+//   ./swap_check .pio/seek_check.bin [first:next:ms ...]
+#include "sequencer_host.h"
+
+#include <cstdlib>
+#include <memory>
+
+static const int64_t SEEKS = 200;
+static const int64_t CONTINUE_MS = 200;
+static const int64_t SWAP_WALL_US = 3000000; // wall time the old schedule starts
+static const int REPORT = 5;
+
+struct SwapCase {
+  std::string first, next;
+  int64_t atMs; // schedule time of the old schedule the swap is asked for
+};
+
+// The default cases: a direction change (the phases have to turn), a swap
+// into a schedule that never sets frequency or duty (they come from the
+// carried-over state on every seek), and one into nested blocks.
+static const SwapCase DEFAULT_CASES[] = {
+    {"/coupling_ccw.json", "/coupling_cw.json", 7500},
+    {"/coupling_cw.json", "/coupling_cw.json", 7500},
+    {"/takeoff.json", "/coupling_cw.json", 12000},
+    {"/tilt.json", "/nested.json", 30000},
+};
+
+// One swap, the way JsonPwmSequencer::run() makes it: run the old schedule
+// every 1 ms; from atMs on, stop at the first task boundary, hand over and
+// run() once. `cur` ends up running the new schedule on its own controller.
+struct Swapped {
+  PwmController pc{nullptr, nullptr, nullptr, 4};
+  HostSequencer cur{&pc};
+  PwmController nextPc{nullptr, nullptr, nullptr, 4};
+  std::unique_ptr<HostSequencer> next{new HostSequencer(&nextPc)};
+  Snap before;   // the old schedule at the boundary
+  Snap handed;   // right after handOver(), before the run()
+  bool turned = false;
+  int64_t wallUs = 0; // wall time of the swap
+};
+
+static bool swap(Swapped &w, const std::vector<uint32_t> &image, const SwapCase &c) {
+  const ScheduleHeader *first = findSchedule(image, c.first);
+  const ScheduleHeader *next = findSchedule(image, c.next);
+  if (!first || !next || !loadSchedule(w.cur, image, first) ||
+      !loadSchedule(*w.next, image, next))
+    return false;
+  g_nowUs = SWAP_WALL_US;
+  w.cur.start();
+  for (int64_t ms = 0;; ms++) {
+    g_nowUs = SWAP_WALL_US + ms * 1000;
+    if (ms < c.atMs) {
+      w.cur.run();
+      if (w.cur.isDone()) return false; // ended before the swap was asked for
+      continue;
+    }
+    w.cur.stopAtTaskBoundary(true);
+    w.cur.run();
+    w.cur.stopAtTaskBoundary(false);
+    if (!w.cur.isDone() && !w.cur.atTaskBoundary()) continue;
+    break;
+  }
+  w.before = snap(w.cur, w.pc);
+  w.wallUs = g_nowUs;
+  w.turned = w.cur.handOver(*w.next, g_nowUs, true);
+  w.handed = snap(w.cur, w.pc);
+  w.next.reset(); // JsonPwmSequencer deletes the old schedule
+  w.cur.run();
+  return true;
+}
+
+static int checkSwap(const std::vector<uint32_t> &image, const SwapCase &c) {
+  Swapped w;
+  if (!swap(w, image, c)) {
+    printf("  %s -> %s at %lld ms: cannot load both or the first ends first\n",
+           c.first.c_str(), c.next.c_str(), (long long)c.atMs);
+    return 1;
+  }
+  const ScheduleHeader *nh = findSchedule(image, c.next);
+  int bad = 0;
+
+  // At the swap: only the phases move, to the new schedule's own.
+  bool differ = false, held = true;
+  for (int i = 0; i < 4; i++) {
+    differ = differ || !sameFloat(w.before.drive.phase[i], nh->initialPhase[i]);
+    held = held && sameFloat(w.handed.drive.phase[i], nh->initialPhase[i]) &&
+           sameFloat(w.handed.drive.duty[i], w.before.drive.duty[i]) &&
+           sameFloat(w.handed.commanded[i], w.before.commanded[i]) &&
+           sameFloat(w.handed.drive.carrier[i], w.before.drive.carrier[i]);
+  }
+  held = held && sameFloat(w.handed.drive.freq, w.before.drive.freq) &&
+         w.handed.posUs == 0 && !w.handed.done;
+  const bool swapOk = held && w.turned == differ;
+  if (!swapOk) {
+    bad++;
+    printf("    at the swap (%lld us wall): handOver() returned %d, phases %s\n",
+           (long long)w.wallUs, (int)w.turned, differ ? "differed" : "matched");
+    printSnap("old ", w.before);
+    printSnap("new ", w.handed);
+    printf("      header phase %.1f %.1f %.1f %.1f\n", nh->initialPhase[0],
+           nh->initialPhase[1], nh->initialPhase[2], nh->initialPhase[3]);
+  }
+
+  // After it: the new schedule's own run, one Snap per ms from the swap.
+  std::vector<Snap> traj = {snap(w.cur, w.pc)};
+  while (!w.cur.isDone()) {
+    g_nowUs = w.wallUs + (int64_t)traj.size() * 1000;
+    w.cur.run();
+    traj.push_back(snap(w.cur, w.pc));
+  }
+  const int64_t endMs = (int64_t)traj.size() - 1;
+
+  // Strides of endMs / SEEKS + 1, so the times drift off round step starts.
+  int seeks = 0, badSeeks = 0;
+  for (int64_t t = 0;; t = std::min(t + endMs / SEEKS + 1, endMs)) {
+    Swapped s;
+    swap(s, image, c);
+    const int64_t base = s.wallUs + 50000000; // wall time at the seek
+    g_nowUs = base;
+    s.cur.seekTo(t * 1000);
+    seeks++;
+    for (int64_t u = t; u <= endMs && u <= t + CONTINUE_MS; u++) {
+      g_nowUs = base + (u - t) * 1000;
+      if (u > t) s.cur.run();
+      if (!same(snap(s.cur, s.pc), traj[u])) {
+        if (bad++ < REPORT) {
+          printf("    seekTo(%lld ms) after the swap%s differs at %lld ms\n", (long long)t,
+                 u > t ? ", then run()," : "", (long long)u);
+          printSnap("seek", snap(s.cur, s.pc));
+          printSnap("run ", traj[u]);
+        }
+        badSeeks++;
+        break;
+      }
+    }
+    if (t == endMs) break;
+  }
+
+  printf("  %-20s -> %-20s at %6lld ms: phases %s%s, %8lld ms after, seekTo %d (%d bad)\n",
+         c.first.c_str(), c.next.c_str(), (long long)c.atMs, w.turned ? "pushed" : "kept",
+         swapOk ? "" : " (swap differs)", (long long)endMs, seeks, badSeeks);
+  return bad;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s image.bin [first:next:ms ...]\n", argv[0]);
+    return 2;
+  }
+  std::vector<uint32_t> image;
+  if (!readImage(argv[1], image)) {
+    fprintf(stderr, "%s: not a schedule image of version %u, task encoding %u\n", argv[1],
+            (unsigned)SCHEDULE_IMAGE_VERSION, (unsigned)PwmSequencer::TASK_ENCODING);
+    return 2;
+  }
+  std::vector<SwapCase> cases;
+  for (int a = 2; a < argc; a++) {
+    const std::string arg = argv[a];
+    const size_t p = arg.find(':'), q = arg.rfind(':');
+    if (p == std::string::npos || p == q) {
+      fprintf(stderr, "%s: expected first:next:ms\n", argv[a]);
+      return 2;
+    }
+    cases.push_back({arg.substr(0, p), arg.substr(p + 1, q - p - 1),
+                     atoll(arg.c_str() + q + 1)});
+  }
+  if (cases.empty()) cases.assign(std::begin(DEFAULT_CASES), std::end(DEFAULT_CASES));
+  int bad = 0;
+  for (const SwapCase &c : cases) bad += checkSwap(image, c);
+  printf(bad ? "swap_check: FAIL\n" : "swap_check: PASS\n");
+  return bad ? 1 : 0;
+}